@@ -19,11 +19,89 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <string.h>
 #include <libpq-fe.h>
 #include "common.h"
 #include "query_priv.h"
 #include "connection_priv.h"
 #include "async.h"
+#include "pool.h"
+#include "util.h"
+#include "notify_priv.h"
+
+static inline int __postgresql_async_is_lsn(PGresult *result)
+{
+    ExecStatusType status = PQresultStatus(result);
+
+    if (status != PGRES_SINGLE_TUPLE && status != PGRES_TUPLES_OK) {
+        return 0;
+    }
+    return PQnfields(result) == 1 &&
+           strcmp(PQfname(result, 0), POSTGRESQL_LSN_FIELD) == 0;
+}
+
+/* Finish a query that will never get its results, letting its owner know why. */
+void postgresql_async_fail_query(postgresql_conn_t *conn, postgresql_query_t *query,
+                                 int status)
+{
+    if (!query->abort && query->end_cb) {
+        query->status = status;
+        query->end_cb(query->privdata, query, query->dr);
+    }
+    postgresql_query_free(query);
+}
+
+/* Hand a complete result set, fetched outside single row mode, to the callbacks of a query. */
+void postgresql_async_handle_result(postgresql_query_t *query, int fd)
+{
+    int i, j;
+
+    if (PQresultStatus(query->result) == PGRES_TUPLES_OK) {
+        if (query->n_fields == 0) {
+            query->n_fields = PQnfields(query->result);
+        }
+
+        if (!query->fields) {
+            query->fields = monkey->mem_alloc(sizeof(char *) * query->n_fields);
+            for (i = 0; i < query->n_fields; ++i) {
+                query->fields[i] = monkey->str_dup(PQfname(query->result, i));
+            }
+        }
+
+        if (query->result_start == 0) {
+            if (query->result_cb) {
+                query->result_cb(query->privdata, query, query->n_fields,
+                                 query->fields, query->dr);
+            }
+            query->result_start = 1;
+        }
+
+        for (i = 0; i < PQntuples(query->result); ++i) {
+            query->values = monkey->mem_alloc(sizeof(char *) * query->n_fields);
+            for (j = 0; j < query->n_fields; ++j) {
+                query->values[j] = monkey->str_dup(PQgetvalue(query->result, i, j));
+            }
+            if (query->row_cb) {
+                query->row_cb(query->privdata, query, query->n_fields,
+                              query->fields, query->values, query->dr);
+            }
+            for (j = 0; j < query->n_fields; ++j) {
+                FREE(query->values[j]);
+            }
+            FREE(query->values);
+        }
+
+        for (i = 0; i < query->n_fields; ++i) {
+            FREE(query->fields[i]);
+        }
+        FREE(query->fields);
+        query->n_fields = 0;
+    } else if (PQresultStatus(query->result) != PGRES_COMMAND_OK){
+        msg->err("[FD %i] PostgreSQL Get Result Error: %s", fd,
+                 PQresultErrorMessage(query->result));
+        query->status = POSTGRESQL_ERR;
+    }
+}
 
 void postgresql_async_handle_query(postgresql_conn_t *conn)
 {
@@ -38,6 +116,17 @@ void postgresql_async_handle_query(postgresql_conn_t *conn)
             continue;
         }
 
+        /* inside a transaction the position would not cover its commit, it is taken after it */
+        if (conn->in_transaction && postgresql_conn_is_lsn_query(query)) {
+            conn->lsn_deferred = 1;
+            postgresql_query_free(query);
+            conn->state = CONN_STATE_CONNECTED;
+            continue;
+        }
+
+        /* keep callbacks of a failing query from re-entering the queue */
+        conn->state = CONN_STATE_QUERYING;
+        query->sent_at = postgresql_util_now();
         if (query->type == QUERY_TYPE_QUERY) {
             status = PQsendQuery(conn->conn, query->query_str);
         } else if (query->type == QUERY_TYPE_PARAMS) {
@@ -53,10 +142,16 @@ void postgresql_async_handle_query(postgresql_conn_t *conn)
         }
 
         if (status != 1) {
-            postgresql_query_free(query);
+            msg->err("[FD %i] PostgreSQL Send Query Error: %s", conn->fd,
+                     PQerrorMessage(conn->conn));
+            postgresql_async_fail_query(conn, query, POSTGRESQL_ERR);
             continue;
         }
 
+        if (query->endpoint) {
+            postgresql_pool_queue_sample(query->endpoint, query->sent_at - query->queued_at);
+        }
+
         status = PQsetSingleRowMode(conn->conn);
         if (status != 1) {
             msg->info("[FD %i] PostgreSQL Fail to Set Single Row Mode: %s", conn->fd,
@@ -70,7 +165,7 @@ void postgresql_async_handle_query(postgresql_conn_t *conn)
         if (status == -1) {
             msg->err("[FD %i] PostgreSQL Send Query Error: %s", conn->fd,
                      PQerrorMessage(conn->conn));
-            postgresql_query_free(query);
+            postgresql_async_fail_query(conn, query, POSTGRESQL_ERR);
         } else if (status == 0) {
             /* successfully send query */
             conn->state = CONN_STATE_QUERIED;
@@ -86,15 +181,19 @@ void postgresql_async_handle_query(postgresql_conn_t *conn)
     conn->current_query = NULL;
     conn->state         = CONN_STATE_CONNECTED;
 
-    event->mode(conn->fd, DUDA_EVENT_SLEEP, DUDA_EVENT_LEVEL_TRIGGERED);
-    if (conn->disconnect_on_finish) {
+    /* a listener keeps reading notifications while it is idle */
+    event->mode(conn->fd, conn->listener ? DUDA_EVENT_READ : DUDA_EVENT_SLEEP,
+                DUDA_EVENT_LEVEL_TRIGGERED);
+    if (conn->client || conn->shared) {
+        postgresql_pool_backend_idle(conn);
+    } else if (conn->disconnect_on_finish) {
         postgresql_conn_handle_release(conn, POSTGRESQL_OK);
     }
 }
 
 void postgresql_async_handle_row(postgresql_conn_t *conn)
 {
-    int status, i, j;
+    int status, i;
     int ret;
     char errbuf[256]; /* use recommended buffer size */
     postgresql_query_t *query = conn->current_query;
@@ -114,9 +213,13 @@ void postgresql_async_handle_row(postgresql_conn_t *conn)
 
         status = PQconsumeInput(conn->conn);
         if (status == 0) {
+            /* the connection is broken, the query is handled by on_error/on_close */
             msg->err("[FD %i] PostgreSQL Consume Input Error: %s", conn->fd,
                      PQerrorMessage(conn->conn));
-            postgresql_query_free(query);
+            break;
+        }
+        if (conn->listener) {
+            postgresql_notify_read(conn);
         }
 
         status = PQisBusy(conn->conn);
@@ -128,7 +231,16 @@ void postgresql_async_handle_row(postgresql_conn_t *conn)
         conn->state = CONN_STATE_ROW_FETCHED;
         query->result = PQgetResult(conn->conn);
         if (query->result) {
-            if (query->single_row_mode) {
+            if (postgresql_conn_is_lsn_query(query) &&
+                __postgresql_async_is_lsn(query->result)) {
+                /* the WAL position fetched by the package, keep it from the callbacks */
+                if (PQntuples(query->result) > 0) {
+                    conn->lsn = postgresql_util_lsn_parse(PQgetvalue(query->result, 0, 0));
+                    if (conn->client) {
+                        conn->client->lsn = conn->lsn;
+                    }
+                }
+            } else if (query->single_row_mode) {
                 if (PQresultStatus(query->result) == PGRES_SINGLE_TUPLE) {
                     if (query->n_fields == 0) {
                         query->n_fields = PQnfields(query->result);
@@ -144,7 +256,7 @@ void postgresql_async_handle_row(postgresql_conn_t *conn)
                     if (query->result_start == 0) {
                         if (query->result_cb) {
                             query->result_cb(query->privdata, query, query->n_fields,
-                                             query->fields, conn->dr);
+                                             query->fields, query->dr);
                         }
                         query->result_start = 1;
                     }
@@ -156,7 +268,7 @@ void postgresql_async_handle_row(postgresql_conn_t *conn)
 
                     if (query->row_cb) {
                         query->row_cb(query->privdata, query, query->n_fields,
-                                      query->fields, query->values, conn->dr);
+                                      query->fields, query->values, query->dr);
                     }
 
                     /* free row */
@@ -173,60 +285,26 @@ void postgresql_async_handle_row(postgresql_conn_t *conn)
                 } else if (PQresultStatus(query->result) != PGRES_COMMAND_OK){
                     msg->err("[FD %i] PostgreSQL Get Result Error: %s", conn->fd,
                              PQerrorMessage(conn->conn));
+                    query->status = POSTGRESQL_ERR;
                 }
             } else {
-                if (PQresultStatus(query->result) == PGRES_TUPLES_OK) {
-                    if (query->n_fields == 0) {
-                        query->n_fields = PQnfields(query->result);
-                    }
-
-                    if (!query->fields) {
-                        query->fields = monkey->mem_alloc(sizeof(char *) * query->n_fields);
-                        for (i = 0; i < query->n_fields; ++i) {
-                            query->fields[i] = monkey->str_dup(PQfname(query->result, i));
-                        }
-                    }
-
-                    if (query->result_start == 0) {
-                        if (query->result_cb) {
-                            query->result_cb(query->privdata, query, query->n_fields,
-                                             query->fields, conn->dr);
-                        }
-                        query->result_start = 1;
-                    }
-
-                    for (i = 0; i < PQntuples(query->result); ++i) {
-                        query->values = monkey->mem_alloc(sizeof(char *) * query->n_fields);
-                        for (j = 0; j < query->n_fields; ++j) {
-                            query->values[j] = monkey->str_dup(PQgetvalue(query->result, i, j));
-                        }
-                        if (query->row_cb) {
-                            query->row_cb(query->privdata, query, query->n_fields,
-                                          query->fields, query->values, conn->dr);
-                        }
-                        for (j = 0; j < query->n_fields; ++j) {
-                            FREE(query->values[j]);
-                        }
-                        FREE(query->values);
-                    }
-
-                    for (i = 0; i < query->n_fields; ++i) {
-                        FREE(query->fields[i]);
-                    }
-                    FREE(query->fields);
-                    query->n_fields = 0;
-                } else if (PQresultStatus(query->result) != PGRES_COMMAND_OK){
-                    msg->err("[FD %i] PostgreSQL Get Result Error: %s", conn->fd,
-                             PQerrorMessage(conn->conn));
-                }
+                postgresql_async_handle_result(query, conn->fd);
             }
             PQclear(query->result);
         } else {
             /* no more results */
+            conn->in_transaction = PQtransactionStatus(conn->conn) != PQTRANS_IDLE;
+            if (query->endpoint) {
+                postgresql_pool_endpoint_sample(query->endpoint,
+                                                postgresql_util_now() - query->sent_at);
+            }
             if (query->end_cb) {
-                query->end_cb(query->privdata, query, conn->dr);
+                query->end_cb(query->privdata, query, query->dr);
             }
             postgresql_query_free(query);
+            if (conn->lsn_deferred && !conn->in_transaction) {
+                postgresql_conn_capture_lsn(conn);
+            }
             conn->state = CONN_STATE_CONNECTED;
             break;
         }
@@ -24,5 +24,8 @@
 
 void postgresql_async_handle_query(postgresql_conn_t *conn);
 void postgresql_async_handle_row(postgresql_conn_t *conn);
+void postgresql_async_handle_result(postgresql_query_t *query, int fd);
+void postgresql_async_fail_query(postgresql_conn_t *conn, postgresql_query_t *query,
+                                 int status);
 
 #endif
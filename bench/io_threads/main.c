@@ -0,0 +1,147 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Benchmark of the connections owned by database threads against the
+ * connections owned by every worker. Both pools connect to the same server
+ * with the same size, /worker/ and /io/ run the same query on one of them,
+ * drive both with the same load and compare the throughput, the latency and
+ * the number of backends seen by the server. /stats/ prints the figures of
+ * the pools as seen by the worker serving it.
+ *
+ * The server and the query are taken from the environment:
+ *
+ *     POSTGRESQL_BENCH_URI    connection string, "dbname=postgres" by default
+ *     POSTGRESQL_BENCH_QUERY  query, "SELECT 1" by default
+ *     POSTGRESQL_BENCH_SIZE   connections per worker or per thread, 4 by default
+ *     POSTGRESQL_BENCH_IO     database threads, 2 by default
+ */
+
+#include <stdlib.h>
+
+#include "webservice.h"
+#include "packages/postgresql/postgresql.h"
+
+DUDA_REGISTER("PostgreSQL Database Threads Benchmark", "pgbench");
+
+duda_global_t worker_pool;
+duda_global_t io_pool;
+
+static const char *bench_query = "SELECT 1";
+
+static inline const char *bench_env(const char *name, const char *fallback)
+{
+    const char *value = getenv(name);
+    return value && *value ? value : fallback;
+}
+
+static void bench_end(void *privdata, postgresql_query_t *query, duda_request_t *dr)
+{
+    postgresql_conn_t *conn = privdata;
+
+    if (postgresql->query_status(query) == POSTGRESQL_OK) {
+        response->http_status(dr, 200);
+    } else {
+        response->http_status(dr, 500);
+    }
+    postgresql->disconnect(conn, NULL);
+    response->cont(dr);
+    response->end(dr, NULL);
+}
+
+static void bench_run(duda_request_t *dr, duda_global_t *pool)
+{
+    postgresql_conn_t *conn;
+
+    response->http_header_n(dr, "Content-Type: text/plain", 24);
+    response->wait(dr);
+
+    conn = postgresql->get_conn(pool, dr, NULL);
+    if (!conn) {
+        response->http_status(dr, 503);
+        response->cont(dr);
+        response->end(dr, NULL);
+        return;
+    }
+
+    if (postgresql->query(conn, bench_query, NULL, NULL, bench_end, conn) != POSTGRESQL_OK) {
+        postgresql->disconnect(conn, NULL);
+        response->http_status(dr, 500);
+        response->cont(dr);
+        response->end(dr, NULL);
+    }
+}
+
+void cb_worker(duda_request_t *dr)
+{
+    bench_run(dr, &worker_pool);
+}
+
+void cb_io(duda_request_t *dr)
+{
+    bench_run(dr, &io_pool);
+}
+
+static void bench_print_stats(duda_request_t *dr, const char *name, duda_global_t *pool)
+{
+    postgresql_endpoint_stats_t stats[1];
+
+    if (postgresql->endpoint_stats(pool, stats, 1) != 1) {
+        return;
+    }
+    response->printf(dr, "%s: size %i, outstanding %i, latency %.0f us, "
+                     "hold %.0f us, checkouts %lu\n",
+                     name, stats[0].size, stats[0].outstanding, stats[0].latency,
+                     stats[0].hold_time, stats[0].checkouts);
+}
+
+void cb_stats(duda_request_t *dr)
+{
+    response->http_status(dr, 200);
+    response->http_header_n(dr, "Content-Type: text/plain", 24);
+    bench_print_stats(dr, "worker", &worker_pool);
+    bench_print_stats(dr, "io", &io_pool);
+    response->end(dr, NULL);
+}
+
+int duda_main()
+{
+    const char *uri = bench_env("POSTGRESQL_BENCH_URI", "dbname=postgres");
+    int size = atoi(bench_env("POSTGRESQL_BENCH_SIZE", "4"));
+    int threads = atoi(bench_env("POSTGRESQL_BENCH_IO", "2"));
+
+    bench_query = bench_env("POSTGRESQL_BENCH_QUERY", bench_query);
+
+    duda_load_package(postgresql, "postgresql");
+
+    duda_global_init(&worker_pool, NULL, NULL);
+    postgresql->create_pool_uri(&worker_pool, size, size, uri);
+
+    duda_global_init(&io_pool, NULL, NULL);
+    postgresql->create_pool_uri(&io_pool, size, size, uri);
+    postgresql->set_pool_io_threads(&io_pool, threads);
+
+    map->static_add("/worker/", "cb_worker");
+    map->static_add("/io/", "cb_io");
+    map->static_add("/stats/", "cb_stats");
+
+    return 0;
+}
@@ -0,0 +1,1104 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <libpq-fe.h>
+#include "common.h"
+#include "query_priv.h"
+#include "connection_priv.h"
+#include "pool.h"
+#include "util.h"
+#include "cache_priv.h"
+#include "notify_priv.h"
+
+static size_t postgresql_cache_max_bytes = POSTGRESQL_CACHE_DEFAULT_SIZE;
+
+/* results saved by the previous process, mapped read-only once and shared by the workers */
+static char *postgresql_cache_path = NULL;
+static const char *postgresql_cache_map = NULL;
+static size_t postgresql_cache_map_length = 0;
+static int postgresql_cache_writer = 0;
+static int postgresql_cache_saving = 0;
+
+static inline void __postgresql_cache_load(postgresql_cache_t *cache);
+static int __postgresql_cache_on_serve(int fd, void *data);
+static int __postgresql_cache_on_close(int fd, void *data);
+
+static inline postgresql_cache_t *__postgresql_cache_table()
+{
+    int i;
+    postgresql_cache_t *cache = global->get(postgresql_cache_key);
+
+    if (cache) {
+        return cache;
+    }
+
+    cache = monkey->mem_alloc(sizeof(postgresql_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->bytes = 0;
+    cache->epoch = 0;
+    cache->changes       = 0;
+    cache->saved_changes = 0;
+    cache->save_at       = time(NULL) + POSTGRESQL_CACHE_SAVE_INTERVAL;
+    cache->scheduled     = 0;
+    memset(&cache->stats, 0, sizeof(cache->stats));
+    mk_list_init(&cache->hits);
+    mk_list_init(&cache->lru);
+    for (i = 0; i < POSTGRESQL_CACHE_BUCKETS; ++i) {
+        mk_list_init(&cache->buckets[i]);
+        mk_list_init(&cache->tags[i]);
+    }
+    global->set(postgresql_cache_key, (void *) cache);
+
+    /* hits are served from the event loop, never from within the call that sent the query */
+    cache->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cache->efd == -1) {
+        msg->err("PostgreSQL Cache Event Create Error");
+    } else {
+        event->add(cache->efd, DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED,
+                   __postgresql_cache_on_serve, NULL, __postgresql_cache_on_close,
+                   __postgresql_cache_on_close, NULL, cache);
+    }
+
+    /* the first worker to cache anything keeps the file up to date */
+    cache->writer = postgresql_cache_path &&
+                    __sync_bool_compare_and_swap(&postgresql_cache_writer, 0, 1);
+    if (postgresql_cache_map) {
+        __postgresql_cache_load(cache);
+    }
+    return cache;
+}
+
+static inline uint32_t __postgresql_cache_tag_hash(const void *scope, const char *channel,
+                                                  const char *tag)
+{
+    uint32_t hash = postgresql_util_hash(&scope, sizeof(scope));
+
+    hash = hash * 31 + postgresql_util_hash(channel, strlen(channel));
+    return hash * 31 + postgresql_util_hash(tag, strlen(tag));
+}
+
+/* Take an entry out of the cache, it is freed once no delivery uses it anymore. */
+static inline void __postgresql_cache_unlink(postgresql_cache_t *cache,
+                                             postgresql_cache_entry_t *entry)
+{
+    if (!entry->linked) {
+        return;
+    }
+
+    mk_list_del(&entry->_hash_head);
+    mk_list_del(&entry->_lru_head);
+    if (entry->channel) {
+        mk_list_del(&entry->_tag_head);
+    }
+    entry->linked = 0;
+    cache->changes++;
+    cache->bytes -= entry->size;
+    cache->stats.entries--;
+    cache->stats.bytes = cache->bytes;
+    if (entry->refs == 0) {
+        FREE(entry);
+    }
+}
+
+static inline postgresql_cache_entry_t *__postgresql_cache_find(postgresql_cache_t *cache,
+                                                                uint32_t hash,
+                                                                const char *key,
+                                                                size_t length)
+{
+    struct mk_list *head;
+    postgresql_cache_entry_t *entry;
+
+    mk_list_foreach(head, &cache->buckets[hash % POSTGRESQL_CACHE_BUCKETS]) {
+        entry = mk_list_entry(head, postgresql_cache_entry_t, _hash_head);
+        if (entry->hash == hash && entry->key_length == length &&
+            memcmp(entry->key, key, length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Pack a collected result into an entry and make room for it. */
+static inline void __postgresql_cache_insert(postgresql_cache_t *cache,
+                                             postgresql_cache_fill_t *fill)
+{
+    int i, n_values;
+    size_t size, tag_length = 0;
+    char *ptr;
+    postgresql_cache_entry_t *entry;
+
+    /* a notification arrived while the query ran, its result may be outdated already */
+    if (fill->channel && fill->epoch != cache->epoch) {
+        return;
+    }
+
+    n_values = fill->n_fields * (fill->n_rows + 1);
+    if (fill->channel) {
+        tag_length = strlen(fill->channel) + strlen(fill->tag) + 2;
+    }
+    size = sizeof(postgresql_cache_entry_t) + sizeof(char *) * n_values +
+           fill->key_length + fill->length + tag_length;
+    if (size > postgresql_cache_max_bytes / POSTGRESQL_CACHE_ENTRY_SHARE) {
+        return;
+    }
+
+    entry = __postgresql_cache_find(cache, fill->hash, fill->key, fill->key_length);
+    if (entry) {
+        __postgresql_cache_unlink(cache, entry);
+    }
+
+    while (cache->bytes + size > postgresql_cache_max_bytes &&
+           mk_list_is_empty(&cache->lru) != 0) {
+        entry = mk_list_entry_last(&cache->lru, postgresql_cache_entry_t, _lru_head);
+        __postgresql_cache_unlink(cache, entry);
+        cache->stats.evictions++;
+    }
+
+    entry = monkey->mem_alloc(size);
+    if (!entry) {
+        return;
+    }
+
+    entry->hash        = fill->hash;
+    entry->key_length  = fill->key_length;
+    entry->size        = size;
+    entry->fresh_until = postgresql_util_now() + (uint64_t) fill->ttl * 1000;
+    entry->stale_until = entry->fresh_until + (uint64_t) fill->stale * 1000;
+    entry->refreshing  = 0;
+    entry->refs        = 0;
+    entry->linked      = 1;
+    entry->n_fields    = fill->n_fields;
+    entry->n_rows      = fill->n_rows;
+    entry->fields      = (char **) (entry + 1);
+    entry->values      = entry->fields + fill->n_fields;
+    entry->key         = (char *) (entry->fields + n_values);
+    memcpy(entry->key, fill->key, fill->key_length);
+
+    ptr = entry->key + fill->key_length;
+    memcpy(ptr, fill->data, fill->length);
+    for (i = 0; i < n_values; ++i) {
+        entry->fields[i] = ptr;
+        ptr += strlen(ptr) + 1;
+    }
+
+    entry->scope   = fill->scope;
+    entry->channel = NULL;
+    entry->tag     = NULL;
+    if (fill->channel) {
+        entry->channel = ptr;
+        strcpy(entry->channel, fill->channel);
+        entry->tag = entry->channel + strlen(fill->channel) + 1;
+        strcpy(entry->tag, fill->tag);
+        entry->tag_hash = __postgresql_cache_tag_hash(entry->scope, entry->channel, entry->tag);
+        mk_list_add(&entry->_tag_head, &cache->tags[entry->tag_hash % POSTGRESQL_CACHE_BUCKETS]);
+    }
+
+    mk_list_add(&entry->_hash_head, &cache->buckets[entry->hash % POSTGRESQL_CACHE_BUCKETS]);
+    mk_list_add(&entry->_lru_head, cache->lru.next);
+    cache->changes++;
+    cache->bytes += size;
+    cache->stats.entries++;
+    cache->stats.bytes = cache->bytes;
+}
+
+static inline void __postgresql_cache_append(postgresql_cache_fill_t *fill, const char *str)
+{
+    size_t n = strlen(str) + 1;
+    char *buf;
+
+    if (fill->overflow) {
+        return;
+    }
+
+    if (fill->length + n > postgresql_cache_max_bytes / POSTGRESQL_CACHE_ENTRY_SHARE) {
+        fill->overflow = 1;
+        FREE(fill->data);
+        return;
+    }
+
+    if (fill->length + n > fill->size) {
+        fill->size = (fill->length + n) * 2;
+        buf = monkey->mem_realloc(fill->data, fill->size);
+        if (!buf) {
+            fill->overflow = 1;
+            FREE(fill->data);
+            return;
+        }
+        fill->data = buf;
+    }
+    memcpy(fill->data + fill->length, str, n);
+    fill->length += n;
+}
+
+static void __postgresql_cache_result(void *privdata, postgresql_query_t *query,
+                                      int n_fields, char **fields, duda_request_t *dr)
+{
+    int i;
+    postgresql_cache_fill_t *fill = privdata;
+
+    /* only the first result set of a query is cached */
+    if (fill->n_fields == 0 && fill->length == 0) {
+        fill->n_fields = n_fields;
+        for (i = 0; i < n_fields; ++i) {
+            __postgresql_cache_append(fill, fields[i]);
+        }
+    } else {
+        fill->overflow = 1;
+    }
+
+    if (fill->result_cb) {
+        fill->result_cb(fill->privdata, query, n_fields, fields, dr);
+    }
+}
+
+static void __postgresql_cache_row(void *privdata, postgresql_query_t *query,
+                                   int n_fields, char **fields, char **values,
+                                   duda_request_t *dr)
+{
+    int i;
+    postgresql_cache_fill_t *fill = privdata;
+
+    if (n_fields == fill->n_fields) {
+        for (i = 0; i < n_fields; ++i) {
+            __postgresql_cache_append(fill, values[i]);
+        }
+        fill->n_rows++;
+    } else {
+        fill->overflow = 1;
+    }
+
+    if (fill->row_cb) {
+        fill->row_cb(fill->privdata, query, n_fields, fields, values, dr);
+    }
+}
+
+static void __postgresql_cache_end(void *privdata, postgresql_query_t *query,
+                                   duda_request_t *dr)
+{
+    postgresql_cache_fill_t *fill = privdata;
+    postgresql_cache_t *cache;
+
+    if (query->status == POSTGRESQL_OK && !query->abort && !fill->overflow &&
+        fill->n_fields > 0) {
+        cache = __postgresql_cache_table();
+        if (cache) {
+            __postgresql_cache_insert(cache, fill);
+        }
+    }
+
+    if (fill->end_cb) {
+        fill->end_cb(fill->privdata, query, dr);
+    }
+}
+
+/* Hand a cached result to the callbacks of a query, the query is freed then. */
+static inline void __postgresql_cache_deliver(postgresql_cache_entry_t *entry,
+                                              postgresql_query_t *query)
+{
+    int i;
+
+    entry->refs++;
+    query->status  = POSTGRESQL_OK;
+    query->sent_at = query->queued_at;
+    if (!query->abort && query->result_cb) {
+        query->result_cb(query->privdata, query, entry->n_fields, entry->fields, query->dr);
+    }
+    for (i = 0; i < entry->n_rows && !query->abort; ++i) {
+        if (query->row_cb) {
+            query->row_cb(query->privdata, query, entry->n_fields, entry->fields,
+                          entry->values + i * entry->n_fields, query->dr);
+        }
+    }
+    if (!query->abort && query->end_cb) {
+        query->end_cb(query->privdata, query, query->dr);
+    }
+    mk_list_init(&query->_head);
+    postgresql_query_free(query);
+
+    entry->refs--;
+    if (!entry->linked && entry->refs == 0) {
+        FREE(entry);
+    }
+}
+
+/*
+ * Serve a cached result to a query on the next pass of the event loop. The
+ * query counts as pipelined on its handle meanwhile, so the later queries of
+ * the handle and its disconnection wait for it.
+ */
+static inline int __postgresql_cache_schedule(postgresql_cache_t *cache, postgresql_conn_t *conn,
+                                              postgresql_cache_entry_t *entry,
+                                              postgresql_query_t *query)
+{
+    uint64_t one = 1;
+    postgresql_cache_hit_t *hit;
+
+    if (cache->efd == -1) {
+        return POSTGRESQL_ERR;
+    }
+
+    hit = monkey->mem_alloc(sizeof(postgresql_cache_hit_t));
+    if (!hit) {
+        return POSTGRESQL_ERR;
+    }
+
+    if (!cache->scheduled) {
+        if (write(cache->efd, &one, sizeof(one)) != sizeof(one)) {
+            msg->err("[FD %i] PostgreSQL Cache Notify Error", cache->efd);
+            FREE(hit);
+            return POSTGRESQL_ERR;
+        }
+        cache->scheduled = 1;
+    }
+
+    entry->refs++;
+    hit->entry = entry;
+    hit->query = query;
+    mk_list_add(&hit->_head, &cache->hits);
+
+    query->handle = conn;
+    conn->pipelined++;
+    return POSTGRESQL_OK;
+}
+
+static int __postgresql_cache_on_serve(int fd, void *data)
+{
+    uint64_t count;
+    struct mk_list hits;
+    postgresql_cache_t *cache = data;
+    postgresql_cache_hit_t *hit;
+    postgresql_cache_entry_t *entry;
+
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return DUDA_EVENT_OWNED;
+    }
+
+    /* the callbacks may schedule more hits, they are served on the next pass */
+    cache->scheduled = 0;
+    mk_list_init(&hits);
+    while (mk_list_is_empty(&cache->hits) != 0) {
+        hit = mk_list_entry_first(&cache->hits, postgresql_cache_hit_t, _head);
+        mk_list_del(&hit->_head);
+        mk_list_add(&hit->_head, &hits);
+    }
+
+    while (mk_list_is_empty(&hits) != 0) {
+        hit = mk_list_entry_first(&hits, postgresql_cache_hit_t, _head);
+        mk_list_del(&hit->_head);
+        entry = hit->entry;
+        __postgresql_cache_deliver(entry, hit->query);
+        FREE(hit);
+
+        /* the reference taken when the hit was scheduled */
+        entry->refs--;
+        if (!entry->linked && entry->refs == 0) {
+            FREE(entry);
+        }
+    }
+    return DUDA_EVENT_OWNED;
+}
+
+static int __postgresql_cache_on_close(int fd, void *data)
+{
+    postgresql_cache_t *cache = data;
+
+    msg->err("[FD %i] PostgreSQL Cache Event Closed", fd);
+    cache->efd = -1;
+    return DUDA_EVENT_CLOSE;
+}
+
+/*
+ * Serve a read from the result cache of the worker. Return POSTGRESQL_OK if
+ * it is served, the query is freed once it is. Otherwise the query must be
+ * sent, its result is collected into the cache; when a stale result is
+ * served meanwhile, stale is set. Results are only served to an idle handle,
+ * so they never pass the queries it already has.
+ */
+int postgresql_cache_lookup(postgresql_conn_t *conn, postgresql_query_t *query, int *stale_hit)
+{
+    int idle;
+    size_t length;
+    uint32_t hash;
+    uint64_t now;
+    char *key;
+    postgresql_cache_t *cache;
+    postgresql_cache_entry_t *entry;
+    postgresql_cache_fill_t *fill;
+    postgresql_query_t *stale;
+
+    /* a transaction may see its own writes, the result of a pool is shared by its handles */
+    if (!query->is_read || conn->in_transaction || !conn->pool || query->cache_fill ||
+        (query->flags & POSTGRESQL_QUERY_TRACK_LSN)) {
+        return POSTGRESQL_ERR;
+    }
+
+    cache = __postgresql_cache_table();
+    if (!cache) {
+        return POSTGRESQL_ERR;
+    }
+
+    /* a tagged result is only cached once its notifications can't be missed */
+    if (query->cache_channel &&
+        postgresql_notify_watch(conn->pool, query->cache_channel) != POSTGRESQL_OK) {
+        return POSTGRESQL_ERR;
+    }
+
+    key = postgresql_query_key(query, &conn->pool->config, sizeof(conn->pool->config),
+                               &length);
+    if (!key) {
+        return POSTGRESQL_ERR;
+    }
+    hash = postgresql_util_hash(key, length);
+    now  = postgresql_util_now();
+
+    entry = __postgresql_cache_find(cache, hash, key, length);
+    if (entry && now >= entry->stale_until) {
+        __postgresql_cache_unlink(cache, entry);
+        entry = NULL;
+    }
+
+    if (entry) {
+        mk_list_del(&entry->_lru_head);
+        mk_list_add(&entry->_lru_head, cache->lru.next);
+    }
+
+    /* overflow connections are freed once closed, they can't wait for a hit */
+    idle = (conn->is_virtual || conn->is_pooled) && !conn->backend && conn->pipelined == 0 &&
+           mk_list_is_empty(&conn->queries) == 0;
+    if (!idle) {
+        entry = NULL;
+    }
+
+    if (entry && (now < entry->fresh_until || entry->refreshing)) {
+        if (__postgresql_cache_schedule(cache, conn, entry, query) == POSTGRESQL_OK) {
+            FREE(key);
+            if (now < entry->fresh_until) {
+                cache->stats.hits++;
+            } else {
+                cache->stats.stale_hits++;
+            }
+            return POSTGRESQL_OK;
+        }
+        entry = NULL;
+    }
+
+    fill = monkey->mem_alloc(sizeof(postgresql_cache_fill_t));
+    if (!fill) {
+        FREE(key);
+        return POSTGRESQL_ERR;
+    }
+
+    stale = NULL;
+    if (entry) {
+        /* the callbacks get the stale result, the query only refreshes the cache */
+        stale = postgresql_query_init();
+        if (!stale) {
+            FREE(fill);
+            FREE(key);
+            return POSTGRESQL_ERR;
+        }
+        stale->result_cb = query->result_cb;
+        stale->row_cb    = query->row_cb;
+        stale->end_cb    = query->end_cb;
+        stale->privdata  = query->privdata;
+        stale->dr        = query->dr;
+        stale->flags     = query->flags;
+        stale->queued_at = query->queued_at;
+
+        /* scheduled first, so the refresh queues behind it on the handle */
+        if (__postgresql_cache_schedule(cache, conn, entry, stale) != POSTGRESQL_OK) {
+            mk_list_init(&stale->_head);
+            postgresql_query_free(stale);
+            stale = NULL;
+            entry = NULL;
+        }
+    }
+
+    if (entry) {
+        query->result_cb = NULL;
+        query->row_cb    = NULL;
+        query->end_cb    = NULL;
+        query->privdata  = NULL;
+        if (query->priority < POSTGRESQL_PRIORITY_BACKGROUND) {
+            query->priority = POSTGRESQL_PRIORITY_BACKGROUND;
+        }
+
+        entry->refreshing = 1;
+        *stale_hit = 1;
+        cache->stats.stale_hits++;
+    } else {
+        cache->stats.misses++;
+    }
+
+    fill->hash       = hash;
+    fill->key        = key;
+    fill->key_length = length;
+    fill->ttl        = query->cache_ttl;
+    fill->stale      = query->cache_stale;
+    fill->scope      = conn->pool->config;
+    fill->channel    = query->cache_channel;
+    fill->tag        = query->cache_tag;
+    fill->epoch      = cache->epoch;
+    fill->n_fields   = 0;
+    fill->n_rows     = 0;
+    fill->data       = NULL;
+    fill->length     = 0;
+    fill->size       = 0;
+    fill->overflow   = 0;
+    fill->result_cb  = query->result_cb;
+    fill->row_cb     = query->row_cb;
+    fill->end_cb     = query->end_cb;
+    fill->privdata   = query->privdata;
+
+    query->result_cb  = __postgresql_cache_result;
+    query->row_cb     = __postgresql_cache_row;
+    query->end_cb     = __postgresql_cache_end;
+    query->privdata   = fill;
+    query->cache_fill = fill;
+    query->cache_channel = NULL;
+    query->cache_tag     = NULL;
+    return POSTGRESQL_ERR;
+}
+
+/* Called when a query whose result was collected into the cache is freed. */
+void postgresql_cache_done(postgresql_query_t *query)
+{
+    postgresql_cache_fill_t *fill = query->cache_fill;
+    postgresql_cache_t *cache = global->get(postgresql_cache_key);
+    postgresql_cache_entry_t *entry;
+
+    query->cache_fill = NULL;
+
+    /* a failed refresh lets the next reader of the stale result try again */
+    if (cache) {
+        entry = __postgresql_cache_find(cache, fill->hash, fill->key, fill->key_length);
+        if (entry) {
+            entry->refreshing = 0;
+        }
+    }
+
+    FREE(fill->data);
+    FREE(fill->key);
+    FREE(fill->channel);
+    FREE(fill->tag);
+    FREE(fill);
+}
+
+static inline void __postgresql_cache_invalidate_tag(postgresql_cache_t *cache,
+                                                     const void *scope,
+                                                     const char *channel, const char *tag)
+{
+    uint32_t hash = __postgresql_cache_tag_hash(scope, channel, tag);
+    struct mk_list *head, *tmp;
+    postgresql_cache_entry_t *entry;
+
+    mk_list_foreach_safe(head, tmp, &cache->tags[hash % POSTGRESQL_CACHE_BUCKETS]) {
+        entry = mk_list_entry(head, postgresql_cache_entry_t, _tag_head);
+        if (entry->tag_hash == hash && entry->scope == scope &&
+            strcmp(entry->channel, channel) == 0 && strcmp(entry->tag, tag) == 0) {
+            __postgresql_cache_unlink(cache, entry);
+            cache->stats.invalidations++;
+        }
+    }
+}
+
+/*
+ * Drop the cached results of a pool tagged with a notification channel and
+ * key. An empty or NULL key drops all the results tagged with the channel,
+ * results tagged with an empty key go with any notification of the channel.
+ */
+void postgresql_cache_invalidate(const void *scope, const char *channel, const char *tag)
+{
+    struct mk_list *head, *tmp;
+    postgresql_cache_entry_t *entry;
+    postgresql_cache_t *cache = global->get(postgresql_cache_key);
+
+    if (!cache) {
+        return;
+    }
+
+    /* results being collected are not cached, they may predate the notification */
+    cache->epoch++;
+
+    if (!tag || tag[0] == '\0') {
+        mk_list_foreach_safe(head, tmp, &cache->lru) {
+            entry = mk_list_entry(head, postgresql_cache_entry_t, _lru_head);
+            if (entry->channel && entry->scope == scope &&
+                strcmp(entry->channel, channel) == 0) {
+                __postgresql_cache_unlink(cache, entry);
+                cache->stats.invalidations++;
+            }
+        }
+        return;
+    }
+
+    __postgresql_cache_invalidate_tag(cache, scope, channel, tag);
+    __postgresql_cache_invalidate_tag(cache, scope, channel, "");
+}
+
+static inline uint64_t __postgresql_cache_wall_now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Identity of a pool that outlives the process, made of the settings of its primary. */
+static inline uint32_t __postgresql_cache_pool_ident(postgresql_pool_config_t *config)
+{
+    int i;
+    uint32_t hash = 0;
+    postgresql_endpoint_config_t *primary = &config->endpoints[0];
+
+    if (primary->type == POOL_TYPE_URI) {
+        return postgresql_util_hash(primary->uri, strlen(primary->uri));
+    }
+
+    for (i = 0; primary->keys && primary->keys[i]; ++i) {
+        hash = hash * 31 + postgresql_util_hash(primary->keys[i], strlen(primary->keys[i]));
+        if (primary->values && primary->values[i]) {
+            hash = hash * 31 + postgresql_util_hash(primary->values[i],
+                                                    strlen(primary->values[i]));
+        }
+    }
+    return hash;
+}
+
+static inline postgresql_pool_config_t *__postgresql_cache_pool_find(uint32_t ident)
+{
+    struct mk_list *head;
+    postgresql_pool_config_t *config;
+
+    mk_list_foreach(head, &postgresql_pool_config_list) {
+        config = mk_list_entry(head, postgresql_pool_config_t, _head);
+        if (__postgresql_cache_pool_ident(config) == ident) {
+            return config;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Index the results saved by the previous process that are still within
+ * their time to live. Their strings are served from the mapped file, only
+ * the key and the pointers are copied.
+ */
+static inline void __postgresql_cache_load(postgresql_cache_t *cache)
+{
+    uint64_t i, offset, wall_now = __postgresql_cache_wall_now();
+    uint64_t now = postgresql_util_now();
+    int j, n_values;
+    size_t size, alloc, left;
+    const char *ptr, *end;
+    const postgresql_cache_file_header_t *header = (const void *) postgresql_cache_map;
+    const postgresql_cache_file_entry_t *record;
+    postgresql_pool_config_t *config;
+    postgresql_cache_entry_t *entry;
+
+    offset = sizeof(postgresql_cache_file_header_t);
+    for (i = 0; i < header->n_entries; ++i) {
+        if (offset + sizeof(postgresql_cache_file_entry_t) > postgresql_cache_map_length) {
+            break;
+        }
+        record = (const void *) (postgresql_cache_map + offset);
+        ptr    = (const char *) (record + 1);
+        size   = sizeof(postgresql_cache_file_entry_t) + record->key_length + record->data_length;
+        if (record->n_fields == 0 || record->data_length == 0 ||
+            size > postgresql_cache_map_length - offset) {
+            break;
+        }
+        if ((uint64_t) record->n_fields * ((uint64_t) record->n_rows + 1) >
+            record->data_length) {
+            offset += (size + 7) & ~7UL;
+            continue;
+        }
+        offset += (size + 7) & ~7UL;
+
+        if (record->stale_until <= wall_now) {
+            continue;
+        }
+        config = __postgresql_cache_pool_find(record->pool);
+        if (!config) {
+            continue;
+        }
+
+        /* the strings stay in the mapped file, they still count against the size of the cache */
+        n_values = record->n_fields * (record->n_rows + 1);
+        alloc = sizeof(postgresql_cache_entry_t) + sizeof(char *) * n_values + sizeof(config) +
+                record->key_length;
+        size  = alloc + record->data_length;
+        if (size > postgresql_cache_max_bytes / POSTGRESQL_CACHE_ENTRY_SHARE) {
+            continue;
+        }
+        /* saved most recently used first, the rest would be evicted anyway */
+        if (cache->bytes + size > postgresql_cache_max_bytes) {
+            break;
+        }
+
+        entry = monkey->mem_alloc(alloc);
+        if (!entry) {
+            break;
+        }
+
+        entry->n_fields = record->n_fields;
+        entry->n_rows   = record->n_rows;
+        entry->fields   = (char **) (entry + 1);
+        entry->values   = entry->fields + record->n_fields;
+        entry->key      = (char *) (entry->fields + n_values);
+
+        /* every string must end within the data of the result */
+        left = record->data_length;
+        end  = ptr + record->key_length;
+        for (j = 0; j < n_values; ++j) {
+            const char *nul = memchr(end, '\0', left);
+            if (!nul) {
+                break;
+            }
+            entry->fields[j] = (char *) end;
+            left -= nul + 1 - end;
+            end   = nul + 1;
+        }
+        if (j != n_values) {
+            FREE(entry);
+            continue;
+        }
+
+        memcpy(entry->key, &config, sizeof(config));
+        memcpy(entry->key + sizeof(config), ptr, record->key_length);
+        entry->key_length  = sizeof(config) + record->key_length;
+        entry->hash        = postgresql_util_hash(entry->key, entry->key_length);
+        entry->size        = size;
+        entry->fresh_until = now + (int64_t) (record->fresh_until - wall_now);
+        entry->stale_until = now + (record->stale_until - wall_now);
+        if (record->fresh_until <= wall_now) {
+            entry->fresh_until = now;
+        }
+        entry->refreshing = 0;
+        entry->refs       = 0;
+        entry->linked     = 1;
+        entry->scope      = config;
+        entry->channel    = NULL;
+        entry->tag        = NULL;
+
+        if (__postgresql_cache_find(cache, entry->hash, entry->key, entry->key_length)) {
+            FREE(entry);
+            continue;
+        }
+        mk_list_add(&entry->_hash_head, &cache->buckets[entry->hash % POSTGRESQL_CACHE_BUCKETS]);
+        mk_list_add(&entry->_lru_head, &cache->lru);
+        cache->bytes += size;
+        cache->stats.entries++;
+        cache->stats.bytes = cache->bytes;
+    }
+}
+
+/* FNV-1a, carried over the whole payload of the file */
+static inline uint32_t __postgresql_cache_checksum(uint32_t checksum, const void *data,
+                                                   size_t length)
+{
+    size_t i;
+    const unsigned char *ptr = data;
+
+    for (i = 0; i < length; ++i) {
+        checksum ^= ptr[i];
+        checksum *= 16777619u;
+    }
+    return checksum;
+}
+
+/* Bytes taken by a result in the file, 0 if it is not saved. */
+static inline size_t __postgresql_cache_record_length(postgresql_cache_entry_t *entry,
+                                                      uint64_t now, uint64_t *data_length)
+{
+    int n_values;
+
+    if (entry->channel || now >= entry->stale_until || entry->key_length < sizeof(void *)) {
+        return 0;
+    }
+
+    n_values = entry->n_fields * (entry->n_rows + 1);
+    *data_length = entry->fields[n_values - 1] + strlen(entry->fields[n_values - 1]) + 1 -
+                   entry->fields[0];
+    return sizeof(postgresql_cache_file_entry_t) + entry->key_length - sizeof(void *) +
+           *data_length;
+}
+
+/*
+ * Write a copy of the file to a temporary file renamed over the cache file
+ * once complete, so a process mapping it never sees a partial one. Runs in
+ * its own thread to keep the write and the sync off the worker.
+ */
+static void *__postgresql_cache_write(void *data)
+{
+    postgresql_cache_save_t *save = data;
+    FILE *file;
+
+    file = fopen(save->tmp, "w");
+    if (!file) {
+        msg->err("PostgreSQL Cache File Open Error: %s", save->tmp);
+        goto out;
+    }
+    if (fwrite(save->buffer, 1, save->length, file) != save->length ||
+        fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        msg->err("PostgreSQL Cache File Write Error: %s", save->tmp);
+        fclose(file);
+        unlink(save->tmp);
+        goto out;
+    }
+    fclose(file);
+
+    if (rename(save->tmp, postgresql_cache_path) != 0) {
+        msg->err("PostgreSQL Cache File Rename Error: %s", postgresql_cache_path);
+        unlink(save->tmp);
+    }
+
+out:
+    FREE(save->buffer);
+    FREE(save->tmp);
+    FREE(save);
+    __sync_lock_release(&postgresql_cache_saving);
+    return NULL;
+}
+
+/*
+ * Copy the results of the worker, most recently used first, in the format of
+ * the file and hand the copy to a writing thread. Tagged results are left
+ * out: the notifications that would drop them are missed while no process
+ * listens.
+ */
+static inline int __postgresql_cache_save(postgresql_cache_t *cache)
+{
+    char *ptr;
+    size_t length, total;
+    uint64_t data_length, now = postgresql_util_now(), wall_now = __postgresql_cache_wall_now();
+    pthread_t tid;
+    pthread_attr_t attr;
+    struct mk_list *head;
+    postgresql_cache_entry_t *entry;
+    postgresql_cache_file_header_t *header;
+    postgresql_cache_file_entry_t *record;
+    postgresql_cache_save_t *save;
+
+    /* a previous save still being written is let finish */
+    if (!__sync_bool_compare_and_swap(&postgresql_cache_saving, 0, 1)) {
+        return POSTGRESQL_ERR;
+    }
+
+    total = sizeof(postgresql_cache_file_header_t);
+    mk_list_foreach(head, &cache->lru) {
+        entry  = mk_list_entry(head, postgresql_cache_entry_t, _lru_head);
+        length = __postgresql_cache_record_length(entry, now, &data_length);
+        total += (length + 7) & ~7UL;
+    }
+
+    save = monkey->mem_alloc(sizeof(postgresql_cache_save_t));
+    if (!save) {
+        __sync_lock_release(&postgresql_cache_saving);
+        return POSTGRESQL_ERR;
+    }
+    length = strlen(postgresql_cache_path) + 32;
+    save->tmp    = monkey->mem_alloc(length);
+    save->buffer = monkey->mem_alloc(total);
+    save->length = total;
+    if (!save->tmp || !save->buffer) {
+        goto error;
+    }
+    memset(save->buffer, 0, total);
+    snprintf(save->tmp, length, "%s.%d.tmp", postgresql_cache_path, (int) getpid());
+
+    header = (postgresql_cache_file_header_t *) save->buffer;
+    ptr    = (char *) (header + 1);
+    mk_list_foreach(head, &cache->lru) {
+        entry  = mk_list_entry(head, postgresql_cache_entry_t, _lru_head);
+        length = __postgresql_cache_record_length(entry, now, &data_length);
+        if (length == 0) {
+            continue;
+        }
+
+        record = (postgresql_cache_file_entry_t *) ptr;
+        record->fresh_until = wall_now +
+                              (entry->fresh_until > now ? entry->fresh_until - now : 0);
+        record->stale_until = wall_now + (entry->stale_until - now);
+        record->pool        = __postgresql_cache_pool_ident(
+                                  (postgresql_pool_config_t *) entry->scope);
+        record->key_length  = entry->key_length - sizeof(void *);
+        record->n_fields    = entry->n_fields;
+        record->n_rows      = entry->n_rows;
+        record->data_length = data_length;
+        memcpy(record + 1, entry->key + sizeof(void *), record->key_length);
+        memcpy((char *) (record + 1) + record->key_length, entry->fields[0], data_length);
+
+        ptr += (length + 7) & ~7UL;
+        header->n_entries++;
+    }
+
+    memcpy(header->magic, POSTGRESQL_CACHE_FILE_MAGIC, sizeof(header->magic));
+    header->version  = POSTGRESQL_CACHE_FILE_VERSION;
+    header->length   = total - sizeof(postgresql_cache_file_header_t);
+    header->checksum = __postgresql_cache_checksum(2166136261u, header + 1, header->length);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, __postgresql_cache_write, save) != 0) {
+        pthread_attr_destroy(&attr);
+        msg->err("PostgreSQL Cache File Thread Error: %s", postgresql_cache_path);
+        goto error;
+    }
+    pthread_attr_destroy(&attr);
+    return POSTGRESQL_OK;
+
+error:
+    FREE(save->buffer);
+    FREE(save->tmp);
+    FREE(save);
+    __sync_lock_release(&postgresql_cache_saving);
+    return POSTGRESQL_ERR;
+}
+
+/* Save the results of the writing worker once in a while, called by the pool ticks. */
+void postgresql_cache_tick()
+{
+    time_t now;
+    postgresql_cache_t *cache = global->get(postgresql_cache_key);
+
+    if (!cache || !cache->writer) {
+        return;
+    }
+
+    now = time(NULL);
+    if (now < cache->save_at || cache->changes == cache->saved_changes) {
+        return;
+    }
+
+    if (__postgresql_cache_save(cache) == POSTGRESQL_OK) {
+        cache->save_at       = now + POSTGRESQL_CACHE_SAVE_INTERVAL;
+        cache->saved_changes = cache->changes;
+    }
+}
+
+/* Map a cache file and check it was written completely by a compatible version. */
+static inline int __postgresql_cache_map(const char *path)
+{
+    int fd;
+    void *map;
+    struct stat st;
+    const postgresql_cache_file_header_t *header;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return POSTGRESQL_ERR;
+    }
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(postgresql_cache_file_header_t)) {
+        close(fd);
+        return POSTGRESQL_ERR;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return POSTGRESQL_ERR;
+    }
+
+    header = map;
+    if (memcmp(header->magic, POSTGRESQL_CACHE_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != POSTGRESQL_CACHE_FILE_VERSION ||
+        header->length != st.st_size - sizeof(postgresql_cache_file_header_t) ||
+        header->checksum != __postgresql_cache_checksum(2166136261u, header + 1,
+                                                        header->length)) {
+        msg->warn("PostgreSQL Cache File Ignored: %s", path);
+        munmap(map, st.st_size);
+        return POSTGRESQL_ERR;
+    }
+
+    postgresql_cache_map        = map;
+    postgresql_cache_map_length = st.st_size;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: set_cache_file
+ * @METHOD_DESC: Back the result cache with a file, so that a restarted service serves the results cached before it stopped, within their time to live, instead of sending all their queries at once. The file is mapped read-only and shared by all the workers, which serve the saved results from it; the results of the first worker caching anything are saved to it every 30 seconds when they changed. The file carries a version and a checksum, it is ignored if it is incomplete or was written by another version. Results tagged with a notification channel are never saved, since notifications are missed while the service is down. It must be called within the function `duda_main()' of a Duda web service.
+ * @METHOD_PROTO: int set_cache_file(const char *path)
+ * @METHOD_PARAM: path The path of the file, in a directory the service can write to.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR if the path is NULL.
+ */
+
+int postgresql_cache_set_file(const char *path)
+{
+    if (!path || postgresql_cache_path) {
+        return POSTGRESQL_ERR;
+    }
+
+    postgresql_cache_path = monkey->str_dup(path);
+    __postgresql_cache_map(path);
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: set_result_cache
+ * @METHOD_DESC: Set how many bytes of query results every worker keeps in its result cache, the least recently used results are evicted first. A single result may take up to an eighth of the cache. Results are cached only for the queries enqueued after set_query_cache. It must be called within the function `duda_main()' of a Duda web service.
+ * @METHOD_PROTO: int set_result_cache(size_t max_bytes)
+ * @METHOD_PARAM: max_bytes The size of the cache of a worker, 4 MB by default.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR if the size is 0.
+ */
+
+int postgresql_cache_set_size(size_t max_bytes)
+{
+    if (max_bytes == 0) {
+        return POSTGRESQL_ERR;
+    }
+
+    postgresql_cache_max_bytes = max_bytes;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: cache_stats
+ * @METHOD_DESC: Get the statistics of the result cache of the calling worker.
+ * @METHOD_PROTO: void cache_stats(postgresql_cache_stats_t *stats)
+ * @METHOD_PARAM: stats The statistics to be filled.
+ * @METHOD_RETURN: None.
+ */
+
+void postgresql_cache_get_stats(postgresql_cache_stats_t *stats)
+{
+    postgresql_cache_t *cache = global->get(postgresql_cache_key);
+
+    if (!cache) {
+        memset(stats, 0, sizeof(postgresql_cache_stats_t));
+        return;
+    }
+    *stats = cache->stats;
+}
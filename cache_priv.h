@@ -0,0 +1,165 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_CACHE_PRIV_H
+#define POSTGRESQL_CACHE_PRIV_H
+
+#include <stdint.h>
+#include <time.h>
+#include "stats.h"
+
+/* buckets of the result cache of a worker */
+#define POSTGRESQL_CACHE_BUCKETS 1024
+
+/* bytes of results a worker keeps by default */
+#define POSTGRESQL_CACHE_DEFAULT_SIZE (4 * 1024 * 1024)
+
+/* a result takes at most this share of the cache */
+#define POSTGRESQL_CACHE_ENTRY_SHARE 8
+
+/* file the results of a worker are saved to, for the next process to start warm */
+#define POSTGRESQL_CACHE_FILE_MAGIC "DUDAPGRC"
+#define POSTGRESQL_CACHE_FILE_VERSION 1
+
+/* seconds between two saves of a changed cache */
+#define POSTGRESQL_CACHE_SAVE_INTERVAL 30
+
+typedef struct postgresql_cache_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t checksum;  /* of everything after the header */
+    uint64_t n_entries;
+    uint64_t length;    /* bytes after the header */
+} postgresql_cache_file_header_t;
+
+/* followed by the key without its pool, then the strings of the result, 8 bytes aligned */
+typedef struct postgresql_cache_file_entry {
+    uint64_t fresh_until; /* wall clock, in microseconds */
+    uint64_t stale_until;
+    uint32_t pool;        /* identity of the primary of the pool */
+    uint32_t key_length;
+    uint32_t n_fields;
+    uint32_t n_rows;
+    uint64_t data_length;
+} postgresql_cache_file_entry_t;
+
+/* a copy of the file built by the worker, written by a thread of its own */
+typedef struct postgresql_cache_save {
+    char *tmp;
+    char *buffer;
+    size_t length;
+} postgresql_cache_save_t;
+
+/* a cached result, stored with its key in a single immutable block */
+typedef struct postgresql_cache_entry {
+    uint32_t hash;
+    size_t key_length;
+    char *key;
+    size_t size;            /* bytes accounted for the entry */
+    uint64_t fresh_until;   /* served as is until then */
+    uint64_t stale_until;   /* served while it is refreshed until then */
+    int refreshing;
+    int refs;               /* deliveries in progress */
+    int linked;
+
+    /* notification invalidating the entry, channel is NULL if untagged */
+    const void *scope;
+    char *channel;
+    char *tag;
+    uint32_t tag_hash;
+
+    int n_fields;
+    int n_rows;
+    char **fields;
+    char **values;          /* n_fields values per row */
+
+    struct mk_list _hash_head;
+    struct mk_list _lru_head;
+    struct mk_list _tag_head;
+} postgresql_cache_entry_t;
+
+/* result of a query being collected into the cache */
+typedef struct postgresql_cache_fill {
+    uint32_t hash;
+    size_t key_length;
+    char *key;
+    int ttl;
+    int stale;
+    const void *scope;
+    char *channel;
+    char *tag;
+    unsigned long epoch; /* invalidations seen when the query was sent */
+
+    int n_fields;
+    int n_rows;
+    char *data;   /* field names then values, NUL terminated */
+    size_t length;
+    size_t size;
+    int overflow; /* too large to be cached */
+
+    postgresql_query_result_cb *result_cb;
+    postgresql_query_row_cb *row_cb;
+    postgresql_query_end_cb *end_cb;
+    void *privdata;
+} postgresql_cache_fill_t;
+
+/* cached result to be served to the callbacks of a query, on the next pass of the event loop */
+typedef struct postgresql_cache_hit {
+    postgresql_cache_entry_t *entry;
+    postgresql_query_t *query;
+
+    struct mk_list _head;
+} postgresql_cache_hit_t;
+
+/* results cached by a worker */
+typedef struct postgresql_cache {
+    size_t bytes;
+    unsigned long epoch; /* bumped by every invalidation */
+    unsigned long changes;
+    unsigned long saved_changes;
+    time_t save_at;
+    int writer;          /* saves its results to the cache file */
+    int efd;             /* readable while hits wait to be served */
+    int scheduled;
+    struct mk_list hits;
+    postgresql_cache_stats_t stats;
+    struct mk_list lru; /* most recently used first */
+    struct mk_list buckets[POSTGRESQL_CACHE_BUCKETS];
+    struct mk_list tags[POSTGRESQL_CACHE_BUCKETS];
+} postgresql_cache_t;
+
+duda_global_t postgresql_cache_key;
+
+int postgresql_cache_lookup(postgresql_conn_t *conn, postgresql_query_t *query, int *stale);
+
+void postgresql_cache_done(postgresql_query_t *query);
+
+void postgresql_cache_invalidate(const void *scope, const char *channel, const char *tag);
+
+int postgresql_cache_set_size(size_t max_bytes);
+
+int postgresql_cache_set_file(const char *path);
+
+void postgresql_cache_tick();
+
+void postgresql_cache_get_stats(postgresql_cache_stats_t *stats);
+
+#endif
@@ -0,0 +1,191 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <libpq-fe.h>
+#include "common.h"
+#include "query_priv.h"
+#include "connection_priv.h"
+#include "pool.h"
+#include "util.h"
+#include "coalesce_priv.h"
+
+static void __postgresql_coalesce_result(void *privdata, postgresql_query_t *query,
+                                         int n_fields, char **fields, duda_request_t *dr)
+{
+    struct mk_list *head;
+    postgresql_query_t *member;
+    postgresql_flight_t *flight = privdata;
+
+    flight->started = 1;
+    mk_list_foreach(head, &flight->members) {
+        member = mk_list_entry(head, postgresql_query_t, _head);
+        if (!member->abort && member->result_cb) {
+            member->result_cb(member->privdata, member, n_fields, fields, member->dr);
+        }
+    }
+}
+
+static void __postgresql_coalesce_row(void *privdata, postgresql_query_t *query,
+                                      int n_fields, char **fields, char **values,
+                                      duda_request_t *dr)
+{
+    struct mk_list *head;
+    postgresql_query_t *member;
+    postgresql_flight_t *flight = privdata;
+
+    flight->started = 1;
+    mk_list_foreach(head, &flight->members) {
+        member = mk_list_entry(head, postgresql_query_t, _head);
+        if (!member->abort && member->row_cb) {
+            member->row_cb(member->privdata, member, n_fields, fields, values, member->dr);
+        }
+    }
+}
+
+static void __postgresql_coalesce_end(void *privdata, postgresql_query_t *query,
+                                      duda_request_t *dr)
+{
+    struct mk_list *head;
+    postgresql_query_t *member;
+    postgresql_flight_t *flight = privdata;
+
+    flight->started = 1;
+    mk_list_foreach(head, &flight->members) {
+        member = mk_list_entry(head, postgresql_query_t, _head);
+        member->status  = query->status;
+        member->sent_at = query->sent_at;
+        if (!member->abort && member->end_cb) {
+            member->end_cb(member->privdata, member, member->dr);
+        }
+    }
+}
+
+/*
+ * Join a query to an identical one in flight on the same endpoint, its
+ * callbacks get the same results. Return POSTGRESQL_OK if it joined, the
+ * query must not be sent then. Otherwise the query is sent and later
+ * identical queries may join it.
+ */
+int postgresql_coalesce_attach(postgresql_pool_endpoint_t *ep, postgresql_query_t *query)
+{
+    int i;
+    size_t length;
+    uint32_t hash;
+    char *key;
+    struct mk_list *head, *bucket;
+    postgresql_pool_t *pool = ep->pool;
+    postgresql_flight_t *flight;
+    postgresql_query_t *member;
+
+    if (!pool->flights) {
+        pool->flights = monkey->mem_alloc(sizeof(struct mk_list) * POSTGRESQL_COALESCE_BUCKETS);
+        if (!pool->flights) {
+            return POSTGRESQL_ERR;
+        }
+        for (i = 0; i < POSTGRESQL_COALESCE_BUCKETS; ++i) {
+            mk_list_init(&pool->flights[i]);
+        }
+    }
+
+    key = postgresql_query_key(query, &ep->index, sizeof(ep->index), &length);
+    if (!key) {
+        return POSTGRESQL_ERR;
+    }
+    hash = postgresql_util_hash(key, length);
+    bucket = &pool->flights[hash % POSTGRESQL_COALESCE_BUCKETS];
+
+    mk_list_foreach(head, bucket) {
+        flight = mk_list_entry(head, postgresql_flight_t, _head);
+        if (flight->hash != hash || flight->key_length != length ||
+            memcmp(flight->key, key, length) != 0) {
+            continue;
+        }
+
+        if (flight->started) {
+            /* rows went out already, the next identical queries get a flight of their own */
+            mk_list_del(&flight->_head);
+            flight->linked = 0;
+            break;
+        }
+
+        FREE(key);
+        mk_list_add(&query->_head, &flight->members);
+        ep->coalesced++;
+        return POSTGRESQL_OK;
+    }
+
+    flight = monkey->mem_alloc(sizeof(postgresql_flight_t));
+    member = postgresql_query_init();
+    if (!flight || !member) {
+        FREE(flight);
+        FREE(member);
+        FREE(key);
+        return POSTGRESQL_ERR;
+    }
+
+    /* the callbacks of the query sent move to a member of its own */
+    member->result_cb = query->result_cb;
+    member->row_cb    = query->row_cb;
+    member->end_cb    = query->end_cb;
+    member->privdata  = query->privdata;
+    member->dr        = query->dr;
+    member->flags     = query->flags;
+    member->priority  = query->priority;
+    member->queued_at = query->queued_at;
+
+    flight->hash       = hash;
+    flight->key        = key;
+    flight->key_length = length;
+    flight->started    = 0;
+    flight->linked     = 1;
+    flight->query      = query;
+    mk_list_init(&flight->members);
+    mk_list_add(&member->_head, &flight->members);
+    mk_list_add(&flight->_head, bucket);
+
+    query->result_cb = __postgresql_coalesce_result;
+    query->row_cb    = __postgresql_coalesce_row;
+    query->end_cb    = __postgresql_coalesce_end;
+    query->privdata  = flight;
+    query->flight    = flight;
+    return POSTGRESQL_ERR;
+}
+
+/* Called when the query sent for a flight is freed. */
+void postgresql_coalesce_done(postgresql_query_t *query)
+{
+    postgresql_query_t *member;
+    postgresql_flight_t *flight = query->flight;
+
+    query->flight = NULL;
+    if (flight->linked) {
+        mk_list_del(&flight->_head);
+    }
+
+    while (mk_list_is_empty(&flight->members) != 0) {
+        member = mk_list_entry_first(&flight->members, postgresql_query_t, _head);
+        postgresql_query_free(member);
+    }
+    FREE(flight->key);
+    FREE(flight);
+}
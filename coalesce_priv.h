@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_COALESCE_PRIV_H
+#define POSTGRESQL_COALESCE_PRIV_H
+
+#include <stdint.h>
+
+/* buckets of the table of queries in flight of a pool */
+#define POSTGRESQL_COALESCE_BUCKETS 64
+
+/* one execution shared by identical queries */
+typedef struct postgresql_flight {
+    uint32_t hash;
+    size_t key_length;
+    char *key;    /* endpoint, statement and parameters */
+    int started;  /* results are being delivered, late queries can't join anymore */
+    int linked;   /* still found by new queries */
+
+    postgresql_query_t *query; /* the query sent to the server */
+    struct mk_list members;    /* queries whose callbacks get the results */
+
+    struct mk_list _head;
+} postgresql_flight_t;
+
+int postgresql_coalesce_attach(postgresql_pool_endpoint_t *ep, postgresql_query_t *query);
+
+void postgresql_coalesce_done(postgresql_query_t *query);
+
+#endif
@@ -23,5 +23,18 @@
 
 #define POSTGRESQL_OK 0
 #define POSTGRESQL_ERR -1
+#define POSTGRESQL_CONN_LOST -2
+#define POSTGRESQL_OVERLOADED -4 /* low priority work rejected by admission control */
+
+/* how long a pooled connection stays bound to a handle */
+#define POSTGRESQL_POOL_SESSION     0 /* from get_conn until disconnect */
+#define POSTGRESQL_POOL_TRANSACTION 1 /* for a transaction or a single statement */
+#define POSTGRESQL_POOL_STATEMENT   2 /* as transaction, reads share pipelined connections */
+
+/* workload classes, every class has its own share of the connections of a pool */
+#define POSTGRESQL_CLASS_INTERACTIVE 0
+#define POSTGRESQL_CLASS_BATCH       1
+#define POSTGRESQL_CLASS_ANALYTICAL  2
+#define POSTGRESQL_CLASSES           3
 
 #define FREE(p) if (p) { monkey->mem_free(p); p = NULL; }
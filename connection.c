@@ -19,15 +19,19 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <stdio.h>
+#include <string.h>
 #include <libpq-fe.h>
 #include "postgresql.h"
 #include "query_priv.h"
 #include "connection_priv.h"
 #include "async.h"
 #include "pool.h"
+#include "util.h"
+#include "coalesce_priv.h"
+#include "cache_priv.h"
 
-static inline postgresql_conn_t *__postgresql_conn_create(duda_request_t *dr,
-                                                          postgresql_connect_cb *cb)
+postgresql_conn_t *postgresql_conn_create(duda_request_t *dr, postgresql_connect_cb *cb)
 {
     postgresql_conn_t *conn = monkey->mem_alloc(sizeof(postgresql_conn_t));
     if (!conn) {
@@ -43,32 +47,51 @@ static inline postgresql_conn_t *__postgresql_conn_create(duda_request_t *dr,
     conn->state                = CONN_STATE_CLOSED;
     conn->disconnect_on_finish = 0;
     conn->is_pooled            = 0;
+    conn->is_busy              = 0;
     conn->pool                 = NULL;
+    conn->endpoint             = NULL;
+    conn->budget               = NULL;
+    conn->read_only            = 0;
+    conn->workload             = -1;
+    conn->query_flags          = 0;
+    conn->query_priority       = POSTGRESQL_PRIORITY_NORMAL;
+    conn->query_ttl            = 0;
+    conn->query_stale          = 0;
+    conn->query_channel        = NULL;
+    conn->query_tag            = NULL;
+    conn->in_transaction       = 0;
+    conn->lsn_deferred         = 0;
+    conn->lsn                  = 0;
+    conn->min_lsn              = 0;
+    conn->is_virtual           = 0;
+    conn->is_waiting           = 0;
+    conn->backend              = NULL;
+    conn->client               = NULL;
+    conn->checkout_at          = 0;
+    conn->shared               = 0;
+    conn->pipeline             = NULL;
+    conn->pipelined            = 0;
+    conn->listener             = NULL;
     mk_list_init(&conn->queries);
 
     return conn;
 }
 
-static inline void __postgresql_conn_handle_connect(postgresql_conn_t *conn)
+static inline int __postgresql_conn_start(postgresql_conn_t *conn)
 {
-    if (!conn->conn) {
-        FREE(conn);
-        return;
-    }
-
     if (PQstatus(conn->conn) == CONNECTION_BAD) {
         msg->err("PostgreSQL Connect Error: %s", PQerrorMessage(conn->conn));
         if (conn->connect_cb) {
             conn->connect_cb(conn, POSTGRESQL_ERR, conn->dr);
         }
-        goto cleanup;
+        return POSTGRESQL_ERR;
     }
 
     /* set soecket non-blocking mode */
     int ret = PQsetnonblocking(conn->conn, 1);
     if (ret == -1) {
         msg->err("PostgreSQL Set Non-blocking Error");
-        goto cleanup;
+        return POSTGRESQL_ERR;
     }
 
     conn->fd = PQsocket(conn->conn);
@@ -81,7 +104,7 @@ static inline void __postgresql_conn_handle_connect(postgresql_conn_t *conn)
         if (conn->connect_cb) {
             conn->connect_cb(conn, POSTGRESQL_ERR, conn->dr);
         }
-        goto cleanup;
+        return POSTGRESQL_ERR;
     } else if (status == PGRES_POLLING_OK) {
         /* on connected */
         if (conn->connect_cb) {
@@ -101,6 +124,19 @@ static inline void __postgresql_conn_handle_connect(postgresql_conn_t *conn)
     event->add(conn->fd, events, DUDA_EVENT_LEVEL_TRIGGERED,
                postgresql_on_read, postgresql_on_write, postgresql_on_error,
                postgresql_on_close, postgresql_on_timeout, NULL);
+    return POSTGRESQL_OK;
+}
+
+static inline int __postgresql_conn_handle_connect(postgresql_conn_t *conn)
+{
+    if (!conn->conn) {
+        FREE(conn);
+        return POSTGRESQL_ERR;
+    }
+
+    if (__postgresql_conn_start(conn) != POSTGRESQL_OK) {
+        goto cleanup;
+    }
 
     struct mk_list *conn_list = global->get(postgresql_conn_list);
     if (!conn_list) {
@@ -118,11 +154,298 @@ static inline void __postgresql_conn_handle_connect(postgresql_conn_t *conn)
         postgresql_async_handle_query(conn);
     }
 
-    return;
+    return POSTGRESQL_OK;
 
 cleanup:
     PQfinish(conn->conn);
     FREE(conn);
+    return POSTGRESQL_ERR;
+}
+
+/*
+ * Replace the broken libpq connection of a pooled connection handle with a
+ * fresh one from the same pool, the handle and its pending queries are kept.
+ */
+static inline int __postgresql_conn_restart(postgresql_conn_t *conn)
+{
+    event->delete(conn->fd);
+    PQfinish(conn->conn);
+
+    conn->connect_cb     = NULL;
+    conn->current_query  = NULL;
+    conn->in_transaction = 0;
+    conn->lsn_deferred   = 0;
+    conn->state          = CONN_STATE_CLOSED;
+    conn->conn           = postgresql_pool_conn_start(conn);
+    if (!conn->conn) {
+        return POSTGRESQL_ERR;
+    }
+
+    if (__postgresql_conn_start(conn) != POSTGRESQL_OK) {
+        PQfinish(conn->conn);
+        conn->conn = NULL;
+        return POSTGRESQL_ERR;
+    }
+
+    if (conn->state == CONN_STATE_CONNECTED) {
+        postgresql_async_handle_query(conn);
+    }
+    return POSTGRESQL_OK;
+}
+
+static inline int __postgresql_conn_query_replayable(postgresql_conn_t *conn,
+                                                     postgresql_query_t *query)
+{
+    if (!conn->pool || conn->in_transaction) {
+        return 0;
+    }
+
+    /* rows have been delivered or the statement only lives in the old session */
+    if (query->result_start || query->type == QUERY_TYPE_PREPARED) {
+        return 0;
+    }
+
+    if (query->retries >= POSTGRESQL_QUERY_MAX_RETRIES) {
+        return 0;
+    }
+
+    return query->is_read || (query->flags & POSTGRESQL_QUERY_IDEMPOTENT);
+}
+
+static inline void __postgresql_conn_add_query(postgresql_conn_t *conn,
+                                               postgresql_query_t *query)
+{
+    uint64_t now;
+    struct mk_list *head, *pos = &conn->queries;
+    postgresql_query_t *other;
+
+    if (conn->endpoint && !query->endpoint) {
+        query->endpoint = conn->endpoint;
+        query->endpoint->outstanding++;
+    }
+
+    /*
+     * A query passes the less urgent queries other handles queued on a shared
+     * backend. Queries of the same owner keep their order, and aging lets old
+     * queries through before newer urgent ones.
+     */
+    now = postgresql_util_now();
+    for (head = conn->queries.prev; head != &conn->queries; head = head->prev) {
+        other = mk_list_entry(head, postgresql_query_t, _head);
+        if (other->handle == query->handle ||
+            (head == conn->queries.next && conn->state >= CONN_STATE_QUERYING) ||
+            postgresql_query_priority(other, now) <= query->priority) {
+            break;
+        }
+        pos = head;
+    }
+    mk_list_add(&query->_head, pos);
+}
+
+static inline postgresql_query_t *__postgresql_conn_lsn_query(postgresql_conn_t *conn)
+{
+    postgresql_query_t *lsn_query = postgresql_query_init();
+    if (!lsn_query) {
+        msg->err("[FD %i] PostgreSQL Add Query Error", conn->fd);
+        return NULL;
+    }
+    lsn_query->query_str = monkey->str_dup(POSTGRESQL_LSN_QUERY);
+    lsn_query->type      = QUERY_TYPE_QUERY;
+    lsn_query->flags     = POSTGRESQL_QUERY_TRACK_LSN;
+    lsn_query->is_read   = 1;
+    lsn_query->queued_at = postgresql_util_now();
+    return lsn_query;
+}
+
+/*
+ * Fetch the WAL position with a query of its own after a tracked write. It
+ * must run once the write is committed, so it is held back while the write
+ * leaves a transaction open, see postgresql_async_handle_query().
+ */
+static inline void __postgresql_conn_track_lsn(postgresql_conn_t *conn,
+                                               postgresql_query_t *query)
+{
+    postgresql_query_t *lsn_query = __postgresql_conn_lsn_query(conn);
+    if (!lsn_query) {
+        return;
+    }
+    lsn_query->dr        = query->dr;
+    lsn_query->queued_at = query->queued_at;
+    lsn_query->priority  = query->priority;
+    __postgresql_conn_add_query(conn, lsn_query);
+}
+
+/* Tell the WAL position queries added by the package from the queries of the user. */
+int postgresql_conn_is_lsn_query(postgresql_query_t *query)
+{
+    return (query->flags & POSTGRESQL_QUERY_TRACK_LSN) && !query->end_cb &&
+           query->type == QUERY_TYPE_QUERY &&
+           strcmp(query->query_str, POSTGRESQL_LSN_QUERY) == 0;
+}
+
+/* Fetch the WAL position held back by a transaction, before any other query of the connection. */
+void postgresql_conn_capture_lsn(postgresql_conn_t *conn)
+{
+    postgresql_query_t *lsn_query;
+
+    conn->lsn_deferred = 0;
+    lsn_query = __postgresql_conn_lsn_query(conn);
+    if (!lsn_query) {
+        return;
+    }
+    lsn_query->dr = conn->dr;
+    mk_list_add(&lsn_query->_head, conn->queries.next);
+}
+
+/* Add a query to the queue of a connection, without sending it yet. */
+void postgresql_conn_push_query(postgresql_conn_t *conn, postgresql_query_t *query)
+{
+    __postgresql_conn_add_query(conn, query);
+
+    if (query->flags & POSTGRESQL_QUERY_TRACK_LSN) {
+        __postgresql_conn_track_lsn(conn, query);
+    }
+}
+
+/*
+ * Start processing the queue of an idle connection. Queries queued on a busy
+ * pooled connection may be taken over by an idle one of the same pool.
+ */
+void postgresql_conn_kick(postgresql_conn_t *conn)
+{
+    /* a coalesced read of the connection runs elsewhere, the queue waits for it */
+    if (conn->pipelined > 0) {
+        return;
+    }
+
+    if (conn->state == CONN_STATE_CONNECTED) {
+        event->mode(conn->fd, DUDA_EVENT_WAKEUP, DUDA_EVENT_LEVEL_TRIGGERED);
+        postgresql_async_handle_query(conn);
+    } else if (conn->endpoint) {
+        postgresql_pool_rebalance(conn->endpoint);
+    }
+}
+
+static inline int __postgresql_conn_dispatch(postgresql_conn_t *conn,
+                                             postgresql_query_t *query)
+{
+    /* an overloaded server gets no new low priority work, the caller is told right away */
+    if (conn->endpoint && !postgresql_pool_admit(conn->endpoint, query->priority)) {
+        mk_list_init(&query->_head);
+        postgresql_query_free(query);
+        return POSTGRESQL_OVERLOADED;
+    }
+
+    /*
+     * An identical read in flight delivers its results to this query as well,
+     * only for autocommit reads which would run next on an idle handle. The
+     * handle counts the query as pipelined, so it holds its next queries and
+     * its disconnection until the query is over; overflow connections are
+     * left out as they are freed once closed.
+     */
+    if ((query->flags & POSTGRESQL_QUERY_COALESCE) && conn->endpoint && !query->flight &&
+        (conn->is_virtual || conn->is_pooled) &&
+        !(query->flags & POSTGRESQL_QUERY_TRACK_LSN) && query->is_read &&
+        !conn->backend && !conn->in_transaction && conn->pipelined == 0 &&
+        mk_list_is_empty(&conn->queries) == 0 &&
+        postgresql_coalesce_attach(conn->endpoint, query) == POSTGRESQL_OK) {
+        query->handle = conn;
+        conn->pipelined++;
+        return POSTGRESQL_OK;
+    }
+
+    /* a handle without backend keeps its queries until the pool binds one */
+    if (conn->is_virtual && !conn->backend) {
+        if (postgresql_pool_pipeline(conn, query) == POSTGRESQL_OK) {
+            return POSTGRESQL_OK;
+        }
+        postgresql_conn_push_query(conn, query);
+        postgresql_pool_acquire(conn);
+        return POSTGRESQL_OK;
+    }
+
+    /* reads stolen from the backend are still running, later queries wait for them */
+    if (conn->backend && conn->pipelined > 0) {
+        postgresql_conn_push_query(conn, query);
+        return POSTGRESQL_OK;
+    }
+
+    if (conn->backend) {
+        conn = conn->backend;
+    }
+    postgresql_conn_push_query(conn, query);
+    postgresql_conn_kick(conn);
+    return POSTGRESQL_OK;
+}
+
+static inline int __postgresql_conn_enqueue(postgresql_conn_t *conn,
+                                            postgresql_query_t *query)
+{
+    int ret, stale = 0;
+
+    query->flags   = conn->query_flags;
+    query->priority = conn->query_priority;
+    query->is_read = query->type != QUERY_TYPE_PREPARED &&
+                     postgresql_query_is_read(query->query_str);
+    query->dr      = conn->dr;
+    query->queued_at  = postgresql_util_now();
+    query->cache_ttl   = conn->query_ttl;
+    query->cache_stale = conn->query_stale;
+    query->cache_channel = conn->query_channel;
+    query->cache_tag     = conn->query_tag;
+    conn->query_flags = 0;
+    conn->query_priority = POSTGRESQL_PRIORITY_NORMAL;
+    conn->query_ttl   = 0;
+    conn->query_stale = 0;
+    conn->query_channel = NULL;
+    conn->query_tag     = NULL;
+
+    /* a cached result is served without a connection */
+    if (query->cache_ttl > 0 && postgresql_cache_lookup(conn, query, &stale) == POSTGRESQL_OK) {
+        return POSTGRESQL_OK;
+    }
+
+    /* a stale result is served to the caller whatever happens to the query refreshing it */
+    ret = __postgresql_conn_dispatch(conn, query);
+    return stale ? POSTGRESQL_OK : ret;
+}
+
+/*
+ * Enqueue a query built by the caller, who keeps a reference on it until its
+ * end callback runs. On failure the query is freed already.
+ */
+int postgresql_conn_enqueue(postgresql_conn_t *conn, postgresql_query_t *query)
+{
+    return __postgresql_conn_enqueue(conn, query);
+}
+
+/*
+ * Get the libpq connection behind a handle, a handle without backend borrows
+ * one of its pool. The connections of a pool with database threads belong to
+ * those threads, so there is none to use from a worker.
+ */
+PGconn *postgresql_conn_pgconn(postgresql_conn_t *conn)
+{
+    postgresql_conn_t *other;
+
+    if (conn->conn) {
+        return conn->conn;
+    }
+    if (conn->endpoint && conn->endpoint->pool->config->io_threads > 0) {
+        return NULL;
+    }
+    if (conn->backend) {
+        return conn->backend->conn;
+    }
+    if (conn->endpoint && mk_list_is_empty(&conn->endpoint->free_conns) != 0) {
+        other = mk_list_entry_first(&conn->endpoint->free_conns, postgresql_conn_t, _pool_head);
+        return other->conn;
+    }
+    if (conn->endpoint && mk_list_is_empty(&conn->endpoint->busy_conns) != 0) {
+        other = mk_list_entry_first(&conn->endpoint->busy_conns, postgresql_conn_t, _pool_head);
+        return other->conn;
+    }
+    return NULL;
 }
 
 /*
@@ -141,14 +464,16 @@ postgresql_conn_t *postgresql_conn_connect(duda_request_t *dr, postgresql_connec
                                            const char * const *keys,
                                            const char * const *values, int expand_dbname)
 {
-    postgresql_conn_t *conn = __postgresql_conn_create(dr, cb);
+    postgresql_conn_t *conn = postgresql_conn_create(dr, cb);
     if (!conn) {
         return NULL;
     }
 
     conn->conn = PQconnectStartParams(keys, values, expand_dbname);
 
-    __postgresql_conn_handle_connect(conn);
+    if (__postgresql_conn_handle_connect(conn) != POSTGRESQL_OK) {
+        return NULL;
+    }
 
     return conn;
 }
@@ -166,18 +491,41 @@ postgresql_conn_t *postgresql_conn_connect(duda_request_t *dr, postgresql_connec
 postgresql_conn_t *postgresql_conn_connect_uri(duda_request_t *dr, postgresql_connect_cb *cb,
                                                const char *uri)
 {
-    postgresql_conn_t *conn = __postgresql_conn_create(dr, cb);
+    postgresql_conn_t *conn = postgresql_conn_create(dr, cb);
     if (!conn) {
         return NULL;
     }
 
     conn->conn = PQconnectStart(uri);
 
-    __postgresql_conn_handle_connect(conn);
+    if (__postgresql_conn_handle_connect(conn) != POSTGRESQL_OK) {
+        return NULL;
+    }
 
     return conn;
 }
 
+/* Copy the value of a parameter, binary ones may hold NUL bytes. */
+static inline char *__postgresql_conn_param_dup(const char *value, int i, const int *lengths,
+                                                const int *formats)
+{
+    char *copy;
+
+    if (!value) {
+        return NULL;
+    }
+    if (!lengths || !formats || formats[i] == 0) {
+        return monkey->str_dup(value);
+    }
+
+    copy = monkey->mem_alloc(lengths[i] + 1);
+    if (copy) {
+        memcpy(copy, value, lengths[i]);
+        copy[lengths[i]] = '\0';
+    }
+    return copy;
+}
+
 /*
  * @METHOD_NAME: query
  * @METHOD_DESC: Enqueue a new query to a PostgreSQL connection.
@@ -188,7 +536,7 @@ postgresql_conn_t *postgresql_conn_connect_uri(duda_request_t *dr, postgresql_co
  * @METHOD_PARAM: row_cb The callback function that will take actions when every row of the result set is fetched.
  * @METHOD_PARAM: end_cb The callback function that will take actions after all the row in the result set are fetched.
  * @METHOD_PARAM: privdata The user defined private data that will be passed to callback.
- * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, POSTGRESQL_OVERLOADED if admission control rejected the query, or POSTGRESQL_ERR on failure.
  */
 
 int postgresql_conn_send_query(postgresql_conn_t *conn, const char *query_str,
@@ -201,7 +549,6 @@ int postgresql_conn_send_query(postgresql_conn_t *conn, const char *query_str,
         msg->err("[FD %i] PostgreSQL Add Query Error", conn->fd);
         return POSTGRESQL_ERR;
     }
-    mk_list_add(&query->_head, &conn->queries);
 
     query->query_str = monkey->str_dup(query_str);
     query->result_cb = result_cb;
@@ -210,11 +557,7 @@ int postgresql_conn_send_query(postgresql_conn_t *conn, const char *query_str,
     query->privdata  = privdata;
     query->type      = QUERY_TYPE_QUERY;
 
-    if (conn->state == CONN_STATE_CONNECTED) {
-        event->mode(conn->fd, DUDA_EVENT_WAKEUP, DUDA_EVENT_LEVEL_TRIGGERED);
-        postgresql_async_handle_query(conn);
-    }
-    return POSTGRESQL_OK;
+    return __postgresql_conn_enqueue(conn, query);
 }
 
 /*
@@ -232,7 +575,7 @@ int postgresql_conn_send_query(postgresql_conn_t *conn, const char *query_str,
  * @METHOD_PARAM: row_cb The callback function that will take actions when every row of the result set is fetched.
  * @METHOD_PARAM: end_cb The callback function that will take actions after all the row in the result set are fetched.
  * @METHOD_PARAM: privdata The user defined private data that will be passed to callback.
- * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, POSTGRESQL_OVERLOADED if admission control rejected the query, or POSTGRESQL_ERR on failure.
  */
 
 int postgresql_conn_send_query_params(postgresql_conn_t *conn, const char *query_str,
@@ -247,7 +590,6 @@ int postgresql_conn_send_query_params(postgresql_conn_t *conn, const char *query
         msg->err("[FD %i] PostgreSQL Add Query Error", conn->fd);
         return POSTGRESQL_ERR;
     }
-    mk_list_add(&query->_head, &conn->queries);
 
     int i;
     query->query_str = monkey->str_dup(query_str);
@@ -256,7 +598,9 @@ int postgresql_conn_send_query_params(postgresql_conn_t *conn, const char *query
     if (params_values) {
         query->params_values = monkey->mem_alloc(sizeof(char *) * n_params);
         for (i = 0; i < n_params; ++i) {
-            query->params_values[i] = monkey->str_dup(params_values[i]);
+            query->params_values[i] = __postgresql_conn_param_dup(params_values[i], i,
+                                                                  params_lengths,
+                                                                  params_formats);
         }
     }
 
@@ -281,11 +625,7 @@ int postgresql_conn_send_query_params(postgresql_conn_t *conn, const char *query
     query->privdata      = privdata;
     query->type          = QUERY_TYPE_PARAMS;
 
-    if (conn->state == CONN_STATE_CONNECTED) {
-        event->mode(conn->fd, DUDA_EVENT_WAKEUP, DUDA_EVENT_LEVEL_TRIGGERED);
-        postgresql_async_handle_query(conn);
-    }
-    return POSTGRESQL_OK;
+    return __postgresql_conn_enqueue(conn, query);
 }
 
 /*
@@ -303,7 +643,7 @@ int postgresql_conn_send_query_params(postgresql_conn_t *conn, const char *query
  * @METHOD_PARAM: row_cb The callback function that will take actions when every row of the result set is fetched.
  * @METHOD_PARAM: end_cb The callback function that will take actions after all the row in the result set are fetched.
  * @METHOD_PARAM: privdata The user defined private data that will be passed to callback.
- * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, POSTGRESQL_OVERLOADED if admission control rejected the query, or POSTGRESQL_ERR on failure.
  */
 
 int postgresql_conn_send_query_prepared(postgresql_conn_t *conn, const char *stmt_name,
@@ -318,7 +658,6 @@ int postgresql_conn_send_query_prepared(postgresql_conn_t *conn, const char *stm
         msg->err("[FD %i] PostgreSQL Add Query Error", conn->fd);
         return POSTGRESQL_ERR;
     }
-    mk_list_add(&query->_head, &conn->queries);
 
     int i;
     query->stmt_name = monkey->str_dup(stmt_name);
@@ -327,7 +666,9 @@ int postgresql_conn_send_query_prepared(postgresql_conn_t *conn, const char *stm
     if (params_values) {
         query->params_values = monkey->mem_alloc(sizeof(char *) * n_params);
         for (i = 0; i < n_params; ++i) {
-            query->params_values[i] = monkey->str_dup(params_values[i]);
+            query->params_values[i] = __postgresql_conn_param_dup(params_values[i], i,
+                                                                  params_lengths,
+                                                                  params_formats);
         }
     }
 
@@ -352,11 +693,7 @@ int postgresql_conn_send_query_prepared(postgresql_conn_t *conn, const char *stm
     query->privdata      = privdata;
     query->type          = QUERY_TYPE_PREPARED;
 
-    if (conn->state == CONN_STATE_CONNECTED) {
-        event->mode(conn->fd, DUDA_EVENT_WAKEUP, DUDA_EVENT_LEVEL_TRIGGERED);
-        postgresql_async_handle_query(conn);
-    }
-    return POSTGRESQL_OK;
+    return __postgresql_conn_enqueue(conn, query);
 }
 
 void postgresql_conn_handle_release(postgresql_conn_t *conn, int status)
@@ -372,6 +709,15 @@ void postgresql_conn_handle_release(postgresql_conn_t *conn, int status)
     if (conn->is_pooled) {
         postgresql_pool_reclaim_conn(conn);
     } else {
+        if (conn->client) {
+            postgresql_pool_backend_lost(conn);
+        }
+        if (conn->pool) {
+            postgresql_pool_remove_conn(conn);
+        }
+        if (conn->budget) {
+            postgresql_pool_budget_release(conn);
+        }
         conn->state = CONN_STATE_CLOSED;
         mk_list_del(&conn->_head);
         PQfinish(conn->conn);
@@ -380,10 +726,124 @@ void postgresql_conn_handle_release(postgresql_conn_t *conn, int status)
                                                             postgresql_query_t, _head);
             postgresql_query_free(query);
         }
+        FREE(conn->query_channel);
+        FREE(conn->query_tag);
         FREE(conn);
     }
 }
 
+/*
+ * Called when the connection to the server is broken. Pending queries that are
+ * safe to be sent again (reads, or queries tagged idempotent) are replayed on
+ * a fresh connection from the same pool, the rest of them are finished with
+ * status POSTGRESQL_CONN_LOST through their end callbacks.
+ */
+int postgresql_conn_handle_lost(postgresql_conn_t *conn)
+{
+    struct mk_list *head, *tmp;
+    postgresql_query_t *query;
+    int replay = 0;
+
+    msg->warn("[FD %i] PostgreSQL Connection Lost", conn->fd);
+    if (conn->pool) {
+        postgresql_pool_endpoint_failed(conn);
+    }
+
+    mk_list_foreach_safe(head, tmp, &conn->queries) {
+        query = mk_list_entry(head, postgresql_query_t, _head);
+        if (__postgresql_conn_query_replayable(conn, query)) {
+            query->retries++;
+            replay = 1;
+        } else {
+            postgresql_async_fail_query(conn, query, POSTGRESQL_CONN_LOST);
+        }
+    }
+    conn->current_query = NULL;
+
+    if (replay && __postgresql_conn_restart(conn) == POSTGRESQL_OK) {
+        msg->info("[FD %i] PostgreSQL Connection Restarted, Replaying Queries", conn->fd);
+        return POSTGRESQL_OK;
+    }
+
+    while (mk_list_is_empty(&conn->queries) != 0) {
+        query = mk_list_entry_first(&conn->queries, postgresql_query_t, _head);
+        postgresql_async_fail_query(conn, query, POSTGRESQL_CONN_LOST);
+    }
+    conn->is_pooled = 0;
+    postgresql_conn_handle_release(conn, POSTGRESQL_ERR);
+    return POSTGRESQL_ERR;
+}
+
+/*
+ * @METHOD_NAME: set_query_flags
+ * @METHOD_DESC: Set the flags of the next query enqueued to a PostgreSQL connection. Use POSTGRESQL_QUERY_IDEMPOTENT to tell the package that a query can be sent again safely if the connection is lost before its results arrive, single plain reads calling no function known to write are detected automatically. POSTGRESQL_QUERY_COALESCE lets a read share the execution of an identical query in flight on the same pool endpoint.
+ * @METHOD_PROTO: void set_query_flags(postgresql_conn_t *conn, int flags)
+ * @METHOD_PARAM: conn The PostgreSQL connection handle.
+ * @METHOD_PARAM: flags A bitwise OR of the POSTGRESQL_QUERY_* flags.
+ * @METHOD_RETURN: None.
+ */
+
+void postgresql_conn_set_query_flags(postgresql_conn_t *conn, int flags)
+{
+    conn->query_flags = flags;
+}
+
+/*
+ * @METHOD_NAME: set_query_priority
+ * @METHOD_DESC: Set the priority of the next query enqueued to a PostgreSQL connection. When a pool runs out of connections, the handles waiting for one are served by the priority of their next query; queries of different handles pipelined on a shared connection are ordered the same way. Queries of a single connection always run in the order they were enqueued. A query gains one level every 100 milliseconds it waits, so low priority work is delayed but never starved.
+ * @METHOD_PROTO: void set_query_priority(postgresql_conn_t *conn, int priority)
+ * @METHOD_PARAM: conn The PostgreSQL connection handle.
+ * @METHOD_PARAM: priority POSTGRESQL_PRIORITY_CRITICAL, POSTGRESQL_PRIORITY_NORMAL (the default), POSTGRESQL_PRIORITY_BACKGROUND or POSTGRESQL_PRIORITY_BATCH.
+ * @METHOD_RETURN: None.
+ */
+
+void postgresql_conn_set_query_priority(postgresql_conn_t *conn, int priority)
+{
+    if (priority < POSTGRESQL_PRIORITY_CRITICAL) {
+        priority = POSTGRESQL_PRIORITY_CRITICAL;
+    } else if (priority > POSTGRESQL_PRIORITY_BATCH) {
+        priority = POSTGRESQL_PRIORITY_BATCH;
+    }
+    conn->query_priority = priority;
+}
+
+/*
+ * @METHOD_NAME: set_query_cache
+ * @METHOD_DESC: Cache the result of the next query enqueued to a pooled PostgreSQL connection, in the result cache of the worker. An identical read (same pool, statement and parameters) enqueued on a handle with nothing queued while the result is fresh is served from the cache, through its callbacks on the next pass of the event loop, without using a connection. Once the result is stale, it is still served while one of those reads refreshes it in the background. Queries inside a transaction are never cached.
+ * @METHOD_PROTO: void set_query_cache(postgresql_conn_t *conn, int ttl, int stale)
+ * @METHOD_PARAM: conn The PostgreSQL connection handle.
+ * @METHOD_PARAM: ttl How long the result is fresh, in milliseconds.
+ * @METHOD_PARAM: stale How long a stale result may still be served while it is refreshed, in milliseconds, 0 to refresh it before serving it again.
+ * @METHOD_RETURN: None.
+ */
+
+void postgresql_conn_set_query_cache(postgresql_conn_t *conn, int ttl, int stale)
+{
+    conn->query_ttl   = ttl > 0 ? ttl : 0;
+    conn->query_stale = stale > 0 ? stale : 0;
+}
+
+/*
+ * @METHOD_NAME: set_query_tag
+ * @METHOD_DESC: Tag the result the next query enqueued to a PostgreSQL connection leaves in the result cache (see set_query_cache) with a notification channel and a key. The pool listens to the channel, and a notification on it whose payload is the key, or is empty, drops the result from the cache of every worker, so results can be cached for a long time and still be fresh. Until the server confirmed that the channel is listened to, tagged results are not cached.
+ * @METHOD_PROTO: void set_query_tag(postgresql_conn_t *conn, const char *channel, const char *key)
+ * @METHOD_PARAM: conn The PostgreSQL connection handle.
+ * @METHOD_PARAM: channel The name of the notification channel.
+ * @METHOD_PARAM: key The key invalidating the result, or NULL for any notification of the channel.
+ * @METHOD_RETURN: None.
+ */
+
+void postgresql_conn_set_query_tag(postgresql_conn_t *conn, const char *channel,
+                                   const char *key)
+{
+    FREE(conn->query_channel);
+    FREE(conn->query_tag);
+    if (channel) {
+        conn->query_channel = monkey->str_dup(channel);
+        conn->query_tag     = monkey->str_dup(key ? key : "");
+    }
+}
+
 /*
  * @METHOD_NAME: disconnect
  * @METHOD_DESC: Disconnect a previous opened connection and release all the resource with it. It will ensure that all previous enqueued queries of that connection are processed before it is disconnected.
@@ -395,8 +855,13 @@ void postgresql_conn_handle_release(postgresql_conn_t *conn, int status)
 
 void postgresql_conn_disconnect(postgresql_conn_t *conn, postgresql_disconnect_cb *cb)
 {
+    if (conn->is_virtual) {
+        postgresql_pool_handle_disconnect(conn, cb);
+        return;
+    }
+
     conn->disconnect_cb = cb;
-    if (conn->state != CONN_STATE_CONNECTED) {
+    if (conn->state != CONN_STATE_CONNECTED || conn->pipelined > 0) {
         conn->disconnect_on_finish = 1;
         return;
     }
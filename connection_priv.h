@@ -22,6 +22,7 @@
 #ifndef POSTGRESQL_CONNECTION_PRIV_H
 #define POSTGRESQL_CONNECTION_PRIV_H
 
+#include <stdint.h>
 #include "connection.h"
 
 typedef enum {
@@ -32,6 +33,9 @@ typedef enum {
 } postgresql_conn_state_t;
 
 struct postgresql_pool;
+struct postgresql_pool_config;
+struct postgresql_pool_endpoint;
+struct postgresql_listener;
 
 struct postgresql_conn {
     struct duda_request *dr;
@@ -45,13 +49,46 @@ struct postgresql_conn {
     postgresql_query_t *current_query;
     int disconnect_on_finish;
     int is_pooled;
+    int is_busy;
     struct postgresql_pool *pool;
+    struct postgresql_pool_endpoint *endpoint;
+    struct postgresql_pool_config *budget; /* pool whose backend budget this connection uses */
+    int read_only;
+    int workload; /* class of a handle, or of the handle a backend serves; -1 if none */
+
+    int query_flags;    /* flags applied to the next enqueued query */
+    int query_priority; /* priority of the next enqueued query */
+    int query_ttl;      /* result cache lifetimes of the next enqueued query, in milliseconds */
+    int query_stale;
+    char *query_channel; /* notification channel and key invalidating that result */
+    char *query_tag;
+    int in_transaction; /* transaction status after the last query */
+    uint64_t lsn;       /* WAL position after the last tracked write */
+    int lsn_deferred;   /* a tracked write waits for its transaction to end */
+    uint64_t min_lsn;   /* WAL position a read-only handle must see */
+
+    /* transaction pooling: a handle borrows a backend while it needs one */
+    int is_virtual;
+    int is_waiting;
+    struct postgresql_conn *backend; /* backend bound to a handle */
+    struct postgresql_conn *client;  /* handle a backend is bound to */
+    uint64_t checkout_at;            /* when it was checked out, bound or created */
+
+    /* statement pooling: reads of many handles share the pipeline of a backend */
+    int shared;
+    struct postgresql_conn *pipeline; /* shared backend running the reads of a handle */
+    int pipelined;                    /* reads of a handle queued on that backend */
+
+    struct postgresql_listener *listener; /* set on the connection receiving notifications */
+    struct mk_list _wait_head;
 
     struct mk_list queries;
     struct mk_list _head;
     struct mk_list _pool_head;
 };
 
+postgresql_conn_t *postgresql_conn_create(duda_request_t *dr, postgresql_connect_cb *cb);
+
 postgresql_conn_t *postgresql_conn_connect(duda_request_t *dr, postgresql_connect_cb *cb,
                                            const char * const *keys,
                                            const char * const *values, int expand_dbname);
@@ -78,8 +115,31 @@ int postgresql_conn_send_query_prepared(postgresql_conn_t *conn, const char *stm
                                          postgresql_query_row_cb *row_cb,
                                          postgresql_query_end_cb *end_cb, void *privdata);
 
+void postgresql_conn_push_query(postgresql_conn_t *conn, postgresql_query_t *query);
+
+int postgresql_conn_enqueue(postgresql_conn_t *conn, postgresql_query_t *query);
+
+int postgresql_conn_is_lsn_query(postgresql_query_t *query);
+
+void postgresql_conn_capture_lsn(postgresql_conn_t *conn);
+
+void postgresql_conn_kick(postgresql_conn_t *conn);
+
+PGconn *postgresql_conn_pgconn(postgresql_conn_t *conn);
+
+void postgresql_conn_set_query_flags(postgresql_conn_t *conn, int flags);
+
+void postgresql_conn_set_query_priority(postgresql_conn_t *conn, int priority);
+
+void postgresql_conn_set_query_cache(postgresql_conn_t *conn, int ttl, int stale);
+
+void postgresql_conn_set_query_tag(postgresql_conn_t *conn, const char *channel,
+                                   const char *key);
+
 void postgresql_conn_handle_release(postgresql_conn_t *conn, int status);
 
+int postgresql_conn_handle_lost(postgresql_conn_t *conn);
+
 void postgresql_conn_disconnect(postgresql_conn_t *conn, postgresql_disconnect_cb *cb);
 
 #endif
@@ -35,6 +35,14 @@
 #include "connection_priv.h"
 #include "util.h"
 #include "pool.h"
+#include "hedge.h"
+#include "shard_priv.h"
+#include "fanout_priv.h"
+#include "tenant_priv.h"
+#include "cache_priv.h"
+#include "notify_priv.h"
+#include "mirror_priv.h"
+#include "loader_priv.h"
 
 postgresql_object_t *get_postgresql_api()
 {
@@ -49,16 +57,56 @@ postgresql_object_t *get_postgresql_api()
     postgresql->connect_uri        = postgresql_conn_connect_uri;
     postgresql->create_pool_params = postgresql_pool_params_create;
     postgresql->create_pool_uri    = postgresql_pool_uri_create;
+    postgresql->add_replica        = postgresql_pool_add_replica;
     postgresql->get_conn           = postgresql_pool_get_conn;
+    postgresql->get_conn_ro        = postgresql_pool_get_conn_ro;
+    postgresql->create_shards      = postgresql_shard_create;
+    postgresql->add_shard          = postgresql_shard_add;
+    postgresql->get_conn_key       = postgresql_shard_get_conn;
+    postgresql->shard_stats        = postgresql_shard_stats;
+    postgresql->get_conn_ro_lsn    = postgresql_pool_get_conn_ro_lsn;
+    postgresql->get_conn_class     = postgresql_pool_get_conn_class;
+    postgresql->get_conn_tenant    = postgresql_tenant_get_conn;
+    postgresql->set_tenant_limits  = postgresql_tenant_set_limits;
+    postgresql->set_pool_mode      = postgresql_pool_set_mode;
+    postgresql->set_max_lag        = postgresql_pool_set_max_lag;
+    postgresql->set_steal_threshold = postgresql_pool_set_steal_threshold;
+    postgresql->set_pool_budget    = postgresql_pool_set_budget;
+    postgresql->set_pool_admission = postgresql_pool_set_admission;
+    postgresql->set_pool_io_threads = postgresql_pool_set_io_threads;
+    postgresql->set_class_quota    = postgresql_pool_set_class_quota;
+    postgresql->set_class_endpoint = postgresql_pool_set_class_endpoint;
+    postgresql->set_hedge_budget   = postgresql_pool_set_hedge_budget;
+    postgresql->endpoint_stats     = postgresql_pool_endpoint_stats;
     postgresql->query              = postgresql_conn_send_query;
     postgresql->query_params       = postgresql_conn_send_query_params;
     postgresql->query_prepared     = postgresql_conn_send_query_prepared;
+    postgresql->hedged_query       = postgresql_hedge_query;
+    postgresql->fanout_query       = postgresql_fanout_query;
     postgresql->escape_literal     = postgresql_util_escape_literal;
     postgresql->escape_identifier  = postgresql_util_escape_identifier;
     postgresql->escape_binary      = postgresql_util_escape_binary;
     postgresql->unescape_binary    = postgresql_util_unescape_binary;
+    postgresql->set_query_flags    = postgresql_conn_set_query_flags;
+    postgresql->set_query_priority = postgresql_conn_set_query_priority;
+    postgresql->set_query_cache    = postgresql_conn_set_query_cache;
+    postgresql->set_query_tag      = postgresql_conn_set_query_tag;
+    postgresql->set_result_cache   = postgresql_cache_set_size;
+    postgresql->set_cache_file     = postgresql_cache_set_file;
+    postgresql->cache_stats        = postgresql_cache_get_stats;
+    postgresql->listen             = postgresql_notify_listen;
+    postgresql->subscribe          = postgresql_notify_subscribe;
+    postgresql->unsubscribe        = postgresql_notify_unsubscribe;
+    postgresql->create_mirror      = postgresql_mirror_create;
+    postgresql->create_reference   = postgresql_mirror_reference;
+    postgresql->mirror_lookup      = postgresql_mirror_lookup;
+    postgresql->create_loader      = postgresql_loader_create;
+    postgresql->load               = postgresql_loader_load;
+    postgresql->query_status       = postgresql_query_status;
+    postgresql->query_queue_time   = postgresql_query_queue_time;
     postgresql->abort              = postgresql_query_abort;
     postgresql->free               = postgresql_util_free;
+    postgresql->lsn_token          = postgresql_util_lsn_token;
     postgresql->disconnect         = postgresql_conn_disconnect;
 
     return postgresql;
@@ -66,10 +114,22 @@ postgresql_object_t *get_postgresql_api()
 
 duda_package_t *duda_package_main()
 {
+    int i;
     duda_package_t *dpkg;
 
     duda_global_init(&postgresql_conn_list, NULL, NULL);
+    duda_global_init(&postgresql_tenant_key, NULL, NULL);
+    duda_global_init(&postgresql_cache_key, NULL, NULL);
+    duda_global_init(&postgresql_mirror_key, NULL, NULL);
+    duda_global_init(&postgresql_loader_key, NULL, NULL);
     mk_list_init(&postgresql_pool_config_list);
+    for (i = 0; i < POSTGRESQL_POOL_CONFIG_BUCKETS; ++i) {
+        mk_list_init(&postgresql_pool_config_table[i]);
+    }
+    postgresql_tenant_init();
+    mk_list_init(&postgresql_shard_config_list);
+    mk_list_init(&postgresql_mirror_list);
+    mk_list_init(&postgresql_loader_list);
 
     dpkg          = monkey->mem_alloc(sizeof(duda_package_t));
     dpkg->name    = "PostgreSQL";
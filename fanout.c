@@ -0,0 +1,559 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libpq-fe.h>
+#include "common.h"
+#include "query_priv.h"
+#include "connection_priv.h"
+#include "pool.h"
+#include "fanout_priv.h"
+
+static inline void __postgresql_fanout_release(postgresql_fanout_branch_t *branch)
+{
+    if (branch->conn) {
+        postgresql_conn_disconnect(branch->conn, NULL);
+        branch->conn = NULL;
+    }
+}
+
+static inline void __postgresql_fanout_row_free(postgresql_fanout_row_t *row)
+{
+    int i;
+
+    for (i = 0; i < row->n_values; ++i) {
+        FREE(row->values[i]);
+    }
+    FREE(row->values);
+    FREE(row);
+}
+
+static inline void __postgresql_fanout_free(postgresql_fanout_t *fanout)
+{
+    int i;
+    struct mk_list *head, *tmp;
+    postgresql_fanout_row_t *row;
+
+    for (i = 0; i < fanout->n_branches; ++i) {
+        mk_list_foreach_safe(head, tmp, &fanout->branches[i].rows) {
+            row = mk_list_entry(head, postgresql_fanout_row_t, _head);
+            mk_list_del(&row->_head);
+            __postgresql_fanout_row_free(row);
+        }
+        FREE(fanout->branches[i].query_str);
+    }
+
+    for (i = 0; i < fanout->n_fields; ++i) {
+        FREE(fanout->fields[i]);
+    }
+    FREE(fanout->fields);
+    FREE(fanout->branches);
+    FREE(fanout->heap);
+    FREE(fanout->sort_field);
+    FREE(fanout->snapshot);
+    FREE(fanout);
+}
+
+/* Queries may fail while they are being sent, the sender frees the fan-out then. */
+static inline void __postgresql_fanout_try_free(postgresql_fanout_t *fanout)
+{
+    if (fanout->finished && fanout->pending == 0 && fanout->sending == 0) {
+        __postgresql_fanout_free(fanout);
+    }
+}
+
+static inline int __postgresql_fanout_cmp(postgresql_fanout_t *fanout, int a, int b)
+{
+    int ret;
+    double da, db;
+    const char *va = "", *vb = "";
+    postgresql_fanout_branch_t *ba = &fanout->branches[a];
+    postgresql_fanout_branch_t *bb = &fanout->branches[b];
+    postgresql_fanout_row_t *ra = mk_list_entry_first(&ba->rows, postgresql_fanout_row_t, _head);
+    postgresql_fanout_row_t *rb = mk_list_entry_first(&bb->rows, postgresql_fanout_row_t, _head);
+
+    if (ba->key >= 0) {
+        va = ra->values[ba->key];
+    }
+    if (bb->key >= 0) {
+        vb = rb->values[bb->key];
+    }
+
+    if (fanout->flags & POSTGRESQL_FANOUT_NUMERIC) {
+        da  = strtod(va, NULL);
+        db  = strtod(vb, NULL);
+        ret = (da > db) - (da < db);
+    } else {
+        ret = strcmp(va, vb);
+    }
+
+    if (fanout->flags & POSTGRESQL_FANOUT_DESC) {
+        ret = -ret;
+    }
+    /* rows comparing equal keep the order of the branches */
+    return ret != 0 ? ret : a - b;
+}
+
+static inline void __postgresql_fanout_heap_swap(postgresql_fanout_t *fanout, int i, int j)
+{
+    int tmp = fanout->heap[i];
+
+    fanout->heap[i] = fanout->heap[j];
+    fanout->heap[j] = tmp;
+}
+
+static inline void __postgresql_fanout_heap_push(postgresql_fanout_t *fanout, int branch)
+{
+    int i = fanout->n_heap++, parent;
+
+    fanout->heap[i] = branch;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (__postgresql_fanout_cmp(fanout, fanout->heap[i], fanout->heap[parent]) >= 0) {
+            break;
+        }
+        __postgresql_fanout_heap_swap(fanout, i, parent);
+        i = parent;
+    }
+}
+
+static inline int __postgresql_fanout_heap_pop(postgresql_fanout_t *fanout)
+{
+    int top = fanout->heap[0];
+    int i = 0, child;
+
+    fanout->heap[0] = fanout->heap[--fanout->n_heap];
+    while ((child = 2 * i + 1) < fanout->n_heap) {
+        if (child + 1 < fanout->n_heap &&
+            __postgresql_fanout_cmp(fanout, fanout->heap[child + 1], fanout->heap[child]) < 0) {
+            child++;
+        }
+        if (__postgresql_fanout_cmp(fanout, fanout->heap[i], fanout->heap[child]) <= 0) {
+            break;
+        }
+        __postgresql_fanout_heap_swap(fanout, i, child);
+        i = child;
+    }
+    return top;
+}
+
+/*
+ * Deliver the smallest waiting row for as long as every running branch has a
+ * row waiting, a branch without rows may still produce a smaller one.
+ */
+static void __postgresql_fanout_merge(postgresql_fanout_t *fanout)
+{
+    int i;
+    postgresql_fanout_row_t *row;
+    postgresql_fanout_branch_t *branch;
+
+    while (fanout->waiting == 0 && fanout->n_heap > 0) {
+        i = __postgresql_fanout_heap_pop(fanout);
+        branch = &fanout->branches[i];
+        row = mk_list_entry_first(&branch->rows, postgresql_fanout_row_t, _head);
+        mk_list_del(&row->_head);
+        branch->n_rows--;
+
+        if (fanout->row_cb) {
+            fanout->row_cb(fanout->privdata, NULL, fanout->n_fields, fanout->fields,
+                           row->values, fanout->dr);
+        }
+        __postgresql_fanout_row_free(row);
+
+        if (branch->n_rows > 0) {
+            __postgresql_fanout_heap_push(fanout, i);
+        } else if (!branch->done) {
+            fanout->waiting++;
+        }
+    }
+}
+
+static void __postgresql_fanout_commit_end(void *privdata, postgresql_query_t *query,
+                                           duda_request_t *dr)
+{
+    postgresql_fanout_branch_t *branch = privdata;
+    postgresql_fanout_t *fanout = branch->fanout;
+
+    fanout->pending--;
+    if (postgresql_query_status(query) == POSTGRESQL_CONN_LOST) {
+        branch->conn = NULL;
+    }
+    __postgresql_fanout_release(branch);
+    __postgresql_fanout_try_free(fanout);
+}
+
+/* End the transaction holding the exported snapshot, once nobody needs it anymore. */
+static inline void __postgresql_fanout_snapshot_close(postgresql_fanout_t *fanout)
+{
+    int ret;
+    postgresql_fanout_branch_t *branch = &fanout->branches[0];
+
+    if (!branch->conn) {
+        return;
+    }
+
+    fanout->pending++;
+    fanout->sending++;
+    ret = postgresql_conn_send_query(branch->conn, "COMMIT", NULL, NULL,
+                                     __postgresql_fanout_commit_end, branch);
+    fanout->sending--;
+    if (ret != POSTGRESQL_OK) {
+        fanout->pending--;
+        __postgresql_fanout_release(branch);
+    }
+}
+
+static inline void __postgresql_fanout_finish(postgresql_fanout_t *fanout)
+{
+    if (fanout->end_cb) {
+        fanout->end_cb(fanout->privdata, fanout->status, fanout->dr);
+    }
+    fanout->finished = 1;
+
+    if (fanout->flags & POSTGRESQL_FANOUT_SNAPSHOT) {
+        __postgresql_fanout_snapshot_close(fanout);
+    }
+}
+
+static void __postgresql_fanout_branch_done(postgresql_fanout_branch_t *branch, int status)
+{
+    postgresql_fanout_t *fanout = branch->fanout;
+
+    if (status != POSTGRESQL_OK && fanout->status == POSTGRESQL_OK) {
+        fanout->status = status;
+    }
+
+    branch->done = 1;
+    fanout->n_done++;
+    if (fanout->sort_field && branch->n_rows == 0) {
+        fanout->waiting--;
+    }
+    __postgresql_fanout_merge(fanout);
+
+    if (fanout->n_done == fanout->n_branches) {
+        __postgresql_fanout_finish(fanout);
+    }
+}
+
+static void __postgresql_fanout_result(void *privdata, postgresql_query_t *query,
+                                       int n_fields, char **fields, duda_request_t *dr)
+{
+    int i;
+    postgresql_fanout_branch_t *branch = privdata;
+    postgresql_fanout_t *fanout = branch->fanout;
+
+    if (!fanout->fields) {
+        fanout->fields = monkey->mem_alloc(sizeof(char *) * n_fields);
+        for (i = 0; i < n_fields; ++i) {
+            fanout->fields[i] = monkey->str_dup(fields[i]);
+        }
+        fanout->n_fields = n_fields;
+        if (fanout->result_cb) {
+            fanout->result_cb(fanout->privdata, NULL, fanout->n_fields, fanout->fields, dr);
+        }
+    } else if (n_fields != fanout->n_fields) {
+        msg->err("[FD %i] PostgreSQL Fan-out Result Columns Mismatch", branch->conn->fd);
+        branch->mismatch = 1;
+        fanout->status   = POSTGRESQL_ERR;
+        return;
+    }
+
+    branch->key = -1;
+    for (i = 0; fanout->sort_field && i < n_fields; ++i) {
+        if (strcmp(fields[i], fanout->sort_field) == 0) {
+            branch->key = i;
+            break;
+        }
+    }
+}
+
+static void __postgresql_fanout_row(void *privdata, postgresql_query_t *query,
+                                    int n_fields, char **fields, char **values,
+                                    duda_request_t *dr)
+{
+    int i;
+    postgresql_fanout_row_t *row;
+    postgresql_fanout_branch_t *branch = privdata;
+    postgresql_fanout_t *fanout = branch->fanout;
+
+    if (branch->mismatch) {
+        return;
+    }
+
+    /* without a sort field rows are delivered as soon as they arrive */
+    if (!fanout->sort_field) {
+        if (fanout->row_cb) {
+            fanout->row_cb(fanout->privdata, NULL, fanout->n_fields, fanout->fields,
+                           values, dr);
+        }
+        return;
+    }
+
+    row = monkey->mem_alloc(sizeof(postgresql_fanout_row_t));
+    if (!row) {
+        fanout->status = POSTGRESQL_ERR;
+        return;
+    }
+    row->n_values = n_fields;
+    row->values   = monkey->mem_alloc(sizeof(char *) * n_fields);
+    for (i = 0; i < n_fields; ++i) {
+        row->values[i] = monkey->str_dup(values[i]);
+    }
+    mk_list_add(&row->_head, &branch->rows);
+
+    if (branch->n_rows++ == 0) {
+        __postgresql_fanout_heap_push(fanout, branch - fanout->branches);
+        fanout->waiting--;
+    }
+    __postgresql_fanout_merge(fanout);
+}
+
+static void __postgresql_fanout_end(void *privdata, postgresql_query_t *query,
+                                    duda_request_t *dr)
+{
+    postgresql_fanout_branch_t *branch = privdata;
+    postgresql_fanout_t *fanout = branch->fanout;
+    int status = postgresql_query_status(query);
+
+    fanout->pending--;
+
+    /* a lost connection is released by the package itself */
+    if (status == POSTGRESQL_CONN_LOST) {
+        branch->conn = NULL;
+    } else if (!(fanout->flags & POSTGRESQL_FANOUT_SNAPSHOT) || branch != fanout->branches) {
+        __postgresql_fanout_release(branch);
+    }
+
+    __postgresql_fanout_branch_done(branch, status);
+    __postgresql_fanout_try_free(fanout);
+}
+
+static inline void __postgresql_fanout_send(postgresql_fanout_branch_t *branch,
+                                            const char *query_str)
+{
+    int ret;
+    postgresql_fanout_t *fanout = branch->fanout;
+
+    fanout->pending++;
+    fanout->sending++;
+    ret = postgresql_conn_send_query(branch->conn, query_str, __postgresql_fanout_result,
+                                     __postgresql_fanout_row, __postgresql_fanout_end,
+                                     branch);
+    fanout->sending--;
+    if (ret != POSTGRESQL_OK) {
+        fanout->pending--;
+        __postgresql_fanout_release(branch);
+        __postgresql_fanout_branch_done(branch, POSTGRESQL_ERR);
+    }
+}
+
+static inline void __postgresql_fanout_dispatch(postgresql_fanout_t *fanout)
+{
+    int i;
+    size_t length;
+    char *query_str;
+    postgresql_fanout_branch_t *branch;
+
+    fanout->sending++;
+    for (i = 0; i < fanout->n_branches; ++i) {
+        branch = &fanout->branches[i];
+
+        /* the exporting connection already runs inside the snapshot */
+        if (!fanout->snapshot || i == 0) {
+            __postgresql_fanout_send(branch, branch->query_str);
+            continue;
+        }
+
+        length = sizeof(POSTGRESQL_SNAPSHOT_IMPORT) + strlen(fanout->snapshot) +
+                 strlen(branch->query_str);
+        query_str = monkey->mem_alloc(length);
+        if (!query_str) {
+            __postgresql_fanout_release(branch);
+            __postgresql_fanout_branch_done(branch, POSTGRESQL_ERR);
+            continue;
+        }
+        snprintf(query_str, length, POSTGRESQL_SNAPSHOT_IMPORT, fanout->snapshot,
+                 branch->query_str);
+        __postgresql_fanout_send(branch, query_str);
+        FREE(query_str);
+    }
+    fanout->sending--;
+}
+
+static void __postgresql_fanout_snapshot_row(void *privdata, postgresql_query_t *query,
+                                             int n_fields, char **fields, char **values,
+                                             duda_request_t *dr)
+{
+    postgresql_fanout_branch_t *branch = privdata;
+    postgresql_fanout_t *fanout = branch->fanout;
+
+    if (!fanout->snapshot && n_fields == 1) {
+        fanout->snapshot = monkey->str_dup(values[0]);
+    }
+}
+
+static void __postgresql_fanout_snapshot_end(void *privdata, postgresql_query_t *query,
+                                             duda_request_t *dr)
+{
+    int i;
+    postgresql_fanout_branch_t *branch = privdata;
+    postgresql_fanout_t *fanout = branch->fanout;
+    int status = postgresql_query_status(query);
+
+    fanout->pending--;
+    if (status == POSTGRESQL_CONN_LOST) {
+        branch->conn = NULL;
+    }
+
+    if (status == POSTGRESQL_OK && fanout->snapshot) {
+        __postgresql_fanout_dispatch(fanout);
+        __postgresql_fanout_try_free(fanout);
+        return;
+    }
+
+    msg->err("PostgreSQL Fan-out Snapshot Export Error");
+    fanout->status = status != POSTGRESQL_OK ? status : POSTGRESQL_ERR;
+    for (i = 1; i < fanout->n_branches; ++i) {
+        __postgresql_fanout_release(&fanout->branches[i]);
+    }
+    fanout->n_done = fanout->n_branches;
+    __postgresql_fanout_finish(fanout);
+    __postgresql_fanout_try_free(fanout);
+}
+
+/*
+ * @METHOD_NAME: fanout_query
+ * @METHOD_DESC: Run a set of queries in parallel, every one on its own connection taken from a pool, and deliver their rows through a single stream. When a sort field is given and every query returns its rows ordered by that field, the streams are merged so the rows are delivered in order. The query argument of the result and row callbacks is NULL, and the end callback is called once, after all the queries finished. With flag POSTGRESQL_FANOUT_SNAPSHOT the queries see the same snapshot of the database, exported by the first connection, so all the pools must point to the same server. The connections are taken from the pools and returned to them by the package.
+ * @METHOD_PROTO: int fanout_query(duda_request_t *dr, int n, duda_global_t **pool_keys, const char **query_strs, const char *sort_field, int flags, postgresql_query_result_cb *result_cb, postgresql_query_row_cb *row_cb, postgresql_fanout_end_cb *end_cb, void *privdata)
+ * @METHOD_PARAM: dr The request context information hold by a duda_request_t type.
+ * @METHOD_PARAM: n The number of queries.
+ * @METHOD_PARAM: pool_keys An array with the global key definitions of the pools every query runs on, the same pool can be used many times.
+ * @METHOD_PARAM: query_strs An array with the SQL statement strings of the queries, they must not modify data and should return the same columns.
+ * @METHOD_PARAM: sort_field The name of the column rows are ordered by, or NULL to deliver rows as soon as they arrive.
+ * @METHOD_PARAM: flags A combination of POSTGRESQL_FANOUT_SNAPSHOT, POSTGRESQL_FANOUT_NUMERIC to compare the sort field as a number, and POSTGRESQL_FANOUT_DESC to merge rows in descending order.
+ * @METHOD_PARAM: result_cb The callback function that will take actions when the columns of the first result set are available.
+ * @METHOD_PARAM: row_cb The callback function that will take actions when every row is delivered.
+ * @METHOD_PARAM: end_cb The callback function that will take actions after all the queries finished, its status is POSTGRESQL_OK when every query succeeded.
+ * @METHOD_PARAM: privdata The user defined private data that will be passed to callback.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_fanout_query(duda_request_t *dr, int n, duda_global_t **pool_keys,
+                            const char **query_strs, const char *sort_field, int flags,
+                            postgresql_query_result_cb *result_cb,
+                            postgresql_query_row_cb *row_cb,
+                            postgresql_fanout_end_cb *end_cb, void *privdata)
+{
+    int i, ret;
+    postgresql_fanout_t *fanout;
+    postgresql_fanout_branch_t *branch;
+
+    if (n <= 0 || !pool_keys || !query_strs) {
+        return POSTGRESQL_ERR;
+    }
+
+    fanout = monkey->mem_alloc(sizeof(postgresql_fanout_t));
+    if (!fanout) {
+        return POSTGRESQL_ERR;
+    }
+
+    fanout->dr         = dr;
+    fanout->sort_field = sort_field ? monkey->str_dup(sort_field) : NULL;
+    fanout->flags      = flags;
+    fanout->status     = POSTGRESQL_OK;
+    fanout->snapshot   = NULL;
+    fanout->n_fields   = 0;
+    fanout->fields     = NULL;
+    fanout->n_branches = n;
+    fanout->n_done     = 0;
+    fanout->pending    = 0;
+    fanout->sending    = 0;
+    fanout->finished   = 0;
+    fanout->n_heap     = 0;
+    fanout->waiting    = n;
+    fanout->result_cb  = result_cb;
+    fanout->row_cb     = row_cb;
+    fanout->end_cb     = end_cb;
+    fanout->privdata   = privdata;
+    fanout->heap       = monkey->mem_alloc(sizeof(int) * n);
+    fanout->branches   = monkey->mem_alloc(sizeof(postgresql_fanout_branch_t) * n);
+    if (!fanout->heap || !fanout->branches) {
+        FREE(fanout->heap);
+        FREE(fanout->branches);
+        FREE(fanout->sort_field);
+        FREE(fanout);
+        return POSTGRESQL_ERR;
+    }
+
+    for (i = 0; i < n; ++i) {
+        branch = &fanout->branches[i];
+        branch->fanout    = fanout;
+        branch->query_str = monkey->str_dup(query_strs[i]);
+        branch->key       = -1;
+        branch->mismatch  = 0;
+        branch->done      = 0;
+        branch->n_rows    = 0;
+        mk_list_init(&branch->rows);
+
+        /* an exported snapshot can only be imported on the server it comes from */
+        if (flags & POSTGRESQL_FANOUT_SNAPSHOT) {
+            branch->conn = postgresql_pool_get_conn(pool_keys[i], dr, NULL);
+        } else {
+            branch->conn = postgresql_pool_get_conn_ro(pool_keys[i], dr, NULL);
+        }
+    }
+
+    for (i = 0; i < n && fanout->branches[i].conn; ++i);
+    if (i < n) {
+        msg->err("PostgreSQL Fan-out Get Connection Error");
+        for (i = 0; i < n; ++i) {
+            __postgresql_fanout_release(&fanout->branches[i]);
+        }
+        __postgresql_fanout_free(fanout);
+        return POSTGRESQL_ERR;
+    }
+
+    if (!(flags & POSTGRESQL_FANOUT_SNAPSHOT)) {
+        __postgresql_fanout_dispatch(fanout);
+        __postgresql_fanout_try_free(fanout);
+        return POSTGRESQL_OK;
+    }
+
+    branch = &fanout->branches[0];
+    fanout->pending++;
+    fanout->sending++;
+    ret = postgresql_conn_send_query(branch->conn, POSTGRESQL_SNAPSHOT_QUERY, NULL,
+                                     __postgresql_fanout_snapshot_row,
+                                     __postgresql_fanout_snapshot_end, branch);
+    fanout->sending--;
+    if (ret != POSTGRESQL_OK) {
+        for (i = 0; i < n; ++i) {
+            __postgresql_fanout_release(&fanout->branches[i]);
+        }
+        __postgresql_fanout_free(fanout);
+        return POSTGRESQL_ERR;
+    }
+
+    __postgresql_fanout_try_free(fanout);
+    return POSTGRESQL_OK;
+}
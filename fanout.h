@@ -0,0 +1,32 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_FANOUT_H
+#define POSTGRESQL_FANOUT_H
+
+/* flags of a fan-out query */
+#define POSTGRESQL_FANOUT_SNAPSHOT 0x01 /* run every branch in one exported snapshot */
+#define POSTGRESQL_FANOUT_NUMERIC  0x02 /* compare the sort field as a number */
+#define POSTGRESQL_FANOUT_DESC     0x04 /* merge rows in descending order */
+
+typedef void (postgresql_fanout_end_cb)(void *privdata, int status, duda_request_t *dr);
+
+#endif
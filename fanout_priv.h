@@ -0,0 +1,86 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_FANOUT_PRIV_H
+#define POSTGRESQL_FANOUT_PRIV_H
+
+#include "fanout.h"
+
+#define POSTGRESQL_SNAPSHOT_QUERY "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY; " \
+                                  "SELECT pg_export_snapshot()"
+/* the query of the branch may end with a comment, COMMIT goes on a line of its own */
+#define POSTGRESQL_SNAPSHOT_IMPORT "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY; " \
+                                   "SET TRANSACTION SNAPSHOT '%s'; %s\n; COMMIT"
+
+typedef struct postgresql_fanout postgresql_fanout_t;
+
+typedef struct postgresql_fanout_row {
+    int n_values;
+    char **values;
+    struct mk_list _head;
+} postgresql_fanout_row_t;
+
+typedef struct postgresql_fanout_branch {
+    postgresql_fanout_t *fanout;
+    postgresql_conn_t *conn;
+    char *query_str;
+    int key;      /* column of the sort field in the rows of this branch */
+    int mismatch; /* the columns differ from the other branches */
+    int done;
+    int n_rows;   /* rows waiting to be merged */
+    struct mk_list rows;
+} postgresql_fanout_branch_t;
+
+struct postgresql_fanout {
+    duda_request_t *dr;
+    char *sort_field;
+    int flags;
+    int status;
+    char *snapshot;
+
+    int n_fields;
+    char **fields;
+
+    int n_branches;
+    int n_done;
+    int pending;  /* internal queries in flight */
+    int sending;
+    int finished;
+    postgresql_fanout_branch_t *branches;
+
+    /* branches by their first waiting row, used by the k-way merge */
+    int n_heap;
+    int *heap;
+    int waiting;  /* running branches without any waiting row */
+
+    postgresql_query_result_cb *result_cb;
+    postgresql_query_row_cb *row_cb;
+    postgresql_fanout_end_cb *end_cb;
+    void *privdata;
+};
+
+int postgresql_fanout_query(duda_request_t *dr, int n, duda_global_t **pool_keys,
+                            const char **query_strs, const char *sort_field, int flags,
+                            postgresql_query_result_cb *result_cb,
+                            postgresql_query_row_cb *row_cb,
+                            postgresql_fanout_end_cb *end_cb, void *privdata);
+
+#endif
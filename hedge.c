@@ -0,0 +1,315 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <libpq-fe.h>
+#include "common.h"
+#include "query_priv.h"
+#include "connection_priv.h"
+#include "pool.h"
+#include "hedge.h"
+
+static inline void __postgresql_hedge_timer_stop(postgresql_hedge_t *hedge)
+{
+    if (hedge->timer_fd == -1) {
+        return;
+    }
+    event->delete(hedge->timer_fd);
+    close(hedge->timer_fd);
+    hedge->timer_fd = -1;
+}
+
+static inline void __postgresql_hedge_free(postgresql_hedge_t *hedge)
+{
+    __postgresql_hedge_timer_stop(hedge);
+    FREE(hedge->query_str);
+    FREE(hedge);
+}
+
+/* Drop an attempt that lost the race, its late results never reach the caller. */
+static inline void __postgresql_hedge_cancel(postgresql_hedge_attempt_t *attempt)
+{
+    postgresql_query_t *query = attempt->query;
+
+    if (query) {
+        query->result_cb = NULL;
+        query->row_cb    = NULL;
+        query->end_cb    = NULL;
+        query->privdata  = NULL;
+        postgresql_query_abort(query);
+    }
+    attempt->active = 0;
+    postgresql_conn_disconnect(attempt->conn, NULL);
+}
+
+static inline void __postgresql_hedge_pick(postgresql_hedge_attempt_t *attempt)
+{
+    int i;
+    postgresql_hedge_t *hedge = attempt->hedge;
+
+    if (hedge->winner) {
+        return;
+    }
+
+    hedge->winner = attempt;
+    __postgresql_hedge_timer_stop(hedge);
+    for (i = 0; i < hedge->n_attempts; ++i) {
+        if (&hedge->attempts[i] != attempt && hedge->attempts[i].active) {
+            __postgresql_hedge_cancel(&hedge->attempts[i]);
+        }
+    }
+}
+
+static inline int __postgresql_hedge_n_active(postgresql_hedge_t *hedge)
+{
+    int i, n = 0;
+
+    for (i = 0; i < hedge->n_attempts; ++i) {
+        n += hedge->attempts[i].active;
+    }
+    return n;
+}
+
+static void __postgresql_hedge_result(void *privdata, postgresql_query_t *query,
+                                      int n_fields, char **fields, duda_request_t *dr)
+{
+    postgresql_hedge_attempt_t *attempt = privdata;
+    postgresql_hedge_t *hedge = attempt->hedge;
+
+    attempt->query = query;
+    __postgresql_hedge_pick(attempt);
+    if (hedge->result_cb) {
+        hedge->result_cb(hedge->privdata, query, n_fields, fields, dr);
+    }
+}
+
+static void __postgresql_hedge_row(void *privdata, postgresql_query_t *query,
+                                   int n_fields, char **fields, char **values,
+                                   duda_request_t *dr)
+{
+    postgresql_hedge_attempt_t *attempt = privdata;
+    postgresql_hedge_t *hedge = attempt->hedge;
+
+    attempt->query = query;
+    __postgresql_hedge_pick(attempt);
+    if (hedge->row_cb) {
+        hedge->row_cb(hedge->privdata, query, n_fields, fields, values, dr);
+    }
+}
+
+static void __postgresql_hedge_end(void *privdata, postgresql_query_t *query,
+                                   duda_request_t *dr)
+{
+    postgresql_hedge_attempt_t *attempt = privdata;
+    postgresql_hedge_t *hedge = attempt->hedge;
+    int status = postgresql_query_status(query);
+
+    attempt->query = query;
+    attempt->active = 0;
+
+    /* a lost connection is released by the package itself */
+    if (status != POSTGRESQL_CONN_LOST) {
+        postgresql_conn_disconnect(attempt->conn, NULL);
+    }
+
+    /* a failed attempt does not win while another one is still running */
+    if (!hedge->winner && status != POSTGRESQL_OK && __postgresql_hedge_n_active(hedge) > 0) {
+        return;
+    }
+
+    __postgresql_hedge_pick(attempt);
+    if (hedge->end_cb) {
+        hedge->end_cb(hedge->privdata, query, dr);
+    }
+
+    /* the query may fail while it is being sent, the sender frees the hedge then */
+    hedge->finished = 1;
+    if (!hedge->sending) {
+        __postgresql_hedge_free(hedge);
+    }
+}
+
+static inline int __postgresql_hedge_send(postgresql_hedge_t *hedge, postgresql_conn_t *conn)
+{
+    int ret;
+    postgresql_query_t *query;
+    postgresql_hedge_attempt_t *attempt = &hedge->attempts[hedge->n_attempts++];
+
+    attempt->hedge  = hedge;
+    attempt->conn   = conn;
+    attempt->query  = NULL;
+    attempt->active = 0;
+
+    query = postgresql_query_init();
+    if (!query) {
+        msg->err("[FD %i] PostgreSQL Add Query Error", conn->fd);
+        postgresql_conn_disconnect(conn, NULL);
+        return POSTGRESQL_ERR;
+    }
+    query->query_str = monkey->str_dup(hedge->query_str);
+    query->result_cb = __postgresql_hedge_result;
+    query->row_cb    = __postgresql_hedge_row;
+    query->end_cb    = __postgresql_hedge_end;
+    query->privdata  = attempt;
+    query->type      = QUERY_TYPE_QUERY;
+
+    attempt->active = 1;
+    hedge->sending = 1;
+    ret = postgresql_conn_enqueue(conn, query);
+    hedge->sending = 0;
+    if (ret != POSTGRESQL_OK) {
+        attempt->active = 0;
+        postgresql_conn_disconnect(conn, NULL);
+        return POSTGRESQL_ERR;
+    }
+
+    /* the query stays alive until its end callback, which may have run already */
+    attempt->query = attempt->active ? query : NULL;
+    return POSTGRESQL_OK;
+}
+
+static int __postgresql_hedge_on_timer(int fd, void *data)
+{
+    uint64_t expirations;
+    postgresql_hedge_t *hedge = data;
+    postgresql_hedge_attempt_t *first = &hedge->attempts[0];
+    postgresql_conn_t *conn;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return DUDA_EVENT_OWNED;
+    }
+    __postgresql_hedge_timer_stop(hedge);
+
+    if (hedge->winner || !first->active || hedge->n_attempts == POSTGRESQL_HEDGE_ATTEMPTS) {
+        return DUDA_EVENT_OWNED;
+    }
+
+    conn = postgresql_pool_hedge_conn(hedge->pool, hedge->dr, first->conn->endpoint);
+    if (conn) {
+        msg->info("[FD %i] PostgreSQL Hedging Query on FD %i", first->conn->fd, conn->fd);
+        __postgresql_hedge_send(hedge, conn);
+        if (hedge->finished) {
+            __postgresql_hedge_free(hedge);
+        }
+    }
+    return DUDA_EVENT_OWNED;
+}
+
+static int __postgresql_hedge_on_timer_close(int fd, void *data)
+{
+    postgresql_hedge_t *hedge = data;
+
+    msg->err("[FD %i] PostgreSQL Hedge Timer Closed", fd);
+    hedge->timer_fd = -1;
+    return DUDA_EVENT_CLOSE;
+}
+
+static inline void __postgresql_hedge_timer_start(postgresql_hedge_t *hedge, uint64_t delay)
+{
+    struct itimerspec spec;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd == -1) {
+        msg->err("PostgreSQL Hedge Timer Create Error");
+        return;
+    }
+
+    spec.it_interval.tv_sec  = 0;
+    spec.it_interval.tv_nsec = 0;
+    spec.it_value.tv_sec     = delay / 1000000;
+    spec.it_value.tv_nsec    = (delay % 1000000) * 1000;
+    if (timerfd_settime(fd, 0, &spec, NULL) == -1) {
+        msg->err("PostgreSQL Hedge Timer Set Error");
+        close(fd);
+        return;
+    }
+
+    event->add(fd, DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED,
+               __postgresql_hedge_on_timer, NULL, __postgresql_hedge_on_timer_close,
+               __postgresql_hedge_on_timer_close, NULL, hedge);
+    hedge->timer_fd = fd;
+}
+
+/*
+ * @METHOD_NAME: hedged_query
+ * @METHOD_DESC: Send a latency critical read-only query to a replica of a connection pool. If the replica has not answered within the 95th percentile of the latency observed by the pool, the same query is sent to a second replica, the first one to answer wins and the other one is cancelled. Hedged queries are limited by the budget of the pool, see set_hedge_budget. The connections are taken from the pool and returned to it by the package.
+ * @METHOD_PROTO: int hedged_query(duda_global_t *pool_key, duda_request_t *dr, const char *query_str, postgresql_query_result_cb *result_cb, postgresql_query_row_cb *row_cb, postgresql_query_end_cb *end_cb, void *privdata)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: dr The request context information hold by a duda_request_t type.
+ * @METHOD_PARAM: query_str The SQL statement string of this query, it must not modify data.
+ * @METHOD_PARAM: result_cb The callback function that will take actions when the result set of this query is available.
+ * @METHOD_PARAM: row_cb The callback function that will take actions when every row of the result set is fetched.
+ * @METHOD_PARAM: end_cb The callback function that will take actions after all the row in the result set are fetched.
+ * @METHOD_PARAM: privdata The user defined private data that will be passed to callback.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_hedge_query(duda_global_t *pool_key, duda_request_t *dr,
+                           const char *query_str, postgresql_query_result_cb *result_cb,
+                           postgresql_query_row_cb *row_cb,
+                           postgresql_query_end_cb *end_cb, void *privdata)
+{
+    uint64_t delay;
+    postgresql_conn_t *conn;
+    postgresql_hedge_t *hedge;
+    postgresql_pool_t *pool = postgresql_pool_get(pool_key);
+    if (!pool) {
+        return POSTGRESQL_ERR;
+    }
+
+    hedge = monkey->mem_alloc(sizeof(postgresql_hedge_t));
+    if (!hedge) {
+        return POSTGRESQL_ERR;
+    }
+
+    hedge->pool       = pool;
+    hedge->dr         = dr;
+    hedge->query_str  = monkey->str_dup(query_str);
+    hedge->timer_fd   = -1;
+    hedge->sending    = 0;
+    hedge->finished   = 0;
+    hedge->n_attempts = 0;
+    hedge->winner     = NULL;
+    hedge->result_cb  = result_cb;
+    hedge->row_cb     = row_cb;
+    hedge->end_cb     = end_cb;
+    hedge->privdata   = privdata;
+
+    conn = postgresql_pool_get_conn_ro(pool_key, dr, NULL);
+    if (!conn || __postgresql_hedge_send(hedge, conn) != POSTGRESQL_OK) {
+        __postgresql_hedge_free(hedge);
+        return POSTGRESQL_ERR;
+    }
+
+    /* the query failed right away and the callbacks already ran */
+    if (hedge->finished) {
+        __postgresql_hedge_free(hedge);
+        return POSTGRESQL_OK;
+    }
+
+    postgresql_pool_hedge_earn(pool);
+    delay = postgresql_pool_latency_p95(pool);
+    if (delay > 0 && pool->config->hedge_budget > 0) {
+        __postgresql_hedge_timer_start(hedge, delay);
+    }
+    return POSTGRESQL_OK;
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_HEDGE_H
+#define POSTGRESQL_HEDGE_H
+
+/* attempts of a hedged query: the first replica and a backup one */
+#define POSTGRESQL_HEDGE_ATTEMPTS 2
+
+typedef struct postgresql_hedge postgresql_hedge_t;
+
+typedef struct postgresql_hedge_attempt {
+    postgresql_hedge_t *hedge;
+    postgresql_conn_t *conn;
+    postgresql_query_t *query;
+    int active;
+} postgresql_hedge_attempt_t;
+
+struct postgresql_hedge {
+    struct postgresql_pool *pool;
+    duda_request_t *dr;
+    char *query_str;
+    int timer_fd;
+    int sending;
+    int finished;
+
+    int n_attempts;
+    postgresql_hedge_attempt_t *winner;
+    postgresql_hedge_attempt_t attempts[POSTGRESQL_HEDGE_ATTEMPTS];
+
+    postgresql_query_result_cb *result_cb;
+    postgresql_query_row_cb *row_cb;
+    postgresql_query_end_cb *end_cb;
+    void *privdata;
+};
+
+int postgresql_hedge_query(duda_global_t *pool_key, duda_request_t *dr,
+                           const char *query_str, postgresql_query_result_cb *result_cb,
+                           postgresql_query_row_cb *row_cb,
+                           postgresql_query_end_cb *end_cb, void *privdata);
+
+#endif
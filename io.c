@@ -0,0 +1,629 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <libpq-fe.h>
+#include "common.h"
+#include "query_priv.h"
+#include "connection_priv.h"
+#include "pool.h"
+#include "async.h"
+#include "util.h"
+#include "io_priv.h"
+
+static inline int __postgresql_io_ring_init(postgresql_io_ring_t *ring, unsigned int size)
+{
+    unsigned int i;
+
+    ring->slots = monkey->mem_alloc(sizeof(postgresql_io_slot_t) * size);
+    if (!ring->slots) {
+        return POSTGRESQL_ERR;
+    }
+
+    for (i = 0; i < size; ++i) {
+        ring->slots[i].seq  = i;
+        ring->slots[i].data = NULL;
+    }
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    return POSTGRESQL_OK;
+}
+
+/* Called by any thread, it fails when the ring is full. */
+static inline int __postgresql_io_ring_push(postgresql_io_ring_t *ring, void *data)
+{
+    int diff;
+    unsigned int pos;
+    postgresql_io_slot_t *slot;
+
+    while (1) {
+        pos  = *(volatile unsigned int *) &ring->tail;
+        slot = &ring->slots[pos & ring->mask];
+        diff = (int) (*(volatile unsigned int *) &slot->seq - pos);
+        if (diff < 0) {
+            return POSTGRESQL_ERR;
+        }
+        if (diff == 0 && __sync_bool_compare_and_swap(&ring->tail, pos, pos + 1)) {
+            break;
+        }
+    }
+
+    slot->data = data;
+    __sync_synchronize();
+    slot->seq = pos + 1;
+    return POSTGRESQL_OK;
+}
+
+/* Called by the consumer of the ring only, it returns NULL when the ring is empty. */
+static inline void *__postgresql_io_ring_pop(postgresql_io_ring_t *ring)
+{
+    void *data;
+    unsigned int pos = ring->head;
+    postgresql_io_slot_t *slot = &ring->slots[pos & ring->mask];
+
+    if (*(volatile unsigned int *) &slot->seq != pos + 1) {
+        return NULL;
+    }
+    __sync_synchronize();
+
+    data = slot->data;
+    ring->head = pos + 1;
+    __sync_synchronize();
+    slot->seq = pos + ring->mask + 1;
+    return data;
+}
+
+static inline void __postgresql_io_notify(int efd)
+{
+    uint64_t one = 1;
+
+    if (write(efd, &one, sizeof(one)) != sizeof(one)) {
+        msg->err("[FD %i] PostgreSQL I/O Notify Error", efd);
+    }
+}
+
+/* Hand a finished query back to the worker that submitted it. */
+static inline void __postgresql_io_complete(postgresql_io_t *io, postgresql_query_t *query,
+                                            int status)
+{
+    if (status != POSTGRESQL_OK) {
+        query->status = status;
+    }
+
+    if (__postgresql_io_ring_push(&query->chan->done, query) != POSTGRESQL_OK) {
+        mk_list_add(&query->_head, &io->backlog);
+        return;
+    }
+    __postgresql_io_notify(query->chan->efd);
+}
+
+static inline void __postgresql_io_flush_backlog(postgresql_io_t *io)
+{
+    struct mk_list *head, *tmp;
+    postgresql_query_t *query;
+
+    mk_list_foreach_safe(head, tmp, &io->backlog) {
+        query = mk_list_entry(head, postgresql_query_t, _head);
+        mk_list_del(&query->_head);
+        if (__postgresql_io_ring_push(&query->chan->done, query) != POSTGRESQL_OK) {
+            mk_list_add(&query->_head, &io->backlog);
+            break;
+        }
+        __postgresql_io_notify(query->chan->efd);
+    }
+}
+
+static inline int __postgresql_io_watch(postgresql_io_t *io, postgresql_io_conn_t *ic, int op)
+{
+    struct epoll_event ev;
+
+    ev.events   = ic->writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = ic;
+    return epoll_ctl(io->epfd, op, ic->fd, &ev);
+}
+
+/* Give up on a connection for a while, the delay grows while the endpoint stays down. */
+static inline void __postgresql_io_close(postgresql_io_t *io, postgresql_io_conn_t *ic)
+{
+    if (ic->fd != -1) {
+        epoll_ctl(io->epfd, EPOLL_CTL_DEL, ic->fd, NULL);
+    }
+    if (ic->conn) {
+        PQfinish(ic->conn);
+        ic->conn = NULL;
+    }
+    ic->fd         = -1;
+    ic->writing    = 0;
+    ic->connecting = 0;
+    ic->retry_at   = postgresql_util_now() + (uint64_t) ic->retry_delay * 1000;
+    ic->retry_delay *= 2;
+    if (ic->retry_delay > POSTGRESQL_IO_RETRY_MAX) {
+        ic->retry_delay = POSTGRESQL_IO_RETRY_MAX;
+    }
+}
+
+/* Start opening a connection, it is completed by __postgresql_io_poll() from the loop. */
+static inline void __postgresql_io_open(postgresql_io_t *io, postgresql_io_conn_t *ic)
+{
+    postgresql_endpoint_config_t *config = &io->config->endpoints[ic->endpoint];
+
+    if (config->type == POOL_TYPE_PARAMS) {
+        ic->conn = PQconnectStartParams((const char * const *) config->keys,
+                                        (const char * const *) config->values,
+                                        config->expand_dbname);
+    } else {
+        ic->conn = PQconnectStart(config->uri);
+    }
+
+    if (!ic->conn || PQstatus(ic->conn) == CONNECTION_BAD ||
+        PQsetnonblocking(ic->conn, 1) == -1) {
+        msg->err("PostgreSQL I/O Thread %i Connect Error: %s", io->index,
+                 ic->conn ? PQerrorMessage(ic->conn) : "out of memory");
+        __postgresql_io_close(io, ic);
+        return;
+    }
+
+    ic->fd         = PQsocket(ic->conn);
+    ic->writing    = 1;
+    ic->connecting = 1;
+    ic->query      = NULL;
+    if (__postgresql_io_watch(io, ic, EPOLL_CTL_ADD) != 0) {
+        __postgresql_io_close(io, ic);
+    }
+}
+
+static inline void __postgresql_io_poll(postgresql_io_t *io, postgresql_io_conn_t *ic)
+{
+    int fd, writing;
+    PostgresPollingStatusType status = PQconnectPoll(ic->conn);
+
+    if (status == PGRES_POLLING_FAILED) {
+        msg->err("[FD %i] PostgreSQL I/O Thread %i Connect Error: %s", ic->fd, io->index,
+                 PQerrorMessage(ic->conn));
+        __postgresql_io_close(io, ic);
+        return;
+    }
+
+    if (status == PGRES_POLLING_OK) {
+        ic->connecting  = 0;
+        ic->retry_delay = POSTGRESQL_IO_RETRY_MIN;
+    }
+    writing = status == PGRES_POLLING_WRITING;
+
+    /* the socket changes when another address of the server is tried */
+    fd = PQsocket(ic->conn);
+    if (fd != ic->fd) {
+        epoll_ctl(io->epfd, EPOLL_CTL_DEL, ic->fd, NULL);
+        ic->fd      = fd;
+        ic->writing = writing;
+        if (__postgresql_io_watch(io, ic, EPOLL_CTL_ADD) != 0) {
+            __postgresql_io_close(io, ic);
+        }
+    } else if (writing != ic->writing) {
+        ic->writing = writing;
+        __postgresql_io_watch(io, ic, EPOLL_CTL_MOD);
+    }
+}
+
+/* Fail the query in flight on a broken connection, it is opened again later. */
+static inline void __postgresql_io_reset(postgresql_io_t *io, postgresql_io_conn_t *ic)
+{
+    msg->err("[FD %i] PostgreSQL I/O Thread %i Connection Lost: %s", ic->fd, io->index,
+             PQerrorMessage(ic->conn));
+
+    if (ic->query) {
+        __postgresql_io_complete(io, ic->query, POSTGRESQL_CONN_LOST);
+        ic->query = NULL;
+    }
+    __postgresql_io_close(io, ic);
+}
+
+static inline void __postgresql_io_flush(postgresql_io_t *io, postgresql_io_conn_t *ic)
+{
+    int ret = PQflush(ic->conn);
+
+    if (ret == -1) {
+        __postgresql_io_reset(io, ic);
+        return;
+    }
+    if ((ret == 1) != ic->writing) {
+        ic->writing = ret == 1;
+        __postgresql_io_watch(io, ic, EPOLL_CTL_MOD);
+    }
+}
+
+static inline void __postgresql_io_send(postgresql_io_t *io, postgresql_io_conn_t *ic,
+                                        postgresql_query_t *query)
+{
+    int status = 0;
+
+    query->sent_at = postgresql_util_now();
+    if (query->type == QUERY_TYPE_QUERY) {
+        status = PQsendQuery(ic->conn, query->query_str);
+    } else if (query->type == QUERY_TYPE_PARAMS) {
+        status = PQsendQueryParams(ic->conn, query->query_str, query->n_params, NULL,
+                                   (const char * const *)query->params_values,
+                                   query->params_lengths, query->params_formats,
+                                   query->result_format);
+    } else if (query->type == QUERY_TYPE_PREPARED) {
+        status = PQsendQueryPrepared(ic->conn, query->stmt_name, query->n_params,
+                                     (const char * const *)query->params_values,
+                                     query->params_lengths, query->params_formats,
+                                     query->result_format);
+    }
+
+    if (status != 1) {
+        msg->err("[FD %i] PostgreSQL Send Query Error: %s", ic->fd, PQerrorMessage(ic->conn));
+        __postgresql_io_complete(io, query, POSTGRESQL_ERR);
+        return;
+    }
+
+    ic->query = query;
+    __postgresql_io_flush(io, ic);
+}
+
+/* Results are collected here and handed to the callbacks by the worker. */
+static inline void __postgresql_io_read(postgresql_io_t *io, postgresql_io_conn_t *ic)
+{
+    PGresult *result, **results;
+    postgresql_query_t *query;
+
+    if (PQconsumeInput(ic->conn) == 0) {
+        __postgresql_io_reset(io, ic);
+        return;
+    }
+
+    while (ic->query && PQisBusy(ic->conn) == 0) {
+        query  = ic->query;
+        result = PQgetResult(ic->conn);
+        if (!result) {
+            ic->query = NULL;
+            __postgresql_io_complete(io, query, POSTGRESQL_OK);
+            break;
+        }
+
+        /* the results left are still read, the query fails once they are over */
+        results = monkey->mem_realloc(query->io_results,
+                                      sizeof(PGresult *) * (query->io_n_results + 1));
+        if (!results) {
+            PQclear(result);
+            query->status = POSTGRESQL_ERR;
+            continue;
+        }
+        query->io_results = results;
+        query->io_results[query->io_n_results++] = result;
+    }
+}
+
+/* Give the waiting queries to the idle connections of their endpoint, in arrival order. */
+static inline void __postgresql_io_dispatch(postgresql_io_t *io)
+{
+    int i, alive;
+    struct mk_list *head, *tmp;
+    postgresql_query_t *query;
+    postgresql_io_conn_t *ic = NULL;
+
+    mk_list_foreach_safe(head, tmp, &io->pending) {
+        query = mk_list_entry(head, postgresql_query_t, _head);
+        alive = 0;
+        for (i = 0; i < io->n_conns; ++i) {
+            ic = &io->conns[i];
+            if (ic->endpoint != query->io_endpoint || ic->fd == -1) {
+                continue;
+            }
+            /* queries wait for a connection being opened */
+            alive = 1;
+            if (!ic->connecting && !ic->query) {
+                break;
+            }
+        }
+
+        if (i < io->n_conns) {
+            mk_list_del(&query->_head);
+            __postgresql_io_send(io, ic, query);
+        } else if (!alive) {
+            /* every connection to the endpoint is down */
+            mk_list_del(&query->_head);
+            __postgresql_io_complete(io, query, POSTGRESQL_CONN_LOST);
+        }
+    }
+}
+
+/* Waiting queries are kept by priority, aged by the time they waited. */
+static inline void __postgresql_io_enqueue(postgresql_io_t *io, postgresql_query_t *query)
+{
+    uint64_t now = postgresql_util_now();
+    struct mk_list *head, *pos = &io->pending;
+    postgresql_query_t *other;
+
+    for (head = io->pending.prev; head != &io->pending; head = head->prev) {
+        other = mk_list_entry(head, postgresql_query_t, _head);
+        if (postgresql_query_priority(other, now) <= query->priority) {
+            break;
+        }
+        pos = head;
+    }
+    mk_list_add(&query->_head, pos);
+}
+
+static void *__postgresql_io_loop(void *data)
+{
+    int i, n, timeout;
+    uint64_t count, now;
+    struct epoll_event events[POSTGRESQL_IO_EVENTS];
+    postgresql_io_t *io = data;
+    postgresql_io_conn_t *ic;
+    postgresql_query_t *query;
+
+    for (i = 0; i < io->n_conns; ++i) {
+        __postgresql_io_open(io, &io->conns[i]);
+    }
+
+    while (1) {
+        /* completions left in the backlog are retried soon, broken connections a bit later */
+        timeout = -1;
+        for (i = 0; i < io->n_conns && timeout == -1; ++i) {
+            if (io->conns[i].fd == -1) {
+                timeout = POSTGRESQL_IO_RETRY_MIN;
+            }
+        }
+        if (mk_list_is_empty(&io->backlog) != 0) {
+            timeout = 1;
+        }
+        n = epoll_wait(io->epfd, events, POSTGRESQL_IO_EVENTS, timeout);
+
+        for (i = 0; i < n; ++i) {
+            ic = events[i].data.ptr;
+            if (!ic) {
+                if (read(io->efd, &count, sizeof(count)) != sizeof(count)) {
+                    continue;
+                }
+                continue;
+            }
+            if (ic->connecting) {
+                __postgresql_io_poll(io, ic);
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                __postgresql_io_reset(io, ic);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                __postgresql_io_flush(io, ic);
+            }
+            if ((events[i].events & EPOLLIN) && ic->fd != -1) {
+                __postgresql_io_read(io, ic);
+            }
+        }
+
+        while ((query = __postgresql_io_ring_pop(&io->submit))) {
+            __postgresql_io_enqueue(io, query);
+        }
+
+        /* broken connections are opened again once their delay is over */
+        now = postgresql_util_now();
+        for (i = 0; i < io->n_conns; ++i) {
+            if (io->conns[i].fd == -1 && now >= io->conns[i].retry_at) {
+                __postgresql_io_open(io, &io->conns[i]);
+            }
+        }
+
+        __postgresql_io_dispatch(io);
+        __postgresql_io_flush_backlog(io);
+    }
+    return NULL;
+}
+
+static inline int __postgresql_io_create(postgresql_io_t *io, postgresql_pool_config_t *config,
+                                         int index)
+{
+    int i, j, k;
+    struct epoll_event ev;
+
+    io->index  = index;
+    io->config = config;
+    io->n_conns = config->n_endpoints * config->max_size;
+    mk_list_init(&io->pending);
+    mk_list_init(&io->backlog);
+
+    if (__postgresql_io_ring_init(&io->submit, POSTGRESQL_IO_RING_SIZE) != POSTGRESQL_OK) {
+        return POSTGRESQL_ERR;
+    }
+
+    io->efd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    io->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (io->efd == -1 || io->epfd == -1) {
+        return POSTGRESQL_ERR;
+    }
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->efd, &ev) == -1) {
+        return POSTGRESQL_ERR;
+    }
+
+    io->conns = monkey->mem_alloc(sizeof(postgresql_io_conn_t) * io->n_conns);
+    if (!io->conns) {
+        return POSTGRESQL_ERR;
+    }
+
+    k = 0;
+    for (i = 0; i < config->n_endpoints; ++i) {
+        for (j = 0; j < config->max_size; ++j, ++k) {
+            io->conns[k].endpoint = i;
+            io->conns[k].query    = NULL;
+            io->conns[k].writing  = 0;
+            io->conns[k].fd       = -1;
+            io->conns[k].conn     = NULL;
+            io->conns[k].connecting  = 0;
+            io->conns[k].retry_at    = 0;
+            io->conns[k].retry_delay = POSTGRESQL_IO_RETRY_MIN;
+        }
+    }
+    return POSTGRESQL_OK;
+}
+
+/*
+ * Start the database threads of a pool, it is done once, by the first
+ * worker that uses the pool. The threads open their connections themselves,
+ * so no worker waits for the server here.
+ */
+int postgresql_io_start(postgresql_pool_config_t *config)
+{
+    int i;
+
+    if (!__sync_bool_compare_and_swap(&config->io_started, 0, 1)) {
+        /* another worker is starting them */
+        while (*(volatile int *) &config->io_ready == 0) {
+            sched_yield();
+        }
+        return config->io_ready == 1 ? POSTGRESQL_OK : POSTGRESQL_ERR;
+    }
+
+    config->io = monkey->mem_alloc(sizeof(postgresql_io_t) * config->io_threads);
+    for (i = 0; config->io && i < config->io_threads; ++i) {
+        if (__postgresql_io_create(&config->io[i], config, i) != POSTGRESQL_OK ||
+            pthread_create(&config->io[i].tid, NULL, __postgresql_io_loop,
+                           &config->io[i]) != 0) {
+            msg->err("PostgreSQL I/O Thread %i Start Error", i);
+            break;
+        }
+    }
+
+    __sync_synchronize();
+    if (!config->io || i < config->io_threads) {
+        config->io_ready = -1;
+        return POSTGRESQL_ERR;
+    }
+    config->io_ready = 1;
+    return POSTGRESQL_OK;
+}
+
+/* Run the callbacks of the queries finished by the database threads for this worker. */
+static int __postgresql_io_on_complete(int fd, void *data)
+{
+    int i;
+    uint64_t count;
+    postgresql_io_chan_t *chan = data;
+    postgresql_query_t *query;
+    postgresql_conn_t *handle;
+
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return DUDA_EVENT_OWNED;
+    }
+
+    while ((query = __postgresql_io_ring_pop(&chan->done))) {
+        mk_list_init(&query->_head);
+        handle = query->handle;
+        if (query->sent_at > query->queued_at) {
+            postgresql_pool_queue_sample(handle->endpoint, query->sent_at - query->queued_at);
+        }
+        if (!query->abort) {
+            for (i = 0; i < query->io_n_results; ++i) {
+                query->result = query->io_results[i];
+                postgresql_async_handle_result(query, fd);
+            }
+            if (query->status == POSTGRESQL_OK) {
+                postgresql_pool_endpoint_sample(handle->endpoint,
+                                                postgresql_util_now() - query->sent_at);
+            }
+            if (query->end_cb) {
+                query->end_cb(query->privdata, query, query->dr);
+            }
+        }
+        postgresql_query_free(query);
+    }
+    return DUDA_EVENT_OWNED;
+}
+
+static int __postgresql_io_on_close(int fd, void *data)
+{
+    msg->err("[FD %i] PostgreSQL I/O Completion Channel Closed", fd);
+    return DUDA_EVENT_CLOSE;
+}
+
+/* Create the completion channel of the calling worker and watch it from its event loop. */
+postgresql_io_chan_t *postgresql_io_chan_create()
+{
+    postgresql_io_chan_t *chan = monkey->mem_alloc(sizeof(postgresql_io_chan_t));
+    if (!chan) {
+        return NULL;
+    }
+
+    if (__postgresql_io_ring_init(&chan->done, POSTGRESQL_IO_RING_SIZE) != POSTGRESQL_OK) {
+        FREE(chan);
+        return NULL;
+    }
+
+    chan->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (chan->efd == -1) {
+        FREE(chan->done.slots);
+        FREE(chan);
+        return NULL;
+    }
+
+    event->add(chan->efd, DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED,
+               __postgresql_io_on_complete, NULL, __postgresql_io_on_close,
+               __postgresql_io_on_close, NULL, chan);
+    return chan;
+}
+
+/*
+ * Hand a query of a handle to a database thread. Queries of a handle run one
+ * at a time, the next one is submitted when the previous one is freed. The
+ * query is failed right away with POSTGRESQL_POOL_EXHAUSTED if the threads
+ * are behind by a whole ring.
+ */
+int postgresql_io_submit(postgresql_conn_t *handle, postgresql_query_t *query)
+{
+    unsigned int next;
+    postgresql_pool_t *pool = handle->pool;
+    postgresql_pool_config_t *config = pool->config;
+    postgresql_io_t *io;
+
+    mk_list_init(&query->_head);
+    query->handle      = handle;
+    query->chan        = pool->io_chan;
+    query->io_endpoint = handle->endpoint->index;
+    handle->pipelined++;
+
+    if (config->io_ready != 1 || !query->chan) {
+        postgresql_async_fail_query(handle, query, POSTGRESQL_ERR);
+        return POSTGRESQL_ERR;
+    }
+
+    next = __sync_fetch_and_add(&config->io_next, 1);
+    io = &config->io[next % config->io_threads];
+    if (__postgresql_io_ring_push(&io->submit, query) != POSTGRESQL_OK) {
+        msg->warn("PostgreSQL I/O Thread %i Queue Full", io->index);
+        postgresql_async_fail_query(handle, query, POSTGRESQL_POOL_EXHAUSTED);
+        return POSTGRESQL_POOL_EXHAUSTED;
+    }
+
+    __postgresql_io_notify(io->efd);
+    return POSTGRESQL_OK;
+}
@@ -0,0 +1,93 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_IO_PRIV_H
+#define POSTGRESQL_IO_PRIV_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* slots of the rings between workers and database threads, a power of two */
+#define POSTGRESQL_IO_RING_SIZE 1024
+
+/* events fetched by one turn of the loop of a database thread */
+#define POSTGRESQL_IO_EVENTS 64
+
+/* milliseconds before a broken connection is opened again, doubled on every failure */
+#define POSTGRESQL_IO_RETRY_MIN 100
+#define POSTGRESQL_IO_RETRY_MAX 30000
+
+/*
+ * Bounded ring with many producers and one consumer, every slot carries a
+ * sequence number telling whether it is ready to be written or to be read.
+ */
+typedef struct postgresql_io_slot {
+    unsigned int seq;
+    void *data;
+} postgresql_io_slot_t;
+
+typedef struct postgresql_io_ring {
+    unsigned int mask;
+    unsigned int head; /* next slot to read, only touched by the consumer */
+    unsigned int tail; /* next slot to write, claimed by the producers */
+    postgresql_io_slot_t *slots;
+} postgresql_io_ring_t;
+
+/* completions of the queries submitted by one worker */
+typedef struct postgresql_io_chan {
+    int efd;
+    postgresql_io_ring_t done;
+} postgresql_io_chan_t;
+
+typedef struct postgresql_io_conn {
+    PGconn *conn;
+    int fd;
+    int endpoint;
+    int writing;
+    int connecting;
+    uint64_t retry_at;  /* when a broken connection is opened again */
+    int retry_delay;    /* milliseconds */
+    postgresql_query_t *query; /* in flight, NULL when idle */
+} postgresql_io_conn_t;
+
+/* a database thread, it owns the connections and runs the queries of every worker */
+typedef struct postgresql_io {
+    int index;
+    pthread_t tid;
+    int efd;  /* wakes the thread up on submissions */
+    int epfd;
+    postgresql_io_ring_t submit;
+    struct postgresql_pool_config *config;
+
+    int n_conns;
+    postgresql_io_conn_t *conns;
+
+    struct mk_list pending; /* queries waiting for an idle connection */
+    struct mk_list backlog; /* completions waiting for room in the ring of their worker */
+} postgresql_io_t;
+
+int postgresql_io_start(struct postgresql_pool_config *config);
+
+postgresql_io_chan_t *postgresql_io_chan_create();
+
+int postgresql_io_submit(postgresql_conn_t *handle, postgresql_query_t *query);
+
+#endif
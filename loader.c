@@ -0,0 +1,491 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <libpq-fe.h>
+#include "common.h"
+#include "query_priv.h"
+#include "connection_priv.h"
+#include "pool.h"
+#include "util.h"
+#include "loader_priv.h"
+
+static int postgresql_loader_count = 0;
+
+static inline void __postgresql_loader_put32(char *buf, uint32_t value)
+{
+    buf[0] = (char) (value >> 24);
+    buf[1] = (char) (value >> 16);
+    buf[2] = (char) (value >> 8);
+    buf[3] = (char) value;
+}
+
+static inline postgresql_loader_batch_t *__postgresql_loader_batch_new(postgresql_loader_t *loader)
+{
+    int i;
+    postgresql_loader_batch_t *batch = monkey->mem_alloc(sizeof(postgresql_loader_batch_t));
+
+    if (!batch) {
+        return NULL;
+    }
+
+    batch->loader      = loader;
+    batch->n_keys      = 0;
+    batch->key_index   = -1;
+    batch->key_missing = 0;
+    batch->conn        = NULL;
+    mk_list_init(&batch->keys);
+    for (i = 0; i < POSTGRESQL_LOADER_BUCKETS; ++i) {
+        mk_list_init(&batch->buckets[i]);
+    }
+    return batch;
+}
+
+/* Tell every caller of a batch it is over, then free it. */
+static inline void __postgresql_loader_batch_end(postgresql_loader_batch_t *batch, int status)
+{
+    postgresql_loader_key_t *key;
+    postgresql_loader_waiter_t *waiter;
+
+    while (mk_list_is_empty(&batch->keys) != 0) {
+        key = mk_list_entry_first(&batch->keys, postgresql_loader_key_t, _head);
+        while (mk_list_is_empty(&key->waiters) != 0) {
+            waiter = mk_list_entry_first(&key->waiters, postgresql_loader_waiter_t, _head);
+            mk_list_del(&waiter->_head);
+            if (waiter->end_cb) {
+                waiter->end_cb(waiter->privdata, key->key, status, waiter->dr);
+            }
+            FREE(waiter);
+        }
+        mk_list_del(&key->_head);
+        FREE(key->key);
+        FREE(key);
+    }
+    FREE(batch);
+}
+
+static inline postgresql_loader_key_t *__postgresql_loader_find(postgresql_loader_batch_t *batch,
+                                                                const char *str, uint32_t hash)
+{
+    struct mk_list *head;
+    postgresql_loader_key_t *key;
+
+    mk_list_foreach(head, &batch->buckets[hash % POSTGRESQL_LOADER_BUCKETS]) {
+        key = mk_list_entry(head, postgresql_loader_key_t, _hash_head);
+        if (key->hash == hash && strcmp(key->key, str) == 0) {
+            return key;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Encode the keys of a batch as a one dimensional array in the binary format
+ * of the server, so they are sent as a single parameter without quoting.
+ */
+static inline char *__postgresql_loader_array(postgresql_loader_batch_t *batch, int *length)
+{
+    int size, n;
+    uint32_t oid;
+    long long value;
+    char *array, *ptr;
+    struct mk_list *head;
+    postgresql_loader_key_t *key;
+
+    switch (batch->loader->key_type) {
+    case POSTGRESQL_LOADER_INT4:
+        oid  = POSTGRESQL_LOADER_INT4_OID;
+        size = 20 + batch->n_keys * 8;
+        break;
+    case POSTGRESQL_LOADER_INT8:
+        oid  = POSTGRESQL_LOADER_INT8_OID;
+        size = 20 + batch->n_keys * 12;
+        break;
+    default:
+        oid  = POSTGRESQL_LOADER_TEXT_OID;
+        size = 20 + batch->n_keys * 4;
+        mk_list_foreach(head, &batch->keys) {
+            key = mk_list_entry(head, postgresql_loader_key_t, _head);
+            size += strlen(key->key);
+        }
+        break;
+    }
+
+    array = monkey->mem_alloc(size);
+    if (!array) {
+        return NULL;
+    }
+
+    __postgresql_loader_put32(array, 1);                  /* dimensions */
+    __postgresql_loader_put32(array + 4, 0);              /* no NULL */
+    __postgresql_loader_put32(array + 8, oid);
+    __postgresql_loader_put32(array + 12, batch->n_keys);
+    __postgresql_loader_put32(array + 16, 1);             /* lower bound */
+
+    ptr = array + 20;
+    mk_list_foreach(head, &batch->keys) {
+        key = mk_list_entry(head, postgresql_loader_key_t, _head);
+        if (oid == POSTGRESQL_LOADER_TEXT_OID) {
+            n = strlen(key->key);
+            __postgresql_loader_put32(ptr, n);
+            memcpy(ptr + 4, key->key, n);
+            ptr += 4 + n;
+            continue;
+        }
+
+        value = strtoll(key->key, NULL, 10);
+        if (oid == POSTGRESQL_LOADER_INT4_OID) {
+            __postgresql_loader_put32(ptr, 4);
+            __postgresql_loader_put32(ptr + 4, (uint32_t) value);
+            ptr += 8;
+        } else {
+            __postgresql_loader_put32(ptr, 8);
+            __postgresql_loader_put32(ptr + 4, (uint32_t) ((uint64_t) value >> 32));
+            __postgresql_loader_put32(ptr + 8, (uint32_t) value);
+            ptr += 12;
+        }
+    }
+
+    *length = size;
+    return array;
+}
+
+static void __postgresql_loader_result(void *privdata, postgresql_query_t *query,
+                                       int n_fields, char **fields, duda_request_t *dr)
+{
+    int i;
+    postgresql_loader_batch_t *batch = privdata;
+
+    batch->key_index = -1;
+    for (i = 0; i < n_fields; ++i) {
+        if (strcmp(fields[i], batch->loader->key_column) == 0) {
+            batch->key_index = i;
+            return;
+        }
+    }
+
+    /* the rows can't be routed, the callers get an error once the query ends */
+    batch->key_missing = 1;
+    msg->err("PostgreSQL Loader Result Has No Column %s", batch->loader->key_column);
+}
+
+/* Route a row to the callers that asked for its key. */
+static void __postgresql_loader_row(void *privdata, postgresql_query_t *query,
+                                    int n_fields, char **fields, char **values,
+                                    duda_request_t *dr)
+{
+    struct mk_list *head;
+    postgresql_loader_batch_t *batch = privdata;
+    postgresql_loader_key_t *key;
+    postgresql_loader_waiter_t *waiter;
+    const char *str;
+
+    if (batch->key_index < 0 || batch->key_index >= n_fields) {
+        return;
+    }
+
+    str = values[batch->key_index];
+    key = __postgresql_loader_find(batch, str, postgresql_util_hash(str, strlen(str)));
+    if (!key) {
+        return;
+    }
+
+    mk_list_foreach(head, &key->waiters) {
+        waiter = mk_list_entry(head, postgresql_loader_waiter_t, _head);
+        if (waiter->row_cb) {
+            waiter->row_cb(waiter->privdata, key->key, n_fields, fields, values, waiter->dr);
+        }
+    }
+}
+
+static void __postgresql_loader_end(void *privdata, postgresql_query_t *query,
+                                    duda_request_t *dr)
+{
+    postgresql_loader_batch_t *batch = privdata;
+    int status = postgresql_query_status(query);
+
+    /* a lost connection is released by the package itself */
+    if (status != POSTGRESQL_CONN_LOST) {
+        postgresql_conn_disconnect(batch->conn, NULL);
+    }
+    if (batch->key_missing) {
+        status = POSTGRESQL_ERR;
+    }
+    __postgresql_loader_batch_end(batch, status);
+}
+
+/* Send the keys of a batch as one query on a connection of the pool of the loader. */
+static inline void __postgresql_loader_send(postgresql_loader_batch_t *batch)
+{
+    int ret, length;
+    const int formats[] = {1};
+    const char *values[1];
+    int lengths[1];
+    char *array;
+    postgresql_conn_t *conn;
+
+    array = __postgresql_loader_array(batch, &length);
+    if (!array) {
+        __postgresql_loader_batch_end(batch, POSTGRESQL_ERR);
+        return;
+    }
+
+    conn = postgresql_pool_get_conn(batch->loader->pool_key, NULL, NULL);
+    if (!conn) {
+        FREE(array);
+        __postgresql_loader_batch_end(batch, POSTGRESQL_ERR);
+        return;
+    }
+
+    values[0]   = array;
+    lengths[0]  = length;
+    batch->conn = conn;
+    ret = postgresql_conn_send_query_params(conn, batch->loader->query, 1, values, lengths,
+                                            formats, 0, __postgresql_loader_result,
+                                            __postgresql_loader_row, __postgresql_loader_end,
+                                            batch);
+    FREE(array);
+
+    if (ret != POSTGRESQL_OK) {
+        postgresql_conn_disconnect(conn, NULL);
+        __postgresql_loader_batch_end(batch, ret);
+    }
+}
+
+/* The event loop went through the events that asked for keys, send their batches. */
+static int __postgresql_loader_on_flush(int fd, void *data)
+{
+    int i;
+    uint64_t count;
+    postgresql_loader_worker_t *worker = data;
+    postgresql_loader_batch_t *batch;
+
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return DUDA_EVENT_OWNED;
+    }
+
+    worker->scheduled = 0;
+    for (i = 0; i < postgresql_loader_count; ++i) {
+        batch = worker->batches[i];
+        if (batch) {
+            worker->batches[i] = NULL;
+            __postgresql_loader_send(batch);
+        }
+    }
+    return DUDA_EVENT_OWNED;
+}
+
+static int __postgresql_loader_on_close(int fd, void *data)
+{
+    postgresql_loader_worker_t *worker = data;
+
+    msg->err("[FD %i] PostgreSQL Loader Event Closed", fd);
+    worker->efd = -1;
+    return DUDA_EVENT_CLOSE;
+}
+
+static inline postgresql_loader_worker_t *__postgresql_loader_worker()
+{
+    postgresql_loader_worker_t *worker = global->get(postgresql_loader_key);
+
+    if (worker) {
+        return worker->efd != -1 ? worker : NULL;
+    }
+
+    worker = monkey->mem_alloc(sizeof(postgresql_loader_worker_t));
+    if (!worker) {
+        return NULL;
+    }
+
+    worker->batches = monkey->mem_alloc(sizeof(postgresql_loader_batch_t *) *
+                                        (postgresql_loader_count + 1));
+    worker->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!worker->batches || worker->efd == -1) {
+        msg->err("PostgreSQL Loader Event Create Error");
+        if (worker->efd != -1) {
+            close(worker->efd);
+        }
+        FREE(worker->batches);
+        FREE(worker);
+        return NULL;
+    }
+    memset(worker->batches, 0, sizeof(postgresql_loader_batch_t *) *
+           (postgresql_loader_count + 1));
+    worker->scheduled = 0;
+
+    event->add(worker->efd, DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED,
+               __postgresql_loader_on_flush, NULL, __postgresql_loader_on_close,
+               __postgresql_loader_on_close, NULL, worker);
+    global->set(postgresql_loader_key, (void *) worker);
+    return worker;
+}
+
+/* Write an integer key the way the server prints it, so rows can be matched by their text. */
+static inline int __postgresql_loader_key_format(postgresql_loader_t *loader, const char *key,
+                                                 char *buf, size_t size)
+{
+    char *end;
+    long long value;
+
+    errno = 0;
+    value = strtoll(key, &end, 10);
+    if (errno != 0 || end == key || *end != '\0') {
+        return POSTGRESQL_ERR;
+    }
+    if (loader->key_type == POSTGRESQL_LOADER_INT4 && (value < INT_MIN || value > INT_MAX)) {
+        return POSTGRESQL_ERR;
+    }
+
+    snprintf(buf, size, "%lld", value);
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: create_loader
+ * @METHOD_DESC: Create a loader batching the lookups of rows by key. The keys asked for during one iteration of the event loop of a worker, by any request, are sent together as a single array parameter of one query, and each row of its result is handed to the callers that asked for its key. It must be called within the function `duda_main()' of a Duda web service.
+ * @METHOD_PROTO: postgresql_loader_t *create_loader(duda_global_t *pool_key, const char *query, const char *key_column, int key_type)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: query The SQL statement taking the array of keys as $1, such as `SELECT * FROM item WHERE id = ANY($1)'.
+ * @METHOD_PARAM: key_column The column of the result holding the key of a row.
+ * @METHOD_PARAM: key_type POSTGRESQL_LOADER_INT4, POSTGRESQL_LOADER_INT8 or POSTGRESQL_LOADER_TEXT, it must match the type of the array the server expects.
+ * @METHOD_RETURN: The loader on success, or NULL on failure.
+ */
+
+postgresql_loader_t *postgresql_loader_create(duda_global_t *pool_key, const char *query,
+                                              const char *key_column, int key_type)
+{
+    postgresql_loader_t *loader;
+
+    if (!pool_key || !query || !key_column ||
+        key_type < POSTGRESQL_LOADER_INT4 || key_type > POSTGRESQL_LOADER_TEXT) {
+        return NULL;
+    }
+
+    loader = monkey->mem_alloc(sizeof(postgresql_loader_t));
+    if (!loader) {
+        return NULL;
+    }
+
+    loader->pool_key   = pool_key;
+    loader->query      = monkey->str_dup(query);
+    loader->key_column = monkey->str_dup(key_column);
+    loader->key_type   = key_type;
+    loader->index      = postgresql_loader_count++;
+    mk_list_add(&loader->_head, &postgresql_loader_list);
+    return loader;
+}
+
+/*
+ * @METHOD_NAME: load
+ * @METHOD_DESC: Ask a loader for the rows of a key. The key joins the batch of the worker, sent once the event loop is done with the events at hand, or right away once it holds 1000 keys. Keys asked for several times in a batch are sent once. The row callback is called for every row of the key, then the end callback once the batch is over, with or without rows.
+ * @METHOD_PROTO: int load(postgresql_loader_t *loader, const char *key, duda_request_t *dr, postgresql_loader_row_cb *row_cb, postgresql_loader_end_cb *end_cb, void *privdata)
+ * @METHOD_PARAM: loader The loader returned by create_loader.
+ * @METHOD_PARAM: key The key, in text.
+ * @METHOD_PARAM: dr The request context information hold by a duda_request_t type.
+ * @METHOD_PARAM: row_cb The callback function that will take actions for every row of the key.
+ * @METHOD_PARAM: end_cb The callback function that will take actions once the rows of the key are fetched, with the status of the query.
+ * @METHOD_PARAM: privdata The user defined private data that will be passed to the callbacks.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR if the key is not valid for the loader or it failed to be queued.
+ */
+
+int postgresql_loader_load(postgresql_loader_t *loader, const char *key, duda_request_t *dr,
+                           postgresql_loader_row_cb *row_cb, postgresql_loader_end_cb *end_cb,
+                           void *privdata)
+{
+    uint32_t hash;
+    uint64_t one = 1;
+    char buf[32];
+    postgresql_loader_worker_t *worker;
+    postgresql_loader_batch_t *batch;
+    postgresql_loader_key_t *entry;
+    postgresql_loader_waiter_t *waiter;
+
+    if (!key) {
+        return POSTGRESQL_ERR;
+    }
+    if (loader->key_type != POSTGRESQL_LOADER_TEXT) {
+        if (__postgresql_loader_key_format(loader, key, buf, sizeof(buf)) != POSTGRESQL_OK) {
+            return POSTGRESQL_ERR;
+        }
+        key = buf;
+    }
+
+    worker = __postgresql_loader_worker();
+    if (!worker) {
+        return POSTGRESQL_ERR;
+    }
+
+    batch = worker->batches[loader->index];
+    if (!batch) {
+        batch = __postgresql_loader_batch_new(loader);
+        if (!batch) {
+            return POSTGRESQL_ERR;
+        }
+        worker->batches[loader->index] = batch;
+    }
+
+    waiter = monkey->mem_alloc(sizeof(postgresql_loader_waiter_t));
+    if (!waiter) {
+        return POSTGRESQL_ERR;
+    }
+    waiter->row_cb   = row_cb;
+    waiter->end_cb   = end_cb;
+    waiter->privdata = privdata;
+    waiter->dr       = dr;
+
+    hash  = postgresql_util_hash(key, strlen(key));
+    entry = __postgresql_loader_find(batch, key, hash);
+    if (!entry) {
+        entry = monkey->mem_alloc(sizeof(postgresql_loader_key_t));
+        if (!entry) {
+            FREE(waiter);
+            return POSTGRESQL_ERR;
+        }
+        entry->hash = hash;
+        entry->key  = monkey->str_dup(key);
+        mk_list_init(&entry->waiters);
+        mk_list_add(&entry->_head, &batch->keys);
+        mk_list_add(&entry->_hash_head, &batch->buckets[hash % POSTGRESQL_LOADER_BUCKETS]);
+        batch->n_keys++;
+    }
+    mk_list_add(&waiter->_head, &entry->waiters);
+
+    if (batch->n_keys >= POSTGRESQL_LOADER_MAX_KEYS) {
+        worker->batches[loader->index] = NULL;
+        __postgresql_loader_send(batch);
+        return POSTGRESQL_OK;
+    }
+
+    /* readable once the events already returned by the event loop are handled */
+    if (!worker->scheduled) {
+        if (write(worker->efd, &one, sizeof(one)) != sizeof(one)) {
+            msg->err("[FD %i] PostgreSQL Loader Notify Error", worker->efd);
+        }
+        worker->scheduled = 1;
+    }
+    return POSTGRESQL_OK;
+}
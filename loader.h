@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_LOADER_H
+#define POSTGRESQL_LOADER_H
+
+/* types of the keys of a loader, sent as a binary array of that type */
+#define POSTGRESQL_LOADER_INT4 0
+#define POSTGRESQL_LOADER_INT8 1
+#define POSTGRESQL_LOADER_TEXT 2
+
+typedef struct postgresql_loader postgresql_loader_t;
+
+typedef void (postgresql_loader_row_cb)(void *privdata, const char *key, int n_fields,
+                                        char **fields, char **values, duda_request_t *dr);
+
+typedef void (postgresql_loader_end_cb)(void *privdata, const char *key, int status,
+                                        duda_request_t *dr);
+
+#endif
@@ -0,0 +1,97 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_LOADER_PRIV_H
+#define POSTGRESQL_LOADER_PRIV_H
+
+#include <stdint.h>
+#include "loader.h"
+
+/* buckets of the keys of a batch */
+#define POSTGRESQL_LOADER_BUCKETS 64
+
+/* keys sent in one query at most, a full batch is sent right away */
+#define POSTGRESQL_LOADER_MAX_KEYS 1000
+
+/* type oids of the array elements */
+#define POSTGRESQL_LOADER_INT4_OID 23
+#define POSTGRESQL_LOADER_INT8_OID 20
+#define POSTGRESQL_LOADER_TEXT_OID 25
+
+struct postgresql_loader {
+    duda_global_t *pool_key;
+    char *query;
+    char *key_column;
+    int key_type;
+    int index; /* of its batch in the workers */
+
+    struct mk_list _head;
+};
+
+/* a caller waiting for the rows of a key */
+typedef struct postgresql_loader_waiter {
+    postgresql_loader_row_cb *row_cb;
+    postgresql_loader_end_cb *end_cb;
+    void *privdata;
+    duda_request_t *dr;
+
+    struct mk_list _head;
+} postgresql_loader_waiter_t;
+
+typedef struct postgresql_loader_key {
+    uint32_t hash;
+    char *key;
+    struct mk_list waiters;
+
+    struct mk_list _head;
+    struct mk_list _hash_head;
+} postgresql_loader_key_t;
+
+/* keys collected during one iteration of the event loop, then sent as one query */
+typedef struct postgresql_loader_batch {
+    postgresql_loader_t *loader;
+    int n_keys;
+    int key_index;   /* column of the result holding the key */
+    int key_missing; /* the result has no such column */
+    struct postgresql_conn *conn;
+    struct mk_list keys;
+    struct mk_list buckets[POSTGRESQL_LOADER_BUCKETS];
+} postgresql_loader_batch_t;
+
+/* batches of a worker, by loader */
+typedef struct postgresql_loader_worker {
+    int efd;
+    int scheduled;
+    postgresql_loader_batch_t **batches;
+} postgresql_loader_worker_t;
+
+struct mk_list postgresql_loader_list;
+
+duda_global_t postgresql_loader_key;
+
+postgresql_loader_t *postgresql_loader_create(duda_global_t *pool_key, const char *query,
+                                              const char *key_column, int key_type);
+
+int postgresql_loader_load(postgresql_loader_t *loader, const char *key, duda_request_t *dr,
+                           postgresql_loader_row_cb *row_cb, postgresql_loader_end_cb *end_cb,
+                           void *privdata);
+
+#endif
@@ -0,0 +1,1391 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <libpq-fe.h>
+#include "common.h"
+#include "query_priv.h"
+#include "connection_priv.h"
+#include "pool.h"
+#include "util.h"
+#include "mirror_priv.h"
+
+/* workers reading snapshots, and the reclamation epoch they are compared to */
+static struct mk_list postgresql_mirror_readers = {&postgresql_mirror_readers,
+                                                   &postgresql_mirror_readers};
+static pthread_mutex_t postgresql_mirror_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long postgresql_mirror_epoch = 1;
+static int postgresql_mirror_ids = 0;
+
+/* reader of the replication stream, every read is bound checked */
+typedef struct {
+    const char *ptr;
+    size_t left;
+    int error;
+} postgresql_mirror_buf_t;
+
+static inline uint64_t __postgresql_mirror_get(postgresql_mirror_buf_t *buf, int n)
+{
+    int i;
+    uint64_t value = 0;
+
+    if (buf->left < (size_t) n) {
+        buf->error = 1;
+        return 0;
+    }
+    for (i = 0; i < n; ++i) {
+        value = (value << 8) | (unsigned char) buf->ptr[i];
+    }
+    buf->ptr  += n;
+    buf->left -= n;
+    return value;
+}
+
+static inline const char *__postgresql_mirror_get_str(postgresql_mirror_buf_t *buf)
+{
+    const char *str = buf->ptr;
+    size_t n = strnlen(buf->ptr, buf->left);
+
+    if (n == buf->left) {
+        buf->error = 1;
+        return "";
+    }
+    buf->ptr  += n + 1;
+    buf->left -= n + 1;
+    return str;
+}
+
+static inline void __postgresql_mirror_put(char *buf, uint64_t value, int n)
+{
+    int i;
+
+    for (i = n - 1; i >= 0; --i) {
+        buf[i] = (char) (value & 0xff);
+        value >>= 8;
+    }
+}
+
+/* Quote an identifier, the result must be freed. */
+static inline char *__postgresql_mirror_quote(const char *name)
+{
+    size_t i, n = 0;
+    char *quoted = monkey->mem_alloc(strlen(name) * 2 + 3);
+
+    if (!quoted) {
+        return NULL;
+    }
+    quoted[n++] = '"';
+    for (i = 0; name[i]; ++i) {
+        if (name[i] == '"') {
+            quoted[n++] = '"';
+        }
+        quoted[n++] = name[i];
+    }
+    quoted[n++] = '"';
+    quoted[n]   = '\0';
+    return quoted;
+}
+
+static inline postgresql_mirror_tuple_t *__postgresql_mirror_tuple_new(int n_values,
+                                                                       const char **values,
+                                                                       const int *lengths,
+                                                                       int key_index)
+{
+    int i;
+    size_t size = sizeof(postgresql_mirror_tuple_t) + sizeof(char *) * n_values;
+    char *ptr;
+    postgresql_mirror_tuple_t *tuple;
+
+    for (i = 0; i < n_values; ++i) {
+        size += lengths[i] + 1;
+    }
+
+    tuple = monkey->mem_alloc(size);
+    if (!tuple) {
+        return NULL;
+    }
+
+    tuple->refs     = 0;
+    tuple->n_values = n_values;
+    tuple->values   = (char **) (tuple + 1);
+    ptr = (char *) (tuple->values + n_values);
+    for (i = 0; i < n_values; ++i) {
+        tuple->values[i] = ptr;
+        memcpy(ptr, values[i], lengths[i]);
+        ptr[lengths[i]] = '\0';
+        ptr += lengths[i] + 1;
+    }
+    tuple->hash = postgresql_util_hash(tuple->values[key_index], lengths[key_index]);
+    return tuple;
+}
+
+static inline void __postgresql_mirror_tuple_put(postgresql_mirror_tuple_t *tuple)
+{
+    if (--tuple->refs == 0) {
+        FREE(tuple);
+    }
+}
+
+static inline postgresql_mirror_entry_t *__postgresql_mirror_find(postgresql_mirror_t *mirror,
+                                                                  const char *key,
+                                                                  uint32_t hash)
+{
+    struct mk_list *head;
+    postgresql_mirror_entry_t *entry;
+
+    mk_list_foreach(head, &mirror->buckets[hash % POSTGRESQL_MIRROR_BUCKETS]) {
+        entry = mk_list_entry(head, postgresql_mirror_entry_t, _head);
+        if (entry->tuple->hash == hash &&
+            strcmp(entry->tuple->values[mirror->key_index], key) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static inline void __postgresql_mirror_delete(postgresql_mirror_t *mirror, const char *key)
+{
+    postgresql_mirror_entry_t *entry;
+
+    entry = __postgresql_mirror_find(mirror, key, postgresql_util_hash(key, strlen(key)));
+    if (entry) {
+        mk_list_del(&entry->_head);
+        __postgresql_mirror_tuple_put(entry->tuple);
+        FREE(entry);
+        mirror->n_rows--;
+        mirror->dirty = 1;
+    }
+}
+
+static inline void __postgresql_mirror_upsert(postgresql_mirror_t *mirror,
+                                              postgresql_mirror_tuple_t *tuple)
+{
+    const char *key = tuple->values[mirror->key_index];
+    postgresql_mirror_entry_t *entry = __postgresql_mirror_find(mirror, key, tuple->hash);
+
+    tuple->refs++;
+    mirror->dirty = 1;
+    if (entry) {
+        __postgresql_mirror_tuple_put(entry->tuple);
+        entry->tuple = tuple;
+        return;
+    }
+
+    entry = monkey->mem_alloc(sizeof(postgresql_mirror_entry_t));
+    if (!entry) {
+        __postgresql_mirror_tuple_put(tuple);
+        return;
+    }
+    entry->tuple = tuple;
+    mk_list_add(&entry->_head, &mirror->buckets[tuple->hash % POSTGRESQL_MIRROR_BUCKETS]);
+    mirror->n_rows++;
+}
+
+static inline void __postgresql_mirror_clear(postgresql_mirror_t *mirror)
+{
+    int i;
+    postgresql_mirror_entry_t *entry;
+
+    for (i = 0; i < POSTGRESQL_MIRROR_BUCKETS; ++i) {
+        while (mk_list_is_empty(&mirror->buckets[i]) != 0) {
+            entry = mk_list_entry_first(&mirror->buckets[i], postgresql_mirror_entry_t, _head);
+            mk_list_del(&entry->_head);
+            __postgresql_mirror_tuple_put(entry->tuple);
+            FREE(entry);
+        }
+    }
+    mirror->n_rows = 0;
+    mirror->dirty  = 1;
+}
+
+/* Set the columns of the table, they come from the initial copy and the stream. */
+static inline int __postgresql_mirror_set_fields(postgresql_mirror_t *mirror, int n_fields,
+                                                 const char **fields)
+{
+    int i;
+
+    for (i = 0; i < mirror->n_fields; ++i) {
+        FREE(mirror->fields[i]);
+    }
+    FREE(mirror->fields);
+    mirror->n_fields  = 0;
+    mirror->key_index = -1;
+
+    mirror->fields = monkey->mem_alloc(sizeof(char *) * (n_fields + 1));
+    if (!mirror->fields) {
+        return POSTGRESQL_ERR;
+    }
+    for (i = 0; i < n_fields; ++i) {
+        mirror->fields[i] = monkey->str_dup(fields[i]);
+        if (strcmp(fields[i], mirror->key_column) == 0) {
+            mirror->key_index = i;
+        }
+    }
+    mirror->n_fields = n_fields;
+
+    mirror->key_missing = mirror->key_index < 0;
+    if (mirror->key_missing) {
+        msg->err("PostgreSQL Mirror of %s Has No Column %s", mirror->table,
+                 mirror->key_column);
+        return POSTGRESQL_ERR;
+    }
+    return POSTGRESQL_OK;
+}
+
+/* Queue a snapshot that was replaced, it is freed once no worker may still read it. */
+static inline void __postgresql_mirror_retire(postgresql_mirror_t *mirror,
+                                              postgresql_mirror_snapshot_t *snapshot)
+{
+    snapshot->retired_at = __sync_add_and_fetch(&postgresql_mirror_epoch, 1);
+    mk_list_add(&snapshot->_head, &mirror->retired);
+}
+
+/* Build an immutable index of the working table and make it the one readers get. */
+static inline void __postgresql_mirror_publish(postgresql_mirror_t *mirror)
+{
+    int i;
+    unsigned long n_slots = POSTGRESQL_MIRROR_MIN_SLOTS, slot;
+    size_t size;
+    char *ptr;
+    struct mk_list *head;
+    postgresql_mirror_entry_t *entry;
+    postgresql_mirror_snapshot_t *snapshot, *old;
+
+    while (n_slots < mirror->n_rows * 2) {
+        n_slots *= 2;
+    }
+
+    size = sizeof(postgresql_mirror_snapshot_t) + sizeof(char *) * mirror->n_fields +
+           sizeof(postgresql_mirror_tuple_t *) * n_slots;
+    for (i = 0; i < mirror->n_fields; ++i) {
+        size += strlen(mirror->fields[i]) + 1;
+    }
+
+    snapshot = monkey->mem_alloc(size);
+    if (!snapshot) {
+        return;
+    }
+
+    snapshot->n_fields  = mirror->n_fields;
+    snapshot->key_index = mirror->key_index;
+    snapshot->n_rows    = mirror->n_rows;
+    snapshot->mask      = n_slots - 1;
+    snapshot->slots     = (postgresql_mirror_tuple_t **) (snapshot + 1);
+    snapshot->fields    = (char **) (snapshot->slots + n_slots);
+    memset(snapshot->slots, 0, sizeof(postgresql_mirror_tuple_t *) * n_slots);
+
+    ptr = (char *) (snapshot->fields + mirror->n_fields);
+    for (i = 0; i < mirror->n_fields; ++i) {
+        snapshot->fields[i] = ptr;
+        strcpy(ptr, mirror->fields[i]);
+        ptr += strlen(ptr) + 1;
+    }
+
+    for (i = 0; i < POSTGRESQL_MIRROR_BUCKETS; ++i) {
+        mk_list_foreach(head, &mirror->buckets[i]) {
+            entry = mk_list_entry(head, postgresql_mirror_entry_t, _head);
+            slot = entry->tuple->hash & snapshot->mask;
+            while (snapshot->slots[slot]) {
+                slot = (slot + 1) & snapshot->mask;
+            }
+            snapshot->slots[slot] = entry->tuple;
+            entry->tuple->refs++;
+        }
+    }
+
+    old = __sync_lock_test_and_set(&mirror->current, snapshot);
+    __sync_synchronize();
+    if (old) {
+        __postgresql_mirror_retire(mirror, old);
+    }
+    mirror->dirty = 0;
+}
+
+/* Free the retired snapshots no worker can be reading anymore. */
+static inline void __postgresql_mirror_reclaim(postgresql_mirror_t *mirror)
+{
+    unsigned long i, min_epoch = (unsigned long) -1;
+    struct mk_list *head, *tmp;
+    postgresql_mirror_reader_t *reader;
+    postgresql_mirror_snapshot_t *snapshot;
+
+    if (mk_list_is_empty(&mirror->retired) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&postgresql_mirror_mutex);
+    mk_list_foreach(head, &postgresql_mirror_readers) {
+        reader = mk_list_entry(head, postgresql_mirror_reader_t, _head);
+        if (__sync_fetch_and_add(&reader->epoch, 0) < min_epoch) {
+            min_epoch = reader->epoch;
+        }
+    }
+    pthread_mutex_unlock(&postgresql_mirror_mutex);
+
+    mk_list_foreach_safe(head, tmp, &mirror->retired) {
+        snapshot = mk_list_entry(head, postgresql_mirror_snapshot_t, _head);
+        if (snapshot->retired_at > min_epoch) {
+            continue;
+        }
+        mk_list_del(&snapshot->_head);
+        for (i = 0; i <= snapshot->mask; ++i) {
+            if (snapshot->slots[i]) {
+                __postgresql_mirror_tuple_put(snapshot->slots[i]);
+            }
+        }
+        FREE(snapshot);
+    }
+}
+
+/* Stop the replication client, it starts over later from a fresh copy. */
+static inline void __postgresql_mirror_fail(postgresql_mirror_t *mirror)
+{
+    if (mirror->repl) {
+        msg->err("PostgreSQL Mirror of %s Error: %s", mirror->table,
+                 PQerrorMessage(mirror->repl));
+        event->delete(mirror->fd);
+        PQfinish(mirror->repl);
+        mirror->repl = NULL;
+    }
+    FREE(mirror->snapshot_name);
+    mirror->state    = MIRROR_STATE_IDLE;
+    mirror->retry_at = time(NULL) + POSTGRESQL_MIRROR_RETRY;
+}
+
+static inline void __postgresql_mirror_wait(postgresql_mirror_t *mirror)
+{
+    int ret = PQflush(mirror->repl);
+
+    if (ret == -1) {
+        __postgresql_mirror_fail(mirror);
+    } else if (ret == 1) {
+        event->mode(mirror->fd, DUDA_EVENT_READ | DUDA_EVENT_WRITE, DUDA_EVENT_LEVEL_TRIGGERED);
+    } else {
+        event->mode(mirror->fd, DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED);
+    }
+}
+
+/* Acknowledge the position applied to the mirror, the server may recycle the WAL before it. */
+static inline void __postgresql_mirror_feedback(postgresql_mirror_t *mirror, int reply)
+{
+    char buf[34];
+    struct timeval tv;
+    uint64_t now;
+
+    if (mirror->state != MIRROR_STATE_STREAMING) {
+        return;
+    }
+
+    gettimeofday(&tv, NULL);
+    now = ((uint64_t) tv.tv_sec - POSTGRESQL_MIRROR_PG_EPOCH) * 1000000 + tv.tv_usec;
+
+    buf[0] = 'r';
+    __postgresql_mirror_put(buf + 1, mirror->received_lsn, 8);
+    __postgresql_mirror_put(buf + 9, mirror->applied_lsn, 8);
+    __postgresql_mirror_put(buf + 17, mirror->applied_lsn, 8);
+    __postgresql_mirror_put(buf + 25, now, 8);
+    buf[33] = reply;
+
+    if (PQputCopyData(mirror->repl, buf, sizeof(buf)) != 1) {
+        __postgresql_mirror_fail(mirror);
+        return;
+    }
+    __postgresql_mirror_wait(mirror);
+}
+
+/* Read the columns of a change, unchanged TOAST values are taken from the old row. */
+static inline postgresql_mirror_tuple_t *__postgresql_mirror_read_tuple(postgresql_mirror_t *mirror,
+                                                                        postgresql_mirror_buf_t *buf,
+                                                                        postgresql_mirror_tuple_t *old)
+{
+    int i, n, length;
+    char kind;
+    const char **values;
+    int *lengths;
+    postgresql_mirror_tuple_t *tuple = NULL;
+
+    n = (int) __postgresql_mirror_get(buf, 2);
+    if (buf->error || n != mirror->n_fields) {
+        buf->error = 1;
+        return NULL;
+    }
+
+    values  = monkey->mem_alloc(sizeof(char *) * (n + 1));
+    lengths = monkey->mem_alloc(sizeof(int) * (n + 1));
+    if (!values || !lengths) {
+        buf->error = 1;
+        goto out;
+    }
+
+    for (i = 0; i < n; ++i) {
+        kind = (char) __postgresql_mirror_get(buf, 1);
+        if (kind == 't') {
+            length = (int) __postgresql_mirror_get(buf, 4);
+            if (buf->error || length < 0 || (size_t) length > buf->left) {
+                buf->error = 1;
+                goto out;
+            }
+            values[i]  = buf->ptr;
+            lengths[i] = length;
+            buf->ptr  += length;
+            buf->left -= length;
+        } else if (kind == 'u' && old) {
+            values[i]  = old->values[i];
+            lengths[i] = strlen(old->values[i]);
+        } else {
+            /* NULL values are empty strings, as in query results */
+            values[i]  = "";
+            lengths[i] = 0;
+        }
+    }
+
+    if (!buf->error) {
+        tuple = __postgresql_mirror_tuple_new(n, values, lengths, mirror->key_index);
+    }
+
+out:
+    FREE(values);
+    FREE(lengths);
+    return tuple;
+}
+
+/* Track the relation of the mirrored table, the columns must match the copy. */
+static inline int __postgresql_mirror_relation(postgresql_mirror_t *mirror,
+                                               postgresql_mirror_buf_t *buf)
+{
+    int i, n;
+    uint32_t relid;
+    const char *schema, *table, **fields;
+
+    relid  = (uint32_t) __postgresql_mirror_get(buf, 4);
+    schema = __postgresql_mirror_get_str(buf);
+    table  = __postgresql_mirror_get_str(buf);
+    __postgresql_mirror_get(buf, 1);
+    n = (int) __postgresql_mirror_get(buf, 2);
+    if (buf->error || strcmp(schema, mirror->schema) != 0 || strcmp(table, mirror->table) != 0) {
+        return buf->error ? POSTGRESQL_ERR : POSTGRESQL_OK;
+    }
+
+    fields = monkey->mem_alloc(sizeof(char *) * (n + 1));
+    if (!fields) {
+        return POSTGRESQL_ERR;
+    }
+    for (i = 0; i < n; ++i) {
+        __postgresql_mirror_get(buf, 1);
+        fields[i] = __postgresql_mirror_get_str(buf);
+        __postgresql_mirror_get(buf, 8);
+    }
+
+    if (buf->error) {
+        FREE(fields);
+        return POSTGRESQL_ERR;
+    }
+
+    /* the copy of an empty table gives no columns */
+    if (mirror->n_fields == 0 &&
+        __postgresql_mirror_set_fields(mirror, n, fields) != POSTGRESQL_OK) {
+        FREE(fields);
+        return POSTGRESQL_ERR;
+    }
+
+    /* a changed table is loaded again rather than patched */
+    if (n != mirror->n_fields) {
+        FREE(fields);
+        return POSTGRESQL_ERR;
+    }
+    for (i = 0; i < n; ++i) {
+        if (strcmp(fields[i], mirror->fields[i]) != 0) {
+            FREE(fields);
+            return POSTGRESQL_ERR;
+        }
+    }
+    FREE(fields);
+    mirror->relid = relid;
+    return POSTGRESQL_OK;
+}
+
+/* Apply one pgoutput message to the working table. */
+static inline int __postgresql_mirror_apply(postgresql_mirror_t *mirror,
+                                            postgresql_mirror_buf_t *buf)
+{
+    int i, n;
+    char kind;
+    uint32_t relid;
+    postgresql_mirror_entry_t *entry;
+    postgresql_mirror_tuple_t *old = NULL, *tuple;
+    const char *key;
+
+    switch (__postgresql_mirror_get(buf, 1)) {
+    case 'R':
+        return __postgresql_mirror_relation(mirror, buf);
+    case 'C':
+        __postgresql_mirror_get(buf, 1);
+        __postgresql_mirror_get(buf, 8);
+        mirror->applied_lsn = __postgresql_mirror_get(buf, 8);
+        break;
+    case 'I':
+        relid = (uint32_t) __postgresql_mirror_get(buf, 4);
+        if (relid != mirror->relid || __postgresql_mirror_get(buf, 1) != 'N') {
+            break;
+        }
+        tuple = __postgresql_mirror_read_tuple(mirror, buf, NULL);
+        if (tuple) {
+            __postgresql_mirror_upsert(mirror, tuple);
+        }
+        break;
+    case 'U':
+        relid = (uint32_t) __postgresql_mirror_get(buf, 4);
+        if (relid != mirror->relid) {
+            break;
+        }
+        kind = (char) __postgresql_mirror_get(buf, 1);
+        if (kind == 'K' || kind == 'O') {
+            /* the key changed, the row under the old key goes away */
+            tuple = __postgresql_mirror_read_tuple(mirror, buf, NULL);
+            if (tuple) {
+                key   = tuple->values[mirror->key_index];
+                entry = __postgresql_mirror_find(mirror, key, tuple->hash);
+                if (entry) {
+                    old = entry->tuple;
+                    old->refs++;
+                    __postgresql_mirror_delete(mirror, key);
+                }
+                FREE(tuple);
+            }
+            kind = (char) __postgresql_mirror_get(buf, 1);
+        }
+        if (kind != 'N') {
+            buf->error = 1;
+        }
+        if (!buf->error && !old) {
+            /* peek at the key of the new row to find the old one */
+            postgresql_mirror_buf_t peek = *buf;
+            tuple = __postgresql_mirror_read_tuple(mirror, &peek, NULL);
+            if (tuple) {
+                entry = __postgresql_mirror_find(mirror, tuple->values[mirror->key_index],
+                                                 tuple->hash);
+                if (entry) {
+                    old = entry->tuple;
+                    old->refs++;
+                }
+                FREE(tuple);
+            }
+        }
+        tuple = buf->error ? NULL : __postgresql_mirror_read_tuple(mirror, buf, old);
+        if (tuple) {
+            __postgresql_mirror_upsert(mirror, tuple);
+        }
+        if (old) {
+            __postgresql_mirror_tuple_put(old);
+        }
+        break;
+    case 'D':
+        relid = (uint32_t) __postgresql_mirror_get(buf, 4);
+        if (relid != mirror->relid) {
+            break;
+        }
+        __postgresql_mirror_get(buf, 1);
+        tuple = __postgresql_mirror_read_tuple(mirror, buf, NULL);
+        if (tuple) {
+            __postgresql_mirror_delete(mirror, tuple->values[mirror->key_index]);
+            FREE(tuple);
+        }
+        break;
+    case 'T':
+        n = (int) __postgresql_mirror_get(buf, 4);
+        __postgresql_mirror_get(buf, 1);
+        for (i = 0; i < n && !buf->error; ++i) {
+            if ((uint32_t) __postgresql_mirror_get(buf, 4) == mirror->relid) {
+                __postgresql_mirror_clear(mirror);
+            }
+        }
+        break;
+    default:
+        /* begin, origin, type and other messages don't change the table */
+        break;
+    }
+    return buf->error ? POSTGRESQL_ERR : POSTGRESQL_OK;
+}
+
+static inline void __postgresql_mirror_stream(postgresql_mirror_t *mirror)
+{
+    int n;
+    char *data;
+    uint64_t lsn;
+    postgresql_mirror_buf_t buf;
+
+    if (PQconsumeInput(mirror->repl) == 0) {
+        __postgresql_mirror_fail(mirror);
+        return;
+    }
+
+    while ((n = PQgetCopyData(mirror->repl, &data, 1)) > 0) {
+        buf.ptr   = data;
+        buf.left  = n;
+        buf.error = 0;
+
+        switch (__postgresql_mirror_get(&buf, 1)) {
+        case 'w':
+            lsn = __postgresql_mirror_get(&buf, 8);
+            __postgresql_mirror_get(&buf, 16);
+            if (lsn > mirror->received_lsn) {
+                mirror->received_lsn = lsn;
+            }
+            if (!buf.error) {
+                __postgresql_mirror_apply(mirror, &buf);
+            }
+            break;
+        case 'k':
+            lsn = __postgresql_mirror_get(&buf, 8);
+            __postgresql_mirror_get(&buf, 8);
+            if (lsn > mirror->received_lsn) {
+                mirror->received_lsn = lsn;
+            }
+            if (__postgresql_mirror_get(&buf, 1) == 1) {
+                PQfreemem(data);
+                __postgresql_mirror_feedback(mirror, 0);
+                if (mirror->state != MIRROR_STATE_STREAMING) {
+                    return;
+                }
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+        PQfreemem(data);
+
+        if (buf.error) {
+            __postgresql_mirror_fail(mirror);
+            return;
+        }
+    }
+
+    /* readers see a batch of changes at once */
+    if (mirror->dirty) {
+        __postgresql_mirror_publish(mirror);
+    }
+
+    if (n < 0) {
+        __postgresql_mirror_fail(mirror);
+    }
+}
+
+static inline void __postgresql_mirror_start(postgresql_mirror_t *mirror)
+{
+    char query[512];
+
+    snprintf(query, sizeof(query),
+             "START_REPLICATION SLOT duda_mirror_%d_%d LOGICAL %X/%X "
+             "(proto_version '1', publication_names '%s')",
+             (int) getpid(), mirror->id, (unsigned int) (mirror->start_lsn >> 32),
+             (unsigned int) mirror->start_lsn, mirror->publication);
+
+    if (PQsendQuery(mirror->repl, query) != 1) {
+        __postgresql_mirror_fail(mirror);
+        return;
+    }
+    mirror->state = MIRROR_STATE_START;
+    __postgresql_mirror_wait(mirror);
+}
+
+static void __postgresql_mirror_copy_result(void *privdata, postgresql_query_t *query,
+                                            int n_fields, char **fields, duda_request_t *dr)
+{
+    postgresql_mirror_t *mirror = privdata;
+
+    /* without its key the rows are skipped, an aborted query would never end */
+    __postgresql_mirror_set_fields(mirror, n_fields, (const char **) fields);
+}
+
+static void __postgresql_mirror_copy_row(void *privdata, postgresql_query_t *query,
+                                         int n_fields, char **fields, char **values,
+                                         duda_request_t *dr)
+{
+    int i;
+    int *lengths;
+    postgresql_mirror_t *mirror = privdata;
+    postgresql_mirror_tuple_t *tuple;
+
+    if (n_fields != mirror->n_fields || mirror->key_index < 0 || mirror->key_missing) {
+        return;
+    }
+
+    lengths = monkey->mem_alloc(sizeof(int) * (n_fields + 1));
+    if (!lengths) {
+        return;
+    }
+    for (i = 0; i < n_fields; ++i) {
+        lengths[i] = strlen(values[i]);
+    }
+    tuple = __postgresql_mirror_tuple_new(n_fields, (const char **) values, lengths,
+                                          mirror->key_index);
+    FREE(lengths);
+    if (tuple) {
+        __postgresql_mirror_upsert(mirror, tuple);
+    }
+}
+
+static void __postgresql_mirror_copy_end(void *privdata, postgresql_query_t *query,
+                                         duda_request_t *dr)
+{
+    postgresql_mirror_t *mirror = privdata;
+
+    if (mirror->state != MIRROR_STATE_COPY) {
+        return;
+    }
+
+    if (postgresql_query_status(query) != POSTGRESQL_OK || mirror->key_missing) {
+        __postgresql_mirror_fail(mirror);
+        return;
+    }
+
+    __postgresql_mirror_publish(mirror);
+    FREE(mirror->snapshot_name);
+    __postgresql_mirror_start(mirror);
+}
+
+static void __postgresql_mirror_copy_connected(postgresql_conn_t *conn, int status,
+                                               duda_request_t *dr)
+{
+    if (status == POSTGRESQL_OK) {
+        postgresql_conn_disconnect(conn, NULL);
+    }
+}
+
+/*
+ * Load the table as of the snapshot exported with the replication slot, on a
+ * regular connection. The stream then starts right after that snapshot.
+ */
+static inline void __postgresql_mirror_copy(postgresql_mirror_t *mirror)
+{
+    char *schema, *table, *query;
+    size_t length;
+    postgresql_conn_t *conn;
+
+    schema = __postgresql_mirror_quote(mirror->schema);
+    table  = __postgresql_mirror_quote(mirror->table);
+    length = strlen(mirror->snapshot_name) + (schema ? strlen(schema) : 0) +
+             (table ? strlen(table) : 0) + 128;
+    query  = monkey->mem_alloc(length);
+    if (!schema || !table || !query) {
+        FREE(schema);
+        FREE(table);
+        FREE(query);
+        __postgresql_mirror_fail(mirror);
+        return;
+    }
+
+    snprintf(query, length, "BEGIN ISOLATION LEVEL REPEATABLE READ; "
+             "SET TRANSACTION SNAPSHOT '%s'; SELECT * FROM %s.%s; COMMIT",
+             mirror->snapshot_name, schema, table);
+    FREE(schema);
+    FREE(table);
+
+    __postgresql_mirror_clear(mirror);
+    mirror->key_missing = 0;
+    mirror->state = MIRROR_STATE_COPY;
+    conn = postgresql_conn_connect_uri(NULL, __postgresql_mirror_copy_connected, mirror->uri);
+    if (!conn || postgresql_conn_send_query(conn, query, __postgresql_mirror_copy_result,
+                                            __postgresql_mirror_copy_row,
+                                            __postgresql_mirror_copy_end,
+                                            mirror) != POSTGRESQL_OK) {
+        FREE(query);
+        __postgresql_mirror_fail(mirror);
+        return;
+    }
+    FREE(query);
+}
+
+static inline void __postgresql_mirror_slot_created(postgresql_mirror_t *mirror)
+{
+    PGresult *result;
+    unsigned int hi, lo;
+    int ok = 0;
+
+    if (PQconsumeInput(mirror->repl) == 0) {
+        __postgresql_mirror_fail(mirror);
+        return;
+    }
+    if (PQisBusy(mirror->repl)) {
+        return;
+    }
+
+    while ((result = PQgetResult(mirror->repl)) != NULL) {
+        if (PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) == 1 &&
+            PQnfields(result) >= 3 &&
+            sscanf(PQgetvalue(result, 0, 1), "%X/%X", &hi, &lo) == 2) {
+            mirror->start_lsn     = ((uint64_t) hi << 32) | lo;
+            mirror->snapshot_name = monkey->str_dup(PQgetvalue(result, 0, 2));
+            ok = 1;
+        }
+        PQclear(result);
+    }
+
+    if (!ok || !mirror->snapshot_name) {
+        __postgresql_mirror_fail(mirror);
+        return;
+    }
+
+    /* the exported snapshot lives until the next command on this connection */
+    event->mode(mirror->fd, DUDA_EVENT_SLEEP, DUDA_EVENT_LEVEL_TRIGGERED);
+    __postgresql_mirror_copy(mirror);
+}
+
+static inline void __postgresql_mirror_started(postgresql_mirror_t *mirror)
+{
+    PGresult *result;
+
+    if (PQconsumeInput(mirror->repl) == 0) {
+        __postgresql_mirror_fail(mirror);
+        return;
+    }
+    if (PQisBusy(mirror->repl)) {
+        return;
+    }
+
+    result = PQgetResult(mirror->repl);
+    if (!result || PQresultStatus(result) != PGRES_COPY_BOTH) {
+        if (result) {
+            PQclear(result);
+        }
+        __postgresql_mirror_fail(mirror);
+        return;
+    }
+    PQclear(result);
+
+    msg->info("[FD %i] PostgreSQL Mirror of %s Streaming", mirror->fd, mirror->table);
+    mirror->state        = MIRROR_STATE_STREAMING;
+    mirror->received_lsn = mirror->start_lsn;
+    mirror->applied_lsn  = mirror->start_lsn;
+    __postgresql_mirror_stream(mirror);
+}
+
+static inline void __postgresql_mirror_connecting(postgresql_mirror_t *mirror)
+{
+    char query[128];
+    int events = 0;
+    int status = PQconnectPoll(mirror->repl);
+
+    if (status == PGRES_POLLING_FAILED) {
+        __postgresql_mirror_fail(mirror);
+    } else if (status == PGRES_POLLING_OK) {
+        /* a temporary slot goes away with the connection */
+        snprintf(query, sizeof(query),
+                 "CREATE_REPLICATION_SLOT duda_mirror_%d_%d TEMPORARY LOGICAL pgoutput",
+                 (int) getpid(), mirror->id);
+        if (PQsendQuery(mirror->repl, query) != 1) {
+            __postgresql_mirror_fail(mirror);
+            return;
+        }
+        mirror->state = MIRROR_STATE_SLOT;
+        __postgresql_mirror_wait(mirror);
+    } else {
+        if (status & PGRES_POLLING_READING) {
+            events |= DUDA_EVENT_READ;
+        }
+        if (status & PGRES_POLLING_WRITING) {
+            events |= DUDA_EVENT_WRITE;
+        }
+        event->mode(mirror->fd, events, DUDA_EVENT_LEVEL_TRIGGERED);
+    }
+}
+
+static int __postgresql_mirror_on_event(int fd, void *data)
+{
+    postgresql_mirror_t *mirror = data;
+
+    if (mirror->state != MIRROR_STATE_CONNECTING && PQflush(mirror->repl) == 1) {
+        return DUDA_EVENT_OWNED;
+    }
+
+    switch (mirror->state) {
+    case MIRROR_STATE_CONNECTING:
+        __postgresql_mirror_connecting(mirror);
+        break;
+    case MIRROR_STATE_SLOT:
+        __postgresql_mirror_slot_created(mirror);
+        break;
+    case MIRROR_STATE_START:
+        __postgresql_mirror_started(mirror);
+        break;
+    case MIRROR_STATE_STREAMING:
+        __postgresql_mirror_stream(mirror);
+        if (mirror->state == MIRROR_STATE_STREAMING) {
+            __postgresql_mirror_wait(mirror);
+        }
+        break;
+    default:
+        break;
+    }
+    return DUDA_EVENT_OWNED;
+}
+
+static int __postgresql_mirror_on_close(int fd, void *data)
+{
+    postgresql_mirror_t *mirror = data;
+
+    if (mirror->repl) {
+        msg->err("[FD %i] PostgreSQL Mirror of %s Connection Lost", fd, mirror->table);
+        __postgresql_mirror_fail(mirror);
+    }
+    return DUDA_EVENT_OWNED;
+}
+
+/* Open the replication connection, with the connection string of the mirror as dbname. */
+static inline void __postgresql_mirror_connect(postgresql_mirror_t *mirror)
+{
+    const char *keys[]   = {"dbname", "replication", NULL};
+    const char *values[] = {mirror->uri, "database", NULL};
+
+    mirror->repl = PQconnectStartParams(keys, values, 1);
+    if (!mirror->repl || PQstatus(mirror->repl) == CONNECTION_BAD ||
+        PQsetnonblocking(mirror->repl, 1) == -1) {
+        if (mirror->repl) {
+            msg->err("PostgreSQL Mirror of %s Connect Error: %s", mirror->table,
+                     PQerrorMessage(mirror->repl));
+            PQfinish(mirror->repl);
+            mirror->repl = NULL;
+        }
+        mirror->retry_at = time(NULL) + POSTGRESQL_MIRROR_RETRY;
+        return;
+    }
+
+    mirror->fd    = PQsocket(mirror->repl);
+    mirror->state = MIRROR_STATE_CONNECTING;
+    event->add(mirror->fd, DUDA_EVENT_WRITE, DUDA_EVENT_LEVEL_TRIGGERED,
+               __postgresql_mirror_on_event, __postgresql_mirror_on_event,
+               __postgresql_mirror_on_close, __postgresql_mirror_on_close, NULL, mirror);
+}
+
+static void __postgresql_reference_result(void *privdata, postgresql_query_t *query,
+                                          int n_fields, char **fields, duda_request_t *dr)
+{
+    int i;
+    postgresql_mirror_t *mirror = privdata;
+
+    if (mirror->full) {
+        mirror->watermark_index = -1;
+        if (__postgresql_mirror_set_fields(mirror, n_fields,
+                                           (const char **) fields) != POSTGRESQL_OK) {
+            return;
+        }
+        for (i = 0; mirror->watermark_column && i < n_fields; ++i) {
+            if (strcmp(fields[i], mirror->watermark_column) == 0) {
+                mirror->watermark_index = i;
+            }
+        }
+        return;
+    }
+
+    /* the columns changed since the last full reload */
+    for (i = 0; i < n_fields && n_fields == mirror->n_fields; ++i) {
+        if (strcmp(fields[i], mirror->fields[i]) != 0) {
+            break;
+        }
+    }
+    if (i != n_fields || n_fields != mirror->n_fields) {
+        /* skip the rows, the next refresh reloads everything */
+        mirror->key_missing = 1;
+        mirror->full = 1;
+    }
+}
+
+static void __postgresql_reference_row(void *privdata, postgresql_query_t *query,
+                                       int n_fields, char **fields, char **values,
+                                       duda_request_t *dr)
+{
+    postgresql_mirror_t *mirror = privdata;
+
+    __postgresql_mirror_copy_row(privdata, query, n_fields, fields, values, dr);
+
+    /* rows come ordered by the watermark, the last one has the highest */
+    if (mirror->watermark_index >= 0 && n_fields == mirror->n_fields) {
+        FREE(mirror->pending_watermark);
+        mirror->pending_watermark = monkey->str_dup(values[mirror->watermark_index]);
+    }
+}
+
+static void __postgresql_reference_end(void *privdata, postgresql_query_t *query,
+                                       duda_request_t *dr)
+{
+    postgresql_mirror_t *mirror = privdata;
+    postgresql_conn_t *conn = mirror->refresh_conn;
+    int status = postgresql_query_status(query);
+
+    mirror->refreshing   = 0;
+    mirror->refresh_conn = NULL;
+    mirror->refresh_at   = time(NULL) + mirror->interval;
+
+    /* a lost connection is released by the package itself */
+    if (status != POSTGRESQL_CONN_LOST) {
+        postgresql_conn_disconnect(conn, NULL);
+    }
+
+    if (status != POSTGRESQL_OK || mirror->key_missing) {
+        /* a partial reload is never published, rows of a partial refresh are loaded again */
+        FREE(mirror->pending_watermark);
+        return;
+    }
+
+    if (mirror->pending_watermark) {
+        FREE(mirror->watermark);
+        mirror->watermark = mirror->pending_watermark;
+        mirror->pending_watermark = NULL;
+    }
+
+    if (mirror->dirty || !mirror->current) {
+        __postgresql_mirror_publish(mirror);
+    }
+
+    mirror->full = 0;
+    if (!mirror->watermark_column || mirror->watermark_index < 0 || !mirror->watermark ||
+        ++mirror->refreshes % POSTGRESQL_REFERENCE_FULL_EVERY == 0) {
+        mirror->full = 1;
+    }
+}
+
+/* Run the reference query on a batch connection of its pool, only for rows past the watermark. */
+static inline void __postgresql_reference_refresh(postgresql_mirror_t *mirror)
+{
+    int ret;
+    size_t length;
+    char *column = NULL, *query;
+    const char *params[1];
+    postgresql_conn_t *conn;
+
+    if (mirror->watermark_column) {
+        column = __postgresql_mirror_quote(mirror->watermark_column);
+        if (!column) {
+            return;
+        }
+    }
+
+    length = strlen(mirror->query) + (column ? strlen(column) * 2 : 0) + 128;
+    query  = monkey->mem_alloc(length);
+    if (!query) {
+        FREE(column);
+        return;
+    }
+
+    if (!column) {
+        snprintf(query, length, "SELECT * FROM (%s) AS duda_reference", mirror->query);
+    } else if (mirror->full) {
+        snprintf(query, length, "SELECT * FROM (%s) AS duda_reference ORDER BY %s",
+                 mirror->query, column);
+    } else {
+        /* rows sharing the watermark may have been committed after the last refresh */
+        snprintf(query, length, "SELECT * FROM (%s) AS duda_reference "
+                 "WHERE %s >= $1 ORDER BY %s", mirror->query, column, column);
+    }
+    FREE(column);
+
+    conn = postgresql_pool_get_conn_class(mirror->pool_key, POSTGRESQL_CLASS_BATCH, NULL, NULL);
+    if (!conn) {
+        FREE(query);
+        mirror->refresh_at = time(NULL) + mirror->interval;
+        return;
+    }
+
+    if (mirror->full) {
+        __postgresql_mirror_clear(mirror);
+    }
+
+    mirror->refreshing   = 1;
+    mirror->refresh_conn = conn;
+    mirror->key_missing  = 0;
+    postgresql_conn_set_query_priority(conn, POSTGRESQL_PRIORITY_BACKGROUND);
+    if (mirror->full || !mirror->watermark_column) {
+        ret = postgresql_conn_send_query(conn, query, __postgresql_reference_result,
+                                         __postgresql_reference_row,
+                                         __postgresql_reference_end, mirror);
+    } else {
+        params[0] = mirror->watermark;
+        ret = postgresql_conn_send_query_params(conn, query, 1, params, NULL, NULL, 0,
+                                                __postgresql_reference_result,
+                                                __postgresql_reference_row,
+                                                __postgresql_reference_end, mirror);
+    }
+    FREE(query);
+
+    if (ret != POSTGRESQL_OK) {
+        mirror->refreshing   = 0;
+        mirror->refresh_conn = NULL;
+        mirror->refresh_at = time(NULL) + mirror->interval;
+        postgresql_conn_disconnect(conn, NULL);
+    }
+}
+
+/*
+ * A worker is between callbacks whenever its timer fires: it holds no
+ * snapshot anymore, and the replication clients it runs get their turn.
+ */
+static int __postgresql_mirror_on_tick(int fd, void *data)
+{
+    uint64_t expirations;
+    struct mk_list *head;
+    postgresql_mirror_t *mirror;
+    postgresql_mirror_reader_t *reader = data;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return DUDA_EVENT_OWNED;
+    }
+
+    __sync_lock_test_and_set(&reader->epoch, __sync_fetch_and_add(&postgresql_mirror_epoch, 0));
+
+    mk_list_foreach(head, &postgresql_mirror_list) {
+        mirror = mk_list_entry(head, postgresql_mirror_t, _head);
+        if (mirror->owner != reader) {
+            continue;
+        }
+        if (mirror->pool_key) {
+            if (!mirror->refreshing && time(NULL) >= mirror->refresh_at) {
+                __postgresql_reference_refresh(mirror);
+            }
+            __postgresql_mirror_reclaim(mirror);
+            continue;
+        }
+        if (mirror->state == MIRROR_STATE_IDLE && time(NULL) >= mirror->retry_at) {
+            __postgresql_mirror_connect(mirror);
+        }
+        __postgresql_mirror_feedback(mirror, 0);
+        __postgresql_mirror_reclaim(mirror);
+    }
+    return DUDA_EVENT_OWNED;
+}
+
+static int __postgresql_mirror_on_tick_close(int fd, void *data)
+{
+    postgresql_mirror_reader_t *reader = data;
+
+    msg->err("[FD %i] PostgreSQL Mirror Timer Closed", fd);
+    reader->timer_fd = -1;
+    return DUDA_EVENT_CLOSE;
+}
+
+static inline postgresql_mirror_reader_t *__postgresql_mirror_reader()
+{
+    struct itimerspec spec;
+    postgresql_mirror_reader_t *reader = global->get(postgresql_mirror_key);
+    int fd;
+
+    if (reader) {
+        return reader;
+    }
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        msg->err("PostgreSQL Mirror Timer Create Error");
+        return NULL;
+    }
+
+    spec.it_interval.tv_sec  = POSTGRESQL_POOL_TICK_INTERVAL / 1000;
+    spec.it_interval.tv_nsec = (POSTGRESQL_POOL_TICK_INTERVAL % 1000) * 1000000;
+    spec.it_value            = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, NULL) == -1) {
+        msg->err("PostgreSQL Mirror Timer Set Error");
+        close(fd);
+        return NULL;
+    }
+
+    reader = monkey->mem_alloc(sizeof(postgresql_mirror_reader_t));
+    if (!reader) {
+        close(fd);
+        return NULL;
+    }
+    reader->timer_fd = fd;
+
+    /* a new reader holds no snapshot, it is quiescent as of now */
+    pthread_mutex_lock(&postgresql_mirror_mutex);
+    reader->epoch = __sync_fetch_and_add(&postgresql_mirror_epoch, 0);
+    mk_list_add(&reader->_head, &postgresql_mirror_readers);
+    pthread_mutex_unlock(&postgresql_mirror_mutex);
+
+    event->add(fd, DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED,
+               __postgresql_mirror_on_tick, NULL, __postgresql_mirror_on_tick_close,
+               __postgresql_mirror_on_tick_close, NULL, reader);
+    global->set(postgresql_mirror_key, (void *) reader);
+    return reader;
+}
+
+/*
+ * @METHOD_NAME: create_mirror
+ * @METHOD_DESC: Keep an in-memory copy of a small table, indexed by one of its columns and kept up to date by logical replication, so that lookups take no round trip to the server. The table must be part of the publication, the key column part of its replica identity, and the user allowed to replicate. The replication client is run by the first worker that looks the mirror up; it loads the table, streams its changes with the pgoutput plugin through a temporary slot, and acknowledges the positions applied. Readers get immutable snapshots that are replaced as a whole after every batch of changes. It must be called within the function `duda_main()' of a Duda web service.
+ * @METHOD_PROTO: postgresql_mirror_t *create_mirror(const char *uri, const char *publication, const char *table, const char *key_column)
+ * @METHOD_PARAM: uri The connection string of the database.
+ * @METHOD_PARAM: publication The name of the publication including the table, made of letters, digits and underscores.
+ * @METHOD_PARAM: table The name of the table, optionally qualified by its schema (public by default).
+ * @METHOD_PARAM: key_column The column the rows are looked up by, its values must be unique.
+ * @METHOD_RETURN: The mirror on success, or NULL on failure.
+ */
+
+postgresql_mirror_t *postgresql_mirror_create(const char *uri, const char *publication,
+                                              const char *table, const char *key_column)
+{
+    int i;
+    const char *dot, *ptr;
+    postgresql_mirror_t *mirror;
+
+    if (!uri || !publication || !table || !key_column || !publication[0]) {
+        return NULL;
+    }
+    for (ptr = publication; *ptr; ++ptr) {
+        if (!((*ptr >= 'a' && *ptr <= 'z') || (*ptr >= 'A' && *ptr <= 'Z') ||
+              (*ptr >= '0' && *ptr <= '9') || *ptr == '_')) {
+            msg->err("PostgreSQL Mirror Invalid Publication Name: %s", publication);
+            return NULL;
+        }
+    }
+
+    mirror = monkey->mem_alloc(sizeof(postgresql_mirror_t));
+    if (!mirror) {
+        return NULL;
+    }
+    memset(mirror, 0, sizeof(postgresql_mirror_t));
+
+    dot = strchr(table, '.');
+    mirror->uri         = monkey->str_dup(uri);
+    mirror->publication = monkey->str_dup(publication);
+    mirror->schema      = dot ? monkey->str_dup(table) : monkey->str_dup("public");
+    mirror->table       = monkey->str_dup(dot ? dot + 1 : table);
+    mirror->key_column  = monkey->str_dup(key_column);
+    if (dot) {
+        mirror->schema[dot - table] = '\0';
+    }
+    mirror->id        = __sync_add_and_fetch(&postgresql_mirror_ids, 1);
+    mirror->state     = MIRROR_STATE_IDLE;
+    mirror->fd        = -1;
+    mirror->key_index = -1;
+    for (i = 0; i < POSTGRESQL_MIRROR_BUCKETS; ++i) {
+        mk_list_init(&mirror->buckets[i]);
+    }
+    mk_list_init(&mirror->retired);
+    mk_list_add(&mirror->_head, &postgresql_mirror_list);
+    return mirror;
+}
+
+/*
+ * @METHOD_NAME: create_reference
+ * @METHOD_DESC: Keep an in-memory copy of the result of a query on slowly changing lookup tables, indexed by one of its columns, so that lookups take no round trip to the server. The query is run by the first worker that looks the reference up, then refreshed in the background on a batch connection of the pool: only the rows whose watermark column is at least the highest value already loaded are fetched, such as an updated_at column or `xmin::text::bigint'. Deleted rows are dropped on a full reload, run every 60 refreshes, or on every refresh without watermark. Readers get immutable snapshots that are replaced as a whole after every refresh, and are looked up with mirror_lookup. It must be called within the function `duda_main()' of a Duda web service.
+ * @METHOD_PROTO: postgresql_mirror_t *create_reference(duda_global_t *pool_key, const char *query, const char *key_column, const char *watermark_column, int interval)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: query The SELECT statement loading the rows, without ORDER BY.
+ * @METHOD_PARAM: key_column The column of the result the rows are looked up by, its values must be unique. An expression concatenating several columns can be used for composite keys.
+ * @METHOD_PARAM: watermark_column The column of the result growing with every change of a row, or NULL to reload the whole result on every refresh.
+ * @METHOD_PARAM: interval The number of seconds between two refreshes.
+ * @METHOD_RETURN: The reference on success, or NULL on failure.
+ */
+
+postgresql_mirror_t *postgresql_mirror_reference(duda_global_t *pool_key, const char *query,
+                                                 const char *key_column,
+                                                 const char *watermark_column, int interval)
+{
+    int i;
+    postgresql_mirror_t *mirror;
+
+    if (!pool_key || !query || !key_column || interval < 1) {
+        return NULL;
+    }
+
+    mirror = monkey->mem_alloc(sizeof(postgresql_mirror_t));
+    if (!mirror) {
+        return NULL;
+    }
+    memset(mirror, 0, sizeof(postgresql_mirror_t));
+
+    mirror->pool_key   = pool_key;
+    mirror->query      = monkey->str_dup(query);
+    mirror->table      = mirror->query;
+    mirror->key_column = monkey->str_dup(key_column);
+    if (watermark_column) {
+        mirror->watermark_column = monkey->str_dup(watermark_column);
+    }
+    mirror->interval  = interval;
+    mirror->full      = 1;
+    mirror->state     = MIRROR_STATE_IDLE;
+    mirror->fd        = -1;
+    mirror->key_index = -1;
+    mirror->watermark_index = -1;
+    for (i = 0; i < POSTGRESQL_MIRROR_BUCKETS; ++i) {
+        mk_list_init(&mirror->buckets[i]);
+    }
+    mk_list_init(&mirror->retired);
+    mk_list_add(&mirror->_head, &postgresql_mirror_list);
+    return mirror;
+}
+
+/*
+ * @METHOD_NAME: mirror_lookup
+ * @METHOD_DESC: Look a row of a mirrored table or of a reference query up by its key, without any query. The row belongs to the snapshot of the table the worker currently sees, it must not be used once the calling callback has returned.
+ * @METHOD_PROTO: int mirror_lookup(postgresql_mirror_t *mirror, const char *key, postgresql_mirror_row_t *row)
+ * @METHOD_PARAM: mirror The mirror returned by create_mirror or create_reference.
+ * @METHOD_PARAM: key The value of the key column.
+ * @METHOD_PARAM: row The row to be filled with the column names and values.
+ * @METHOD_RETURN: POSTGRESQL_OK if the row was found, or POSTGRESQL_ERR if it does not exist or the table is not loaded yet.
+ */
+
+int postgresql_mirror_lookup(postgresql_mirror_t *mirror, const char *key,
+                             postgresql_mirror_row_t *row)
+{
+    uint32_t hash;
+    unsigned long slot;
+    postgresql_mirror_reader_t *reader = __postgresql_mirror_reader();
+    postgresql_mirror_snapshot_t *snapshot;
+    postgresql_mirror_tuple_t *tuple;
+
+    if (!reader) {
+        return POSTGRESQL_ERR;
+    }
+
+    /* the first worker looking the mirror up runs its replication client */
+    if (!mirror->owner &&
+        __sync_bool_compare_and_swap(&mirror->owner, NULL, reader)) {
+        if (mirror->pool_key) {
+            __postgresql_reference_refresh(mirror);
+        } else {
+            __postgresql_mirror_connect(mirror);
+        }
+    }
+
+    snapshot = __sync_fetch_and_add(&mirror->current, 0);
+    if (!snapshot) {
+        return POSTGRESQL_ERR;
+    }
+
+    hash = postgresql_util_hash(key, strlen(key));
+    slot = hash & snapshot->mask;
+    while ((tuple = snapshot->slots[slot]) != NULL) {
+        if (tuple->hash == hash && strcmp(tuple->values[snapshot->key_index], key) == 0) {
+            row->n_fields = snapshot->n_fields;
+            row->fields   = snapshot->fields;
+            row->values   = tuple->values;
+            return POSTGRESQL_OK;
+        }
+        slot = (slot + 1) & snapshot->mask;
+    }
+    return POSTGRESQL_ERR;
+}
@@ -0,0 +1,150 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_MIRROR_PRIV_H
+#define POSTGRESQL_MIRROR_PRIV_H
+
+#include <stdint.h>
+#include <libpq-fe.h>
+#include "mirror.h"
+
+/* buckets of the table a replication client keeps up to date */
+#define POSTGRESQL_MIRROR_BUCKETS 1024
+
+/* seconds before a failed replication client starts over */
+#define POSTGRESQL_MIRROR_RETRY 5
+
+/* smallest number of slots of a snapshot */
+#define POSTGRESQL_MIRROR_MIN_SLOTS 16
+
+/* refreshes of a reference query between two full reloads, which pick up deleted rows */
+#define POSTGRESQL_REFERENCE_FULL_EVERY 60
+
+/* seconds between 1970-01-01 and 2000-01-01, the epoch of replication timestamps */
+#define POSTGRESQL_MIRROR_PG_EPOCH 946684800
+
+typedef enum {
+    MIRROR_STATE_IDLE,        /* not started, or waiting to start over */
+    MIRROR_STATE_CONNECTING,
+    MIRROR_STATE_SLOT,        /* creating the replication slot */
+    MIRROR_STATE_COPY,        /* loading the table as of the slot snapshot */
+    MIRROR_STATE_START,       /* starting the replication stream */
+    MIRROR_STATE_STREAMING,
+} postgresql_mirror_state_t;
+
+/* a row, immutable and shared by the working table and the snapshots */
+typedef struct postgresql_mirror_tuple {
+    int refs; /* only touched by the worker running the replication client */
+    uint32_t hash;
+    int n_values;
+    char **values;
+} postgresql_mirror_tuple_t;
+
+typedef struct postgresql_mirror_entry {
+    postgresql_mirror_tuple_t *tuple;
+    struct mk_list _head;
+} postgresql_mirror_entry_t;
+
+/* immutable open addressing index of the rows, read by every worker */
+typedef struct postgresql_mirror_snapshot {
+    int n_fields;
+    char **fields;
+    int key_index;
+    unsigned long n_rows;
+    unsigned long mask;
+    postgresql_mirror_tuple_t **slots;
+
+    unsigned long retired_at; /* reclamation epoch it was replaced in */
+    struct mk_list _head;
+} postgresql_mirror_snapshot_t;
+
+/* quiescent state of a worker reading snapshots */
+typedef struct postgresql_mirror_reader {
+    unsigned long epoch; /* reclamation epoch seen when it was last between callbacks */
+    int timer_fd;
+
+    struct mk_list _head;
+} postgresql_mirror_reader_t;
+
+struct postgresql_mirror {
+    char *uri;
+    char *publication;
+    char *schema;
+    char *table;
+    char *key_column;
+    int id;
+
+    /* replication client, run by the worker that claimed it */
+    postgresql_mirror_reader_t *owner;
+    postgresql_mirror_state_t state;
+    time_t retry_at;
+    PGconn *repl;
+    int fd;
+    char *snapshot_name;
+    uint64_t start_lsn;
+    uint64_t received_lsn;
+    uint64_t applied_lsn;
+    uint32_t relid;
+
+    /* reference query, refreshed on a pool instead of replicated */
+    duda_global_t *pool_key;
+    char *query;
+    char *watermark_column;
+    int watermark_index;
+    char *watermark;         /* highest value loaded so far */
+    char *pending_watermark; /* highest value of the refresh running */
+    int interval;
+    time_t refresh_at;
+    int refreshing;
+    struct postgresql_conn *refresh_conn;
+    int full;                /* the next refresh reloads the whole result */
+    int refreshes;
+
+    /* working table, changed by the replication stream */
+    int n_fields;
+    char **fields;
+    int key_index;
+    int key_missing; /* the last result had no key column */
+    int dirty;
+    struct mk_list buckets[POSTGRESQL_MIRROR_BUCKETS];
+    unsigned long n_rows;
+
+    postgresql_mirror_snapshot_t *current; /* swapped with atomic operations */
+    struct mk_list retired;
+
+    struct mk_list _head;
+};
+
+struct mk_list postgresql_mirror_list;
+
+duda_global_t postgresql_mirror_key;
+
+postgresql_mirror_t *postgresql_mirror_create(const char *uri, const char *publication,
+                                              const char *table, const char *key_column);
+
+postgresql_mirror_t *postgresql_mirror_reference(duda_global_t *pool_key, const char *query,
+                                                 const char *key_column,
+                                                 const char *watermark_column, int interval);
+
+int postgresql_mirror_lookup(postgresql_mirror_t *mirror, const char *key,
+                             postgresql_mirror_row_t *row);
+
+#endif
@@ -0,0 +1,446 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <libpq-fe.h>
+#include "common.h"
+#include "query_priv.h"
+#include "connection_priv.h"
+#include "pool.h"
+#include "util.h"
+#include "cache_priv.h"
+#include "notify_priv.h"
+
+static inline postgresql_channel_t *__postgresql_notify_channel(postgresql_listener_t *listener,
+                                                                const char *name)
+{
+    uint32_t hash = postgresql_util_hash(name, strlen(name));
+    struct mk_list *head;
+    postgresql_channel_t *channel;
+
+    mk_list_foreach(head, &listener->channels[hash % POSTGRESQL_NOTIFY_BUCKETS]) {
+        channel = mk_list_entry(head, postgresql_channel_t, _head);
+        if (channel->hash == hash && strcmp(channel->name, name) == 0) {
+            return channel;
+        }
+    }
+    return NULL;
+}
+
+static inline int __postgresql_notify_in_use(postgresql_channel_t *channel)
+{
+    return channel->watched || mk_list_is_empty(&channel->subs) != 0;
+}
+
+static void __postgresql_notify_listen_end(void *privdata, postgresql_query_t *query,
+                                           duda_request_t *dr)
+{
+    postgresql_channel_t *channel = privdata;
+
+    channel->pending--;
+    if (postgresql_query_status(query) != POSTGRESQL_OK) {
+        msg->err("PostgreSQL Listen Error on Channel %s", channel->name);
+        channel->listen_sent = 0;
+        channel->state = CHANNEL_STATE_IDLE;
+    } else if (channel->pending == 0 && channel->listen_sent) {
+        channel->state = CHANNEL_STATE_LISTENING;
+    }
+}
+
+/* Send LISTEN or UNLISTEN for a channel, its name is quoted as an identifier. */
+static inline int __postgresql_notify_send(postgresql_channel_t *channel, const char *command,
+                                           postgresql_query_end_cb *end_cb)
+{
+    int ret;
+    size_t i, n;
+    char *query_str;
+    postgresql_conn_t *conn = channel->listener->conn;
+
+    query_str = monkey->mem_alloc(strlen(command) + strlen(channel->name) * 2 + 4);
+    if (!query_str) {
+        return POSTGRESQL_ERR;
+    }
+
+    n = strlen(command);
+    memcpy(query_str, command, n);
+    query_str[n++] = ' ';
+    query_str[n++] = '"';
+    for (i = 0; channel->name[i]; ++i) {
+        if (channel->name[i] == '"') {
+            query_str[n++] = '"';
+        }
+        query_str[n++] = channel->name[i];
+    }
+    query_str[n++] = '"';
+    query_str[n]   = '\0';
+
+    ret = postgresql_conn_send_query(conn, query_str, NULL, NULL, end_cb, channel);
+    FREE(query_str);
+    return ret;
+}
+
+/* Bring the server side of a channel in line with its use, on the current connection. */
+static inline void __postgresql_notify_sync(postgresql_channel_t *channel)
+{
+    if (!channel->listener->conn) {
+        return;
+    }
+
+    if (__postgresql_notify_in_use(channel) && !channel->listen_sent) {
+        channel->listen_sent = 1;
+        channel->state = CHANNEL_STATE_PENDING;
+        channel->pending++;
+        if (__postgresql_notify_send(channel, "LISTEN",
+                                     __postgresql_notify_listen_end) != POSTGRESQL_OK) {
+            channel->pending--;
+            channel->listen_sent = 0;
+            channel->state = CHANNEL_STATE_IDLE;
+        }
+    } else if (!__postgresql_notify_in_use(channel) && channel->listen_sent) {
+        /* a LISTEN still waiting for its result must not mark the channel listened */
+        channel->listen_sent = 0;
+        channel->state = CHANNEL_STATE_IDLE;
+        __postgresql_notify_send(channel, "UNLISTEN", NULL);
+    }
+}
+
+/*
+ * The connection was lost: notifications may have been missed meanwhile, so
+ * the cached results depending on them are dropped, and the channels are
+ * listened to again once the pool reconnects.
+ */
+static void __postgresql_notify_lost(postgresql_conn_t *conn, int status,
+                                     duda_request_t *dr)
+{
+    int i;
+    struct mk_list *head;
+    postgresql_channel_t *channel;
+    postgresql_listener_t *listener = conn->listener;
+
+    msg->warn("[FD %i] PostgreSQL Listener Connection Lost", conn->fd);
+    listener->conn = NULL;
+    for (i = 0; i < POSTGRESQL_NOTIFY_BUCKETS; ++i) {
+        mk_list_foreach(head, &listener->channels[i]) {
+            channel = mk_list_entry(head, postgresql_channel_t, _head);
+            channel->state       = CHANNEL_STATE_IDLE;
+            channel->listen_sent = 0;
+            channel->pending     = 0;
+            postgresql_cache_invalidate(listener->pool->config, channel->name, NULL);
+        }
+    }
+}
+
+static inline void __postgresql_notify_connect(postgresql_listener_t *listener)
+{
+    int i;
+    struct mk_list *head;
+    postgresql_channel_t *channel;
+    postgresql_endpoint_config_t *config = &listener->pool->config->endpoints[0];
+    postgresql_conn_t *conn = NULL;
+
+    if (config->type == POOL_TYPE_PARAMS) {
+        conn = postgresql_conn_connect(NULL, NULL, (const char * const *) config->keys,
+                                       (const char * const *) config->values,
+                                       config->expand_dbname);
+    } else if (config->type == POOL_TYPE_URI) {
+        conn = postgresql_conn_connect_uri(NULL, NULL, config->uri);
+    }
+    if (!conn) {
+        return;
+    }
+
+    conn->listener      = listener;
+    conn->disconnect_cb = __postgresql_notify_lost;
+    listener->conn      = conn;
+    for (i = 0; i < POSTGRESQL_NOTIFY_BUCKETS; ++i) {
+        mk_list_foreach(head, &listener->channels[i]) {
+            channel = mk_list_entry(head, postgresql_channel_t, _head);
+            __postgresql_notify_sync(channel);
+        }
+    }
+}
+
+static inline postgresql_listener_t *__postgresql_notify_listener(postgresql_pool_t *pool)
+{
+    int i;
+    postgresql_listener_t *listener = pool->listener;
+
+    if (listener) {
+        return listener;
+    }
+
+    listener = monkey->mem_alloc(sizeof(postgresql_listener_t));
+    if (!listener) {
+        return NULL;
+    }
+
+    listener->pool = pool;
+    listener->conn = NULL;
+    for (i = 0; i < POSTGRESQL_NOTIFY_BUCKETS; ++i) {
+        mk_list_init(&listener->channels[i]);
+    }
+    pool->listener = listener;
+    __postgresql_notify_connect(listener);
+    return listener;
+}
+
+/*
+ * Find or create a channel of the listener of a pool. Channels are kept once
+ * created, an unused one is only UNLISTENed, so they can be reused cheaply.
+ */
+static inline postgresql_channel_t *__postgresql_notify_add_channel(postgresql_pool_t *pool,
+                                                                    const char *name)
+{
+    postgresql_listener_t *listener = __postgresql_notify_listener(pool);
+    postgresql_channel_t *channel;
+
+    if (!listener) {
+        return NULL;
+    }
+
+    channel = __postgresql_notify_channel(listener, name);
+    if (channel) {
+        return channel;
+    }
+
+    channel = monkey->mem_alloc(sizeof(postgresql_channel_t));
+    if (!channel) {
+        return NULL;
+    }
+
+    channel->name = monkey->str_dup(name);
+    if (!channel->name) {
+        FREE(channel);
+        return NULL;
+    }
+    channel->hash        = postgresql_util_hash(name, strlen(name));
+    channel->state       = CHANNEL_STATE_IDLE;
+    channel->listen_sent = 0;
+    channel->pending     = 0;
+    channel->watched     = 0;
+    channel->dispatching = 0;
+    channel->listener    = listener;
+    mk_list_init(&channel->subs);
+    mk_list_add(&channel->_head, &listener->channels[channel->hash % POSTGRESQL_NOTIFY_BUCKETS]);
+    return channel;
+}
+
+static inline postgresql_notify_sub_t *__postgresql_notify_add_sub(duda_global_t *pool_key,
+                                                                   const char *channel_name)
+{
+    postgresql_pool_t *pool = postgresql_pool_get(pool_key);
+    postgresql_channel_t *channel;
+    postgresql_notify_sub_t *sub;
+
+    if (!pool || !channel_name) {
+        return NULL;
+    }
+
+    channel = __postgresql_notify_add_channel(pool, channel_name);
+    if (!channel) {
+        return NULL;
+    }
+
+    sub = monkey->mem_alloc(sizeof(postgresql_notify_sub_t));
+    if (!sub) {
+        return NULL;
+    }
+    sub->cb         = NULL;
+    sub->request_cb = NULL;
+    sub->privdata   = NULL;
+    sub->dr         = NULL;
+    sub->dead       = 0;
+    sub->channel    = channel;
+    mk_list_add(&sub->_head, &channel->subs);
+    __postgresql_notify_sync(channel);
+    return sub;
+}
+
+/* Free the subscribers removed while the notifications of a channel were handed out. */
+static inline void __postgresql_notify_purge(postgresql_channel_t *channel)
+{
+    struct mk_list *head, *tmp;
+    postgresql_notify_sub_t *sub;
+
+    mk_list_foreach_safe(head, tmp, &channel->subs) {
+        sub = mk_list_entry(head, postgresql_notify_sub_t, _head);
+        if (sub->dead) {
+            mk_list_del(&sub->_head);
+            FREE(sub);
+        }
+    }
+    __postgresql_notify_sync(channel);
+}
+
+/*
+ * Make sure the pool listens to a channel. Return POSTGRESQL_OK once the
+ * server confirmed the LISTEN, from then on no notification of the channel
+ * is missed without the cache knowing about it.
+ */
+int postgresql_notify_watch(postgresql_pool_t *pool, const char *channel_name)
+{
+    postgresql_channel_t *channel = __postgresql_notify_add_channel(pool, channel_name);
+
+    if (!channel) {
+        return POSTGRESQL_ERR;
+    }
+
+    channel->watched = 1;
+    __postgresql_notify_sync(channel);
+    if (channel->state != CHANNEL_STATE_LISTENING) {
+        return POSTGRESQL_ERR;
+    }
+    return POSTGRESQL_OK;
+}
+
+/*
+ * Hand the notifications received by a listener connection to the
+ * subscribers of their channel, they all get the same payload.
+ */
+void postgresql_notify_read(postgresql_conn_t *conn)
+{
+    PGnotify *notify;
+    struct mk_list *head;
+    postgresql_channel_t *channel;
+    postgresql_notify_sub_t *sub;
+    postgresql_listener_t *listener = conn->listener;
+
+    while ((notify = PQnotifies(conn->conn)) != NULL) {
+        postgresql_cache_invalidate(listener->pool->config, notify->relname,
+                                    notify->extra);
+
+        channel = __postgresql_notify_channel(listener, notify->relname);
+        if (channel) {
+            channel->dispatching++;
+            mk_list_foreach(head, &channel->subs) {
+                sub = mk_list_entry(head, postgresql_notify_sub_t, _head);
+                if (sub->dead) {
+                    continue;
+                }
+                if (sub->request_cb) {
+                    sub->request_cb(sub->privdata, notify->relname, notify->extra, sub->dr);
+                } else {
+                    sub->cb(sub->privdata, notify->relname, notify->extra);
+                }
+            }
+            if (--channel->dispatching == 0) {
+                __postgresql_notify_purge(channel);
+            }
+        }
+        PQfreemem(notify);
+    }
+}
+
+/* Reconnect a listener that lost its connection, run on every tick of its pool. */
+void postgresql_notify_tick(postgresql_pool_t *pool)
+{
+    postgresql_listener_t *listener = pool->listener;
+
+    if (listener && !listener->conn) {
+        __postgresql_notify_connect(listener);
+    }
+}
+
+/*
+ * @METHOD_NAME: listen
+ * @METHOD_DESC: Listen to the notifications sent to a channel (with NOTIFY or pg_notify) of the database of a pool. Every worker has one connection per pool to receive notifications, opened on demand and never checked out; it is opened again if it is lost. The notifications received by the worker calling this function are handed to the callback. It must be called from the worker that needs the notifications, for instance in the callback of a request.
+ * @METHOD_PROTO: int listen(duda_global_t *pool_key, const char *channel, postgresql_notify_cb *cb, void *privdata)
+ * @METHOD_PARAM: pool_key The key of the pool, as given to create_pool_params or create_pool_uri.
+ * @METHOD_PARAM: channel The name of the channel.
+ * @METHOD_PARAM: cb The callback function that will take actions when a notification is received, it gets the channel and the payload of the notification.
+ * @METHOD_PARAM: privdata The user defined private data that will be passed to the callback.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_notify_listen(duda_global_t *pool_key, const char *channel_name,
+                             postgresql_notify_cb *cb, void *privdata)
+{
+    postgresql_notify_sub_t *sub;
+
+    if (!cb) {
+        return POSTGRESQL_ERR;
+    }
+
+    sub = __postgresql_notify_add_sub(pool_key, channel_name);
+    if (!sub) {
+        return POSTGRESQL_ERR;
+    }
+    sub->cb       = cb;
+    sub->privdata = privdata;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: subscribe
+ * @METHOD_DESC: Subscribe a request, such as a websocket or a suspended long-poll request, to the notifications of a channel of the database of a pool. All the requests of a worker share the connection listening to the pool, and every notification is handed to the callbacks of the subscribers without being copied. The subscription must be removed with unsubscribe before the request is closed.
+ * @METHOD_PROTO: postgresql_subscription_t *subscribe(duda_global_t *pool_key, const char *channel, duda_request_t *dr, postgresql_subscribe_cb *cb, void *privdata)
+ * @METHOD_PARAM: pool_key The key of the pool, as given to create_pool_params or create_pool_uri.
+ * @METHOD_PARAM: channel The name of the channel.
+ * @METHOD_PARAM: dr The request context information hold by a duda_request_t type.
+ * @METHOD_PARAM: cb The callback function that will take actions when a notification is received, it gets the channel, the payload of the notification and the request.
+ * @METHOD_PARAM: privdata The user defined private data that will be passed to the callback.
+ * @METHOD_RETURN: The subscription on success, or NULL on failure.
+ */
+
+postgresql_subscription_t *postgresql_notify_subscribe(duda_global_t *pool_key,
+                                                       const char *channel_name,
+                                                       duda_request_t *dr,
+                                                       postgresql_subscribe_cb *cb,
+                                                       void *privdata)
+{
+    postgresql_notify_sub_t *sub;
+
+    if (!cb) {
+        return NULL;
+    }
+
+    sub = __postgresql_notify_add_sub(pool_key, channel_name);
+    if (!sub) {
+        return NULL;
+    }
+    sub->request_cb = cb;
+    sub->privdata   = privdata;
+    sub->dr         = dr;
+    return sub;
+}
+
+/*
+ * @METHOD_NAME: unsubscribe
+ * @METHOD_DESC: Remove a subscription, it may be called from the callback of any subscriber. Once a channel has no subscribers left, the pool stops listening to it.
+ * @METHOD_PROTO: void unsubscribe(postgresql_subscription_t *sub)
+ * @METHOD_PARAM: sub The subscription returned by subscribe.
+ * @METHOD_RETURN: None.
+ */
+
+void postgresql_notify_unsubscribe(postgresql_subscription_t *sub)
+{
+    postgresql_channel_t *channel = sub->channel;
+
+    if (channel->dispatching > 0) {
+        sub->dead = 1;
+        return;
+    }
+
+    mk_list_del(&sub->_head);
+    FREE(sub);
+    __postgresql_notify_sync(channel);
+}
@@ -0,0 +1,91 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_NOTIFY_PRIV_H
+#define POSTGRESQL_NOTIFY_PRIV_H
+
+#include "notify.h"
+#include "pool.h"
+
+/* buckets of the channels of a listener */
+#define POSTGRESQL_NOTIFY_BUCKETS 64
+
+typedef enum {
+    CHANNEL_STATE_IDLE,      /* not listened to on the current connection */
+    CHANNEL_STATE_PENDING,   /* LISTEN sent */
+    CHANNEL_STATE_LISTENING,
+} postgresql_channel_state_t;
+
+struct postgresql_channel;
+
+/* a callback of listen, or a request subscribed to a channel */
+struct postgresql_notify_sub {
+    postgresql_notify_cb *cb;
+    postgresql_subscribe_cb *request_cb;
+    void *privdata;
+    duda_request_t *dr;
+    int dead; /* unsubscribed while notifications were handed out */
+    struct postgresql_channel *channel;
+
+    struct mk_list _head;
+};
+
+typedef struct postgresql_notify_sub postgresql_notify_sub_t;
+
+typedef struct postgresql_channel {
+    uint32_t hash;
+    char *name;
+    postgresql_channel_state_t state;
+    int listen_sent;  /* LISTEN was the last command sent for the channel */
+    int pending;      /* LISTEN commands waiting for their result */
+    int watched;      /* results of the cache depend on it */
+    int dispatching;  /* notifications are being handed to the subscribers */
+    struct postgresql_listener *listener;
+    struct mk_list subs;
+
+    struct mk_list _head;
+} postgresql_channel_t;
+
+/* connection of a pool in a worker that receives notifications, never checked out */
+typedef struct postgresql_listener {
+    postgresql_pool_t *pool;
+    postgresql_conn_t *conn;
+    struct mk_list channels[POSTGRESQL_NOTIFY_BUCKETS];
+} postgresql_listener_t;
+
+int postgresql_notify_listen(duda_global_t *pool_key, const char *channel,
+                             postgresql_notify_cb *cb, void *privdata);
+
+postgresql_subscription_t *postgresql_notify_subscribe(duda_global_t *pool_key,
+                                                       const char *channel,
+                                                       duda_request_t *dr,
+                                                       postgresql_subscribe_cb *cb,
+                                                       void *privdata);
+
+void postgresql_notify_unsubscribe(postgresql_subscription_t *sub);
+
+int postgresql_notify_watch(postgresql_pool_t *pool, const char *channel);
+
+void postgresql_notify_read(postgresql_conn_t *conn);
+
+void postgresql_notify_tick(postgresql_pool_t *pool);
+
+#endif
@@ -19,123 +19,203 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 #include <libpq-fe.h>
 #include "common.h"
-#include "query.h"
+#include "query_priv.h"
 #include "connection_priv.h"
 #include "pool.h"
+#include "async.h"
+#include "util.h"
+#include "io_priv.h"
+#include "notify_priv.h"
+#include "cache_priv.h"
 
-static inline int __postgresql_pool_spawn_conn(postgresql_pool_t *pool, int size)
+static inline postgresql_conn_t *__postgresql_pool_endpoint_connect(postgresql_endpoint_config_t *config,
+                                                                     duda_request_t *dr,
+                                                                     postgresql_connect_cb *cb)
 {
-    int i;
-    postgresql_conn_t *conn;
-    postgresql_pool_config_t *config = pool->config;
+    postgresql_conn_t *conn = NULL;
 
-    for (i = 0; i < size; ++i) {
-        if (config->type == POOL_TYPE_PARAMS) {
-            conn = postgresql_conn_connect(NULL, NULL, (const char * const *)config->keys,
-                                           (const char * const *)config->values,
-                                           config->expand_dbname);
-        } else if (config->type == POOL_TYPE_URI) {
-            conn = postgresql_conn_connect_uri(NULL, NULL, config->uri);
+    if (config->type == POOL_TYPE_PARAMS) {
+        conn = postgresql_conn_connect(dr, cb, (const char * const *)config->keys,
+                                       (const char * const *)config->values,
+                                       config->expand_dbname);
+    } else if (config->type == POOL_TYPE_URI) {
+        conn = postgresql_conn_connect_uri(dr, cb, config->uri);
+    }
+    return conn;
+}
+
+/*
+ * Reserve one backend out of the budget shared by all the workers of a pool.
+ * A denied reservation asks the other workers to give an idle backend back.
+ */
+static inline int __postgresql_pool_budget_take(postgresql_pool_config_t *config)
+{
+    int n;
+
+    if (config->budget == 0) {
+        return POSTGRESQL_OK;
+    }
+
+    do {
+        n = config->n_backends;
+        if (n >= config->budget) {
+            if (config->starved < config->budget) {
+                __sync_fetch_and_add(&config->starved, 1);
+            }
+            return POSTGRESQL_POOL_EXHAUSTED;
         }
+    } while (!__sync_bool_compare_and_swap(&config->n_backends, n, n + 1));
+
+    return POSTGRESQL_OK;
+}
+
+static inline void __postgresql_pool_budget_put(postgresql_pool_config_t *config)
+{
+    if (config->budget > 0) {
+        __sync_fetch_and_sub(&config->n_backends, 1);
+    }
+}
+
+/* Open a connection to an endpoint, accounted to the backend budget of its pool. */
+static inline postgresql_conn_t *__postgresql_pool_budget_connect(postgresql_pool_endpoint_t *ep,
+                                                                  duda_request_t *dr,
+                                                                  postgresql_connect_cb *cb,
+                                                                  int *ret)
+{
+    postgresql_conn_t *conn;
+    postgresql_pool_config_t *config = ep->pool->config;
+
+    *ret = __postgresql_pool_budget_take(config);
+    if (*ret != POSTGRESQL_OK) {
+        return NULL;
+    }
+
+    conn = __postgresql_pool_endpoint_connect(ep->config, dr, cb);
+    if (!conn) {
+        __postgresql_pool_budget_put(config);
+        *ret = POSTGRESQL_ERR;
+        return NULL;
+    }
+
+    if (config->budget > 0) {
+        conn->budget = config;
+    }
+    return conn;
+}
 
+static inline int __postgresql_pool_spawn_conn(postgresql_pool_endpoint_t *ep, int size)
+{
+    int i, ret = POSTGRESQL_ERR;
+    postgresql_conn_t *conn;
+
+    for (i = 0; i < size; ++i) {
+        conn = __postgresql_pool_budget_connect(ep, NULL, NULL, &ret);
         if (!conn) {
             break;
         }
 
         conn->is_pooled = 1;
-        conn->pool = pool;
-        mk_list_add(&conn->_pool_head, &pool->free_conns);
-        pool->size++;
-        pool->free_size++;
+        conn->pool = ep->pool;
+        conn->endpoint = ep;
+        mk_list_add(&conn->_pool_head, &ep->free_conns);
+        ep->size++;
+        ep->free_size++;
     }
 
-    if (pool->free_size == 0) {
-        return POSTGRESQL_ERR;
+    if (ep->free_size == 0) {
+        return ret == POSTGRESQL_POOL_EXHAUSTED ? ret : POSTGRESQL_ERR;
     }
 
     return POSTGRESQL_OK;
 }
 
-static inline void __postgresql_pool_release_conn(postgresql_pool_t *pool, int size)
+static inline void __postgresql_pool_release_conn(postgresql_pool_endpoint_t *ep, int size)
 {
     int i;
     postgresql_conn_t *conn;
 
     for (i = 0; i < size; ++i) {
-        conn = mk_list_entry_first(&pool->free_conns, postgresql_conn_t, _pool_head);
+        conn = mk_list_entry_first(&ep->free_conns, postgresql_conn_t, _pool_head);
         mk_list_del(&conn->_pool_head);
         conn->is_pooled = 0;
+        conn->pool = NULL;
+        conn->endpoint = NULL;
         postgresql_conn_handle_release(conn, POSTGRESQL_OK);
-        pool->size--;
-        pool->free_size--;
+        ep->size--;
+        ep->free_size--;
     }
 }
 
+static inline struct mk_list *__postgresql_pool_config_bucket(duda_global_t *pool_key)
+{
+    uint32_t hash = postgresql_util_hash(&pool_key, sizeof(pool_key));
+    return &postgresql_pool_config_table[hash % POSTGRESQL_POOL_CONFIG_BUCKETS];
+}
+
 static inline postgresql_pool_config_t *__postgresql_pool_get_config(duda_global_t *pool_key)
 {
     struct mk_list *head;
-    postgresql_pool_config_t *config = NULL;
+    postgresql_pool_config_t *config;
 
-    mk_list_foreach(head, &postgresql_pool_config_list) {
-        config = mk_list_entry(head, postgresql_pool_config_t, _head);
+    mk_list_foreach(head, __postgresql_pool_config_bucket(pool_key)) {
+        config = mk_list_entry(head, postgresql_pool_config_t, _hash_head);
         if (config->pool_key == pool_key) {
-            break;
+            return config;
         }
     }
 
-    return config;
+    return NULL;
 }
 
-/*
- * @METHOD_NAME: create_pool_params
- * @METHOD_DESC: Create a connection pool per thread for connection sharing with the given parameters. It must be called within the function `duda_main()' of a Duda web service.
- * @METHOD_PROTO: int create_pool_params(duda_global_t *pool_key, int min_size, int max_size, const char * const *keys, const char * const *values, int expand_dbname)
- * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
- * @METHOD_PARAM: min_size The minimum number of connections in the pool.
- * @METHOD_PARAM: max_size The maximum number of connections in the pool.
- * @METHOD_PARAM: keys A NULL-terminated string array that stands for the keywords you want to customize. If the array is empty, then it will try to connect the server with default paramter keywords. If any keyword is unspecified, then the corresponding environment variable is checked. The currently recognized parameter key words are listed <a href="http://www.postgresql.org/docs/9.2/static/libpq-connect.html#LIBPQ-PARAMKEYWORDS">here</a>.
- * @METHOD_PARAM: values A NULL-terminated strin array that gives the corresponding values for each keyword in the keys array.
- * @METHOD_PARAM: expand_dbname A flag that determines whether the dbname key word value is allowed to be recognized as a connection string. Use zero to disable it or non-zero to enable it.
- * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
- */
+static inline void __postgresql_pool_config_register(postgresql_pool_config_t *config)
+{
+    mk_list_add(&config->_head, &postgresql_pool_config_list);
+    mk_list_add(&config->_hash_head, __postgresql_pool_config_bucket(config->pool_key));
+}
 
-int postgresql_pool_params_create(duda_global_t *pool_key, int min_size, int max_size,
-                                  const char * const *keys, const char * const *values,
-                                  int expand_dbname)
+static inline postgresql_pool_config_t *__postgresql_pool_config_create(duda_global_t *pool_key,
+                                                                        int min_size,
+                                                                        int max_size)
 {
+    int i;
     postgresql_pool_config_t *config = monkey->mem_alloc(sizeof(postgresql_pool_config_t));
     if (!config) {
-        return POSTGRESQL_ERR;
+        return NULL;
     }
 
-    config->pool_key = pool_key;
-    int length = 0;
-    const char * const *ptr = keys;
-    while (*ptr != NULL) {
-        length++;
-        ptr++;
-    }
-    
-    int i;
-    if (keys) {
-        config->keys = monkey->mem_alloc(sizeof(char *) * (length + 1));
-        for (i = 0; i < length; ++i) {
-            config->keys[i] = monkey->str_dup(keys[i]);
-        }
-        config->keys[length] = NULL;
+    config->endpoints = monkey->mem_alloc(sizeof(postgresql_endpoint_config_t));
+    if (!config->endpoints) {
+        FREE(config);
+        return NULL;
     }
-
-    if (values) {
-        config->values = monkey->mem_alloc(sizeof(char *) * (length + 1));
-        for (i = 0; i < length; ++i) {
-            config->values[i] = monkey->str_dup(values[i]);
-        }
-        config->values[length] = NULL;
+    memset(config->endpoints, 0, sizeof(postgresql_endpoint_config_t));
+    config->n_endpoints = 1;
+    config->pool_key = pool_key;
+    config->mode = POSTGRESQL_POOL_SESSION;
+    config->max_lag = 0;
+    config->steal_threshold = POSTGRESQL_POOL_DEFAULT_STEAL_THRESHOLD;
+    config->codel_target = 0;
+    config->codel_interval = 0;
+    config->budget = 0;
+    config->n_backends = 0;
+    config->starved = 0;
+    config->io_threads = 0;
+    config->io_started = 0;
+    config->io_ready = 0;
+    config->io_next = 0;
+    config->io = NULL;
+    for (i = 0; i < POSTGRESQL_CLASSES; ++i) {
+        config->class_quota[i]    = 0;
+        config->class_endpoint[i] = 0;
     }
-
-    config->expand_dbname = expand_dbname;
+    config->class_quota[POSTGRESQL_CLASS_INTERACTIVE] = POSTGRESQL_POOL_DEFAULT_RESERVE;
+    config->hedge_budget = POSTGRESQL_POOL_DEFAULT_HEDGE_BUDGET;
 
     if (min_size == 0) {
         config->min_size = POSTGRESQL_POOL_DEFAULT_MIN_SIZE;
@@ -148,111 +228,128 @@ int postgresql_pool_params_create(duda_global_t *pool_key, int min_size, int max
         config->max_size = max_size;
     }
 
-    config->type = POOL_TYPE_PARAMS;
-    mk_list_add(&config->_head, &postgresql_pool_config_list);
-    return POSTGRESQL_OK;
+    return config;
 }
 
 /*
- * @METHOD_NAME: create_pool_uri
- * @METHOD_DESC: Create a connection pool per thread for connection sharing with the given connection string. It must be called within the function `duda_main()' of a Duda web service.
- * @METHOD_PROTO: int create_pool_uri(duda_global_t *pool_key, int min_size, int max_size, const char *uri)
- * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
- * @METHOD_PARAM: min_size The minimum number of connections in the pool.
- * @METHOD_PARAM: max_size The maximum number of connections in the pool.
- * @METHOD_PARAM: uri The string which specifies the connection parameters and their values. There are two accepted formats for these strings: plain keyword = value strings and RFC 3986 URIs. For full reference of the connection strings please consult the official <a href="http://www.postgresql.org/docs/9.2/static/libpq-connect.html#LIBPQ-CONNSTRING">documentation</a> of PostgreSQL.
- * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ * Check whether a class may hold one more backend of an endpoint: it must stay
+ * within its quota, and the other classes must leave the interactive reserve
+ * of the endpoint untouched. Interactive work is never held back.
  */
-
-int postgresql_pool_uri_create(duda_global_t *pool_key, int min_size, int max_size,
-                               const char *uri)
+static inline int __postgresql_pool_class_admit(postgresql_pool_endpoint_t *ep, int workload)
 {
-    postgresql_pool_config_t *config = monkey->mem_alloc(sizeof(postgresql_pool_config_t));
-    if (!config) {
-        return POSTGRESQL_ERR;
+    int i, quota, reserve, others = 0;
+    postgresql_pool_config_t *config = ep->pool->config;
+
+    if (workload <= POSTGRESQL_CLASS_INTERACTIVE) {
+        return 1;
     }
 
-    config->pool_key = pool_key;
-    config->uri = monkey->str_dup(uri);
+    quota = config->class_quota[workload];
+    if (quota > 0 && ep->class_busy[workload] >= quota) {
+        return 0;
+    }
 
-    if (min_size == 0) {
-        config->min_size = POSTGRESQL_POOL_DEFAULT_MIN_SIZE;
-    } else {
-        config->min_size = min_size;
+    /* a dedicated endpoint does not serve interactive work */
+    if (ep->config->dedicated) {
+        return 1;
     }
-    if (max_size == 0) {
-        config->max_size = POSTGRESQL_POOL_DEFAULT_MAX_SIZE;
-    } else {
-        config->max_size = max_size;
+
+    reserve = config->class_quota[POSTGRESQL_CLASS_INTERACTIVE];
+    if (reserve > config->max_size - 1) {
+        reserve = config->max_size - 1;
+    }
+    for (i = POSTGRESQL_CLASS_INTERACTIVE + 1; i < POSTGRESQL_CLASSES; ++i) {
+        others += ep->class_busy[i];
+    }
+    return others < config->max_size - reserve;
+}
+
+static inline void __postgresql_pool_class_take(postgresql_conn_t *backend, int workload)
+{
+    if (workload < 0) {
+        workload = POSTGRESQL_CLASS_INTERACTIVE;
     }
+    backend->workload = workload;
+    backend->endpoint->class_busy[workload]++;
+}
 
-    config->type = POOL_TYPE_URI;
-    mk_list_add(&config->_head, &postgresql_pool_config_list);
-    return POSTGRESQL_OK;
+static inline void __postgresql_pool_class_put(postgresql_conn_t *backend)
+{
+    if (backend->workload >= 0) {
+        backend->endpoint->class_busy[backend->workload]--;
+        backend->workload = -1;
+    }
+}
+
+static inline int __postgresql_pool_waiter_priority(postgresql_conn_t *handle, uint64_t now)
+{
+    postgresql_query_t *query;
+
+    if (mk_list_is_empty(&handle->queries) == 0) {
+        return POSTGRESQL_PRIORITY_NORMAL;
+    }
+    query = mk_list_entry_first(&handle->queries, postgresql_query_t, _head);
+    return postgresql_query_priority(query, now);
 }
 
 /*
- * @METHOD_NAME: get_conn
- * @METHOD_DESC: Get a PostgreSQL connection from a connection pool. If all the connections in a pool are currently used, the pool will spawn more connections as long as the pool size don't exceed the maximum.
- * @METHOD_PROTO: postgresql_conn_t *get_conn(duda_global_t *pool_key, duda_request_t *dr, postgresql_connect_cb *cb)
- * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
- * @METHOD_PARAM: dr The request context information hold by a duda_request_t type.
- * @METHOD_PARAM: cb The callback function that will take actions when a connection success or fail to establish.
- * @METHOD_RETURN: A PostgreSQL connection on success, or NULL on failure.
+ * Among the handles whose class may take a backend, the one with the most
+ * urgent next query, aged by the time it waited. Ties go to the oldest one.
  */
-
-postgresql_conn_t *postgresql_pool_get_conn(duda_global_t *pool_key, duda_request_t *dr,
-                                            postgresql_connect_cb *cb)
+static inline postgresql_conn_t *__postgresql_pool_next_waiter(postgresql_pool_endpoint_t *ep)
 {
-    postgresql_pool_t *pool;
-    postgresql_pool_config_t *config;
-    postgresql_conn_t *conn;
+    int priority, best_priority = 0;
+    uint64_t now = postgresql_util_now();
+    struct mk_list *head;
+    postgresql_conn_t *handle, *best = NULL;
 
-    pool = global->get(*pool_key);
-    if (!pool) {
-        pool = monkey->mem_alloc(sizeof(postgresql_pool_t));
-        if (!pool) {
-            return NULL;
+    mk_list_foreach(head, &ep->waiters) {
+        handle = mk_list_entry(head, postgresql_conn_t, _wait_head);
+        if (!__postgresql_pool_class_admit(ep, handle->workload)) {
+            continue;
         }
-
-        config = __postgresql_pool_get_config(pool_key);
-        if (!config) {
-            FREE(pool);
-            return NULL;
+        priority = __postgresql_pool_waiter_priority(handle, now);
+        if (!best || priority < best_priority) {
+            best = handle;
+            best_priority = priority;
+        }
+        if (best_priority == POSTGRESQL_PRIORITY_CRITICAL) {
+            break;
         }
-
-        pool->size = 0;
-        pool->free_size = 0;
-        pool->config = config;
-        mk_list_init(&pool->free_conns);
-        mk_list_init(&pool->busy_conns);
-        global->set(*pool_key, (void *) pool);
     }
+    return best;
+}
 
-    /* configuration of a pool */
-    config = pool->config;
-
+static inline postgresql_conn_t *__postgresql_pool_endpoint_get_conn(postgresql_pool_endpoint_t *ep,
+                                                                     duda_request_t *dr,
+                                                                     postgresql_connect_cb *cb)
+{
     int ret;
-    if (mk_list_is_empty(&pool->free_conns) == 0) {
-        if (pool->size < config->max_size) {
-            ret = __postgresql_pool_spawn_conn(pool, POSTGRESQL_POOL_DEFAULT_SIZE);
+    postgresql_conn_t *conn;
+    postgresql_pool_config_t *config = ep->pool->config;
+
+    if (mk_list_is_empty(&ep->free_conns) == 0) {
+        if (ep->size < config->max_size) {
+            ret = __postgresql_pool_spawn_conn(ep, POSTGRESQL_POOL_DEFAULT_SIZE);
             if (ret != POSTGRESQL_OK) {
                 return NULL;
             }
+        } else if (ep->overloaded) {
+            /* more connections would only add load to a server that is behind already */
+            ep->shed++;
+            msg->warn("PostgreSQL Pool Overloaded, Overflow Connection Refused");
+            return NULL;
         } else {
-            if (config->type == POOL_TYPE_PARAMS) {
-                conn = postgresql_conn_connect(dr, cb, (const char * const *)config->keys,
-                                               (const char * const *)config->values,
-                                               config->expand_dbname);
-            } else if (config->type == POOL_TYPE_URI) {
-                conn = postgresql_conn_connect_uri(dr, cb, config->uri);
+            conn = __postgresql_pool_budget_connect(ep, dr, cb, &ret);
+            if (ret == POSTGRESQL_POOL_EXHAUSTED) {
+                msg->warn("PostgreSQL Pool Backend Budget Exhausted");
             }
-            
             return conn;
         }
     }
 
-    conn = mk_list_entry_first(&pool->free_conns, postgresql_conn_t, _pool_head);
+    conn = mk_list_entry_first(&ep->free_conns, postgresql_conn_t, _pool_head);
     conn->dr = dr;
     conn->connect_cb = cb;
 
@@ -261,27 +358,1633 @@ postgresql_conn_t *postgresql_pool_get_conn(duda_global_t *pool_key, duda_reques
     }
 
     mk_list_del(&conn->_pool_head);
-    mk_list_add(&conn->_pool_head, &pool->busy_conns);
-    pool->free_size--;
+    mk_list_add(&conn->_pool_head, &ep->busy_conns);
+    conn->is_busy = 1;
+    conn->checkout_at = postgresql_util_now();
+    ep->free_size--;
 
     return conn;
 }
 
-void postgresql_pool_reclaim_conn(postgresql_conn_t *conn)
+/* Account the time a connection stayed checked out, once it goes back to its pool. */
+static inline void __postgresql_pool_hold_sample(postgresql_conn_t *conn)
 {
-    postgresql_pool_t *pool = conn->pool;
+    postgresql_pool_endpoint_t *ep = conn->endpoint;
 
-    conn->dr            = NULL;
-    conn->connect_cb    = NULL;
-    conn->disconnect_cb = NULL;
-    conn->disconnect_on_finish = 0;
+    if (conn->checkout_at == 0) {
+        return;
+    }
+    ep->checkouts++;
+    ep->hold_total += postgresql_util_now() - conn->checkout_at;
+    conn->checkout_at = 0;
+}
 
-    mk_list_del(&conn->_pool_head);
-    mk_list_add(&conn->_pool_head, &pool->free_conns);
-    pool->free_size++;
+/* Bind a backend of the pool to a handle and send the queries the handle kept. */
+static inline void __postgresql_pool_bind(postgresql_conn_t *handle, postgresql_conn_t *backend)
+{
+    postgresql_query_t *query;
+    postgresql_pool_endpoint_t *ep = backend->endpoint;
+
+    if (!backend->is_busy) {
+        mk_list_del(&backend->_pool_head);
+        mk_list_add(&backend->_pool_head, &ep->busy_conns);
+        backend->is_busy = 1;
+        ep->free_size--;
+    }
+
+    __postgresql_pool_class_take(backend, handle->workload);
+    backend->checkout_at = postgresql_util_now();
+    backend->dr        = handle->dr;
+    backend->read_only = handle->read_only;
+    backend->min_lsn   = handle->min_lsn;
+    backend->client    = handle;
+    handle->backend    = backend;
+
+    while (mk_list_is_empty(&handle->queries) != 0) {
+        query = mk_list_entry_first(&handle->queries, postgresql_query_t, _head);
+        mk_list_del(&query->_head);
+        mk_list_add(&query->_head, &backend->queries);
+    }
+    postgresql_conn_kick(backend);
+}
+
+static inline void __postgresql_pool_handle_free(postgresql_conn_t *handle, int status)
+{
+    postgresql_query_t *query;
+    postgresql_pool_endpoint_t *ep = handle->endpoint;
+
+    ep->handles++;
+    ep->handle_total += postgresql_util_now() - handle->checkout_at;
+
+    if (handle->is_waiting) {
+        mk_list_del(&handle->_wait_head);
+        handle->is_waiting = 0;
+    }
+    if (handle->disconnect_cb) {
+        handle->disconnect_cb(handle, status, handle->dr);
+    }
+    while (mk_list_is_empty(&handle->queries) != 0) {
+        query = mk_list_entry_first(&handle->queries, postgresql_query_t, _head);
+        postgresql_query_free(query);
+    }
+    FREE(handle->query_channel);
+    FREE(handle->query_tag);
+    FREE(handle);
+}
+
+/*
+ * In transaction mode the pool hands out lightweight handles, backends are
+ * only bound to them while they have queries to run or a transaction open.
+ */
+static inline postgresql_conn_t *__postgresql_pool_handle_create(postgresql_pool_endpoint_t *ep,
+                                                                 int workload,
+                                                                 duda_request_t *dr,
+                                                                 postgresql_connect_cb *cb)
+{
+    postgresql_conn_t *handle = postgresql_conn_create(dr, cb);
+    if (!handle) {
+        return NULL;
+    }
+
+    handle->is_virtual = 1;
+    handle->workload   = workload;
+    handle->checkout_at = postgresql_util_now();
+    handle->state      = CONN_STATE_CONNECTED;
+    handle->pool       = ep->pool;
+    handle->endpoint   = ep;
+
+    if (handle->connect_cb) {
+        handle->connect_cb(handle, POSTGRESQL_OK, handle->dr);
+    }
+    return handle;
+}
+
+static inline postgresql_conn_t *__postgresql_pool_checkout_class(postgresql_pool_endpoint_t *ep,
+                                                                  int workload,
+                                                                  duda_request_t *dr,
+                                                                  postgresql_connect_cb *cb)
+{
+    postgresql_conn_t *conn;
+
+    if (ep->pool->config->mode != POSTGRESQL_POOL_SESSION || ep->pool->config->io_threads > 0) {
+        return __postgresql_pool_handle_create(ep, workload, dr, cb);
+    }
+
+    /* a session holds its backend until disconnect, there is nothing to wait for */
+    if (!__postgresql_pool_class_admit(ep, workload)) {
+        msg->warn("PostgreSQL Pool Class %i Over Quota", workload);
+        return NULL;
+    }
+
+    conn = __postgresql_pool_endpoint_get_conn(ep, dr, cb);
+    if (conn && conn->pool) {
+        __postgresql_pool_class_take(conn, workload);
+    }
+    return conn;
+}
+
+static inline postgresql_conn_t *__postgresql_pool_checkout(postgresql_pool_endpoint_t *ep,
+                                                            duda_request_t *dr,
+                                                            postgresql_connect_cb *cb)
+{
+    return __postgresql_pool_checkout_class(ep, POSTGRESQL_CLASS_INTERACTIVE, dr, cb);
+}
+
+static void __postgresql_pool_lag_row(void *privdata, postgresql_query_t *query,
+                                      int n_fields, char **fields, char **values,
+                                      duda_request_t *dr)
+{
+    (void) query;
+    (void) fields;
+    (void) dr;
+    postgresql_conn_t *conn = privdata;
+
+    if (n_fields > 1) {
+        conn->endpoint->lag = atof(values[0]);
+        conn->endpoint->replay_lsn = postgresql_util_lsn_parse(values[1]);
+    }
+}
+
+static void __postgresql_pool_lag_end(void *privdata, postgresql_query_t *query,
+                                      duda_request_t *dr)
+{
+    (void) dr;
+    postgresql_conn_t *conn = privdata;
+
+    conn->endpoint->lag_probing = 0;
+    if (postgresql_query_status(query) != POSTGRESQL_OK) {
+        conn->endpoint->lag = -1;
+    }
+
+    /* a lost connection is released by the package itself */
+    if (postgresql_query_status(query) != POSTGRESQL_CONN_LOST) {
+        postgresql_conn_disconnect(conn, NULL);
+    }
+}
+
+/* Sample the replication lag of a replica on one of its idle connections. */
+static inline void __postgresql_pool_probe_lag(postgresql_pool_endpoint_t *ep)
+{
+    postgresql_conn_t *conn;
+
+    if (ep->lag_probing || ep->down_until > time(NULL)) {
+        return;
+    }
+
+    /* never open an unpooled connection just for a probe */
+    if (mk_list_is_empty(&ep->free_conns) == 0 && ep->size >= ep->pool->config->max_size) {
+        return;
+    }
+
+    conn = __postgresql_pool_endpoint_get_conn(ep, NULL, NULL);
+    if (!conn) {
+        return;
+    }
+
+    ep->lag_probing = 1;
+    postgresql_conn_set_query_priority(conn, POSTGRESQL_PRIORITY_CRITICAL);
+    if (postgresql_conn_send_query(conn, POSTGRESQL_POOL_LAG_QUERY, NULL,
+                                   __postgresql_pool_lag_row, __postgresql_pool_lag_end,
+                                   conn) != POSTGRESQL_OK) {
+        ep->lag_probing = 0;
+        postgresql_conn_disconnect(conn, NULL);
+    }
+}
+
+/* Give idle backends back to the budget while other workers are denied one. */
+static inline void __postgresql_pool_budget_donate(postgresql_pool_endpoint_t *ep)
+{
+    int n;
+    postgresql_pool_config_t *config = ep->pool->config;
+
+    while (config->budget > 0 && ep->free_size > 0 && ep->size > 1) {
+        n = config->starved;
+        if (n <= 0) {
+            return;
+        }
+        if (__sync_bool_compare_and_swap(&config->starved, n, n - 1)) {
+            __postgresql_pool_release_conn(ep, POSTGRESQL_POOL_DEFAULT_SIZE);
+        }
+    }
+}
+
+/* Try again to open backends for the handles of this worker waiting for one. */
+static inline void __postgresql_pool_budget_retry(postgresql_pool_endpoint_t *ep)
+{
+    postgresql_conn_t *handle;
+
+    while ((handle = __postgresql_pool_next_waiter(ep)) && ep->size < ep->pool->config->max_size &&
+           __postgresql_pool_spawn_conn(ep, POSTGRESQL_POOL_DEFAULT_SIZE) == POSTGRESQL_OK) {
+        mk_list_del(&handle->_wait_head);
+        handle->is_waiting = 0;
+        __postgresql_pool_bind(handle,
+                               mk_list_entry_first(&ep->free_conns, postgresql_conn_t, _pool_head));
+    }
+}
+
+static inline void __postgresql_pool_codel_set(postgresql_pool_endpoint_t *ep, int overloaded)
+{
+    if (overloaded != ep->overloaded) {
+        msg->warn("PostgreSQL Pool Endpoint %i %s", ep->index,
+                  overloaded ? "Overloaded, Shedding Low Priority Work" : "Recovered");
+    }
+    ep->overloaded = overloaded;
+}
+
+/*
+ * No query was sent for a whole interval: the endpoint is idle, unless
+ * handles have been waiting for a backend longer than the target.
+ */
+static inline void __postgresql_pool_codel_tick(postgresql_pool_endpoint_t *ep)
+{
+    uint64_t now;
+    postgresql_conn_t *handle;
+    postgresql_query_t *query;
+    postgresql_pool_config_t *config = ep->pool->config;
+    int overloaded = 0;
+
+    if (config->codel_target == 0) {
+        return;
+    }
+
+    now = postgresql_util_now();
+    if (now - ep->codel_start < (uint64_t) config->codel_interval) {
+        return;
+    }
+
+    if (mk_list_is_empty(&ep->waiters) != 0) {
+        handle = mk_list_entry_first(&ep->waiters, postgresql_conn_t, _wait_head);
+        if (mk_list_is_empty(&handle->queries) != 0) {
+            query = mk_list_entry_first(&handle->queries, postgresql_query_t, _head);
+            overloaded = now - query->queued_at > (uint64_t) config->codel_target;
+        }
+    }
+    __postgresql_pool_codel_set(ep, overloaded);
+    ep->codel_min   = UINT64_MAX;
+    ep->codel_start = now;
+}
+
+/* Maintenance of a pool, run once per tick. */
+void postgresql_pool_tick(postgresql_pool_t *pool)
+{
+    int i;
+
+    for (i = 1; i < pool->n_endpoints; ++i) {
+        if (!pool->endpoints[i].config->dedicated) {
+            __postgresql_pool_probe_lag(&pool->endpoints[i]);
+        }
+    }
+
+    postgresql_notify_tick(pool);
+    postgresql_cache_tick();
+
+    for (i = 0; i < pool->n_endpoints; ++i) {
+        __postgresql_pool_codel_tick(&pool->endpoints[i]);
+        postgresql_pool_rebalance(&pool->endpoints[i]);
+        __postgresql_pool_budget_donate(&pool->endpoints[i]);
+        __postgresql_pool_budget_retry(&pool->endpoints[i]);
+    }
+
+    /* decay the latency histogram so it follows recent traffic */
+    for (i = 0; i < POSTGRESQL_POOL_LATENCY_BUCKETS; ++i) {
+        pool->latency_hist[i] /= 2;
+    }
+    pool->latency_samples /= 2;
+}
+
+static int __postgresql_pool_on_tick(int fd, void *data)
+{
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+        postgresql_pool_tick(data);
+    }
+    return DUDA_EVENT_OWNED;
+}
+
+static int __postgresql_pool_on_tick_close(int fd, void *data)
+{
+    postgresql_pool_t *pool = data;
+
+    msg->err("[FD %i] PostgreSQL Pool Timer Closed", fd);
+    pool->timer_fd = -1;
+    return DUDA_EVENT_CLOSE;
+}
+
+/* Register the maintenance timer of a pool into the event loop of this worker. */
+static inline void __postgresql_pool_timer_start(postgresql_pool_t *pool)
+{
+    struct itimerspec spec;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd == -1) {
+        msg->err("PostgreSQL Pool Timer Create Error");
+        return;
+    }
+
+    spec.it_interval.tv_sec  = POSTGRESQL_POOL_TICK_INTERVAL / 1000;
+    spec.it_interval.tv_nsec = (POSTGRESQL_POOL_TICK_INTERVAL % 1000) * 1000000;
+    spec.it_value            = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, NULL) == -1) {
+        msg->err("PostgreSQL Pool Timer Set Error");
+        close(fd);
+        return;
+    }
+
+    event->add(fd, DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED,
+               __postgresql_pool_on_tick, NULL, __postgresql_pool_on_tick_close,
+               __postgresql_pool_on_tick_close, NULL, pool);
+    pool->timer_fd = fd;
+}
+
+/* Create a pool instance of the calling worker, without maintenance timer. */
+postgresql_pool_t *postgresql_pool_create(postgresql_pool_config_t *config)
+{
+    int i;
+    postgresql_pool_t *pool;
+    postgresql_pool_endpoint_t *ep;
+
+    pool = monkey->mem_alloc(sizeof(postgresql_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->endpoints = monkey->mem_alloc(sizeof(postgresql_pool_endpoint_t) *
+                                        config->n_endpoints);
+    if (!pool->endpoints) {
+        FREE(pool);
+        return NULL;
+    }
+
+    for (i = 0; i < config->n_endpoints; ++i) {
+        ep = &pool->endpoints[i];
+        ep->index      = i;
+        ep->size       = 0;
+        ep->free_size  = 0;
+        ep->down_until = 0;
+        ep->config     = &config->endpoints[i];
+        ep->pool       = pool;
+        ep->outstanding = 0;
+        ep->latency     = 0;
+        ep->lag         = -1;
+        ep->replay_lsn  = 0;
+        ep->lag_probing = 0;
+        ep->selected    = 0;
+        ep->checkouts   = 0;
+        ep->hold_total  = 0;
+        ep->handles     = 0;
+        ep->handle_total = 0;
+        memset(ep->class_busy, 0, sizeof(ep->class_busy));
+        ep->codel_min   = UINT64_MAX;
+        ep->codel_start = 0;
+        ep->overloaded  = 0;
+        ep->shed        = 0;
+        ep->coalesced   = 0;
+        mk_list_init(&ep->free_conns);
+        mk_list_init(&ep->busy_conns);
+        mk_list_init(&ep->waiters);
+    }
+
+    pool->config      = config;
+    pool->n_endpoints = config->n_endpoints;
+    pool->seed        = (unsigned int) (time(NULL) ^ (uintptr_t) pool);
+    pool->timer_fd    = -1;
+    pool->latency_samples = 0;
+    pool->hedge_tokens    = 0;
+    memset(pool->latency_hist, 0, sizeof(pool->latency_hist));
+    pool->io_chan     = NULL;
+    pool->flights     = NULL;
+    pool->listener    = NULL;
+    return pool;
+}
+
+/* Get the pool of the calling worker, it is created on first use. */
+postgresql_pool_t *postgresql_pool_get(duda_global_t *pool_key)
+{
+    postgresql_pool_t *pool;
+    postgresql_pool_config_t *config;
+
+    pool = global->get(*pool_key);
+    if (pool) {
+        return pool;
+    }
+
+    config = __postgresql_pool_get_config(pool_key);
+    if (!config) {
+        return NULL;
+    }
+
+    pool = postgresql_pool_create(config);
+    if (!pool) {
+        return NULL;
+    }
+
+    global->set(*pool_key, (void *) pool);
+    __postgresql_pool_timer_start(pool);
+
+    if (config->io_threads > 0 && postgresql_io_start(config) == POSTGRESQL_OK) {
+        pool->io_chan = postgresql_io_chan_create();
+    }
+
+    return pool;
+}
+
+/* Create the configuration of a pool defined at runtime, it is not registered under any key. */
+postgresql_pool_config_t *postgresql_pool_config_uri(const char *uri, int max_size)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_config_create(NULL, 0, max_size);
+    if (!config) {
+        return NULL;
+    }
+
+    config->min_size = 0;
+    config->endpoints[0].uri  = monkey->str_dup(uri);
+    config->endpoints[0].type = POOL_TYPE_URI;
+    return config;
+}
+
+postgresql_conn_t *postgresql_pool_checkout(postgresql_pool_t *pool, duda_request_t *dr,
+                                            postgresql_connect_cb *cb)
+{
+    return __postgresql_pool_checkout(&pool->endpoints[0], dr, cb);
+}
+
+/* Number of idle connections of a pool. */
+int postgresql_pool_idle(postgresql_pool_t *pool)
+{
+    int i, idle = 0;
+
+    for (i = 0; i < pool->n_endpoints; ++i) {
+        idle += pool->endpoints[i].free_size;
+    }
+    return idle;
+}
+
+/* Close up to n idle connections of a pool, return how many were closed. */
+int postgresql_pool_evict(postgresql_pool_t *pool, int n)
+{
+    int i, closed = 0;
+    postgresql_pool_endpoint_t *ep;
+
+    for (i = 0; i < pool->n_endpoints && closed < n; ++i) {
+        ep = &pool->endpoints[i];
+        while (ep->free_size > 0 && closed < n) {
+            __postgresql_pool_release_conn(ep, POSTGRESQL_POOL_DEFAULT_SIZE);
+            closed++;
+        }
+    }
+    return closed;
+}
+
+static inline int __postgresql_pool_replica_usable(postgresql_pool_endpoint_t *ep, time_t now,
+                                                   uint64_t min_lsn)
+{
+    int max_lag = ep->pool->config->max_lag;
+
+    if (ep->config->dedicated || ep->down_until > now) {
+        return 0;
+    }
+    /* a replica is only trusted once its lag is known */
+    if (max_lag > 0 && (ep->lag < 0 || ep->lag * 1000 > max_lag)) {
+        return 0;
+    }
+    if (min_lsn > 0 && ep->replay_lsn < min_lsn) {
+        return 0;
+    }
+    return 1;
+}
+
+static inline double __postgresql_pool_endpoint_score(postgresql_pool_endpoint_t *ep)
+{
+    return (ep->outstanding + 1) * (ep->latency + 1);
+}
+
+/*
+ * Pick a replica with the power of two choices: take two usable replicas at
+ * random and keep the one with less outstanding queries weighted by latency.
+ * When min_lsn is set only replicas that replayed up to it are usable. Fall
+ * back to the primary if no replica is usable.
+ */
+static inline postgresql_pool_endpoint_t *__postgresql_pool_select_replica(postgresql_pool_t *pool,
+                                                                           uint64_t min_lsn)
+{
+    int i, a, b, n = 0;
+    time_t now = time(NULL);
+    postgresql_pool_endpoint_t *ep, *first = NULL, *second = NULL;
+
+    for (i = 1; i < pool->n_endpoints; ++i) {
+        n += __postgresql_pool_replica_usable(&pool->endpoints[i], now, min_lsn);
+    }
+
+    if (n == 0) {
+        ep = &pool->endpoints[0];
+        ep->selected++;
+        return ep;
+    }
+
+    a = rand_r(&pool->seed) % n;
+    b = a;
+    if (n > 1) {
+        b = rand_r(&pool->seed) % (n - 1);
+        if (b >= a) {
+            b++;
+        }
+    }
+
+    for (i = 1, n = 0; i < pool->n_endpoints; ++i) {
+        ep = &pool->endpoints[i];
+        if (!__postgresql_pool_replica_usable(ep, now, min_lsn)) {
+            continue;
+        }
+        if (n == a) {
+            first = ep;
+        }
+        if (n == b) {
+            second = ep;
+        }
+        n++;
+    }
+
+    ep = first;
+    if (__postgresql_pool_endpoint_score(second) < __postgresql_pool_endpoint_score(first)) {
+        ep = second;
+    }
+    ep->selected++;
+    return ep;
+}
+
+/*
+ * @METHOD_NAME: create_pool_params
+ * @METHOD_DESC: Create a connection pool per thread for connection sharing with the given parameters. It must be called within the function `duda_main()' of a Duda web service.
+ * @METHOD_PROTO: int create_pool_params(duda_global_t *pool_key, int min_size, int max_size, const char * const *keys, const char * const *values, int expand_dbname)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: min_size The minimum number of connections in the pool.
+ * @METHOD_PARAM: max_size The maximum number of connections in the pool.
+ * @METHOD_PARAM: keys A NULL-terminated string array that stands for the keywords you want to customize. If the array is empty, then it will try to connect the server with default paramter keywords. If any keyword is unspecified, then the corresponding environment variable is checked. The currently recognized parameter key words are listed <a href="http://www.postgresql.org/docs/9.2/static/libpq-connect.html#LIBPQ-PARAMKEYWORDS">here</a>.
+ * @METHOD_PARAM: values A NULL-terminated strin array that gives the corresponding values for each keyword in the keys array.
+ * @METHOD_PARAM: expand_dbname A flag that determines whether the dbname key word value is allowed to be recognized as a connection string. Use zero to disable it or non-zero to enable it.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_params_create(duda_global_t *pool_key, int min_size, int max_size,
+                                  const char * const *keys, const char * const *values,
+                                  int expand_dbname)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_config_create(pool_key, min_size,
+                                                                       max_size);
+    if (!config) {
+        return POSTGRESQL_ERR;
+    }
+
+    postgresql_endpoint_config_t *primary = &config->endpoints[0];
+    int length = 0;
+    const char * const *ptr = keys;
+    while (*ptr != NULL) {
+        length++;
+        ptr++;
+    }
+    
+    int i;
+    if (keys) {
+        primary->keys = monkey->mem_alloc(sizeof(char *) * (length + 1));
+        for (i = 0; i < length; ++i) {
+            primary->keys[i] = monkey->str_dup(keys[i]);
+        }
+        primary->keys[length] = NULL;
+    }
+
+    if (values) {
+        primary->values = monkey->mem_alloc(sizeof(char *) * (length + 1));
+        for (i = 0; i < length; ++i) {
+            primary->values[i] = monkey->str_dup(values[i]);
+        }
+        primary->values[length] = NULL;
+    }
+
+    primary->expand_dbname = expand_dbname;
+    primary->type = POOL_TYPE_PARAMS;
+    __postgresql_pool_config_register(config);
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: create_pool_uri
+ * @METHOD_DESC: Create a connection pool per thread for connection sharing with the given connection string. It must be called within the function `duda_main()' of a Duda web service.
+ * @METHOD_PROTO: int create_pool_uri(duda_global_t *pool_key, int min_size, int max_size, const char *uri)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: min_size The minimum number of connections in the pool.
+ * @METHOD_PARAM: max_size The maximum number of connections in the pool.
+ * @METHOD_PARAM: uri The string which specifies the connection parameters and their values. There are two accepted formats for these strings: plain keyword = value strings and RFC 3986 URIs. For full reference of the connection strings please consult the official <a href="http://www.postgresql.org/docs/9.2/static/libpq-connect.html#LIBPQ-CONNSTRING">documentation</a> of PostgreSQL.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_uri_create(duda_global_t *pool_key, int min_size, int max_size,
+                               const char *uri)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_config_create(pool_key, min_size,
+                                                                       max_size);
+    if (!config) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->endpoints[0].uri  = monkey->str_dup(uri);
+    config->endpoints[0].type = POOL_TYPE_URI;
+    __postgresql_pool_config_register(config);
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: add_replica
+ * @METHOD_DESC: Add a read-only replica server to a connection pool, the server the pool was created with acts as the primary. Read-only connections are spread across the replicas and a replica that fails is skipped for a while. It must be called within the function `duda_main()' of a Duda web service, after the pool is created.
+ * @METHOD_PROTO: int add_replica(duda_global_t *pool_key, const char *uri)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: uri The connection string of the replica, in the same formats accepted by create_pool_uri.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_add_replica(duda_global_t *pool_key, const char *uri)
+{
+    postgresql_endpoint_config_t *endpoints;
+    postgresql_pool_config_t *config = __postgresql_pool_get_config(pool_key);
+    if (!config) {
+        return POSTGRESQL_ERR;
+    }
+
+    endpoints = monkey->mem_realloc(config->endpoints, sizeof(postgresql_endpoint_config_t) *
+                                    (config->n_endpoints + 1));
+    if (!endpoints) {
+        return POSTGRESQL_ERR;
+    }
+
+    memset(&endpoints[config->n_endpoints], 0, sizeof(postgresql_endpoint_config_t));
+    endpoints[config->n_endpoints].uri  = monkey->str_dup(uri);
+    endpoints[config->n_endpoints].type = POOL_TYPE_URI;
+    config->endpoints = endpoints;
+    config->n_endpoints++;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: get_conn
+ * @METHOD_DESC: Get a PostgreSQL connection from a connection pool. If all the connections in a pool are currently used, the pool will spawn more connections as long as the pool size don't exceed the maximum.
+ * @METHOD_PROTO: postgresql_conn_t *get_conn(duda_global_t *pool_key, duda_request_t *dr, postgresql_connect_cb *cb)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: dr The request context information hold by a duda_request_t type.
+ * @METHOD_PARAM: cb The callback function that will take actions when a connection success or fail to establish.
+ * @METHOD_RETURN: A PostgreSQL connection on success, or NULL on failure, also in session mode when the backend budget of the pool is spent.
+ */
+
+postgresql_conn_t *postgresql_pool_get_conn(duda_global_t *pool_key, duda_request_t *dr,
+                                            postgresql_connect_cb *cb)
+{
+    postgresql_pool_t *pool = postgresql_pool_get(pool_key);
+    if (!pool) {
+        return NULL;
+    }
+
+    return __postgresql_pool_checkout(&pool->endpoints[0], dr, cb);
+}
+
+/*
+ * @METHOD_NAME: get_conn_ro
+ * @METHOD_DESC: Get a read-only PostgreSQL connection from a connection pool. The connection is taken from one of the replicas of the pool in turn, replicas that are out of rotation are skipped, and the primary is used if the pool has no usable replica.
+ * @METHOD_PROTO: postgresql_conn_t *get_conn_ro(duda_global_t *pool_key, duda_request_t *dr, postgresql_connect_cb *cb)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: dr The request context information hold by a duda_request_t type.
+ * @METHOD_PARAM: cb The callback function that will take actions when a connection success or fail to establish.
+ * @METHOD_RETURN: A PostgreSQL connection on success, or NULL on failure.
+ */
+
+postgresql_conn_t *postgresql_pool_get_conn_ro(duda_global_t *pool_key, duda_request_t *dr,
+                                               postgresql_connect_cb *cb)
+{
+    return postgresql_pool_get_conn_ro_lsn(pool_key, dr, cb, NULL);
+}
+
+/*
+ * @METHOD_NAME: get_conn_ro_lsn
+ * @METHOD_DESC: Get a read-only PostgreSQL connection from a connection pool that sees the writes described by a token returned from lsn_token. Only replicas that have replayed the write are used, otherwise the connection is taken from the primary.
+ * @METHOD_PROTO: postgresql_conn_t *get_conn_ro_lsn(duda_global_t *pool_key, duda_request_t *dr, postgresql_connect_cb *cb, const char *token)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: dr The request context information hold by a duda_request_t type.
+ * @METHOD_PARAM: cb The callback function that will take actions when a connection success or fail to establish.
+ * @METHOD_PARAM: token The token of the last write of the client, it behaves like get_conn_ro if it is NULL.
+ * @METHOD_RETURN: A PostgreSQL connection on success, or NULL on failure.
+ */
+
+postgresql_conn_t *postgresql_pool_get_conn_ro_lsn(duda_global_t *pool_key, duda_request_t *dr,
+                                                   postgresql_connect_cb *cb, const char *token)
+{
+    uint64_t min_lsn = postgresql_util_lsn_parse(token);
+    postgresql_pool_endpoint_t *ep;
+    postgresql_conn_t *conn;
+    postgresql_pool_t *pool = postgresql_pool_get(pool_key);
+    if (!pool) {
+        return NULL;
+    }
+
+    ep = __postgresql_pool_select_replica(pool, min_lsn);
+    conn = __postgresql_pool_checkout(ep, dr, cb);
+    if (conn) {
+        conn->read_only = 1;
+        conn->min_lsn   = min_lsn;
+    }
+    return conn;
+}
+
+/*
+ * @METHOD_NAME: get_conn_class
+ * @METHOD_DESC: Get a PostgreSQL connection from a connection pool for a class of work. The connections held by a class are limited by its quota, and batch or analytical work never takes the connections reserved for interactive work. A class with a dedicated endpoint gets its connections from it. In transaction and statement modes queries of a class over its share wait for a connection of the class to come back, in session mode NULL is returned.
+ * @METHOD_PROTO: postgresql_conn_t *get_conn_class(duda_global_t *pool_key, int workload, duda_request_t *dr, postgresql_connect_cb *cb)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: workload POSTGRESQL_CLASS_INTERACTIVE, POSTGRESQL_CLASS_BATCH or POSTGRESQL_CLASS_ANALYTICAL.
+ * @METHOD_PARAM: dr The request context information hold by a duda_request_t type.
+ * @METHOD_PARAM: cb The callback function that will take actions when a connection success or fail to establish.
+ * @METHOD_RETURN: A PostgreSQL connection on success, or NULL on failure.
+ */
+
+postgresql_conn_t *postgresql_pool_get_conn_class(duda_global_t *pool_key, int workload,
+                                                  duda_request_t *dr, postgresql_connect_cb *cb)
+{
+    postgresql_pool_t *pool;
+
+    if (workload < 0 || workload >= POSTGRESQL_CLASSES) {
+        return NULL;
+    }
+
+    pool = postgresql_pool_get(pool_key);
+    if (!pool) {
+        return NULL;
+    }
+
+    return __postgresql_pool_checkout_class(&pool->endpoints[pool->config->class_endpoint[workload]],
+                                            workload, dr, cb);
+}
+
+/*
+ * @METHOD_NAME: set_class_quota
+ * @METHOD_DESC: Set the share of the connections of a pool a class of work may use, in every worker. For POSTGRESQL_CLASS_BATCH and POSTGRESQL_CLASS_ANALYTICAL it is the number of connections the class may hold at once. For POSTGRESQL_CLASS_INTERACTIVE it is the number of connections the other classes must leave free for interactive work, one by default. It must be called within the function `duda_main()' of a Duda web service, after the pool is created.
+ * @METHOD_PROTO: int set_class_quota(duda_global_t *pool_key, int workload, int quota)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: workload POSTGRESQL_CLASS_INTERACTIVE, POSTGRESQL_CLASS_BATCH or POSTGRESQL_CLASS_ANALYTICAL.
+ * @METHOD_PARAM: quota The number of connections, zero means no limit.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_set_class_quota(duda_global_t *pool_key, int workload, int quota)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_get_config(pool_key);
+    if (!config || workload < 0 || workload >= POSTGRESQL_CLASSES || quota < 0) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->class_quota[workload] = quota;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: set_class_endpoint
+ * @METHOD_DESC: Route a class of work of a pool to a server of its own, such as a replica set aside for reports, so it does not compete with the other classes. The server is not used for anything else. It must be called within the function `duda_main()' of a Duda web service, after the pool is created.
+ * @METHOD_PROTO: int set_class_endpoint(duda_global_t *pool_key, int workload, const char *uri)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: workload POSTGRESQL_CLASS_BATCH or POSTGRESQL_CLASS_ANALYTICAL.
+ * @METHOD_PARAM: uri The connection string of the server, in the same formats accepted by create_pool_uri.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_set_class_endpoint(duda_global_t *pool_key, int workload, const char *uri)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_get_config(pool_key);
+    if (!config || workload <= POSTGRESQL_CLASS_INTERACTIVE || workload >= POSTGRESQL_CLASSES) {
+        return POSTGRESQL_ERR;
+    }
+
+    if (postgresql_pool_add_replica(pool_key, uri) != POSTGRESQL_OK) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->endpoints[config->n_endpoints - 1].dedicated = 1;
+    config->class_endpoint[workload] = config->n_endpoints - 1;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: set_pool_mode
+ * @METHOD_DESC: Set how long the connections of a pool stay bound to the handles returned by get_conn. In mode POSTGRESQL_POOL_SESSION, the default, a connection is held from get_conn until disconnect. In mode POSTGRESQL_POOL_TRANSACTION get_conn returns a handle right away, and a connection is bound to it only while it has queries to run or a transaction open, so a few connections serve many concurrent requests. Mode POSTGRESQL_POOL_STATEMENT works the same, except that autocommit reads of many handles are pipelined on shared connections. Session state such as prepared statements, temporary tables or SET commands do not survive across transactions in that mode. It must be called within the function `duda_main()' of a Duda web service, after the pool is created.
+ * @METHOD_PROTO: int set_pool_mode(duda_global_t *pool_key, int mode)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: mode POSTGRESQL_POOL_SESSION, POSTGRESQL_POOL_TRANSACTION or POSTGRESQL_POOL_STATEMENT.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_set_mode(duda_global_t *pool_key, int mode)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_get_config(pool_key);
+    if (!config) {
+        return POSTGRESQL_ERR;
+    }
+    if (mode != POSTGRESQL_POOL_SESSION && mode != POSTGRESQL_POOL_TRANSACTION &&
+        mode != POSTGRESQL_POOL_STATEMENT) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->mode = mode;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: set_max_lag
+ * @METHOD_DESC: Set the maximum replication lag allowed for the replicas of a connection pool. The lag of every replica is sampled periodically and a replica lagging behind more than this is skipped by get_conn_ro. It must be called within the function `duda_main()' of a Duda web service, after the pool is created.
+ * @METHOD_PROTO: int set_max_lag(duda_global_t *pool_key, int max_lag)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: max_lag The maximum replication lag in milliseconds, zero means no limit.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_set_max_lag(duda_global_t *pool_key, int max_lag)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_get_config(pool_key);
+    if (!config || max_lag < 0) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->max_lag = max_lag;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: set_steal_threshold
+ * @METHOD_DESC: Set how long a query of a connection pool may run before the queries queued behind it are taken over by an idle connection of the same pool. Only queries that have not been sent yet and do not depend on session state are moved: reads queued on connections bound by transaction or statement pooling, and queries tagged with flag POSTGRESQL_QUERY_STEALABLE. It must be called within the function `duda_main()' of a Duda web service, after the pool is created.
+ * @METHOD_PROTO: int set_steal_threshold(duda_global_t *pool_key, int threshold)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: threshold The threshold in milliseconds, zero disables work stealing.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_set_steal_threshold(duda_global_t *pool_key, int threshold)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_get_config(pool_key);
+    if (!config || threshold < 0) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->steal_threshold = threshold;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: set_pool_budget
+ * @METHOD_DESC: Cap the number of backend connections a pool opens across all the workers of the process, since every worker has its own pool whose max_size applies separately. Workers share the budget on demand, the other workers give their idle connections back to the budget within a second. In transaction and statement modes the queries of a worker denied a connection wait for one; in session mode, the default, get_conn returns NULL right away once the budget is spent, so the request should be answered or retried later. It must be called within the function `duda_main()' of a Duda web service, after the pool is created.
+ * @METHOD_PROTO: int set_pool_budget(duda_global_t *pool_key, int budget)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: budget The maximum number of connections for the whole process, zero means no limit.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_set_budget(duda_global_t *pool_key, int budget)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_get_config(pool_key);
+    if (!config || budget < 0) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->budget = budget;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: set_pool_io_threads
+ * @METHOD_DESC: Let dedicated database threads own the connections of a pool, instead of every worker opening its own. Each thread connects max_size times to every endpoint of the pool, workers hand their queries to the threads through lock-free queues and the callbacks still run in the worker that sent the query. The handles returned by get_conn have the semantics of statement pooling: the queries of a handle run one after the other, but not always on the same connection, so a transaction must be sent as a single query string, and the escape methods are not available on them since no connection belongs to the worker: use query parameters instead. It must be called within the function `duda_main()' of a Duda web service, after the pool is created.
+ * @METHOD_PROTO: int set_pool_io_threads(duda_global_t *pool_key, int n_threads)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: n_threads The number of database threads, zero lets every worker use its own connections.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_set_io_threads(duda_global_t *pool_key, int n_threads)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_get_config(pool_key);
+    if (!config || n_threads < 0 || config->io_started) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->io_threads = n_threads;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: set_pool_admission
+ * @METHOD_DESC: Turn on admission control for a pool, after the CoDel algorithm. When even the shortest time a query waited before being sent stays above the target for a whole interval, the server is considered overloaded: queries with a priority below POSTGRESQL_PRIORITY_NORMAL are rejected right away with POSTGRESQL_OVERLOADED, and no connection is opened beyond the maximum size of the pool, until the queueing delay drops below the target again. It must be called within the function `duda_main()' of a Duda web service, after the pool is created.
+ * @METHOD_PROTO: int set_pool_admission(duda_global_t *pool_key, int target, int interval)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: target The acceptable queueing delay in milliseconds, zero disables admission control.
+ * @METHOD_PARAM: interval The time in milliseconds the delay must stay above the target.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_set_admission(duda_global_t *pool_key, int target, int interval)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_get_config(pool_key);
+    if (!config || target < 0 || interval <= 0) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->codel_target   = target * 1000;
+    config->codel_interval = interval * 1000;
+    return POSTGRESQL_OK;
+}
+
+/* Account the time a query waited before it was sent, in microseconds. */
+void postgresql_pool_queue_sample(postgresql_pool_endpoint_t *ep, uint64_t delay)
+{
+    uint64_t now;
+    postgresql_pool_config_t *config = ep->pool->config;
+
+    if (config->codel_target == 0) {
+        return;
+    }
+
+    if (delay < ep->codel_min) {
+        ep->codel_min = delay;
+    }
+
+    now = postgresql_util_now();
+    if (now - ep->codel_start >= (uint64_t) config->codel_interval) {
+        __postgresql_pool_codel_set(ep, ep->codel_min > (uint64_t) config->codel_target);
+        ep->codel_min   = UINT64_MAX;
+        ep->codel_start = now;
+    }
+}
+
+/* Check whether a query of the given priority may be queued on an endpoint. */
+int postgresql_pool_admit(postgresql_pool_endpoint_t *ep, int priority)
+{
+    if (ep->overloaded && priority > POSTGRESQL_POOL_ADMIT_PRIORITY) {
+        ep->shed++;
+        return 0;
+    }
+    return 1;
+}
+
+/* Give the budget slot of a connection back, once it is closed. */
+void postgresql_pool_budget_release(postgresql_conn_t *conn)
+{
+    __postgresql_pool_budget_put(conn->budget);
+    conn->budget = NULL;
+}
+
+/*
+ * @METHOD_NAME: endpoint_stats
+ * @METHOD_DESC: Get the statistics of the servers of a connection pool as seen by the calling worker: pool sizes, outstanding queries, query latency, replication lag, how many read-only connections were routed to each of them, and how long connections are held per checkout. In transaction mode the average lifetime of the handles is reported too, compared to the hold time of the connections it shows how much pool time the handles saved.
+ * @METHOD_PROTO: int endpoint_stats(duda_global_t *pool_key, postgresql_endpoint_stats_t *stats, int n)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: stats An array that will hold the statistics, the primary comes first.
+ * @METHOD_PARAM: n The number of elements of the stats array.
+ * @METHOD_RETURN: The number of elements filled, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_endpoint_stats(duda_global_t *pool_key,
+                                   postgresql_endpoint_stats_t *stats, int n)
+{
+    int i;
+    time_t now = time(NULL);
+    postgresql_pool_endpoint_t *ep;
+    postgresql_pool_t *pool = postgresql_pool_get(pool_key);
+    if (!pool) {
+        return POSTGRESQL_ERR;
+    }
+
+    for (i = 0; i < pool->n_endpoints && i < n; ++i) {
+        ep = &pool->endpoints[i];
+        stats[i].index       = ep->index;
+        stats[i].available   = i == 0 || __postgresql_pool_replica_usable(ep, now, 0);
+        stats[i].size        = ep->size;
+        stats[i].free_size   = ep->free_size;
+        stats[i].outstanding = ep->outstanding;
+        stats[i].latency     = ep->latency;
+        stats[i].lag         = ep->lag;
+        stats[i].selected    = ep->selected;
+        stats[i].checkouts   = ep->checkouts;
+        stats[i].hold_time   = ep->checkouts ? (double) ep->hold_total / ep->checkouts : 0;
+        stats[i].handles     = ep->handles;
+        stats[i].handle_time = ep->handles ? (double) ep->handle_total / ep->handles : 0;
+        stats[i].overloaded  = ep->overloaded;
+        stats[i].shed        = ep->shed;
+        stats[i].coalesced   = ep->coalesced;
+    }
+    return i;
+}
+
+/* Account the latency of a finished query to the moving average of its endpoint. */
+void postgresql_pool_endpoint_sample(postgresql_pool_endpoint_t *ep, uint64_t latency)
+{
+    int bucket = 0;
+    postgresql_pool_t *pool = ep->pool;
+
+    if (ep->latency == 0) {
+        ep->latency = latency;
+    } else {
+        ep->latency += POSTGRESQL_POOL_LATENCY_ALPHA * ((double) latency - ep->latency);
+    }
+
+    /* bucket i holds latencies below 2^(i + 1) microseconds */
+    while (latency > 1 && bucket < POSTGRESQL_POOL_LATENCY_BUCKETS - 1) {
+        latency >>= 1;
+        bucket++;
+    }
+    pool->latency_hist[bucket]++;
+    pool->latency_samples++;
+}
+
+/* Upper bound of the 95th percentile of recent query latency, 0 if unknown. */
+uint64_t postgresql_pool_latency_p95(postgresql_pool_t *pool)
+{
+    int i;
+    unsigned long count = 0;
+    unsigned long target = pool->latency_samples - pool->latency_samples / 20;
+
+    if (pool->latency_samples < POSTGRESQL_POOL_LATENCY_MIN_SAMPLES) {
+        return 0;
+    }
+
+    for (i = 0; i < POSTGRESQL_POOL_LATENCY_BUCKETS; ++i) {
+        count += pool->latency_hist[i];
+        if (count >= target) {
+            break;
+        }
+    }
+    return (uint64_t) 1 << (i + 1);
+}
+
+/*
+ * Get a read-only connection for a hedged query, on the best usable replica
+ * other than the one given. Every candidate query earns a fraction of a token
+ * and a hedge spends a whole one, which caps the extra load.
+ */
+postgresql_conn_t *postgresql_pool_hedge_conn(postgresql_pool_t *pool, duda_request_t *dr,
+                                              postgresql_pool_endpoint_t *exclude)
+{
+    int i;
+    time_t now = time(NULL);
+    postgresql_pool_endpoint_t *ep, *best = NULL;
+    postgresql_conn_t *conn;
+
+    if (pool->hedge_tokens < 1) {
+        return NULL;
+    }
+
+    for (i = 1; i < pool->n_endpoints; ++i) {
+        ep = &pool->endpoints[i];
+        if (ep == exclude || !__postgresql_pool_replica_usable(ep, now, 0)) {
+            continue;
+        }
+        if (!best || __postgresql_pool_endpoint_score(ep) < __postgresql_pool_endpoint_score(best)) {
+            best = ep;
+        }
+    }
+
+    if (!best) {
+        return NULL;
+    }
+
+    conn = __postgresql_pool_endpoint_get_conn(best, dr, NULL);
+    if (conn) {
+        conn->read_only = 1;
+        best->selected++;
+        pool->hedge_tokens -= 1;
+    }
+    return conn;
+}
+
+void postgresql_pool_hedge_earn(postgresql_pool_t *pool)
+{
+    pool->hedge_tokens += pool->config->hedge_budget / 100.0;
+    if (pool->hedge_tokens > POSTGRESQL_POOL_HEDGE_MAX_TOKENS) {
+        pool->hedge_tokens = POSTGRESQL_POOL_HEDGE_MAX_TOKENS;
+    }
+}
+
+/*
+ * @METHOD_NAME: set_hedge_budget
+ * @METHOD_DESC: Set the budget of hedged queries of a connection pool, as a percentage of the hedged queries issued: with a budget of 5 at most one query out of twenty is sent to a second replica. It must be called within the function `duda_main()' of a Duda web service, after the pool is created.
+ * @METHOD_PROTO: int set_hedge_budget(duda_global_t *pool_key, int percent)
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of a pool.
+ * @METHOD_PARAM: percent The extra load allowed, from 0 (hedging disabled) to 100.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_pool_set_hedge_budget(duda_global_t *pool_key, int percent)
+{
+    postgresql_pool_config_t *config = __postgresql_pool_get_config(pool_key);
+    if (!config || percent < 0 || percent > 100) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->hedge_budget = percent;
+    return POSTGRESQL_OK;
+}
+
+void postgresql_pool_reclaim_conn(postgresql_conn_t *conn)
+{
+    postgresql_conn_t *handle;
+    postgresql_pool_endpoint_t *ep = conn->endpoint;
+
+    __postgresql_pool_hold_sample(conn);
+    __postgresql_pool_class_put(conn);
+    conn->dr            = NULL;
+    conn->connect_cb    = NULL;
+    conn->disconnect_cb = NULL;
+    conn->disconnect_on_finish = 0;
+    conn->query_flags   = 0;
+    conn->is_busy       = 0;
+    conn->read_only     = 0;
+    conn->lsn           = 0;
+    conn->min_lsn       = 0;
+    conn->client        = NULL;
+    conn->shared        = 0;
+
+    /* hand the backend over to the handle waiting the longest for one */
+    handle = __postgresql_pool_next_waiter(ep);
+    if (handle) {
+        mk_list_del(&handle->_wait_head);
+        handle->is_waiting = 0;
+        conn->is_busy = 1;
+        __postgresql_pool_bind(handle, conn);
+        return;
+    }
+
+    mk_list_del(&conn->_pool_head);
+    mk_list_add(&conn->_pool_head, &ep->free_conns);
+    ep->free_size++;
+
+    while (ep->free_size * 2 > ep->size &&
+           ep->size > POSTGRESQL_POOL_DEFAULT_MIN_SIZE) {
+        __postgresql_pool_release_conn(ep, POSTGRESQL_POOL_DEFAULT_SIZE);
+    }
+
+    postgresql_pool_rebalance(ep);
+}
+
+/* Drop a connection that is about to be closed from its pool. */
+void postgresql_pool_remove_conn(postgresql_conn_t *conn)
+{
+    postgresql_pool_endpoint_t *ep = conn->endpoint;
+
+    __postgresql_pool_hold_sample(conn);
+    __postgresql_pool_class_put(conn);
+    mk_list_del(&conn->_pool_head);
+    ep->size--;
+    if (!conn->is_busy) {
+        ep->free_size--;
+    }
+    conn->pool = NULL;
+    conn->endpoint = NULL;
+}
+
+static inline int __postgresql_pool_stealable(postgresql_conn_t *conn,
+                                              postgresql_query_t *query)
+{
+    /* prepared statements live in the session, a WAL position belongs to its write */
+    if (query->type == QUERY_TYPE_PREPARED || (query->flags & POSTGRESQL_QUERY_TRACK_LSN)) {
+        return 0;
+    }
+    if (query->flags & POSTGRESQL_QUERY_STEALABLE) {
+        return 1;
+    }
+    /* handles of multiplexed backends keep no session state */
+    return query->is_read && (conn->client || conn->shared);
+}
+
+/*
+ * Find a connection whose running query is past the steal threshold and that
+ * has queries queued behind it which can run elsewhere.
+ */
+static inline postgresql_conn_t *__postgresql_pool_blocked_conn(postgresql_pool_endpoint_t *ep,
+                                                                uint64_t threshold)
+{
+    uint64_t now = postgresql_util_now();
+    struct mk_list *head;
+    postgresql_conn_t *conn;
+    postgresql_query_t *query, *next;
+
+    mk_list_foreach(head, &ep->busy_conns) {
+        conn = mk_list_entry(head, postgresql_conn_t, _pool_head);
+        query = conn->current_query;
+        if (!query || conn->in_transaction || now - query->sent_at < threshold) {
+            continue;
+        }
+        /* the running query may open a transaction the queued ones belong to */
+        if (!query->is_read && !(query->flags & POSTGRESQL_QUERY_STEALABLE)) {
+            continue;
+        }
+        if (query->_head.next == &conn->queries) {
+            continue;
+        }
+        next = mk_list_entry(query->_head.next, postgresql_query_t, _head);
+        if (!__postgresql_pool_stealable(conn, next)) {
+            continue;
+        }
+        /* the queries of a bound handle all move, or none does, so they keep their order */
+        if (conn->client) {
+            while (next && __postgresql_pool_stealable(conn, next)) {
+                next = next->_head.next == &conn->queries ? NULL :
+                       mk_list_entry(next->_head.next, postgresql_query_t, _head);
+            }
+            if (next) {
+                continue;
+            }
+        }
+        return conn;
+    }
+    return NULL;
+}
+
+static inline postgresql_conn_t *__postgresql_pool_idle_conn(postgresql_pool_endpoint_t *ep)
+{
+    struct mk_list *head;
+    postgresql_conn_t *conn;
+
+    mk_list_foreach(head, &ep->free_conns) {
+        conn = mk_list_entry(head, postgresql_conn_t, _pool_head);
+        if (conn->state == CONN_STATE_CONNECTED) {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Work stealing: move the queries queued behind a long running one to idle
+ * connections of the same pool. Only the run of stealable queries right after
+ * the running one moves, so the queries of a connection keep their order.
+ */
+void postgresql_pool_rebalance(postgresql_pool_endpoint_t *ep)
+{
+    int n;
+    struct mk_list *head, *tmp;
+    postgresql_conn_t *victim, *thief;
+    postgresql_query_t *query;
+    uint64_t threshold = (uint64_t) ep->pool->config->steal_threshold * 1000;
+
+    if (threshold == 0) {
+        return;
+    }
+
+    while ((victim = __postgresql_pool_blocked_conn(ep, threshold)) &&
+           (thief = __postgresql_pool_idle_conn(ep))) {
+        mk_list_del(&thief->_pool_head);
+        mk_list_add(&thief->_pool_head, &ep->busy_conns);
+        thief->is_busy     = 1;
+        thief->shared      = 1;
+        thief->checkout_at = postgresql_util_now();
+        ep->free_size--;
+
+        n = 0;
+        mk_list_foreach_safe(head, tmp, &victim->queries) {
+            query = mk_list_entry(head, postgresql_query_t, _head);
+            if (query == victim->current_query) {
+                continue;
+            }
+            if (!__postgresql_pool_stealable(victim, query)) {
+                break;
+            }
+            mk_list_del(&query->_head);
+            mk_list_add(&query->_head, &thief->queries);
+            /* the handle of a bound backend waits for its stolen reads like for pipelined ones */
+            if (!query->handle && victim->client) {
+                query->handle = victim->client;
+                query->handle->pipelined++;
+            }
+            if (query->handle) {
+                query->handle->pipeline = thief;
+            }
+            n++;
+        }
+
+        msg->info("[FD %i] PostgreSQL %i Queries Taken Over by FD %i", victim->fd, n, thief->fd);
+        postgresql_conn_kick(thief);
+    }
+}
+
+/* Find a backend for a handle that has queries to run, or queue it until one is free. */
+void postgresql_pool_acquire(postgresql_conn_t *handle)
+{
+    int ret;
+    postgresql_query_t *query;
+    postgresql_pool_endpoint_t *ep = handle->endpoint;
+
+    /* the queries of a handle keep their order, so they wait for its pipelined reads */
+    if (handle->backend || handle->is_waiting || handle->pipelined > 0) {
+        return;
+    }
+
+    if (ep->pool->config->io_threads > 0) {
+        if (mk_list_is_empty(&handle->queries) != 0) {
+            query = mk_list_entry_first(&handle->queries, postgresql_query_t, _head);
+            mk_list_del(&query->_head);
+            postgresql_io_submit(handle, query);
+        }
+        return;
+    }
+
+    /* a class over its share waits until one of its own backends comes back */
+    if (!__postgresql_pool_class_admit(ep, handle->workload)) {
+        mk_list_add(&handle->_wait_head, &ep->waiters);
+        handle->is_waiting = 1;
+        return;
+    }
+
+    if (mk_list_is_empty(&ep->free_conns) == 0) {
+        if (ep->size >= ep->pool->config->max_size) {
+            mk_list_add(&handle->_wait_head, &ep->waiters);
+            handle->is_waiting = 1;
+            return;
+        }
+        ret = __postgresql_pool_spawn_conn(ep, POSTGRESQL_POOL_DEFAULT_SIZE);
+        if (ret == POSTGRESQL_POOL_EXHAUSTED) {
+            /* another worker holds the budget, wait for one to be given back */
+            mk_list_add(&handle->_wait_head, &ep->waiters);
+            handle->is_waiting = 1;
+            return;
+        }
+        if (ret != POSTGRESQL_OK) {
+            msg->err("PostgreSQL Pool Spawn Connection Error");
+            while (mk_list_is_empty(&handle->queries) != 0) {
+                query = mk_list_entry_first(&handle->queries, postgresql_query_t, _head);
+                postgresql_async_fail_query(handle, query, POSTGRESQL_ERR);
+            }
+            return;
+        }
+    }
+
+    __postgresql_pool_bind(handle,
+                           mk_list_entry_first(&ep->free_conns, postgresql_conn_t, _pool_head));
+}
+
+static inline int __postgresql_pool_depth(postgresql_conn_t *conn)
+{
+    int depth = 0;
+    struct mk_list *head;
+
+    mk_list_foreach(head, &conn->queries) {
+        depth++;
+    }
+    return depth;
+}
+
+/*
+ * Pick the shared backend with the shortest pipeline. Another backend is
+ * brought in when every pipeline is deep and the pool has room for it.
+ */
+static inline postgresql_conn_t *__postgresql_pool_shared_backend(postgresql_pool_endpoint_t *ep)
+{
+    int depth, best_depth = 0;
+    struct mk_list *head;
+    postgresql_conn_t *conn, *best = NULL;
+
+    mk_list_foreach(head, &ep->busy_conns) {
+        conn = mk_list_entry(head, postgresql_conn_t, _pool_head);
+        if (!conn->shared) {
+            continue;
+        }
+        depth = __postgresql_pool_depth(conn);
+        if (!best || depth < best_depth) {
+            best = conn;
+            best_depth = depth;
+        }
+    }
+
+    if (best && best_depth < POSTGRESQL_POOL_PIPELINE_DEPTH) {
+        return best;
+    }
+
+    if (mk_list_is_empty(&ep->free_conns) == 0 && ep->size < ep->pool->config->max_size) {
+        __postgresql_pool_spawn_conn(ep, POSTGRESQL_POOL_DEFAULT_SIZE);
+    }
+    if (mk_list_is_empty(&ep->free_conns) == 0) {
+        return best;
+    }
+
+    conn = mk_list_entry_first(&ep->free_conns, postgresql_conn_t, _pool_head);
+    mk_list_del(&conn->_pool_head);
+    mk_list_add(&conn->_pool_head, &ep->busy_conns);
+    conn->is_busy     = 1;
+    conn->shared      = 1;
+    conn->checkout_at = postgresql_util_now();
+    ep->free_size--;
+    return conn;
+}
+
+/*
+ * In statement mode an autocommit read of a handle without backend is
+ * appended to the pipeline of a shared backend, every query carries the
+ * request it belongs to. Return POSTGRESQL_ERR when the query must wait
+ * for a backend of its own instead.
+ */
+int postgresql_pool_pipeline(postgresql_conn_t *handle, postgresql_query_t *query)
+{
+    postgresql_conn_t *backend;
+    postgresql_pool_endpoint_t *ep = handle->endpoint;
+
+    /* database threads take every query, one at a time for each handle */
+    if (ep->pool->config->io_threads > 0) {
+        if (handle->pipelined > 0 || mk_list_is_empty(&handle->queries) != 0) {
+            return POSTGRESQL_ERR;
+        }
+        postgresql_io_submit(handle, query);
+        return POSTGRESQL_OK;
+    }
+
+    /* shared backends are not accounted to a class, only interactive reads use them */
+    if (ep->pool->config->mode != POSTGRESQL_POOL_STATEMENT || !query->is_read ||
+        handle->workload > POSTGRESQL_CLASS_INTERACTIVE) {
+        return POSTGRESQL_ERR;
+    }
+
+    /* earlier queries of the handle are waiting for a backend */
+    if (mk_list_is_empty(&handle->queries) != 0 || handle->is_waiting) {
+        return POSTGRESQL_ERR;
+    }
+
+    /* reads of a handle stay on one pipeline so they finish in order */
+    if (handle->pipelined > 0) {
+        backend = handle->pipeline;
+    } else {
+        backend = __postgresql_pool_shared_backend(ep);
+    }
+    if (!backend) {
+        return POSTGRESQL_ERR;
+    }
+
+    query->handle     = handle;
+    handle->pipeline  = backend;
+    handle->pipelined++;
+    postgresql_conn_push_query(backend, query);
+    postgresql_conn_kick(backend);
+    return POSTGRESQL_OK;
+}
+
+/* Called when a pipelined read of a handle is freed. */
+void postgresql_pool_pipeline_done(postgresql_conn_t *handle)
+{
+    postgresql_query_t *query;
+
+    if (--handle->pipelined > 0) {
+        return;
+    }
+
+    /* reads stolen from the bound backend are over, the queries held meanwhile go to it */
+    if (handle->backend) {
+        handle->pipeline = NULL;
+        while (mk_list_is_empty(&handle->queries) != 0) {
+            query = mk_list_entry_first(&handle->queries, postgresql_query_t, _head);
+            mk_list_del(&query->_head);
+            mk_list_add(&query->_head, &handle->backend->queries);
+        }
+        postgresql_conn_kick(handle->backend);
+        return;
+    }
+
+    /* a pooled connection of its own waited for a coalesced read */
+    if (!handle->is_virtual) {
+        if (mk_list_is_empty(&handle->queries) != 0) {
+            postgresql_conn_kick(handle);
+        } else if (handle->disconnect_on_finish && handle->state == CONN_STATE_CONNECTED) {
+            postgresql_conn_handle_release(handle, POSTGRESQL_OK);
+        }
+        return;
+    }
+
+    handle->pipeline = NULL;
+    if (mk_list_is_empty(&handle->queries) != 0) {
+        postgresql_pool_acquire(handle);
+    } else if (handle->disconnect_on_finish) {
+        __postgresql_pool_handle_free(handle, POSTGRESQL_OK);
+    }
+}
+
+/*
+ * Called when a bound or shared backend ran all its queries. It goes back to
+ * the pool unless a transaction is still open, a transaction left open by a
+ * handle that was disconnected is rolled back first.
+ */
+void postgresql_pool_backend_idle(postgresql_conn_t *backend)
+{
+    postgresql_conn_t *handle = backend->client;
+
+    if (backend->in_transaction) {
+        if (handle && !handle->disconnect_on_finish) {
+            return;
+        }
+        msg->warn("[FD %i] PostgreSQL Rolling Back Transaction Left Open", backend->fd);
+        backend->in_transaction = 0;
+        backend->lsn_deferred   = 0;
+        postgresql_conn_send_query(backend, "ROLLBACK", NULL, NULL, NULL, NULL);
+        return;
+    }
+
+    /* a shared backend has no handle of its own */
+    if (!handle) {
+        postgresql_pool_reclaim_conn(backend);
+        return;
+    }
+
+    handle->backend = NULL;
+    postgresql_pool_reclaim_conn(backend);
+    if (handle->pipelined > 0) {
+        return;
+    }
+    if (mk_list_is_empty(&handle->queries) != 0) {
+        postgresql_pool_acquire(handle);
+    } else if (handle->disconnect_on_finish) {
+        __postgresql_pool_handle_free(handle, POSTGRESQL_OK);
+    }
+}
+
+/* Detach a backend that is about to be closed from its handle. */
+void postgresql_pool_backend_lost(postgresql_conn_t *backend)
+{
+    postgresql_conn_t *handle = backend->client;
+
+    handle->backend = NULL;
+    backend->client = NULL;
+    if (handle->disconnect_on_finish && handle->pipelined == 0) {
+        __postgresql_pool_handle_free(handle, POSTGRESQL_ERR);
+    }
+}
+
+void postgresql_pool_handle_disconnect(postgresql_conn_t *handle, postgresql_disconnect_cb *cb)
+{
+    handle->disconnect_cb = cb;
+    handle->disconnect_on_finish = 1;
+
+    /* the backend finishes the queries of the handle first */
+    if (handle->backend) {
+        if (handle->backend->state == CONN_STATE_CONNECTED) {
+            postgresql_pool_backend_idle(handle->backend);
+        }
+        return;
+    }
+
+    if (handle->pipelined > 0) {
+        return;
+    }
+
+    if (mk_list_is_empty(&handle->queries) == 0) {
+        __postgresql_pool_handle_free(handle, POSTGRESQL_OK);
+    }
+}
+
+/* Take the replica of a broken connection out of rotation for a while. */
+void postgresql_pool_endpoint_failed(postgresql_conn_t *conn)
+{
+    postgresql_pool_endpoint_t *ep = conn->endpoint;
+
+    if (ep->index == 0) {
+        return;
+    }
+
+    ep->down_until = time(NULL) + POSTGRESQL_POOL_ENDPOINT_RETRY;
+    msg->warn("[FD %i] PostgreSQL Replica %i Out of Rotation", conn->fd, ep->index);
+}
+
+/*
+ * Start a new libpq connection for a pooled connection handle. A read-only
+ * handle whose replica is out of rotation is moved to another endpoint.
+ */
+PGconn *postgresql_pool_conn_start(postgresql_conn_t *conn)
+{
+    int workload;
+    uint64_t checkout_at;
+    postgresql_pool_endpoint_t *ep = conn->endpoint;
+    postgresql_endpoint_config_t *config;
+
+    if (conn->read_only && ep->down_until > time(NULL)) {
+        ep = __postgresql_pool_select_replica(conn->pool, conn->min_lsn);
+        if (ep != conn->endpoint) {
+            /* the checkout goes on, on another endpoint */
+            checkout_at = conn->checkout_at;
+            workload = conn->workload;
+            conn->checkout_at = 0;
+            postgresql_pool_remove_conn(conn);
+            conn->checkout_at = checkout_at;
+            conn->pool = ep->pool;
+            conn->endpoint = ep;
+            mk_list_add(&conn->_pool_head, &ep->busy_conns);
+            ep->size++;
+            if (workload >= 0) {
+                __postgresql_pool_class_take(conn, workload);
+            }
+        }
+    }
 
-    while (pool->free_size * 2 > pool->size &&
-           pool->size > POSTGRESQL_POOL_DEFAULT_MIN_SIZE) {
-        __postgresql_pool_release_conn(pool, POSTGRESQL_POOL_DEFAULT_SIZE);
+    config = ep->config;
+    if (config->type == POOL_TYPE_PARAMS) {
+        return PQconnectStartParams((const char * const *)config->keys,
+                                    (const char * const *)config->values,
+                                    config->expand_dbname);
+    } else if (config->type == POOL_TYPE_URI) {
+        return PQconnectStart(config->uri);
     }
+    return NULL;
 }
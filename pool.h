@@ -22,39 +22,168 @@
 #ifndef POSTGRESQL_POOL_H
 #define POSTGRESQL_POOL_H
 
+#include <stdint.h>
+#include <time.h>
+#include "stats.h"
+
 #define POSTGRESQL_POOL_DEFAULT_SIZE 1
 #define POSTGRESQL_POOL_DEFAULT_MIN_SIZE 2
 #define POSTGRESQL_POOL_DEFAULT_MAX_SIZE 4
 
+/* seconds a failing replica stays out of rotation */
+#define POSTGRESQL_POOL_ENDPOINT_RETRY 5
+
+/* milliseconds between two maintenance ticks of a pool, replication lag is sampled and
+ * blocked queues are rebalanced on every tick */
+#define POSTGRESQL_POOL_TICK_INTERVAL 1000
+
+#define POSTGRESQL_POOL_LAG_QUERY "SELECT CASE WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() " \
+    "THEN 0 ELSE EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()) END, " \
+    "pg_last_wal_replay_lsn()"
+
+/* weight of the newest sample in the query latency moving average */
+#define POSTGRESQL_POOL_LATENCY_ALPHA 0.2
+
+/* latency histogram used to estimate percentiles */
+#define POSTGRESQL_POOL_LATENCY_BUCKETS 32
+#define POSTGRESQL_POOL_LATENCY_MIN_SAMPLES 20
+
+/* percentage of extra queries hedging may add, and the burst it may reach */
+#define POSTGRESQL_POOL_DEFAULT_HEDGE_BUDGET 5
+#define POSTGRESQL_POOL_HEDGE_MAX_TOKENS 10
+
+/* milliseconds a query may run before idle connections take over the queries queued behind it */
+#define POSTGRESQL_POOL_DEFAULT_STEAL_THRESHOLD 100
+
+/* reads queued on every shared backend before statement pooling brings in another one */
+#define POSTGRESQL_POOL_PIPELINE_DEPTH 4
+
+/* buckets of the table of pools defined in duda_main() */
+#define POSTGRESQL_POOL_CONFIG_BUCKETS 64
+
+/* backends of a pool the interactive class keeps for itself unless told otherwise */
+#define POSTGRESQL_POOL_DEFAULT_RESERVE 1
+
+/* lowest priority admission control keeps accepting while the queues of an endpoint are slow */
+#define POSTGRESQL_POOL_ADMIT_PRIORITY POSTGRESQL_PRIORITY_NORMAL
+
+/* returned when the backend budget shared by the workers of a pool is spent */
+#define POSTGRESQL_POOL_EXHAUSTED -3
+
 typedef enum {
     POOL_TYPE_PARAMS, POOL_TYPE_URI,
 } postgresql_pool_type_t;
 
-typedef struct postgresql_pool_config {
+/* how to reach one server of a pool */
+typedef struct postgresql_endpoint_config {
     postgresql_pool_type_t type;
-    duda_global_t *pool_key;
-
-    int min_size;
-    int max_size;
 
     char **keys;
     char **values;
     int expand_dbname;
 
     char *uri;
+    int dedicated; /* serves one workload class only, kept out of the replica rotation */
+} postgresql_endpoint_config_t;
+
+struct postgresql_io;
+struct postgresql_io_chan;
+
+typedef struct postgresql_pool_config {
+    duda_global_t *pool_key;
+
+    int min_size;
+    int max_size;
+    int mode;    /* POSTGRESQL_POOL_SESSION or POSTGRESQL_POOL_TRANSACTION */
+    int max_lag; /* milliseconds, replicas lagging behind are skipped */
+    int steal_threshold; /* milliseconds, 0 disables work stealing */
+
+    /* admission control on queueing delay, in microseconds, 0 disables it */
+    int codel_target;
+    int codel_interval;
+
+    /* backends open by all the workers, updated with atomic operations */
+    int budget;     /* 0 means no limit */
+    int n_backends;
+    int starved;    /* denied reservations waiting for another worker to give one back */
+    int hedge_budget;
+
+    /* backends a class may hold at once, for the interactive class the backends
+     * the other classes must leave to it; 0 means no limit */
+    int class_quota[POSTGRESQL_CLASSES];
+    int class_endpoint[POSTGRESQL_CLASSES]; /* dedicated endpoint, 0 for the primary */
+
+    /* database threads owning the connections, 0 when every worker has its own */
+    int io_threads;
+    int io_started;
+    int io_ready;   /* 1 once started, -1 if they failed to start */
+    unsigned int io_next;
+    struct postgresql_io *io;
+
+    /* endpoints[0] is the primary, the rest of them are replicas */
+    int n_endpoints;
+    postgresql_endpoint_config_t *endpoints;
 
     struct mk_list _head;
+    struct mk_list _hash_head;
 } postgresql_pool_config_t;
 
 struct mk_list postgresql_pool_config_list;
+struct mk_list postgresql_pool_config_table[POSTGRESQL_POOL_CONFIG_BUCKETS];
 
-typedef struct postgresql_pool {
+struct postgresql_pool;
+struct postgresql_listener;
+
+typedef struct postgresql_pool_endpoint {
+    int index;
     int size;
     int free_size;
-    postgresql_pool_config_t *config;
+    time_t down_until;
+    postgresql_endpoint_config_t *config;
+
+    int outstanding;
+    double latency;
+    double lag;
+    uint64_t replay_lsn;
+    int lag_probing;
+    unsigned long selected;
+
+    /* time connections and handles are held, in microseconds */
+    unsigned long checkouts;
+    uint64_t hold_total;
+    unsigned long handles;
+    uint64_t handle_total;
+
+    int class_busy[POSTGRESQL_CLASSES]; /* backends held by every workload class */
+
+    /* smallest queueing delay seen in the current interval of admission control */
+    uint64_t codel_min;
+    uint64_t codel_start;
+    int overloaded;
+    unsigned long shed;
+    unsigned long coalesced;
+
+    struct postgresql_pool *pool;
 
     struct mk_list busy_conns;
     struct mk_list free_conns;
+    struct mk_list waiters; /* handles waiting for a backend, in arrival order */
+} postgresql_pool_endpoint_t;
+
+typedef struct postgresql_pool {
+    postgresql_pool_config_t *config;
+
+    int n_endpoints;
+    postgresql_pool_endpoint_t *endpoints;
+    unsigned int seed;
+    int timer_fd;
+    struct postgresql_io_chan *io_chan; /* completions from the database threads */
+    struct mk_list *flights; /* queries shared by identical ones, by key */
+    struct postgresql_listener *listener; /* notifications, opened on demand */
+
+    unsigned long latency_hist[POSTGRESQL_POOL_LATENCY_BUCKETS];
+    unsigned long latency_samples;
+    double hedge_tokens;
 } postgresql_pool_t;
 
 int postgresql_pool_params_create(duda_global_t *pool_key, int min_size, int max_size,
@@ -64,9 +193,91 @@ int postgresql_pool_params_create(duda_global_t *pool_key, int min_size, int max
 int postgresql_pool_uri_create(duda_global_t *pool_key, int min_size, int max_size,
                                const char *uri);
 
+int postgresql_pool_add_replica(duda_global_t *pool_key, const char *uri);
+
 postgresql_conn_t *postgresql_pool_get_conn(duda_global_t *pool_key, duda_request_t *dr,
                                             postgresql_connect_cb *cb);
 
+postgresql_conn_t *postgresql_pool_get_conn_ro(duda_global_t *pool_key, duda_request_t *dr,
+                                               postgresql_connect_cb *cb);
+
+postgresql_conn_t *postgresql_pool_get_conn_ro_lsn(duda_global_t *pool_key, duda_request_t *dr,
+                                                   postgresql_connect_cb *cb, const char *token);
+
+postgresql_conn_t *postgresql_pool_get_conn_class(duda_global_t *pool_key, int workload,
+                                                  duda_request_t *dr, postgresql_connect_cb *cb);
+
+int postgresql_pool_set_class_quota(duda_global_t *pool_key, int workload, int quota);
+
+int postgresql_pool_set_class_endpoint(duda_global_t *pool_key, int workload, const char *uri);
+
+int postgresql_pool_set_mode(duda_global_t *pool_key, int mode);
+
+int postgresql_pool_set_max_lag(duda_global_t *pool_key, int max_lag);
+
+int postgresql_pool_set_steal_threshold(duda_global_t *pool_key, int threshold);
+
+int postgresql_pool_set_budget(duda_global_t *pool_key, int budget);
+
+int postgresql_pool_set_admission(duda_global_t *pool_key, int target, int interval);
+
+void postgresql_pool_queue_sample(postgresql_pool_endpoint_t *ep, uint64_t delay);
+
+int postgresql_pool_admit(postgresql_pool_endpoint_t *ep, int priority);
+
+int postgresql_pool_set_io_threads(duda_global_t *pool_key, int n_threads);
+
+void postgresql_pool_budget_release(postgresql_conn_t *conn);
+
+int postgresql_pool_endpoint_stats(duda_global_t *pool_key,
+                                   postgresql_endpoint_stats_t *stats, int n);
+
+void postgresql_pool_endpoint_sample(postgresql_pool_endpoint_t *ep, uint64_t latency);
+
+int postgresql_pool_set_hedge_budget(duda_global_t *pool_key, int percent);
+
+postgresql_pool_t *postgresql_pool_get(duda_global_t *pool_key);
+
+postgresql_pool_t *postgresql_pool_create(postgresql_pool_config_t *config);
+
+postgresql_pool_config_t *postgresql_pool_config_uri(const char *uri, int max_size);
+
+postgresql_conn_t *postgresql_pool_checkout(postgresql_pool_t *pool, duda_request_t *dr,
+                                            postgresql_connect_cb *cb);
+
+void postgresql_pool_tick(postgresql_pool_t *pool);
+
+int postgresql_pool_idle(postgresql_pool_t *pool);
+
+int postgresql_pool_evict(postgresql_pool_t *pool, int n);
+
+uint64_t postgresql_pool_latency_p95(postgresql_pool_t *pool);
+
+postgresql_conn_t *postgresql_pool_hedge_conn(postgresql_pool_t *pool, duda_request_t *dr,
+                                              postgresql_pool_endpoint_t *exclude);
+
+void postgresql_pool_hedge_earn(postgresql_pool_t *pool);
+
 void postgresql_pool_reclaim_conn(postgresql_conn_t *conn);
 
+void postgresql_pool_remove_conn(postgresql_conn_t *conn);
+
+void postgresql_pool_acquire(postgresql_conn_t *handle);
+
+int postgresql_pool_pipeline(postgresql_conn_t *handle, postgresql_query_t *query);
+
+void postgresql_pool_pipeline_done(postgresql_conn_t *handle);
+
+void postgresql_pool_rebalance(postgresql_pool_endpoint_t *ep);
+
+void postgresql_pool_backend_idle(postgresql_conn_t *backend);
+
+void postgresql_pool_backend_lost(postgresql_conn_t *backend);
+
+void postgresql_pool_handle_disconnect(postgresql_conn_t *handle, postgresql_disconnect_cb *cb);
+
+void postgresql_pool_endpoint_failed(postgresql_conn_t *conn);
+
+PGconn *postgresql_pool_conn_start(postgresql_conn_t *conn);
+
 #endif
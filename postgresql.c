@@ -24,20 +24,58 @@
 #include "query_priv.h"
 #include "connection_priv.h"
 #include "async.h"
+#include "notify_priv.h"
 
 static inline postgresql_conn_t *__postgresql_get_conn(int fd)
 {
     struct mk_list *conn_list, *head;
-    postgresql_conn_t *conn = NULL;
+    postgresql_conn_t *conn;
 
     conn_list = global->get(postgresql_conn_list);
+    if (!conn_list) {
+        return NULL;
+    }
+
     mk_list_foreach(head, conn_list) {
         conn = mk_list_entry(head, postgresql_conn_t, _head);
         if (conn->fd == fd) {
-            break;
+            return conn;
         }
     }
-    return conn;
+    return NULL;
+}
+
+static inline int __postgresql_handle_connecting(postgresql_conn_t *conn)
+{
+    int events = 0;
+    int status = PQconnectPoll(conn->conn);
+
+    if (status == PGRES_POLLING_FAILED) {
+        msg->err("PostgreSQL Connect Error: %s", PQerrorMessage(conn->conn));
+        if (conn->connect_cb) {
+            conn->connect_cb(conn, POSTGRESQL_ERR, conn->dr);
+        }
+        if (postgresql_conn_handle_lost(conn) == POSTGRESQL_OK) {
+            return DUDA_EVENT_OWNED;
+        }
+        return DUDA_EVENT_CLOSE;
+    } else if (status == PGRES_POLLING_OK) {
+        /* on connected */
+        if (conn->connect_cb) {
+            conn->connect_cb(conn, POSTGRESQL_OK, conn->dr);
+        }
+        conn->state = CONN_STATE_CONNECTED;
+        postgresql_async_handle_query(conn);
+    } else {
+        if (status & PGRES_POLLING_READING) {
+            events |= DUDA_EVENT_READ;
+        }
+        if (status & PGRES_POLLING_WRITING) {
+            events |= DUDA_EVENT_WRITE;
+        }
+        event->mode(conn->fd, events, DUDA_EVENT_LEVEL_TRIGGERED);
+    }
+    return DUDA_EVENT_OWNED;
 }
 
 int postgresql_on_read(int fd, void *data)
@@ -51,40 +89,27 @@ int postgresql_on_read(int fd, void *data)
         return DUDA_EVENT_CLOSE;
     }
 
-    int events = 0;
-    int status;
     switch (conn->state) {
     case CONN_STATE_CONNECTING:
-        status = PQconnectPoll(conn->conn);
-        if (status == PGRES_POLLING_FAILED) {
-            msg->err("PostgreSQL Connect Error: %s", PQerrorMessage(conn->conn));
-            if (conn->connect_cb) {
-                conn->connect_cb(conn, POSTGRESQL_ERR, conn->dr);
-            }
-            return DUDA_EVENT_CLOSE;
-        } else if (status == PGRES_POLLING_OK) {
-            /* on connected */
-            if (conn->connect_cb) {
-                conn->connect_cb(conn, POSTGRESQL_OK, conn->dr);
-            }
-            conn->state = CONN_STATE_CONNECTED;
-            postgresql_async_handle_query(conn);
-        } else {
-            if (status & PGRES_POLLING_READING) {
-                events |= DUDA_EVENT_READ;
-            }
-            if (status & PGRES_POLLING_WRITING) {
-                events |= DUDA_EVENT_WRITE;
-            }
-            event->mode(conn->fd, events, DUDA_EVENT_LEVEL_TRIGGERED);
-        }
-        break;
+        return __postgresql_handle_connecting(conn);
     case CONN_STATE_ROW_FETCHING:
         postgresql_async_handle_row(conn);
         if (conn->state == CONN_STATE_CONNECTED) {
             postgresql_async_handle_query(conn);
         }
         break;
+    case CONN_STATE_CONNECTED:
+        /* notifications arriving on an idle listener */
+        if (conn->listener) {
+            if (PQconsumeInput(conn->conn) == 0) {
+                msg->err("[FD %i] PostgreSQL Consume Input Error: %s", conn->fd,
+                         PQerrorMessage(conn->conn));
+                postgresql_conn_handle_lost(conn);
+                break;
+            }
+            postgresql_notify_read(conn);
+        }
+        break;
     default:
         break;
     }
@@ -104,12 +129,14 @@ int postgresql_on_write(int fd, void *data)
 
     int status;
     switch (conn->state) {
+    case CONN_STATE_CONNECTING:
+        return __postgresql_handle_connecting(conn);
     case CONN_STATE_QUERYING:
         status = PQflush(conn->conn);
         if (status == -1) {
             msg->err("[FD %i] PostgreSQL Send Query Error: %s", conn->fd,
                      PQerrorMessage(conn->conn));
-            postgresql_query_free(conn->current_query);
+            postgresql_async_fail_query(conn, conn->current_query, POSTGRESQL_ERR);
         } else if (status == 0) {
             /* successfully send query */
             conn->state = CONN_STATE_QUERIED;
@@ -136,8 +163,7 @@ int postgresql_on_error(int fd, void *data)
         msg->err("[FD %i] Error: PostgreSQL Connection Not Found", fd);
         return DUDA_EVENT_CLOSE;
     }
-    conn->is_pooled = 0;
-    postgresql_conn_handle_release(conn, POSTGRESQL_ERR);
+    postgresql_conn_handle_lost(conn);
     return DUDA_EVENT_OWNED;
 }
 
@@ -149,9 +175,12 @@ int postgresql_on_close(int fd, void *data)
 
     if (!conn) {
         msg->err("[FD %i] Error: PostgreSQL Connection Not Found", fd);
+        return DUDA_EVENT_CLOSE;
+    }
+    if (postgresql_conn_handle_lost(conn) == POSTGRESQL_OK) {
+        /* the handle lives on with a new socket */
+        return DUDA_EVENT_OWNED;
     }
-    conn->is_pooled = 0;
-    postgresql_conn_handle_release(conn, POSTGRESQL_ERR);
     return DUDA_EVENT_CLOSE;
 }
 
@@ -25,6 +25,12 @@
 #include "common.h"
 #include "query.h"
 #include "connection.h"
+#include "stats.h"
+#include "shard.h"
+#include "fanout.h"
+#include "notify.h"
+#include "mirror.h"
+#include "loader.h"
 
 duda_global_t postgresql_conn_list;
 
@@ -36,8 +42,33 @@ typedef struct duda_api_postgresql {
     int (*create_pool_params)(duda_global_t *, int , int , const char * const *,
                               const char * const *, int);
     int (*create_pool_uri)(duda_global_t *, int , int , const char *);
+    int (*add_replica)(duda_global_t *, const char *);
     postgresql_conn_t *(*get_conn)(duda_global_t *, duda_request_t *,
                                    postgresql_connect_cb *);
+    postgresql_conn_t *(*get_conn_ro)(duda_global_t *, duda_request_t *,
+                                      postgresql_connect_cb *);
+    postgresql_conn_t *(*get_conn_ro_lsn)(duda_global_t *, duda_request_t *,
+                                          postgresql_connect_cb *, const char *);
+    postgresql_conn_t *(*get_conn_class)(duda_global_t *, int, duda_request_t *,
+                                         postgresql_connect_cb *);
+    postgresql_conn_t *(*get_conn_tenant)(const char *, duda_request_t *,
+                                          postgresql_connect_cb *);
+    int (*set_tenant_limits)(int, int);
+    int (*create_shards)(duda_global_t *, postgresql_shard_hash_cb *);
+    int (*add_shard)(duda_global_t *, duda_global_t *);
+    postgresql_conn_t *(*get_conn_key)(duda_global_t *, const void *, size_t,
+                                       duda_request_t *, postgresql_connect_cb *);
+    int (*shard_stats)(duda_global_t *, postgresql_shard_stats_t *, int);
+    int (*set_pool_mode)(duda_global_t *, int);
+    int (*set_max_lag)(duda_global_t *, int);
+    int (*set_steal_threshold)(duda_global_t *, int);
+    int (*set_pool_budget)(duda_global_t *, int);
+    int (*set_pool_admission)(duda_global_t *, int, int);
+    int (*set_pool_io_threads)(duda_global_t *, int);
+    int (*set_class_quota)(duda_global_t *, int, int);
+    int (*set_class_endpoint)(duda_global_t *, int, const char *);
+    int (*set_hedge_budget)(duda_global_t *, int);
+    int (*endpoint_stats)(duda_global_t *, postgresql_endpoint_stats_t *, int);
     int (*query)(postgresql_conn_t *, const char *, postgresql_query_result_cb *,
                  postgresql_query_row_cb *, postgresql_query_end_cb *, void *);
     int (*query_params)(postgresql_conn_t *, const char *, int, const char * const *,
@@ -46,13 +77,41 @@ typedef struct duda_api_postgresql {
     int (*query_prepared)(postgresql_conn_t *, const char *, int, const char * const *,
                           const int *, const int *, int, postgresql_query_result_cb *,
                           postgresql_query_row_cb *, postgresql_query_end_cb *, void *);
+    int (*hedged_query)(duda_global_t *, duda_request_t *, const char *,
+                        postgresql_query_result_cb *, postgresql_query_row_cb *,
+                        postgresql_query_end_cb *, void *);
+    int (*fanout_query)(duda_request_t *, int, duda_global_t **, const char **,
+                        const char *, int, postgresql_query_result_cb *,
+                        postgresql_query_row_cb *, postgresql_fanout_end_cb *, void *);
     char *(*escape_literal)(postgresql_conn_t *, const char *, size_t);
     char *(*escape_identifier)(postgresql_conn_t *, const char *, size_t);
     unsigned char *(*escape_binary)(postgresql_conn_t *, const unsigned char *,
                                     size_t, size_t *);
     unsigned char *(*unescape_binary)(const unsigned char *, size_t *);
+    void (*set_query_flags)(postgresql_conn_t *, int);
+    void (*set_query_priority)(postgresql_conn_t *, int);
+    void (*set_query_cache)(postgresql_conn_t *, int, int);
+    void (*set_query_tag)(postgresql_conn_t *, const char *, const char *);
+    int (*set_result_cache)(size_t);
+    int (*set_cache_file)(const char *);
+    void (*cache_stats)(postgresql_cache_stats_t *);
+    int (*listen)(duda_global_t *, const char *, postgresql_notify_cb *, void *);
+    postgresql_subscription_t *(*subscribe)(duda_global_t *, const char *, duda_request_t *,
+                                            postgresql_subscribe_cb *, void *);
+    void (*unsubscribe)(postgresql_subscription_t *);
+    postgresql_mirror_t *(*create_mirror)(const char *, const char *, const char *,
+                                          const char *);
+    postgresql_mirror_t *(*create_reference)(duda_global_t *, const char *, const char *,
+                                             const char *, int);
+    int (*mirror_lookup)(postgresql_mirror_t *, const char *, postgresql_mirror_row_t *);
+    postgresql_loader_t *(*create_loader)(duda_global_t *, const char *, const char *, int);
+    int (*load)(postgresql_loader_t *, const char *, duda_request_t *,
+                postgresql_loader_row_cb *, postgresql_loader_end_cb *, void *);
+    int (*query_status)(postgresql_query_t *);
+    unsigned long (*query_queue_time)(postgresql_query_t *);
     void (*abort)(postgresql_query_t *);
     void (*free)(void *);
+    int (*lsn_token)(postgresql_conn_t *, char *, int);
     void (*disconnect)(postgresql_conn_t *, postgresql_disconnect_cb *);
 } postgresql_object_t;
 
@@ -19,9 +19,16 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
 #include <libpq-fe.h>
 #include "common.h"
 #include "query_priv.h"
+#include "connection_priv.h"
+#include "pool.h"
+#include "coalesce_priv.h"
+#include "cache_priv.h"
 
 postgresql_query_t *postgresql_query_init()
 {
@@ -38,6 +45,14 @@ postgresql_query_t *postgresql_query_init()
     query->type            = QUERY_TYPE_NULL;
     query->single_row_mode = 0;
     query->result_start    = 0;
+    query->flags           = 0;
+    query->is_read         = 0;
+    query->retries         = 0;
+    query->status          = POSTGRESQL_OK;
+    query->priority        = POSTGRESQL_PRIORITY_NORMAL;
+    query->endpoint        = NULL;
+    query->queued_at       = 0;
+    query->sent_at         = 0;
     query->stmt_name       = NULL;
     query->n_params        = 0;
     query->params_values   = NULL;
@@ -48,13 +63,38 @@ postgresql_query_t *postgresql_query_init()
     query->row_cb          = NULL;
     query->end_cb          = NULL;
     query->privdata        = NULL;
+    query->dr              = NULL;
+    query->handle          = NULL;
+    query->flight          = NULL;
+    query->cache_ttl       = 0;
+    query->cache_stale     = 0;
+    query->cache_channel   = NULL;
+    query->cache_tag       = NULL;
+    query->cache_fill      = NULL;
+    query->chan            = NULL;
+    query->io_endpoint     = 0;
+    query->io_n_results    = 0;
+    query->io_results      = NULL;
     query->result          = NULL;
     return query;
 }
 
 void postgresql_query_free(postgresql_query_t *query)
 {
+    postgresql_conn_t *handle = query->handle;
+
     mk_list_del(&query->_head);
+    if (query->flight) {
+        postgresql_coalesce_done(query);
+    }
+    if (query->cache_fill) {
+        postgresql_cache_done(query);
+    }
+    FREE(query->cache_channel);
+    FREE(query->cache_tag);
+    if (query->endpoint) {
+        query->endpoint->outstanding--;
+    }
     int i;
     FREE(query->query_str);
     FREE(query->stmt_name);
@@ -64,5 +104,208 @@ void postgresql_query_free(postgresql_query_t *query)
     FREE(query->params_values);
     FREE(query->params_lengths);
     FREE(query->params_formats);
+    for (i = 0; i < query->io_n_results; ++i) {
+        PQclear(query->io_results[i]);
+    }
+    FREE(query->io_results);
     FREE(query);
+
+    if (handle) {
+        postgresql_pool_pipeline_done(handle);
+    }
+}
+
+static inline void __postgresql_query_key_append(char **key, size_t *length, size_t *size,
+                                                 const void *data, size_t n)
+{
+    char *buf;
+
+    if (!*key) {
+        return;
+    }
+
+    if (*length + n > *size) {
+        *size = (*length + n) * 2;
+        buf = monkey->mem_realloc(*key, *size);
+        if (!buf) {
+            FREE(*key);
+            return;
+        }
+        *key = buf;
+    }
+    memcpy(*key + *length, data, n);
+    *length += n;
+}
+
+/*
+ * Build the key identifying the result of a query: the scope given by the
+ * caller, then the statement, its parameters and the result format. Return
+ * NULL if it could not be allocated.
+ */
+char *postgresql_query_key(postgresql_query_t *query, const void *scope,
+                           size_t scope_length, size_t *length)
+{
+    int i, n, format;
+    size_t size = 256;
+    char *key = monkey->mem_alloc(size);
+    const char *str;
+
+    *length = 0;
+    __postgresql_query_key_append(&key, length, &size, scope, scope_length);
+    __postgresql_query_key_append(&key, length, &size, &query->type, sizeof(query->type));
+    __postgresql_query_key_append(&key, length, &size, &query->result_format,
+                                  sizeof(query->result_format));
+
+    str = query->type == QUERY_TYPE_PREPARED ? query->stmt_name : query->query_str;
+    if (str) {
+        __postgresql_query_key_append(&key, length, &size, str, strlen(str) + 1);
+    }
+
+    for (i = 0; i < query->n_params; ++i) {
+        str = query->params_values ? query->params_values[i] : NULL;
+        n = str ? (int) strlen(str) : -1;
+        format = query->params_formats ? query->params_formats[i] : 0;
+        if (str && format && query->params_lengths) {
+            n = query->params_lengths[i];
+        }
+        __postgresql_query_key_append(&key, length, &size, &format, sizeof(format));
+        __postgresql_query_key_append(&key, length, &size, &n, sizeof(n));
+        if (str) {
+            __postgresql_query_key_append(&key, length, &size, str, n);
+        }
+    }
+    return key;
+}
+
+/* functions that change something even when called from a SELECT */
+static const char *postgresql_query_writers[] = {
+    "nextval", "setval", "set_config", "pg_advisory_", "pg_try_advisory_", "pg_notify",
+    "txid_current", "pg_current_xact_id", "lo_", "dblink", NULL
+};
+
+/* Skip a comment, quoted string or dollar quoted string, return NULL if it is not terminated. */
+static inline const char *__postgresql_query_skip(const char *str)
+{
+    int depth, escapes;
+    size_t length;
+    const char *end;
+
+    if (str[0] == '-' && str[1] == '-') {
+        end = strchr(str, '\n');
+        return end ? end + 1 : str + strlen(str);
+    }
+    if (str[0] == '/' && str[1] == '*') {
+        for (depth = 1, str += 2; *str && depth > 0; ++str) {
+            if (str[0] == '/' && str[1] == '*') {
+                depth++;
+                str++;
+            } else if (str[0] == '*' && str[1] == '/') {
+                depth--;
+                str++;
+            }
+        }
+        return depth == 0 ? str : NULL;
+    }
+    if (*str == '\'' || *str == '"') {
+        /* E'...' strings take backslash escapes */
+        escapes = *str == '\'' && (str[-1] == 'E' || str[-1] == 'e') &&
+                  !isalnum((unsigned char) str[-2]) && str[-2] != '_';
+        for (end = str + 1; *end; ++end) {
+            if (escapes && *end == '\\' && end[1]) {
+                end++;
+            } else if (*end == *str) {
+                if (end[1] != *str) {
+                    return end + 1;
+                }
+                end++;
+            }
+        }
+        return NULL;
+    }
+
+    /* $tag$ ... $tag$ */
+    for (end = str + 1; isalnum((unsigned char) *end) || *end == '_'; ++end);
+    if (*end != '$') {
+        return NULL;
+    }
+    length = end + 1 - str;
+    for (end = end + 1; *end; ++end) {
+        if (*end == '$' && strncmp(end, str, length) == 0) {
+            return end + length;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Check if a statement is a plain read, such statements are safe to be sent
+ * again on a fresh connection. The check is conservative: a single SELECT,
+ * SHOW, VALUES or TABLE statement calling none of the functions known to
+ * write, anything else must be tagged with POSTGRESQL_QUERY_IDEMPOTENT.
+ */
+int postgresql_query_is_read(const char *query_str)
+{
+    static const char *reads[] = {"SELECT", "SHOW", "VALUES", "TABLE", NULL};
+    const char **ptr, *str, *word;
+    size_t length;
+    int found = 0;
+
+    if (!query_str) {
+        return 0;
+    }
+
+    while (isspace((unsigned char) *query_str) || *query_str == '(') {
+        query_str++;
+    }
+
+    for (ptr = reads; *ptr != NULL; ptr++) {
+        length = strlen(*ptr);
+        if (strncasecmp(query_str, *ptr, length) == 0 &&
+            !isalnum((unsigned char) query_str[length])) {
+            found = 1;
+            break;
+        }
+    }
+    if (!found) {
+        return 0;
+    }
+
+    for (str = query_str; *str; ) {
+        if ((str[0] == '-' && str[1] == '-') || (str[0] == '/' && str[1] == '*') ||
+            *str == '\'' || *str == '"' || (*str == '$' && !isdigit((unsigned char) str[1]))) {
+            str = __postgresql_query_skip(str);
+            if (!str) {
+                return 0;
+            }
+        } else if (*str == ';') {
+            /* only comments may follow the statement */
+            for (str++; *str; ) {
+                if (isspace((unsigned char) *str)) {
+                    str++;
+                } else if ((str[0] == '-' && str[1] == '-') || (str[0] == '/' && str[1] == '*')) {
+                    str = __postgresql_query_skip(str);
+                    if (!str) {
+                        return 0;
+                    }
+                } else {
+                    return 0;
+                }
+            }
+        } else if (isalpha((unsigned char) *str) || *str == '_') {
+            for (word = str; isalnum((unsigned char) *str) || *str == '_' || *str == '$'; ++str);
+            /* SELECT ... INTO creates a table */
+            if (str - word == 4 && strncasecmp(word, "INTO", 4) == 0) {
+                return 0;
+            }
+            for (ptr = postgresql_query_writers; *ptr != NULL; ptr++) {
+                length = strlen(*ptr);
+                if ((size_t) (str - word) >= length && strncasecmp(word, *ptr, length) == 0) {
+                    return 0;
+                }
+            }
+        } else {
+            str++;
+        }
+    }
+    return 1;
 }
@@ -24,6 +24,18 @@
 
 typedef struct postgresql_query postgresql_query_t;
 
+/* flags that can be attached to the next query of a connection */
+#define POSTGRESQL_QUERY_IDEMPOTENT 0x01
+#define POSTGRESQL_QUERY_TRACK_LSN  0x02
+#define POSTGRESQL_QUERY_STEALABLE  0x04 /* does not depend on session state */
+#define POSTGRESQL_QUERY_COALESCE   0x08 /* a read identical queries in flight may share */
+
+/* priority of the next query of a connection, lower values are served first */
+#define POSTGRESQL_PRIORITY_CRITICAL   0 /* health checks */
+#define POSTGRESQL_PRIORITY_NORMAL     1 /* user-facing queries, the default */
+#define POSTGRESQL_PRIORITY_BACKGROUND 2 /* cache refresh and the like */
+#define POSTGRESQL_PRIORITY_BATCH      3
+
 typedef void (postgresql_query_result_cb)(void *privdata, postgresql_query_t *query,
                                           int n_fields, char **fields, duda_request_t *dr);
 
@@ -22,8 +22,24 @@
 #ifndef POSTGRESQL_QUERY_PRIV_H
 #define POSTGRESQL_QUERY_PRIV_H
 
+#include <stdint.h>
 #include "query.h"
 
+#define POSTGRESQL_QUERY_MAX_RETRIES 3
+
+/* microseconds a query waits in a queue before it is promoted one priority level */
+#define POSTGRESQL_QUERY_PRIORITY_AGING 100000
+
+/* statement used to fetch the WAL position after a write */
+#define POSTGRESQL_LSN_FIELD "__duda_lsn"
+#define POSTGRESQL_LSN_QUERY "SELECT pg_current_wal_lsn() AS " POSTGRESQL_LSN_FIELD
+
+struct postgresql_pool_endpoint;
+struct postgresql_conn;
+struct postgresql_io_chan;
+struct postgresql_flight;
+struct postgresql_cache_fill;
+
 typedef enum {
     QUERY_TYPE_NULL, QUERY_TYPE_QUERY, QUERY_TYPE_PARAMS, QUERY_TYPE_PREPARED,
 } postgresql_query_type_t;
@@ -44,6 +60,18 @@ struct postgresql_query {
     int single_row_mode;
     int result_start;
 
+    /* fields used to replay a query on a fresh connection */
+    int flags;
+    int is_read;
+    int retries;
+    int status;
+    int priority;
+
+    /* fields used to balance the load of pool endpoints */
+    struct postgresql_pool_endpoint *endpoint;
+    uint64_t queued_at;
+    uint64_t sent_at;
+
     /* fields used by query_params and query_prepared */
     char *stmt_name;
     int n_params;
@@ -56,6 +84,26 @@ struct postgresql_query {
     postgresql_query_row_cb *row_cb;
     postgresql_query_end_cb *end_cb;
     void *privdata;
+    duda_request_t *dr;
+
+    /* handle of a query sent down the pipeline of a shared backend or to a database thread */
+    struct postgresql_conn *handle;
+
+    /* execution shared with identical queries, when this query is the one sent */
+    struct postgresql_flight *flight;
+
+    /* result cache: lifetime in milliseconds, and the result being collected */
+    int cache_ttl;
+    int cache_stale;
+    char *cache_channel; /* notification channel and key invalidating the result */
+    char *cache_tag;
+    struct postgresql_cache_fill *cache_fill;
+
+    /* fields used by the database threads, the results are handed to the callbacks by the worker */
+    struct postgresql_io_chan *chan;
+    int io_endpoint;
+    int io_n_results;
+    PGresult **io_results;
 
     struct mk_list _head;
 };
@@ -64,6 +112,27 @@ postgresql_query_t *postgresql_query_init();
 
 void postgresql_query_free(postgresql_query_t *query);
 
+int postgresql_query_is_read(const char *query_str);
+
+char *postgresql_query_key(postgresql_query_t *query, const void *scope,
+                           size_t scope_length, size_t *length);
+
+/* Priority of a queued query, raised by one level for every aging period it waited. */
+static inline int postgresql_query_priority(postgresql_query_t *query, uint64_t now)
+{
+    uint64_t promoted;
+
+    if (now <= query->queued_at) {
+        return query->priority;
+    }
+
+    promoted = (now - query->queued_at) / POSTGRESQL_QUERY_PRIORITY_AGING;
+    if (promoted >= (uint64_t) query->priority) {
+        return POSTGRESQL_PRIORITY_CRITICAL;
+    }
+    return query->priority - (int) promoted;
+}
+
 /*
  * @METHOD_NAME: abort
  * @METHOD_DESC: Abort a query.
@@ -77,4 +146,33 @@ static inline void postgresql_query_abort(postgresql_query_t *query)
     query->abort = QUERY_ABORT_YES;
 }
 
+/*
+ * @METHOD_NAME: query_status
+ * @METHOD_DESC: Get the status of a query, it is meant to be called inside the end callback of that query.
+ * @METHOD_PROTO: int query_status(postgresql_query_t *query)
+ * @METHOD_PARAM: query The query to be checked.
+ * @METHOD_RETURN: POSTGRESQL_OK if the query was processed successfully, POSTGRESQL_CONN_LOST if the connection was lost and the query could not be replayed, or POSTGRESQL_ERR on other failures.
+ */
+
+static inline int postgresql_query_status(postgresql_query_t *query)
+{
+    return query->status;
+}
+
+/*
+ * @METHOD_NAME: query_queue_time
+ * @METHOD_DESC: Get the time a query spent queued before it was sent to the server, it is meant to be called inside the callbacks of that query.
+ * @METHOD_PROTO: unsigned long query_queue_time(postgresql_query_t *query)
+ * @METHOD_PARAM: query The query to be checked.
+ * @METHOD_RETURN: The time in microseconds, or 0 if the query was not sent.
+ */
+
+static inline unsigned long postgresql_query_queue_time(postgresql_query_t *query)
+{
+    if (query->sent_at < query->queued_at) {
+        return 0;
+    }
+    return (unsigned long) (query->sent_at - query->queued_at);
+}
+
 #endif
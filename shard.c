@@ -0,0 +1,244 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <libpq-fe.h>
+#include "common.h"
+#include "query.h"
+#include "connection_priv.h"
+#include "pool.h"
+#include "util.h"
+#include "shard_priv.h"
+
+static inline postgresql_shard_config_t *__postgresql_shard_get_config(duda_global_t *shard_key)
+{
+    struct mk_list *head;
+    postgresql_shard_config_t *config;
+
+    mk_list_foreach(head, &postgresql_shard_config_list) {
+        config = mk_list_entry(head, postgresql_shard_config_t, _head);
+        if (config->shard_key == shard_key) {
+            return config;
+        }
+    }
+
+    return NULL;
+}
+
+static int __postgresql_shard_point_cmp(const void *a, const void *b)
+{
+    const postgresql_shard_point_t *pa = a;
+    const postgresql_shard_point_t *pb = b;
+
+    if (pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    return pa->shard - pb->shard;
+}
+
+/*
+ * Place the virtual nodes of a new shard on the ring. The points of a shard
+ * only depend on its index, so the points of existing shards never move and
+ * a new shard only takes over the keys that fall right before its points.
+ */
+static inline int __postgresql_shard_ring_add(postgresql_shard_config_t *config, int shard)
+{
+    int i, length;
+    char buf[32];
+    postgresql_shard_point_t *ring;
+
+    ring = monkey->mem_realloc(config->ring, sizeof(postgresql_shard_point_t) *
+                               (config->n_points + POSTGRESQL_SHARD_VNODES));
+    if (!ring) {
+        return POSTGRESQL_ERR;
+    }
+
+    for (i = 0; i < POSTGRESQL_SHARD_VNODES; ++i) {
+        length = snprintf(buf, sizeof(buf), "shard-%i-%i", shard, i);
+        ring[config->n_points + i].hash  = postgresql_util_hash(buf, length);
+        ring[config->n_points + i].shard = shard;
+    }
+
+    config->ring = ring;
+    config->n_points += POSTGRESQL_SHARD_VNODES;
+    qsort(config->ring, config->n_points, sizeof(postgresql_shard_point_t),
+          __postgresql_shard_point_cmp);
+    return POSTGRESQL_OK;
+}
+
+/* Find the shard owning a hash: the first point at or after it, wrapping around. */
+static inline int __postgresql_shard_lookup(postgresql_shard_config_t *config, uint32_t hash)
+{
+    int low = 0, high = config->n_points, mid;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (config->ring[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low == config->n_points) {
+        low = 0;
+    }
+    return config->ring[low].shard;
+}
+
+/*
+ * @METHOD_NAME: create_shards
+ * @METHOD_DESC: Create a sharded pool, which routes every key to one of a set of connection pools with consistent hashing. Pools are added with add_shard. It must be called within the function `duda_main()' of a Duda web service.
+ * @METHOD_PROTO: int create_shards(duda_global_t *shard_key, postgresql_shard_hash_cb *hash)
+ * @METHOD_PARAM: shard_key The pointer that refers to the global key definition of a sharded pool.
+ * @METHOD_PARAM: hash The function used to hash the shard keys, or NULL to use the default one.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_shard_create(duda_global_t *shard_key, postgresql_shard_hash_cb *hash)
+{
+    postgresql_shard_config_t *config = monkey->mem_alloc(sizeof(postgresql_shard_config_t));
+    if (!config) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->shard_key = shard_key;
+    config->hash      = hash ? hash : postgresql_util_hash;
+    config->n_shards  = 0;
+    config->pool_keys = NULL;
+    config->checkouts = NULL;
+    config->n_points  = 0;
+    config->ring      = NULL;
+    mk_list_add(&config->_head, &postgresql_shard_config_list);
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: add_shard
+ * @METHOD_DESC: Add a connection pool as a new shard of a sharded pool. Adding a shard only moves to it the keys it takes over, about one out of the new number of shards. It must be called within the function `duda_main()' of a Duda web service, after the pool and the sharded pool are created.
+ * @METHOD_PROTO: int add_shard(duda_global_t *shard_key, duda_global_t *pool_key)
+ * @METHOD_PARAM: shard_key The pointer that refers to the global key definition of a sharded pool.
+ * @METHOD_PARAM: pool_key The pointer that refers to the global key definition of the pool serving the shard.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_shard_add(duda_global_t *shard_key, duda_global_t *pool_key)
+{
+    duda_global_t **pool_keys;
+    unsigned long *checkouts;
+    postgresql_shard_config_t *config = __postgresql_shard_get_config(shard_key);
+    if (!config) {
+        return POSTGRESQL_ERR;
+    }
+
+    pool_keys = monkey->mem_realloc(config->pool_keys,
+                                    sizeof(duda_global_t *) * (config->n_shards + 1));
+    if (!pool_keys) {
+        return POSTGRESQL_ERR;
+    }
+    config->pool_keys = pool_keys;
+
+    checkouts = monkey->mem_realloc(config->checkouts,
+                                    sizeof(unsigned long) * (config->n_shards + 1));
+    if (!checkouts) {
+        return POSTGRESQL_ERR;
+    }
+    config->checkouts = checkouts;
+
+    if (__postgresql_shard_ring_add(config, config->n_shards) != POSTGRESQL_OK) {
+        return POSTGRESQL_ERR;
+    }
+
+    config->pool_keys[config->n_shards] = pool_key;
+    config->checkouts[config->n_shards] = 0;
+    config->n_shards++;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: get_conn_key
+ * @METHOD_DESC: Get a PostgreSQL connection from the shard owning a key, it behaves like get_conn on the pool of that shard.
+ * @METHOD_PROTO: postgresql_conn_t *get_conn_key(duda_global_t *shard_key, const void *key, size_t length, duda_request_t *dr, postgresql_connect_cb *cb)
+ * @METHOD_PARAM: shard_key The pointer that refers to the global key definition of a sharded pool.
+ * @METHOD_PARAM: key The shard key, e.g. a tenant identifier.
+ * @METHOD_PARAM: length The length of the shard key in bytes.
+ * @METHOD_PARAM: dr The request context information hold by a duda_request_t type.
+ * @METHOD_PARAM: cb The callback function that will take actions when a connection success or fail to establish.
+ * @METHOD_RETURN: A PostgreSQL connection on success, or NULL on failure.
+ */
+
+postgresql_conn_t *postgresql_shard_get_conn(duda_global_t *shard_key, const void *key,
+                                             size_t length, duda_request_t *dr,
+                                             postgresql_connect_cb *cb)
+{
+    int shard;
+    postgresql_shard_config_t *config = __postgresql_shard_get_config(shard_key);
+    if (!config || config->n_shards == 0) {
+        return NULL;
+    }
+
+    shard = __postgresql_shard_lookup(config, config->hash(key, length));
+    __sync_fetch_and_add(&config->checkouts[shard], 1);
+    return postgresql_pool_get_conn(config->pool_keys[shard], dr, cb);
+}
+
+/*
+ * @METHOD_NAME: shard_stats
+ * @METHOD_DESC: Get the statistics of the shards of a sharded pool: the share of the keys every shard owns, how many connections were routed to it by all the workers, and the size of its pool in the calling worker.
+ * @METHOD_PROTO: int shard_stats(duda_global_t *shard_key, postgresql_shard_stats_t *stats, int n)
+ * @METHOD_PARAM: shard_key The pointer that refers to the global key definition of a sharded pool.
+ * @METHOD_PARAM: stats An array that will hold the statistics, in the order shards were added.
+ * @METHOD_PARAM: n The number of elements of the stats array.
+ * @METHOD_RETURN: The number of elements filled, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_shard_stats(duda_global_t *shard_key, postgresql_shard_stats_t *stats, int n)
+{
+    int i, shard;
+    uint32_t prev;
+    postgresql_pool_t *pool;
+    postgresql_shard_config_t *config = __postgresql_shard_get_config(shard_key);
+    if (!config) {
+        return POSTGRESQL_ERR;
+    }
+
+    for (i = 0; i < config->n_shards && i < n; ++i) {
+        pool = postgresql_pool_get(config->pool_keys[i]);
+        stats[i].index     = i;
+        stats[i].share     = 0;
+        stats[i].checkouts = __sync_fetch_and_add(&config->checkouts[i], 0);
+        stats[i].size      = pool ? pool->endpoints[0].size : 0;
+        stats[i].free_size = pool ? pool->endpoints[0].free_size : 0;
+    }
+
+    /* every point owns the arc between the previous point and itself */
+    prev = config->n_points > 0 ? config->ring[config->n_points - 1].hash : 0;
+    for (i = 0; i < config->n_points; ++i) {
+        shard = config->ring[i].shard;
+        if (shard < n) {
+            stats[shard].share += (uint32_t) (config->ring[i].hash - prev) / 4294967296.0;
+        }
+        prev = config->ring[i].hash;
+    }
+
+    return config->n_shards < n ? config->n_shards : n;
+}
@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_SHARD_PRIV_H
+#define POSTGRESQL_SHARD_PRIV_H
+
+#include "shard.h"
+#include "stats.h"
+
+/* points every shard owns on the hash ring */
+#define POSTGRESQL_SHARD_VNODES 160
+
+typedef struct postgresql_shard_point {
+    uint32_t hash;
+    int shard;
+} postgresql_shard_point_t;
+
+typedef struct postgresql_shard_config {
+    duda_global_t *shard_key;
+    postgresql_shard_hash_cb *hash;
+
+    int n_shards;
+    duda_global_t **pool_keys;
+    unsigned long *checkouts; /* updated by every worker */
+
+    int n_points;
+    postgresql_shard_point_t *ring; /* sorted by hash */
+
+    struct mk_list _head;
+} postgresql_shard_config_t;
+
+struct mk_list postgresql_shard_config_list;
+
+int postgresql_shard_create(duda_global_t *shard_key, postgresql_shard_hash_cb *hash);
+
+int postgresql_shard_add(duda_global_t *shard_key, duda_global_t *pool_key);
+
+postgresql_conn_t *postgresql_shard_get_conn(duda_global_t *shard_key, const void *key,
+                                             size_t length, duda_request_t *dr,
+                                             postgresql_connect_cb *cb);
+
+int postgresql_shard_stats(duda_global_t *shard_key, postgresql_shard_stats_t *stats, int n);
+
+#endif
@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_STATS_H
+#define POSTGRESQL_STATS_H
+
+/* statistics of one server of a pool, as seen by the calling worker */
+typedef struct postgresql_endpoint_stats {
+    int index;                /* 0 for the primary, replicas start from 1 */
+    int available;            /* 0 if the endpoint is out of rotation */
+    int size;                 /* pooled connections */
+    int free_size;            /* idle pooled connections */
+    int outstanding;          /* queries enqueued and not finished yet */
+    double latency;           /* moving average of query latency, in microseconds */
+    double lag;               /* replication lag in seconds, -1 if unknown */
+    unsigned long selected;   /* read-only checkouts routed to this endpoint */
+    unsigned long checkouts;  /* times a pooled connection was checked out or bound */
+    double hold_time;         /* average time a connection stayed checked out, in microseconds */
+    unsigned long handles;    /* handles disconnected, in transaction mode */
+    double handle_time;       /* average lifetime of those handles, in microseconds */
+    int overloaded;           /* 1 while admission control rejects low priority work */
+    unsigned long shed;       /* queries and overflow connections rejected */
+    unsigned long coalesced;  /* queries that joined an identical one in flight */
+} postgresql_endpoint_stats_t;
+
+/* statistics of one shard of a sharded pool */
+typedef struct postgresql_shard_stats {
+    int index;                /* shards are numbered in the order they were added */
+    double share;             /* fraction of the hash space owned by the shard */
+    unsigned long checkouts;  /* connections routed to the shard by all workers */
+    int size;                 /* pooled connections of the calling worker */
+    int free_size;            /* idle pooled connections of the calling worker */
+} postgresql_shard_stats_t;
+
+/* statistics of the result cache of the calling worker */
+typedef struct postgresql_cache_stats {
+    unsigned long entries;    /* results cached */
+    unsigned long bytes;      /* memory taken by those results */
+    unsigned long hits;       /* queries served with a fresh result */
+    unsigned long stale_hits; /* queries served with a result being refreshed */
+    unsigned long misses;     /* queries sent to the server */
+    unsigned long evictions;  /* results evicted to make room for new ones */
+    unsigned long invalidations; /* results dropped by notifications */
+} postgresql_cache_stats_t;
+
+#endif
@@ -0,0 +1,284 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <libpq-fe.h>
+#include "common.h"
+#include "query_priv.h"
+#include "connection_priv.h"
+#include "pool.h"
+#include "util.h"
+#include "tenant_priv.h"
+
+/* configurations of the tenant pools, created by any worker at runtime */
+static struct mk_list postgresql_tenant_configs[POSTGRESQL_TENANT_BUCKETS];
+static pthread_mutex_t postgresql_tenant_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int postgresql_tenant_max_size = POSTGRESQL_TENANT_DEFAULT_MAX_SIZE;
+static int postgresql_tenant_max_idle = POSTGRESQL_TENANT_DEFAULT_MAX_IDLE;
+
+/* idle connections of the tenant pools of all the workers, updated with atomic operations */
+static int postgresql_tenant_idle = 0;
+
+void postgresql_tenant_init()
+{
+    int i;
+
+    for (i = 0; i < POSTGRESQL_TENANT_BUCKETS; ++i) {
+        mk_list_init(&postgresql_tenant_configs[i]);
+    }
+}
+
+/* Find the configuration of a tenant, or create it for the first worker asking for it. */
+static inline postgresql_pool_config_t *__postgresql_tenant_config(const char *uri,
+                                                                   uint32_t hash)
+{
+    struct mk_list *head, *bucket = &postgresql_tenant_configs[hash % POSTGRESQL_TENANT_BUCKETS];
+    postgresql_pool_config_t *config;
+
+    pthread_mutex_lock(&postgresql_tenant_mutex);
+    mk_list_foreach(head, bucket) {
+        config = mk_list_entry(head, postgresql_pool_config_t, _hash_head);
+        if (strcmp(config->endpoints[0].uri, uri) == 0) {
+            pthread_mutex_unlock(&postgresql_tenant_mutex);
+            return config;
+        }
+    }
+
+    config = postgresql_pool_config_uri(uri, postgresql_tenant_max_size);
+    if (config) {
+        mk_list_add(&config->_hash_head, bucket);
+    }
+    pthread_mutex_unlock(&postgresql_tenant_mutex);
+    return config;
+}
+
+/*
+ * Close idle connections while the tenant pools of the process keep more of
+ * them than allowed. Every worker closes its share of the excess, taken from
+ * the tenants it used least recently.
+ */
+static inline void __postgresql_tenant_evict(postgresql_tenant_table_t *table)
+{
+    int idle = 0, total, excess, closed;
+    struct mk_list *head;
+    postgresql_tenant_t *tenant;
+
+    mk_list_foreach(head, &table->lru) {
+        tenant = mk_list_entry(head, postgresql_tenant_t, _lru_head);
+        idle += postgresql_pool_idle(tenant->pool);
+    }
+    total = __sync_add_and_fetch(&postgresql_tenant_idle, idle - table->idle);
+    table->idle = idle;
+
+    if (total <= postgresql_tenant_max_idle || idle == 0) {
+        return;
+    }
+
+    /* round up so a worker with few idle connections still does its part */
+    excess = ((total - postgresql_tenant_max_idle) * idle + total - 1) / total;
+    mk_list_foreach(head, &table->lru) {
+        if (excess <= 0) {
+            break;
+        }
+        tenant = mk_list_entry(head, postgresql_tenant_t, _lru_head);
+        closed = postgresql_pool_evict(tenant->pool, excess);
+        excess -= closed;
+        table->idle -= closed;
+        __sync_fetch_and_sub(&postgresql_tenant_idle, closed);
+    }
+}
+
+static int __postgresql_tenant_on_tick(int fd, void *data)
+{
+    uint64_t expirations;
+    struct mk_list *head;
+    postgresql_tenant_t *tenant;
+    postgresql_tenant_table_t *table = data;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return DUDA_EVENT_OWNED;
+    }
+
+    mk_list_foreach(head, &table->lru) {
+        tenant = mk_list_entry(head, postgresql_tenant_t, _lru_head);
+        postgresql_pool_tick(tenant->pool);
+    }
+    __postgresql_tenant_evict(table);
+    return DUDA_EVENT_OWNED;
+}
+
+static int __postgresql_tenant_on_tick_close(int fd, void *data)
+{
+    postgresql_tenant_table_t *table = data;
+
+    msg->err("[FD %i] PostgreSQL Tenant Timer Closed", fd);
+    table->timer_fd = -1;
+    return DUDA_EVENT_CLOSE;
+}
+
+/* One timer drives the maintenance of all the tenant pools of a worker. */
+static inline void __postgresql_tenant_timer_start(postgresql_tenant_table_t *table)
+{
+    struct itimerspec spec;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd == -1) {
+        msg->err("PostgreSQL Tenant Timer Create Error");
+        return;
+    }
+
+    spec.it_interval.tv_sec  = POSTGRESQL_POOL_TICK_INTERVAL / 1000;
+    spec.it_interval.tv_nsec = (POSTGRESQL_POOL_TICK_INTERVAL % 1000) * 1000000;
+    spec.it_value            = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, NULL) == -1) {
+        msg->err("PostgreSQL Tenant Timer Set Error");
+        close(fd);
+        return;
+    }
+
+    event->add(fd, DUDA_EVENT_READ, DUDA_EVENT_LEVEL_TRIGGERED,
+               __postgresql_tenant_on_tick, NULL, __postgresql_tenant_on_tick_close,
+               __postgresql_tenant_on_tick_close, NULL, table);
+    table->timer_fd = fd;
+}
+
+static inline postgresql_tenant_table_t *__postgresql_tenant_table()
+{
+    int i;
+    postgresql_tenant_table_t *table = global->get(postgresql_tenant_key);
+
+    if (table) {
+        return table;
+    }
+
+    table = monkey->mem_alloc(sizeof(postgresql_tenant_table_t));
+    if (!table) {
+        return NULL;
+    }
+
+    table->idle     = 0;
+    table->timer_fd = -1;
+    mk_list_init(&table->lru);
+    for (i = 0; i < POSTGRESQL_TENANT_BUCKETS; ++i) {
+        mk_list_init(&table->buckets[i]);
+    }
+    global->set(postgresql_tenant_key, (void *) table);
+    __postgresql_tenant_timer_start(table);
+    return table;
+}
+
+static inline postgresql_tenant_t *__postgresql_tenant_get(postgresql_tenant_table_t *table,
+                                                           const char *uri)
+{
+    uint32_t hash = postgresql_util_hash(uri, strlen(uri));
+    struct mk_list *head, *bucket = &table->buckets[hash % POSTGRESQL_TENANT_BUCKETS];
+    postgresql_tenant_t *tenant;
+    postgresql_pool_config_t *config;
+
+    mk_list_foreach(head, bucket) {
+        tenant = mk_list_entry(head, postgresql_tenant_t, _hash_head);
+        if (tenant->hash == hash &&
+            strcmp(tenant->pool->config->endpoints[0].uri, uri) == 0) {
+            return tenant;
+        }
+    }
+
+    config = __postgresql_tenant_config(uri, hash);
+    if (!config) {
+        return NULL;
+    }
+
+    tenant = monkey->mem_alloc(sizeof(postgresql_tenant_t));
+    if (!tenant) {
+        return NULL;
+    }
+
+    tenant->pool = postgresql_pool_create(config);
+    if (!tenant->pool) {
+        FREE(tenant);
+        return NULL;
+    }
+    tenant->hash = hash;
+    mk_list_add(&tenant->_hash_head, bucket);
+    mk_list_add(&tenant->_lru_head, &table->lru);
+    return tenant;
+}
+
+/*
+ * @METHOD_NAME: set_tenant_limits
+ * @METHOD_DESC: Set the limits of the pools get_conn_tenant creates on demand. Idle connections above the limit are closed within a second, those of the tenants used least recently go first. It must be called within the function `duda_main()' of a Duda web service.
+ * @METHOD_PROTO: int set_tenant_limits(int max_size, int max_idle)
+ * @METHOD_PARAM: max_size The maximum number of connections of a tenant pool in every worker.
+ * @METHOD_PARAM: max_idle The maximum number of idle connections kept by all the tenant pools of the process.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR on failure.
+ */
+
+int postgresql_tenant_set_limits(int max_size, int max_idle)
+{
+    if (max_size <= 0 || max_idle < 0) {
+        return POSTGRESQL_ERR;
+    }
+
+    postgresql_tenant_max_size = max_size;
+    postgresql_tenant_max_idle = max_idle;
+    return POSTGRESQL_OK;
+}
+
+/*
+ * @METHOD_NAME: get_conn_tenant
+ * @METHOD_DESC: Get a PostgreSQL connection from the pool of a tenant database. Unlike the pools created in duda_main(), the pool of a tenant is created the first time its connection string is used, and the connections it keeps idle count against the limit set by set_tenant_limits.
+ * @METHOD_PROTO: postgresql_conn_t *get_conn_tenant(const char *uri, duda_request_t *dr, postgresql_connect_cb *cb)
+ * @METHOD_PARAM: uri The connection string of the tenant database, in the same formats accepted by create_pool_uri.
+ * @METHOD_PARAM: dr The request context information hold by a duda_request_t type.
+ * @METHOD_PARAM: cb The callback function that will take actions when a connection success or fail to establish.
+ * @METHOD_RETURN: A PostgreSQL connection on success, or NULL on failure.
+ */
+
+postgresql_conn_t *postgresql_tenant_get_conn(const char *uri, duda_request_t *dr,
+                                              postgresql_connect_cb *cb)
+{
+    postgresql_tenant_t *tenant;
+    postgresql_tenant_table_t *table;
+
+    if (!uri) {
+        return NULL;
+    }
+
+    table = __postgresql_tenant_table();
+    if (!table) {
+        return NULL;
+    }
+
+    tenant = __postgresql_tenant_get(table, uri);
+    if (!tenant) {
+        msg->err("PostgreSQL Tenant Pool Create Error");
+        return NULL;
+    }
+
+    mk_list_del(&tenant->_lru_head);
+    mk_list_add(&tenant->_lru_head, &table->lru);
+    return postgresql_pool_checkout(tenant->pool, dr, cb);
+}
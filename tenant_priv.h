@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Duda I/O
+ *  --------
+ *  Copyright (C) 2013, Zeying Xie <swpdtz at gmail dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef POSTGRESQL_TENANT_PRIV_H
+#define POSTGRESQL_TENANT_PRIV_H
+
+#include "pool.h"
+
+/* buckets of the tables of tenant pools, shared and per worker */
+#define POSTGRESQL_TENANT_BUCKETS 1024
+
+/* connections a tenant pool may open in every worker */
+#define POSTGRESQL_TENANT_DEFAULT_MAX_SIZE 2
+
+/* idle connections kept by all the tenant pools of the process */
+#define POSTGRESQL_TENANT_DEFAULT_MAX_IDLE 256
+
+/* pool of one tenant in a worker */
+typedef struct postgresql_tenant {
+    uint32_t hash;
+    postgresql_pool_t *pool;
+
+    struct mk_list _hash_head;
+    struct mk_list _lru_head;
+} postgresql_tenant_t;
+
+/* tenant pools of a worker */
+typedef struct postgresql_tenant_table {
+    int idle;     /* idle connections of this worker, as last published */
+    int timer_fd;
+    struct mk_list lru; /* least recently used first */
+    struct mk_list buckets[POSTGRESQL_TENANT_BUCKETS];
+} postgresql_tenant_table_t;
+
+duda_global_t postgresql_tenant_key;
+
+void postgresql_tenant_init();
+
+int postgresql_tenant_set_limits(int max_size, int max_idle);
+
+postgresql_conn_t *postgresql_tenant_get_conn(const char *uri, duda_request_t *dr,
+                                              postgresql_connect_cb *cb);
+
+#endif
@@ -19,6 +19,7 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <stdio.h>
 #include <libpq-fe.h>
 #include "common.h"
 #include "query.h"
@@ -29,7 +30,7 @@
  * @METHOD_NAME: escape_literal
  * @METHOD_DESC: Escape a string for use within an SQL command. This is useful when inserting data values as literal constants in SQL commands.
  * @METHOD_PROTO: char *escape_literal(postgresql_conn_t *conn, const char *str, size_t length)
- * @METHOD_PARAM: conn The PostgreSQL connection handle, it must be a valid, open connection.
+ * @METHOD_PARAM: conn The PostgreSQL connection handle, it must be a valid, open connection. Handles of a pool with database threads have no connection to escape with, use query parameters instead.
  * @METHOD_PARAM: str The literal string to be escaped.
  * @METHOD_PARAM: length The length of parameter str.
  * @METHOD_RETURN: On success an escaped version of the str parameter in memory allocated with malloc() is returned. This memory should be freed using postgresql->free() when the result is no longer needed. On error it will return NULL.
@@ -38,9 +39,17 @@
 char *postgresql_util_escape_literal(postgresql_conn_t *conn, const char *str,
                                      size_t length)
 {
-    char *escaped = PQescapeLiteral(conn->conn, str, length);
+    char *escaped;
+    PGconn *pgconn = postgresql_conn_pgconn(conn);
+
+    if (!pgconn) {
+        msg->err("[FD %i] PostgreSQL Escape Literal Error: no connection", conn->fd);
+        return NULL;
+    }
+    escaped = PQescapeLiteral(pgconn, str, length);
     if (!escaped) {
-        msg->err("[FD %i] PostgreSQL Escape Literal Error: %s", PQerrorMessage(conn->conn));
+        msg->err("[FD %i] PostgreSQL Escape Literal Error: %s", conn->fd,
+                 PQerrorMessage(pgconn));
     }
     return escaped;
 }
@@ -49,7 +58,7 @@ char *postgresql_util_escape_literal(postgresql_conn_t *conn, const char *str,
  * @METHOD_NAME: escape_identifier
  * @METHOD_DESC:  Escape a string for use as an SQL identifier, such as a table, column, or function name. This is useful when a user-supplied identifier might contain special characters that would otherwise not be interpreted as part of the identifier by the SQL parser, or when the identifier might contain upper case characters whose case should be preserved.
  * @METHOD_PROTO: char *escape_identifier(postgresql_conn_t *conn, const char *str, size_t length)
- * @METHOD_PARAM: conn The PostgreSQL connection handle, it must be a valid, open connection.
+ * @METHOD_PARAM: conn The PostgreSQL connection handle, it must be a valid, open connection. Handles of a pool with database threads have no connection to escape with, use query parameters instead.
  * @METHOD_PARAM: str The identifier string to be escaped.
  * @METHOD_PARAM: length The length of parameter str.
  * @METHOD_RETURN: On success an escaped version of the str parameter in memory allocated with malloc() is returned. This memory should be freed using postgresql->free() when the result is no longer needed. On error it will return NULL.
@@ -58,9 +67,17 @@ char *postgresql_util_escape_literal(postgresql_conn_t *conn, const char *str,
 char *postgresql_util_escape_identifier(postgresql_conn_t *conn, const char *str,
                                         size_t length)
 {
-    char *escaped = PQescapeIdentifier(conn->conn, str, length);
+    char *escaped;
+    PGconn *pgconn = postgresql_conn_pgconn(conn);
+
+    if (!pgconn) {
+        msg->err("[FD %i] PostgreSQL Escape Identifier Error: no connection", conn->fd);
+        return NULL;
+    }
+    escaped = PQescapeIdentifier(pgconn, str, length);
     if (!escaped) {
-        msg->err("[FD %i] PostgreSQL Escape Identifier Error: %s", PQerrorMessage(conn->conn));
+        msg->err("[FD %i] PostgreSQL Escape Identifier Error: %s", conn->fd,
+                 PQerrorMessage(pgconn));
     }
     return escaped;
 }
@@ -69,7 +86,7 @@ char *postgresql_util_escape_identifier(postgresql_conn_t *conn, const char *str
  * @METHOD_NAME: escape_binary
  * @METHOD_DESC: Escape binary data for use within an SQL command.
  * @METHOD_PROTO: unsigned char *escape_binary(postgresql_conn_t *conn, const unsigned char *from, size_t from_length, size_t *to_length)
- * @METHOD_PARAM: conn The PostgreSQL connection handle, it must be a valid, open connection.
+ * @METHOD_PARAM: conn The PostgreSQL connection handle, it must be a valid, open connection. Handles of a pool with database threads have no connection to escape with, use query parameters instead.
  * @METHOD_PARAM: from The string to be escaped.
  * @METHOD_PARAM: from_length The number of bytes in this binary string.
  * @METHOD_PARAM: to_length A variable that will hold the resultant escaped string length.
@@ -81,9 +98,17 @@ unsigned char *postgresql_util_escape_binary(postgresql_conn_t *conn,
                                              size_t from_length,
                                              size_t *to_length)
 {
-    unsigned char *escaped = PQescapeByteaConn(conn->conn, from, from_length, to_length);
+    unsigned char *escaped;
+    PGconn *pgconn = postgresql_conn_pgconn(conn);
+
+    if (!pgconn) {
+        msg->err("[FD %i] PostgreSQL Escape Binary Error: no connection", conn->fd);
+        return NULL;
+    }
+    escaped = PQescapeByteaConn(pgconn, from, from_length, to_length);
     if (!escaped) {
-        msg->err("[FD %i] PostgreSQL Escape Binary Error: %s", PQerrorMessage(conn->conn));
+        msg->err("[FD %i] PostgreSQL Escape Binary Error: %s", conn->fd,
+                 PQerrorMessage(pgconn));
     }
     return escaped;
 }
@@ -115,3 +140,60 @@ void postgresql_util_free(void *ptr)
 {
     PQfreemem(ptr);
 }
+
+/* FNV-1a with the murmur3 finalizer for a good spread of similar keys. */
+uint32_t postgresql_util_hash(const void *key, size_t length)
+{
+    size_t i;
+    const unsigned char *ptr = key;
+    uint32_t hash = 2166136261u;
+
+    for (i = 0; i < length; ++i) {
+        hash ^= ptr[i];
+        hash *= 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/* Parse a WAL position in its textual form (e.g. 16/B374D848), 0 on error. */
+uint64_t postgresql_util_lsn_parse(const char *str)
+{
+    unsigned int high, low;
+
+    if (!str || sscanf(str, "%X/%X", &high, &low) != 2) {
+        return 0;
+    }
+    return ((uint64_t) high << 32) | low;
+}
+
+/*
+ * @METHOD_NAME: lsn_token
+ * @METHOD_DESC: Get the WAL position reached by the writes of a connection, as captured by queries sent with flag POSTGRESQL_QUERY_TRACK_LSN. The token is meant to be kept in the session or a cookie of the client and passed to get_conn_ro_lsn later, so that the client reads its own writes.
+ * @METHOD_PROTO: int lsn_token(postgresql_conn_t *conn, char *buf, int size)
+ * @METHOD_PARAM: conn The PostgreSQL connection handle.
+ * @METHOD_PARAM: buf The buffer that will hold the NULL-terminated token.
+ * @METHOD_PARAM: size The size of the buffer, 18 bytes are always enough.
+ * @METHOD_RETURN: POSTGRESQL_OK on success, or POSTGRESQL_ERR if no position was captured or the buffer is too small.
+ */
+
+int postgresql_util_lsn_token(postgresql_conn_t *conn, char *buf, int size)
+{
+    int ret;
+
+    if (conn->lsn == 0) {
+        return POSTGRESQL_ERR;
+    }
+
+    ret = snprintf(buf, size, "%X/%X", (unsigned int) (conn->lsn >> 32),
+                   (unsigned int) conn->lsn);
+    if (ret < 0 || ret >= size) {
+        return POSTGRESQL_ERR;
+    }
+    return POSTGRESQL_OK;
+}
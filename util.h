@@ -22,6 +22,18 @@
 #ifndef POSTGRESQL_UTIL_H
 #define POSTGRESQL_UTIL_H
 
+#include <stdint.h>
+#include <time.h>
+
+/* monotonic clock in microseconds */
+static inline uint64_t postgresql_util_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 char *postgresql_util_escape_literal(postgresql_conn_t *conn, const char *str,
                                      size_t length);
 
@@ -38,4 +50,10 @@ unsigned char *postgresql_util_unescape_binary(const unsigned char *from,
 
 void postgresql_util_free(void *ptr);
 
+uint64_t postgresql_util_lsn_parse(const char *str);
+
+uint32_t postgresql_util_hash(const void *key, size_t length);
+
+int postgresql_util_lsn_token(postgresql_conn_t *conn, char *buf, int size);
+
 #endif